@@ -0,0 +1,783 @@
+/* bench — Benchmarks for flexoSIP's media path
+ *
+ * Prints one JSON object per line, e.g. for feeding into jq.
+ * Run all benchmarks, or only those named on the command line.
+ *
+ * "calls" sets up BENCH_CALLS (default 16) calls to itself over the
+ * loopback interface, both ends playing, and measures BENCH_SECONDS
+ * (default 10) of them. SIP uses port BENCH_SIP_PORT (default 15060).
+ */
+#include "flexosip.h"
+#include "flexoresample.h"
+#include "flexodtmf.h"
+#include "flexomix.h"
+#include "flexojitter.h"
+#include "flexosnd.h"
+#include "flexortp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sndfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "unused.h"
+
+#define FRAME_MS 20
+#define CALL_SECONDS 60 // Audio processed per measurement
+#define FILE_SECONDS 10 // Length of the sound files written
+#define SEND_FRAMES 100000 // Packets per measurement
+#define SEND_CALLS 50 // Sending at once (within the default RTP ports)
+#define SEND_BURST 3 // Frames per call caught up on after a late tick
+
+static char tmpdir[] = "/tmp/flexobench.XXXXXX";
+
+static double cpu_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double wall_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int env_int(const char *name, int dflt)
+{
+  const char *v = getenv(name);
+  return v != NULL ? atoi(v) : dflt;
+}
+
+static void *xmalloc(size_t size)
+{
+  void *p = malloc(size);
+  if (p == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+/**
+ * Fill with a sweep over the voice band plus some noise, interleaved
+ */
+static void fill_audio(short *buf, size_t nframes, int rate, int channels)
+{
+  double phase = 0;
+  for (size_t i = 0; i < nframes; i++) {
+    double f = 200 + 3200.0 * i / nframes;
+    phase += 2 * M_PI * f / rate;
+    short v = 12000 * sin(phase) + (rand() % 1000) - 500;
+    for (int c = 0; c < channels; c++)
+      buf[i * channels + c] = v;
+  }
+}
+
+/**
+ * Write seconds of fill_audio() into a sound file
+ *
+ * Returns != 0 on error (diagnostic printed)
+ */
+static int write_sound(const char *path, int format, int rate, int channels,
+		       int seconds)
+{
+  SF_INFO info = { .samplerate = rate, .channels = channels,
+		   .format = format };
+  SNDFILE *sf = sf_open(path, SFM_WRITE, &info);
+  if (sf == NULL) {
+    fprintf(stderr, "Cannot write %s: %s\n", path, sf_strerror(NULL));
+    return -1;
+  }
+  size_t nframes = (size_t)rate * seconds;
+  short *buf = xmalloc(nframes * channels * sizeof(short));
+  fill_audio(buf, nframes, rate, channels);
+  sf_count_t written = sf_writef_short(sf, buf, nframes);
+  free(buf);
+  sf_close(sf);
+  return written == (sf_count_t)nframes ? 0 : -1;
+}
+
+// ------------- Resampler -----------------
+
+static const char *quality_names[FERESAMPLE_NQUALITIES] = {
+  [FERESAMPLE_LOW] = "low",
+  [FERESAMPLE_MEDIUM] = "medium",
+  [FERESAMPLE_HIGH] = "high",
+};
+
+/**
+ * CPU cost of resampling one call-second, fed in 20 ms chunks
+ * as the streaming play queue does
+ */
+static void bench_resample(void)
+{
+  static const struct { int rate, channels; } inputs[] = {
+    {8000, 1}, {16000, 1}, {22050, 1}, {44100, 2}, {48000, 1}, {48000, 2},
+  };
+  static const int outputs[] = {8000, 16000};
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    int in_rate = inputs[i].rate, channels = inputs[i].channels;
+    size_t nframes = (size_t)in_rate * CALL_SECONDS;
+    short *in = malloc(nframes * channels * sizeof(short));
+    if (in == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    fill_audio(in, nframes, in_rate, channels);
+    for (size_t o = 0; o < sizeof(outputs) / sizeof(outputs[0]); o++) {
+      int out_rate = outputs[o];
+      for (int quality = 0; quality < FERESAMPLE_NQUALITIES; quality++) {
+	struct feresample *r = feresample_new(in_rate, channels, out_rate,
+					      quality);
+	if (r == NULL) {
+	  fprintf(stderr, "Cannot resample %d to %d\n", in_rate, out_rate);
+	  continue;
+	}
+	short out[FRAME_MS * 48];
+	size_t chunk = in_rate * FRAME_MS / 1000, produced = 0;
+	double start = cpu_seconds();
+	for (size_t pos = 0; pos + chunk <= nframes; pos += chunk)
+	  produced += feresample_process(r, in + pos * channels, chunk,
+					 out, sizeof(out) / sizeof(out[0]));
+	double cpu = cpu_seconds() - start;
+	feresample_free(r);
+	printf("{\"bench\":\"resample\",\"kernel\":\"%s\",\"quality\":\"%s\","
+	       "\"in_rate\":%d,\"channels\":%d,\"out_rate\":%d,"
+	       "\"samples\":%zu,\"cpu_us_per_call_second\":%.2f,"
+	       "\"calls_per_core\":%.0f}\n",
+	       feresample_kernel(), quality_names[quality], in_rate, channels,
+	       out_rate, produced, cpu * 1e6 / CALL_SECONDS,
+	       CALL_SECONDS / cpu);
+      }
+    }
+    free(in);
+  }
+}
+
+// ------------- In-band DTMF detector -----------------
+
+#define DTMF_CHANNELS 256
+#define DTMF_SECONDS 10 // Audio per channel and measurement
+
+/**
+ * Append a digit (both tones, 80 ms) or silence, plus some noise
+ */
+static size_t fill_dtmf(short *buf, int rate, char digit, int ms)
+{
+  static const char keys[] = "123A456B789C*0#D";
+  static const double rows[4] = {697, 770, 852, 941};
+  static const double cols[4] = {1209, 1336, 1477, 1633};
+  size_t n = (size_t)rate * ms / 1000;
+  const char *key = digit ? strchr(keys, digit) : NULL;
+  for (size_t i = 0; i < n; i++) {
+    double v = (rand() % 400) - 200;
+    if (key != NULL) {
+      int k = key - keys;
+      v += 5000 * sin(2 * M_PI * rows[k / 4] * i / rate)
+	+ 5000 * sin(2 * M_PI * cols[k % 4] * i / rate);
+    }
+    buf[i] = v;
+  }
+  return n;
+}
+
+/**
+ * CPU cost of watching one channel for a second, fed in 20 ms frames;
+ * all channels are processed round robin, as the media thread does
+ */
+static void bench_dtmf(void)
+{
+  static const char digits[] = "0123456789*#ABCD";
+  static const int rates[] = {8000, 16000};
+  for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    int rate = rates[r];
+    size_t nsamples = (size_t)rate * DTMF_SECONDS;
+    short *audio = malloc(nsamples * sizeof(short));
+    struct fedtmf *det = malloc(DTMF_CHANNELS * sizeof(*det));
+    if (audio == NULL || det == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    // Digits every 500 ms, silence with noise in between
+    size_t pos = 0, sent = 0;
+    while (pos + (size_t)rate / 2 <= nsamples) {
+      pos += fill_dtmf(audio + pos, rate, digits[sent++ % 16], 80);
+      pos += fill_dtmf(audio + pos, rate, '\0', 420);
+    }
+    pos += fill_dtmf(audio + pos, rate, '\0', (nsamples - pos) * 1000 / rate);
+    for (int c = 0; c < DTMF_CHANNELS; c++)
+      fedtmf_init(&det[c], rate);
+
+    size_t frame = rate * FRAME_MS / 1000, detected = 0;
+    char found[4];
+    double start = cpu_seconds();
+    for (size_t off = 0; off + frame <= nsamples; off += frame)
+      for (int c = 0; c < DTMF_CHANNELS; c++)
+	detected += fedtmf_process(&det[c], audio + off, frame, found, 4);
+    double cpu = cpu_seconds() - start;
+    double channel_seconds = (double)DTMF_CHANNELS * DTMF_SECONDS;
+    printf("{\"bench\":\"dtmf\",\"kernel\":\"%s\",\"rate\":%d,"
+	   "\"channels\":%d,\"digits_sent\":%zu,\"digits_detected\":%zu,"
+	   "\"cpu_us_per_channel_second\":%.2f,\"channels_per_core\":%.0f}\n",
+	   fedtmf_kernel(), rate, DTMF_CHANNELS, sent * DTMF_CHANNELS, detected,
+	   cpu * 1e6 / channel_seconds, channel_seconds / cpu);
+    free(det);
+    free(audio);
+  }
+}
+
+// ------------- Mixer -----------------
+
+#define MIX_SECONDS 10 // Conference audio per measurement
+
+/**
+ * CPU cost of one second of a conference of n parties at 16 kHz:
+ * everybody's frame scaled and summed, then n mixes of all but one
+ */
+static void bench_mix(void)
+{
+  static const int parties[] = {3, 10, 32, 64};
+  const int rate = 16000;
+  size_t frame = rate * FRAME_MS / 1000, nsamples = (size_t)rate * MIX_SECONDS;
+  short *audio = xmalloc(nsamples * sizeof(short));
+  fill_audio(audio, nsamples, rate, 1);
+  for (size_t p = 0; p < sizeof(parties) / sizeof(parties[0]); p++) {
+    int n = parties[p];
+    short *self = xmalloc(n * frame * sizeof(short));
+    short out[FESND_MAX_SAMPLES];
+    int sum[FESND_MAX_SAMPLES];
+    long checksum = 0;
+    double start = cpu_seconds();
+    for (size_t off = 0; off + frame <= nsamples; off += frame) {
+      memset(sum, 0, frame * sizeof(int));
+      for (int i = 0; i < n; i++) {
+	// Everybody says the same, but from somewhere else
+	size_t from = (off + i * 997 * frame) % (nsamples - frame);
+	memset(self + i * frame, 0, frame * sizeof(short));
+	femix_add(self + i * frame, audio + from, frame, FEMIX_UNITY * 3 / 4);
+	femix_sum(sum, self + i * frame, frame);
+      }
+      for (int i = 0; i < n; i++) {
+	femix_minus(out, sum, self + i * frame, frame);
+	checksum += out[i % frame];
+      }
+    }
+    double cpu = cpu_seconds() - start;
+    printf("{\"bench\":\"mix\",\"kernel\":\"%s\",\"rate\":%d,"
+	   "\"parties\":%d,\"checksum\":%ld,"
+	   "\"cpu_us_per_conference_second\":%.2f,"
+	   "\"parties_per_core\":%.0f}\n",
+	   femix_kernel(), rate, n, checksum, cpu * 1e6 / MIX_SECONDS,
+	   n * MIX_SECONDS / cpu);
+    free(self);
+  }
+  free(audio);
+}
+
+// ------------- Codecs -----------------
+
+/**
+ * CPU cost of encoding and decoding one call-second per codec,
+ * in 20 ms frames
+ */
+static void bench_codec(void)
+{
+  for (int format = 0; format < FESND_NFORMATS; format++) {
+    const struct fesnd_codec *c = fesnd_codec(format);
+    size_t nsamples = (size_t)c->rate * CALL_SECONDS;
+    short *pcm = malloc(nsamples * sizeof(short));
+    unsigned char *enc = malloc(fesnd_codec_max_bytes(format, nsamples));
+    if (pcm == NULL || enc == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    fill_audio(pcm, nsamples, c->rate, 1);
+    struct fesnd_codec_state encoder = {0}, decoder = {0};
+    size_t nbytes = 0;
+    double start = cpu_seconds();
+    for (size_t pos = 0; pos + c->frame_samples <= nsamples;
+	 pos += c->frame_samples)
+      nbytes += c->encode(&encoder, enc + nbytes, pcm + pos, c->frame_samples);
+    double encode = cpu_seconds() - start;
+    start = cpu_seconds();
+    for (size_t pos = 0; pos + c->frame_bytes <= nbytes; pos += c->frame_bytes)
+      c->decode(&decoder, pcm, enc + pos, c->frame_bytes);
+    double decode = cpu_seconds() - start;
+    printf("{\"bench\":\"codec\",\"codec\":\"%s/%d\",\"rate\":%d,"
+	   "\"kbit_per_second\":%zu,\"encode_us_per_call_second\":%.2f,"
+	   "\"decode_us_per_call_second\":%.2f}\n",
+	   c->name, c->clock_rate, c->rate, nbytes * 8 / CALL_SECONDS / 1000,
+	   encode * 1e6 / CALL_SECONDS, decode * 1e6 / CALL_SECONDS);
+    free(enc);
+    free(pcm);
+  }
+}
+
+// ------------- Jitter buffer -----------------
+
+#define JITTER_CHANNELS 64
+#define JITTER_SECONDS 10 // Audio per channel and measurement
+
+/**
+ * CPU cost of playing out one call-second of PCMA through the jitter
+ * buffer, with packets delayed by up to some jitter and some lost;
+ * all channels see the same network, fed tick by tick
+ */
+static void bench_jitter(void)
+{
+  static const struct {
+    int jitter_ms;
+    double loss;
+  } nets[] = {{0, 0}, {40, 0.02}, {100, 0.05}};
+  const struct fesnd_codec *c = fesnd_codec(FESND_PCMA8000);
+  size_t frames = JITTER_SECONDS * 1000 / FRAME_MS;
+  short *pcm = xmalloc(frames * c->frame_samples * sizeof(short));
+  unsigned char *enc = xmalloc(frames * c->frame_bytes);
+  int *arrival = xmalloc(frames * sizeof(int)); // Tick, -1 = lost
+  struct fejitter *jb = xmalloc(JITTER_CHANNELS * sizeof(*jb));
+  fill_audio(pcm, frames * c->frame_samples, c->rate, 1);
+  struct fesnd_codec_state encoder = {0};
+  c->encode(&encoder, enc, pcm, frames * c->frame_samples);
+  for (size_t n = 0; n < sizeof(nets) / sizeof(nets[0]); n++) {
+    int span = nets[n].jitter_ms / FRAME_MS + 1; // Ticks a packet may be late
+    for (size_t f = 0; f < frames; f++)
+      arrival[f] = rand() < nets[n].loss * RAND_MAX ? -1
+	: (int)f + (rand() % (nets[n].jitter_ms + 1) + FRAME_MS - 1) / FRAME_MS;
+    struct fesnd_codec_state *dec = xmalloc(JITTER_CHANNELS * sizeof(*dec));
+    memset(dec, 0, JITTER_CHANNELS * sizeof(*dec));
+    for (int ch = 0; ch < JITTER_CHANNELS; ch++)
+      fejitter_init(&jb[ch], c);
+    short out[FESND_MAX_SAMPLES];
+    long checksum = 0;
+    double start = cpu_seconds();
+    for (size_t tick = 0; tick < frames + span; tick++) {
+      struct timespec now = { tick * FRAME_MS / 1000,
+			      tick * FRAME_MS % 1000 * 1000000 };
+      for (int ch = 0; ch < JITTER_CHANNELS; ch++) {
+	for (size_t f = tick >= (size_t)span ? tick - span : 0;
+	     f <= tick && f < frames; f++)
+	  if (arrival[f] == (int)tick)
+	    fejitter_put(&jb[ch], f, f * c->frame_samples, f == 0,
+			 enc + f * c->frame_bytes, c->frame_bytes, &now);
+	if (fejitter_get(&jb[ch], &dec[ch], out) > 0)
+	  checksum += out[tick % c->frame_samples];
+      }
+    }
+    double cpu = cpu_seconds() - start;
+    struct fejitter_stats st;
+    fejitter_get_stats(&jb[0], &st);
+    double channel_seconds = (double)JITTER_CHANNELS * JITTER_SECONDS;
+    printf("{\"bench\":\"jitter\",\"jitter_ms\":%d,\"loss\":%.2f,"
+	   "\"packets\":%lu,\"late\":%lu,\"lost\":%lu,\"concealed_ms\":%lu,"
+	   "\"target_ms\":%u,\"checksum\":%ld,"
+	   "\"cpu_us_per_channel_second\":%.2f,\"channels_per_core\":%.0f}\n",
+	   nets[n].jitter_ms, nets[n].loss, st.received, st.late, st.lost,
+	   st.concealed_ms, st.target_ms, checksum, cpu * 1e6 / channel_seconds,
+	   channel_seconds / cpu);
+    free(dec);
+  }
+  free(jb);
+  free(arrival);
+  free(enc);
+  free(pcm);
+}
+
+// ------------- Sound file decoding -----------------
+
+/**
+ * CPU cost of decoding (and resampling) one call-second of a sound
+ * file, read in 20 ms chunks as the streaming play queue does
+ */
+static void bench_read(void)
+{
+  static const struct {
+    const char *type;
+    int format, rate, channels;
+  } files[] = {
+    {"wav", SF_FORMAT_WAV | SF_FORMAT_PCM_16, 8000, 1},
+    {"wav", SF_FORMAT_WAV | SF_FORMAT_PCM_16, 16000, 1},
+    {"wav", SF_FORMAT_WAV | SF_FORMAT_PCM_16, 44100, 2},
+    {"flac", SF_FORMAT_FLAC | SF_FORMAT_PCM_16, 16000, 1},
+    {"ogg", SF_FORMAT_OGG | SF_FORMAT_VORBIS, 48000, 1},
+  };
+  static const int outputs[] = {8000, 16000};
+  for (size_t f = 0; f < sizeof(files) / sizeof(files[0]); f++) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/read%zu.%s", tmpdir, f, files[f].type);
+    if (write_sound(path, files[f].format, files[f].rate, files[f].channels,
+		    FILE_SECONDS) != 0)
+      continue;
+    for (size_t o = 0; o < sizeof(outputs) / sizeof(outputs[0]); o++) {
+      struct fesnd_decoder d;
+      short out[FRAME_MS * 16];
+      size_t chunk = outputs[o] * FRAME_MS / 1000, produced = 0, n;
+      double start = cpu_seconds();
+      if (fesnd_decoder_open(&d, path, outputs[o]) != 0)
+	continue;
+      do {
+	n = fesnd_decoder_read(&d, out, chunk);
+	produced += n;
+      } while (n == chunk);
+      fesnd_decoder_close(&d);
+      double cpu = cpu_seconds() - start;
+      double seconds = (double)produced / outputs[o];
+      printf("{\"bench\":\"read\",\"file\":\"%s\",\"in_rate\":%d,"
+	     "\"channels\":%d,\"out_rate\":%d,\"samples\":%zu,"
+	     "\"cpu_us_per_call_second\":%.2f,\"calls_per_core\":%.0f}\n",
+	     files[f].type, files[f].rate, files[f].channels, outputs[o],
+	     produced, cpu * 1e6 / seconds, seconds / cpu);
+    }
+    unlink(path);
+  }
+}
+
+// ------------- A-law encoding -----------------
+
+/**
+ * CPU cost of encoding one call-second with fesnd_encode_alaw(),
+ * from 8 kHz or (downsampling) 16 kHz, in 20 ms frames
+ */
+static void bench_encode(void)
+{
+  for (int downsample = 0; downsample <= 1; downsample++) {
+    int rate = downsample ? 16000 : 8000;
+    size_t nsamples = (size_t)rate * CALL_SECONDS, encoded = 0;
+    size_t chunk = rate * FRAME_MS / 1000;
+    short *pcm = xmalloc(nsamples * sizeof(short));
+    unsigned char out[FRAME_MS * 8];
+    fill_audio(pcm, nsamples, rate, 1);
+    double start = cpu_seconds();
+    for (size_t pos = 0; pos + chunk <= nsamples; pos += chunk)
+      encoded += fesnd_encode_alaw(out, pcm + pos, chunk, downsample);
+    double cpu = cpu_seconds() - start;
+    printf("{\"bench\":\"encode\",\"codec\":\"PCMA/8000\",\"in_rate\":%d,"
+	   "\"downsample\":%s,\"samples\":%zu,"
+	   "\"cpu_us_per_call_second\":%.2f,\"calls_per_core\":%.0f}\n",
+	   rate, downsample ? "true" : "false", encoded,
+	   cpu * 1e6 / CALL_SECONDS, CALL_SECONDS / cpu);
+    free(pcm);
+  }
+}
+
+// ------------- Broadcast -----------------
+
+/**
+ * CPU cost per listener-second of playing an announcement (16 kHz WAV,
+ * too big for the prompt cache) to n A-law queues, each on its own
+ * and as one broadcast; includes the background decoding
+ */
+static void bench_broadcast(void)
+{
+  static const int audiences[] = {1, 8, 64};
+  char path[sizeof(tmpdir) + 16];
+  snprintf(path, sizeof(path), "%s/broadcast.wav", tmpdir);
+  if (write_sound(path, SF_FORMAT_WAV | SF_FORMAT_PCM_16, 16000, 1,
+		  FILE_SECONDS) != 0)
+    return;
+  fesnd_cache_set_limit(0); // Decoded while playing
+  for (size_t a = 0; a < sizeof(audiences) / sizeof(audiences[0]); a++) {
+    int n = audiences[a];
+    struct fesnd_queue *q = xmalloc(n * sizeof(*q));
+    for (int shared = 0; shared <= 1; shared++) {
+      memset(q, 0, n * sizeof(*q));
+      double start = cpu_seconds();
+      struct fesnd_broadcast *b = shared ? fesnd_broadcast_new(path) : NULL;
+      for (int i = 0; i < n; i++)
+	if (shared)
+	  fesnd_add_broadcast(&q[i], b);
+	else
+	  fesnd_add(&q[i], path);
+      unsigned long frames = 0;
+      for (_Bool playing = true; playing;) {
+	playing = false;
+	for (int i = 0; i < n; i++) {
+	  const unsigned char *frame;
+	  if (fesnd_next_frame(&q[i], &frame) > 0) {
+	    frames++;
+	    playing = true;
+	  }
+	}
+	usleep(FRAME_MS * 50); // Let the decoder keep up, 20× real time
+      }
+      struct fesnd_broadcast_stats st = {0};
+      if (shared) {
+	fesnd_broadcast_get_stats(b, &st);
+	fesnd_broadcast_free(b);
+      }
+      for (int i = 0; i < n; i++)
+	fesnd_close(&q[i]);
+      double cpu = cpu_seconds() - start;
+      printf("{\"bench\":\"broadcast\",\"codec\":\"PCMA/8000\","
+	     "\"listeners\":%d,\"shared\":%s,\"frames\":%lu,"
+	     "\"encoded\":%lu,\"cpu_us_per_listener_second\":%.2f,"
+	     "\"listeners_per_core\":%.0f}\n",
+	     n, shared ? "true" : "false", frames,
+	     shared ? st.encoded : frames, cpu * 1e6 / n / FILE_SECONDS,
+	     n * FILE_SECONDS / cpu);
+    }
+    free(q);
+  }
+  fesnd_cache_set_limit(FESND_CACHE_LIMIT);
+  unlink(path);
+}
+
+// ------------- RTP sending -----------------
+
+static void timespec_add_ms(struct timespec *ts, int ms)
+{
+  ts->tv_nsec += ms * 1000000L;
+  while (ts->tv_nsec >= 1000000000L) {
+    ts->tv_nsec -= 1000000000L;
+    ts->tv_sec++;
+  }
+}
+
+/**
+ * CPU cost of sending a frame with fertp_send_at() to a UDP sink on
+ * the loopback interface (never read, the kernel drops the excess),
+ * for SEND_CALLS calls sent by oRTP one by one, then batched
+ */
+static void bench_send(void)
+{
+  static const enum fesnd_format formats[] = {FESND_PCMA8000, FESND_L16_16000};
+  struct sockaddr_in addr = { .sin_family = AF_INET,
+			      .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  socklen_t len = sizeof(addr);
+  int sink = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sink < 0 || bind(sink, (struct sockaddr *)&addr, len) != 0
+      || getsockname(sink, (struct sockaddr *)&addr, &len) != 0) {
+    perror("UDP sink");
+    if (sink >= 0)
+      close(sink);
+    return;
+  }
+  ortp_init();
+  fertp_set_clocked(true); // Non-blocking, as with the media thread
+  struct fertp_session *rtp = xmalloc(SEND_CALLS * sizeof(*rtp));
+  // Frames due per call and tick: normally one, more when catching up
+  // after a late tick (see MEDIA_MAX_LATE in flexosip.c)
+  for (int run = 0; run < 4; run++) {
+    int batched = run / 2, burst = run % 2 ? SEND_BURST : 1;
+    fertp_set_batched(batched);
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+      const struct fesnd_codec *c = fesnd_codec(formats[f]);
+      int ncalls = 0;
+      for (; ncalls < SEND_CALLS; ncalls++) {
+	memset(&rtp[ncalls], 0, sizeof(rtp[ncalls]));
+	fertp_start(&rtp[ncalls], "127.0.0.1", ntohs(addr.sin_port),
+		    c->static_pt >= 0 ? c->static_pt : 96, c->name,
+		    c->clock_rate);
+	if (rtp[ncalls].session == NULL)
+	  break;
+      }
+      if (ncalls == 0)
+	continue;
+      unsigned char frame[FESND_MAX_FRAME] = {0};
+      struct fertp_batch_stats b0, b1;
+      struct timespec when;
+      int nframes = SEND_FRAMES / (ncalls * burst) * ncalls * burst;
+      fertp_batch_get_stats(&b0);
+      clock_gettime(CLOCK_MONOTONIC, &when);
+      double start = cpu_seconds();
+      for (int i = 0; i < nframes; i += ncalls * burst) {
+	for (int j = 0; j < ncalls; j++) {
+	  struct timespec due = when;
+	  for (int k = 0; k < burst; k++) {
+	    fertp_send_at(&rtp[j], frame, c->frame_bytes, c->clock_rate / 50,
+			  &due);
+	    timespec_add_ms(&due, FRAME_MS);
+	  }
+	}
+	fertp_flush(); // Once per tick, as the media thread does
+	timespec_add_ms(&when, burst * FRAME_MS);
+      }
+      double cpu = cpu_seconds() - start;
+      fertp_batch_get_stats(&b1);
+      unsigned long long send_ns = b1.flush_ns - b0.flush_ns;
+      for (int j = 0; j < ncalls; j++)
+	send_ns += rtp[j].stats.send_ns;
+      // Counted by our transport, on both paths
+      double syscalls = b1.syscalls - b0.syscalls;
+      printf("{\"bench\":\"send\",\"codec\":\"%s/%d\",\"path\":\"%s\","
+	     "\"bytes\":%zu,\"calls\":%d,\"frames_per_tick\":%d,"
+	     "\"frames\":%d,"
+	     "\"cpu_us_per_frame\":%.2f,\"send_us_per_frame\":%.2f,"
+	     "\"syscalls_per_call_second\":%.2f,"
+	     "\"frames_per_core_second\":%.0f,\"calls_per_core\":%.0f}\n",
+	     c->name, c->clock_rate, batched ? "batched" : "ortp",
+	     c->frame_bytes, ncalls, burst, nframes, cpu * 1e6 / nframes,
+	     send_ns / 1e3 / nframes,
+	     syscalls / nframes * (1000 / FRAME_MS),
+	     nframes / cpu, nframes / cpu / (1000 / FRAME_MS));
+      for (int j = 0; j < ncalls; j++)
+	fertp_stop(&rtp[j]);
+    }
+  }
+  fertp_set_batched(false);
+  free(rtp);
+  fertp_pool_drain();
+  close(sink);
+}
+
+// ------------- End to end -----------------
+
+static const char *calls_prompt; // Played by both ends of every call
+static int calls_seconds;
+static fesip_call_t *call_list[FESIP_MAX_CALLS]; // Both ends
+static int ncall_list, nanswered;
+static fesip_call_t *to_answer[FESIP_MAX_CALLS];
+static int nto_answer;
+
+int fesip_event_invite(fesip_call_t *call, eXosip_event_t *UNUSED_PARAM(evt),
+    const char *UNUSED_PARAM(host), int UNUSED_PARAM(port),
+    int UNUSED_PARAM(format))
+{
+  // Answered from bench_calls(), not from within the handler
+  to_answer[nto_answer++] = call;
+  call_list[ncall_list++] = call;
+  return 180; // Ringing
+}
+
+void fesip_event_answered(fesip_call_t *call, eXosip_event_t *UNUSED_PARAM(evt),
+    const char *UNUSED_PARAM(host), int UNUSED_PARAM(port),
+    int UNUSED_PARAM(format))
+{
+  fesip_play(call, calls_prompt);
+  nanswered++;
+}
+
+/**
+ * Read a value in kB from /proc/self/status, -1 if not available
+ */
+static long status_kb(const char *field)
+{
+  char line[128];
+  long kb = -1;
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL)
+    if (strncmp(line, field, strlen(field)) == 0)
+      kb = atol(line + strlen(field) + 1);
+  fclose(f);
+  return kb;
+}
+
+/**
+ * Calls to ourselves over the loopback interface, with audio in both
+ * directions, driven by fesip_handle_event() (no media thread)
+ *
+ * Reports the frames sent per second of wall and of CPU time, and how
+ * late after their due time frames were handed to the kernel.
+ */
+static void bench_calls(void)
+{
+  int ncalls = env_int("BENCH_CALLS", 16);
+  int port = env_int("BENCH_SIP_PORT", 15060);
+  calls_seconds = env_int("BENCH_SECONDS", 10);
+  if (2 * ncalls > FESIP_MAX_CALLS)
+    ncalls = FESIP_MAX_CALLS / 2;
+  char path[64], uri[64];
+  snprintf(path, sizeof(path), "%s/call.wav", tmpdir);
+  if (write_sound(path, SF_FORMAT_WAV | SF_FORMAT_PCM_16, 8000, 1,
+		  calls_seconds + FILE_SECONDS) != 0)
+    return;
+  calls_prompt = path;
+  if (fesip_listen(IPPROTO_UDP, false, port) != 0)
+    return;
+  snprintf(uri, sizeof(uri), "sip:bench@127.0.0.1:%d", port);
+  for (int i = 0; i < ncalls; i++) {
+    fesip_call_t *call = fesip_call(uri, uri, "bench", NULL);
+    if (call != NULL)
+      call_list[ncall_list++] = call;
+  }
+
+  // Until both ends of every call are talking
+  double deadline = wall_seconds() + FILE_SECONDS;
+  while (nanswered < 2 * ncalls && wall_seconds() < deadline) {
+    fesip_handle_event();
+    while (nto_answer > 0) {
+      fesip_call_t *call = to_answer[--nto_answer];
+      fesip_answer(call);
+      fesip_play(call, calls_prompt);
+      nanswered++;
+    }
+  }
+
+  struct fertp_stats *before = xmalloc(ncall_list * sizeof(*before));
+  struct fertp_stats *after = xmalloc(sizeof(*after));
+  for (int i = 0; i < ncall_list; i++)
+    if (fesip_call_get_stats(call_list[i], &before[i]) != 0)
+      memset(&before[i], 0, sizeof(before[i]));
+  double cpu = cpu_seconds(), wall = wall_seconds();
+  while (wall_seconds() - wall < calls_seconds)
+    fesip_handle_event();
+  cpu = cpu_seconds() - cpu;
+  wall = wall_seconds() - wall;
+
+  unsigned long frames = 0, late = 0, skipped = 0;
+  unsigned lateness[FERTP_HIST_BUCKETS] = {0};
+  for (int i = 0; i < ncall_list; i++) {
+    if (fesip_call_get_stats(call_list[i], after) != 0)
+      continue; // Ended early
+    frames += after->frames - before[i].frames;
+    late += after->late - before[i].late;
+    skipped += after->skipped - before[i].skipped;
+    for (int b = 0; b < FERTP_HIST_BUCKETS; b++)
+      lateness[b] += after->lateness[b] - before[i].lateness[b];
+  }
+  printf("{\"bench\":\"calls\",\"calls\":%d,\"established\":%d,"
+	 "\"seconds\":%.1f,\"frames\":%lu,\"frames_per_second\":%.0f,"
+	 "\"frames_per_core_second\":%.0f,\"cpu_percent\":%.1f,"
+	 "\"late\":%lu,\"skipped\":%lu,\"late_us_p50\":%ld,"
+	 "\"late_us_p99\":%ld,\"rss_kb\":%ld,\"max_rss_kb\":%ld}\n",
+	 ncalls, nanswered / 2, wall, frames, frames / wall, frames / cpu,
+	 cpu * 100 / wall, late, skipped, fertp_hist_percentile(lateness, 0.5),
+	 fertp_hist_percentile(lateness, 0.99), status_kb("VmRSS:"),
+	 status_kb("VmHWM:"));
+  free(after);
+  free(before);
+  fesip_quit();
+  unlink(path);
+}
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} benchmarks[] = {
+  {"resample", bench_resample},
+  {"dtmf", bench_dtmf},
+  {"mix", bench_mix},
+  {"codec", bench_codec},
+  {"jitter", bench_jitter},
+  {"read", bench_read},
+  {"encode", bench_encode},
+  {"broadcast", bench_broadcast},
+  {"send", bench_send},
+  {"calls", bench_calls},
+};
+
+int main(int argc, char **argv)
+{
+  if (mkdtemp(tmpdir) == NULL) {
+    perror(tmpdir);
+    return 1;
+  }
+  for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+    _Bool wanted = (argc <= 1);
+    for (int i = 1; i < argc; i++)
+      if (strcmp(argv[i], benchmarks[b].name) == 0)
+	wanted = 1;
+    if (wanted)
+      benchmarks[b].run();
+  }
+  rmdir(tmpdir);
+  return 0;
+}
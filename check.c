@@ -0,0 +1,145 @@
+/* check — Tests for flexoSIP's G.711 conversion
+ *
+ * Encodes all 65536 PCM16 values with every G.711 kernel available on
+ * this machine and compares the result with what libsndfile writes for
+ * SF_FORMAT_ALAW/SF_FORMAT_ULAW. Decoding is compared for all 256
+ * codes. Prints one line per check; exits non-zero if any failed.
+ */
+#include "flexog711.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sndfile.h>
+
+#define NVALUES 65536
+#define CHUNK 37 // Odd, to also run the kernels' scalar tails
+
+static const char *kernels[] = {"table", "sse2", "avx2", "neon"};
+static char tmpname[] = "/tmp/flexocheck.XXXXXX";
+static int failures;
+
+static void check(_Bool ok, const char *what, const char *kernel)
+{
+  printf("%s %s%s%s\n", ok ? "ok  " : "FAIL", what, *kernel ? " " : "",
+	 kernel);
+  if (!ok)
+    failures++;
+}
+
+static SNDFILE *open_raw(int mode, int subformat)
+{
+  SF_INFO info = {
+    .samplerate = 8000,
+    .channels = 1,
+    .format = SF_FORMAT_RAW | subformat,
+  };
+  SNDFILE *sf = sf_open(tmpname, mode, &info);
+  if (sf == NULL) {
+    fprintf(stderr, "check: sf_open(%s): %s\n", tmpname, sf_strerror(NULL));
+    exit(1);
+  }
+  return sf;
+}
+
+// What libsndfile makes of all PCM16 values
+static void sndfile_encode(int subformat, const short *pcm,
+			   unsigned char *out)
+{
+  SNDFILE *sf = open_raw(SFM_WRITE, subformat);
+  if (sf_write_short(sf, pcm, NVALUES) != NVALUES) {
+    fprintf(stderr, "check: sf_write_short(): %s\n", sf_strerror(sf));
+    exit(1);
+  }
+  sf_close(sf);
+
+  FILE *f = fopen(tmpname, "rb");
+  if (f == NULL || fread(out, 1, NVALUES, f) != NVALUES) {
+    fprintf(stderr, "check: Could not read back %s\n", tmpname);
+    exit(1);
+  }
+  fclose(f);
+}
+
+// What libsndfile makes of all 256 codes
+static void sndfile_decode(int subformat, short *out)
+{
+  unsigned char codes[256];
+  for (int i = 0; i < 256; i++)
+    codes[i] = i;
+
+  FILE *f = fopen(tmpname, "wb");
+  if (f == NULL || fwrite(codes, 1, sizeof(codes), f) != sizeof(codes)
+      || fclose(f) != 0) {
+    fprintf(stderr, "check: Could not write %s\n", tmpname);
+    exit(1);
+  }
+  SNDFILE *sf = open_raw(SFM_READ, subformat);
+  if (sf_read_short(sf, out, 256) != 256) {
+    fprintf(stderr, "check: sf_read_short(): %s\n", sf_strerror(sf));
+    exit(1);
+  }
+  sf_close(sf);
+}
+
+static void check_encoder(const char *kernel, const char *what,
+			  void (*encode)(unsigned char *, const short *,
+					 size_t),
+			  const short *pcm, const unsigned char *expect)
+{
+  static unsigned char out[NVALUES];
+  char chunked[64];
+
+  memset(out, 0, sizeof(out));
+  encode(out, pcm, NVALUES);
+  check(memcmp(out, expect, NVALUES) == 0, what, kernel);
+
+  memset(out, 0, sizeof(out));
+  for (size_t i = 0; i < NVALUES; i += CHUNK)
+    encode(out + i, pcm + i, NVALUES - i < CHUNK ? NVALUES - i : CHUNK);
+  snprintf(chunked, sizeof(chunked), "%s chunked", what);
+  check(memcmp(out, expect, NVALUES) == 0, chunked, kernel);
+}
+
+int main(void)
+{
+  static short pcm[NVALUES];
+  static unsigned char alaw[NVALUES], ulaw[NVALUES];
+  short alaw_pcm[256], ulaw_pcm[256], out[256];
+  unsigned char codes[256];
+
+  int fd = mkstemp(tmpname);
+  if (fd < 0) {
+    perror("check: mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  for (int i = 0; i < NVALUES; i++)
+    pcm[i] = (short)(i - 32768);
+  for (int i = 0; i < 256; i++)
+    codes[i] = i;
+  sndfile_encode(SF_FORMAT_ALAW, pcm, alaw);
+  sndfile_encode(SF_FORMAT_ULAW, pcm, ulaw);
+  sndfile_decode(SF_FORMAT_ALAW, alaw_pcm);
+  sndfile_decode(SF_FORMAT_ULAW, ulaw_pcm);
+  unlink(tmpname);
+
+  const char *selected = feg711_kernel();
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    if (feg711_set_kernel(kernels[k]) < 0) {
+      printf("skip %s (not available here)\n", kernels[k]);
+      continue;
+    }
+    check_encoder(kernels[k], "encode alaw", feg711_encode_alaw, pcm, alaw);
+    check_encoder(kernels[k], "encode ulaw", feg711_encode_ulaw, pcm, ulaw);
+  }
+  feg711_set_kernel(selected);
+
+  feg711_decode_alaw(out, codes, 256);
+  check(memcmp(out, alaw_pcm, sizeof(out)) == 0, "decode alaw", "");
+  feg711_decode_ulaw(out, codes, 256);
+  check(memcmp(out, ulaw_pcm, sizeof(out)) == 0, "decode ulaw", "");
+
+  return failures != 0;
+}
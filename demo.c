@@ -10,6 +10,7 @@
 #include <ini.h>
 #include "unused.h"
 #include <signal.h>
+#include <pthread.h>
 
 #define CONFIG1 "/etc/cowbell.ini"
 #define CONFIG2 "cowbell.ini"
@@ -18,6 +19,10 @@
 static char *uri, *registrar, *login, *password;
 // Call parameters
 static char *destination, *name;
+// Media thread parameters
+static int priority = 0, cpu = -1;
+static char *codecs;
+static int port_min = FERTP_PORT_MIN, port_max = FERTP_PORT_MAX, sessions = 0;
 
 
 static int handle_ini(void* UNUSED_PARAM(user), const char* section,
@@ -36,6 +41,19 @@ static int handle_ini(void* UNUSED_PARAM(user), const char* section,
         destination = strdup(value);
     } else if (MATCH("alert", "name")) {
         name = strdup(value);
+    } else if (MATCH("media", "priority")) {
+        priority = atoi(value);
+    } else if (MATCH("media", "cpu")) {
+        cpu = atoi(value);
+    } else if (MATCH("media", "codecs")) {
+        codecs = strdup(value);
+    } else if (MATCH("media", "ports")) {
+        if (sscanf(value, "%d-%d", &port_min, &port_max) != 2) {
+          fprintf(stderr, "Port range must be min-max: %s\n", value);
+          return 0;
+        }
+    } else if (MATCH("media", "sessions")) {
+        sessions = atoi(value);
     } else {
     	fprintf(stderr, "Unknown config option [%s] %s=%s\n", section, name, value);
         return 0;  /* unknown section/name, error */
@@ -43,7 +61,35 @@ static int handle_ini(void* UNUSED_PARAM(user), const char* section,
     return 1;
 }
 
-static char dtmf;
+/**
+ * Reacts to the calls, so the event loop never waits for us
+ */
+static void *worker(void *UNUSED_PARAM(arg))
+{
+  struct fesip_async_event evt;
+  while (fesip_async_next(&evt, -1) > 0) {
+    switch (evt.type) {
+    case FESIP_ASYNC_ANSWERED:
+      // RTP has already been started by flexosip
+      fesip_async_play(evt.call, evt.serial, "media/test.ogg");
+      fesip_async_play(evt.call, evt.serial, "media/test.ogg");
+      break;
+    case FESIP_ASYNC_DTMF:
+      fprintf(stderr, "Pressed %c\n", evt.digit);
+      sleep(1); // Only holds up this thread
+      fprintf(stderr, "Echoback %c\n", evt.digit);
+      fesip_async_dtmf(evt.call, evt.serial, evt.digit);
+      break;
+    case FESIP_ASYNC_TERMINATED:
+      fprintf(stderr, "Call terminated, exiting\n");
+      fesip_run_stop();
+      return NULL;
+    default:
+      break;
+    }
+  }
+  return NULL;
+}
 
 int main(int UNUSED_PARAM(argc), char **UNUSED_PARAM(argv))
 {
@@ -65,7 +111,20 @@ int main(int UNUSED_PARAM(argc), char **UNUSED_PARAM(argv))
   signal(SIGHUP, fesip_cleanup);
   signal(SIGTERM, fesip_cleanup);
   signal(SIGQUIT, fesip_cleanup);
+  signal(SIGUSR1, fesip_stats_signal);
+  if (codecs != NULL && fesip_set_codecs(codecs) != 0)
+    return 1; // Diagnostic already printed
+  if (fertp_set_port_range(port_min, port_max) != 0)
+    return 1;
+  if (fesip_async_start() != 0)
+    return 1;
   fesip_listen(IPPROTO_UDP, false, 0);
+  // Audio timing independent of the event loop
+  fesip_media_start(priority, cpu);
+  // Bind the RTP sockets now, not while the phone rings
+  if (fertp_pool_prewarm(sessions) < sessions)
+    fprintf(stderr, "Could only prepare some of the %d RTP sessions\n",
+	    sessions);
   fesip_register(uri, registrar, login, password);
   int i = fesip_wait_registered();
   if (i < 0) {
@@ -74,40 +133,13 @@ int main(int UNUSED_PARAM(argc), char **UNUSED_PARAM(argv))
   } else {
     fprintf(stderr, "Registration succeeded, continuing...\n");
   }
-  fesip_call(uri, destination, name, NULL);
-  while (1) {
-    fesip_handle_event();
-    if (dtmf != '\0') {
-      fprintf(stderr, "Echoback %c\n", dtmf);
-      sleep(1);
-      fprintf(stderr, "Echoback %c\n", dtmf);
-      fesip_send_dtmf(dtmf);
-      dtmf = '\0';
-    }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+    fprintf(stderr, "Cannot start the worker thread\n");
+    return 1;
   }
-}
-
-void fesip_event_answered(eXosip_event_t *UNUSED_PARAM(evt),
-    const char *remote_host, int port, int format)
-{
-  extern PayloadType payload_type_pcma16000;
-  // if the format is dynamic, the payload type will always be PCMA/16000
-  // (as long as we just support PCMA/8000 and PCMA/16000)
-  fertp_start(remote_host, port, format, &payload_type_pcma16000);
-  fesip_play("media/test.ogg");
-  fesip_play("media/test.ogg");
-}
-
-void fesip_event_terminate(eXosip_event_t *UNUSED_PARAM(evt))
-{
-  fprintf(stderr, "Call terminated, exiting\n");
-  eXosip_unlock(fesip_ctx());
-
-  exit(0);
-}
-
-void fesip_event_dtmf(char c)
-{
-  fprintf(stderr, "Pressed %c\n", c);
-  dtmf = c;
+  fesip_call(uri, destination, name, NULL);
+  fesip_run(); // Until the worker sees the call end
+  pthread_join(thread, NULL);
+  return 0;
 }
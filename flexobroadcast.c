@@ -0,0 +1,275 @@
+/* flexobroadcast — One sound file played to many calls
+ *
+ * A broadcast takes each 20 ms frame from the prompt cache (or, for
+ * files too big for it, decodes and encodes it) once per format, no
+ * matter how many play queues play it. The queues get read-only,
+ * reference counted frames, so all that is left per call is the RTP
+ * header. Everybody hears the same frame at the same time: a queue
+ * joining late (or held up by a delay) starts at the frame playing.
+ */
+#include "flexosnd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/**
+ * An encoded frame, shared by the queues playing it
+ */
+struct fesnd_bframe {
+  struct fesnd_bframe *next;	// Free list
+  int refs;			// Feed + entries, under the broadcast's lock
+  unsigned char data[FESND_MAX_FRAME];
+};
+
+/**
+ * The broadcast in one format
+ */
+struct broadcast_feed {
+  enum fesnd_format format;	// As cached (see struct fesnd_codec)
+  struct fesnd_entry src;	// The file, opened by the prefetcher
+  struct fesnd_codec_state enc;	// For files too big for the cache
+  unsigned long index;		// Of the current frame, 0 = none yet
+  const unsigned char *data;	// The current frame, NULL = silence
+  size_t len;
+  int level;			// Its level, see fesnd_level()
+  struct fesnd_bframe *buf;	// Holding it, NULL if in the cache
+  _Bool ended;
+};
+
+struct fesnd_broadcast {
+  atomic_int refs;		// Application + queue entries
+  pthread_mutex_t lock;		// Everything below
+  char *path;
+  struct broadcast_feed *feed[FESND_NFORMATS];
+  struct fesnd_bframe *free_frames;
+  struct fesnd_broadcast_stats stats;
+};
+
+struct fesnd_broadcast *fesnd_broadcast_new(const char *path)
+{
+  if (fesnd_check(path) != 0)
+    return NULL; // Diagnostic already printed
+  struct fesnd_broadcast *b = calloc(1, sizeof(*b));
+  if (b != NULL)
+    b->path = strdup(path);
+  if (b == NULL || b->path == NULL) {
+    fprintf(stderr, "fesnd_broadcast_new(%s): Out of memory\n", path);
+    free(b);
+    return NULL;
+  }
+  atomic_init(&b->refs, 1);
+  pthread_mutex_init(&b->lock, NULL);
+  return b;
+}
+
+/**
+ * Drop a reference to a frame (lock held)
+ */
+static void frame_put(struct fesnd_broadcast *b, struct fesnd_bframe *f)
+{
+  if (f != NULL && --f->refs == 0) {
+    f->next = b->free_frames;
+    b->free_frames = f;
+  }
+}
+
+/**
+ * A frame to encode into, NULL when out of memory (lock held)
+ *
+ * Frames come back to the free list, so this only allocates until
+ * there are as many as frames held at once.
+ */
+static struct fesnd_bframe *frame_get(struct fesnd_broadcast *b)
+{
+  struct fesnd_bframe *f = b->free_frames;
+  if (f != NULL)
+    b->free_frames = f->next;
+  else if ((f = malloc(sizeof(*f))) == NULL)
+    return NULL;
+  f->refs = 1;
+  return f;
+}
+
+void fesnd_broadcast_free(struct fesnd_broadcast *b)
+{
+  if (b == NULL || atomic_fetch_sub(&b->refs, 1) != 1)
+    return;
+  for (int i = 0; i < FESND_NFORMATS; i++) {
+    struct broadcast_feed *f = b->feed[i];
+    if (f == NULL)
+      continue;
+    if (f->src.prompt != NULL)
+      fesnd_cache_put(f->src.prompt);
+    if (f->src.stream != NULL)
+      fesnd_stream_close(&f->src);
+    if (f->src.job != NULL)
+      fesnd_prefetch_cancel(f->src.job);
+    frame_put(b, f->buf);
+    free(f);
+  }
+  while (b->free_frames != NULL) {
+    struct fesnd_bframe *f = b->free_frames;
+    b->free_frames = f->next;
+    free(f);
+  }
+  pthread_mutex_destroy(&b->lock);
+  free(b->path);
+  free(b);
+}
+
+/**
+ * The feed in a format, started if need be (lock held)
+ *
+ * Returns NULL when out of memory or the file cannot be prefetched
+ * (diagnostic printed to stderr)
+ */
+static struct broadcast_feed *feed_get(struct fesnd_broadcast *b,
+				       enum fesnd_format format)
+{
+  struct broadcast_feed *f = b->feed[format];
+  if (f != NULL)
+    return f;
+  f = calloc(1, sizeof(*f));
+  if (f == NULL) {
+    fprintf(stderr, "Cannot broadcast %s: Out of memory\n", b->path);
+    return NULL;
+  }
+  f->src.job = fesnd_prefetch_start(b->path, format);
+  if (f->src.job == NULL) {
+    free(f); // Diagnostic already printed
+    return NULL;
+  }
+  f->format = format;
+  b->feed[format] = f;
+  return f;
+}
+
+/**
+ * Move a feed on to its next frame (lock held)
+ *
+ * Until the file is opened, or while decoding is behind, the frame is
+ * silence.
+ */
+static void feed_advance(struct fesnd_broadcast *b, struct broadcast_feed *f)
+{
+  struct fesnd_entry *src = &f->src;
+  const struct fesnd_codec *codec = fesnd_codec(f->format);
+  frame_put(b, f->buf);
+  f->buf = NULL;
+  f->data = NULL;
+  f->len = 0;
+  f->level = FESND_SILENT;
+  f->index++;
+  b->stats.frames++;
+  if (f->ended)
+    return;
+  if (src->prompt == NULL && src->stream == NULL) {
+    int ready = fesnd_prefetch_poll(src, codec->rate);
+    if (ready < 0)
+      f->ended = true;
+    if (ready <= 0)
+      return;
+  }
+  if (src->prompt != NULL) {
+    // Straight from the cache
+    f->data = fesnd_prompt_frame(src->prompt, src->pos, &f->len);
+    if (f->data == NULL)
+      f->ended = true;
+    f->level = fesnd_prompt_level(src->prompt, src->pos++);
+    return;
+  }
+  struct fesnd_bframe *buf = frame_get(b);
+  if (buf == NULL)
+    return; // Silence, try again next frame
+  ssize_t nbytes = fesnd_stream_frame(src, codec, &f->enc, buf->data);
+  if (nbytes <= 0) {
+    frame_put(b, buf);
+    f->ended = (nbytes < 0);
+    return;
+  }
+  b->stats.encoded++;
+  f->buf = buf;
+  f->data = buf->data;
+  f->len = nbytes;
+  f->level = src->level;
+}
+
+// ------------- Play queue -----------------
+
+int fesnd_add_broadcast(struct fesnd_queue *q, struct fesnd_broadcast *b)
+{
+  struct fesnd_entry *e = fesnd_queue_reserve(q);
+  if (e == NULL)
+    return 1; // Diagnostic already printed
+  if (fesnd_broadcast_attach(e, b, q->format) != 0)
+    return 1;
+  atomic_fetch_add(&b->refs, 1);
+  e->bc = b;
+  pthread_mutex_lock(&b->lock);
+  b->stats.listeners++;
+  pthread_mutex_unlock(&b->lock);
+  fesnd_queue_commit(q);
+  return 0;
+}
+
+int fesnd_broadcast_attach(struct fesnd_entry *e, struct fesnd_broadcast *b,
+			   enum fesnd_format format)
+{
+  pthread_mutex_lock(&b->lock);
+  struct broadcast_feed *f = feed_get(b, fesnd_codec(format)->cache_as);
+  if (f != NULL)
+    e->pos = f->index + 1; // Join with the next frame
+  pthread_mutex_unlock(&b->lock);
+  return f == NULL;
+}
+
+ssize_t fesnd_broadcast_frame(struct fesnd_entry *e, enum fesnd_format format,
+			      const unsigned char **frame)
+{
+  struct fesnd_broadcast *b = e->bc;
+  pthread_mutex_lock(&b->lock);
+  struct broadcast_feed *f = feed_get(b, fesnd_codec(format)->cache_as);
+  if (f == NULL) {
+    pthread_mutex_unlock(&b->lock);
+    return -1;
+  }
+  // The first queue to want the next frame makes it; the others
+  // (and any that fell behind) get the one playing
+  if (e->pos > f->index)
+    feed_advance(b, f);
+  e->pos = f->index + 1;
+  frame_put(b, e->held);
+  e->held = f->buf;
+  if (f->buf != NULL)
+    f->buf->refs++;
+  *frame = f->data;
+  e->level = f->level;
+  ssize_t nbytes = f->data != NULL ? (ssize_t)f->len : f->ended ? -1 : 0;
+  if (nbytes > 0)
+    b->stats.delivered++;
+  pthread_mutex_unlock(&b->lock);
+  return nbytes;
+}
+
+void fesnd_broadcast_close(struct fesnd_entry *e)
+{
+  struct fesnd_broadcast *b = e->bc;
+  pthread_mutex_lock(&b->lock);
+  frame_put(b, e->held);
+  b->stats.listeners--;
+  pthread_mutex_unlock(&b->lock);
+  e->held = NULL;
+  e->bc = NULL;
+  fesnd_broadcast_free(b);
+}
+
+void fesnd_broadcast_get_stats(struct fesnd_broadcast *b,
+			       struct fesnd_broadcast_stats *stats)
+{
+  pthread_mutex_lock(&b->lock);
+  *stats = b->stats;
+  pthread_mutex_unlock(&b->lock);
+}
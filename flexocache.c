@@ -0,0 +1,363 @@
+/* flexocache — Prompt cache for flexosnd
+ *
+ * Every prompt is decoded, resampled and encoded only once per
+ * codec; all play queues then share the encoded frames.
+ */
+#include "flexosnd.h"
+#include <sndfile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define CACHE_BUCKETS 64
+
+struct fesnd_prompt {
+  struct fesnd_prompt *hnext;		// Hash chain
+  struct fesnd_prompt *prev, *next;	// LRU list, most recent first
+  char *path;
+  struct timespec mtime;
+  off_t size;
+  enum fesnd_format format;
+  int refcount;
+  _Bool stale;				// File changed, no longer findable
+  _Bool loading;			// Being decoded, frames not there yet
+  size_t frame_bytes;			// Bytes per (full) frame
+  size_t nbytes;			// Total bytes in frames
+  unsigned char *frames;
+  unsigned char *levels;		// Per frame, see fesnd_level()
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER;
+static struct fesnd_prompt *buckets[CACHE_BUCKETS];
+static struct fesnd_prompt *lru_head, *lru_tail;
+static size_t cache_usage;
+static size_t cache_limit = FESND_CACHE_LIMIT;
+static unsigned preload_formats =
+  1 << FESND_PCMA8000 | 1 << FESND_PCMU8000 | 1 << FESND_G722;
+
+static unsigned hash(const char *path, enum fesnd_format format)
+{
+  unsigned h = 2166136261u ^ format; // FNV-1a
+  while (*path)
+    h = (h ^ (unsigned char)*path++) * 16777619u;
+  return h % CACHE_BUCKETS;
+}
+
+static void lru_unlink(struct fesnd_prompt *p)
+{
+  if (p->prev != NULL)
+    p->prev->next = p->next;
+  else
+    lru_head = p->next;
+  if (p->next != NULL)
+    p->next->prev = p->prev;
+  else
+    lru_tail = p->prev;
+  p->prev = p->next = NULL;
+}
+
+static void lru_push(struct fesnd_prompt *p)
+{
+  p->prev = NULL;
+  p->next = lru_head;
+  if (lru_head != NULL)
+    lru_head->prev = p;
+  else
+    lru_tail = p;
+  lru_head = p;
+}
+
+/**
+ * Remove the prompt from the hash table, so it cannot be found anymore
+ */
+static void cache_unhash(struct fesnd_prompt *p)
+{
+  struct fesnd_prompt **pp = &buckets[hash(p->path, p->format)];
+  while (*pp != NULL) {
+    if (*pp == p) {
+      *pp = p->hnext;
+      break;
+    }
+    pp = &(*pp)->hnext;
+  }
+  p->hnext = NULL;
+}
+
+static void cache_free(struct fesnd_prompt *p)
+{
+  cache_usage -= p->nbytes;
+  free(p->frames);
+  free(p->levels);
+  free(p->path);
+  free(p);
+}
+
+/**
+ * Evict unused prompts, least recently used first, until below the limit
+ */
+static void cache_trim(void)
+{
+  struct fesnd_prompt *p = lru_tail;
+  while (cache_usage > cache_limit && p != NULL) {
+    struct fesnd_prompt *prev = p->prev;
+    if (p->refcount == 0) {
+      lru_unlink(p);
+      cache_unhash(p);
+      cache_free(p);
+    }
+    p = prev;
+  }
+}
+
+/**
+ * Decode and encode a sound file into a new prompt, without cache_lock
+ *
+ * Returns non-zero on error or if too big for limit (*toobig set then)
+ */
+static int cache_load(struct fesnd_prompt *p, size_t limit, _Bool *toobig)
+{
+  struct fesnd_decoder dec;
+  *toobig = false;
+  if (fesnd_decoder_open(&dec, p->path, fesnd_format_rate(p->format)) != 0)
+    return 1; // Diagnostic already printed
+  const struct fesnd_codec *codec = fesnd_codec(p->format);
+  size_t maxbytes = fesnd_codec_max_bytes(p->format, dec.left);
+  if (maxbytes > limit) {
+    *toobig = true;
+    fesnd_decoder_close(&dec);
+    return 1;
+  }
+
+  size_t maxframes = maxbytes / codec->frame_bytes;
+  p->frames = malloc(maxbytes > 0 ? maxbytes : 1);
+  p->levels = malloc(maxframes > 0 ? maxframes : 1);
+  if (p->frames == NULL || p->levels == NULL) {
+    fprintf(stderr, "Out of memory caching %s\n", p->path);
+    fesnd_decoder_close(&dec);
+    return 1;
+  }
+  p->frame_bytes = codec->frame_bytes;
+
+  // Frame by frame, so only the last one may be short
+  struct fesnd_codec_state enc = {0};
+  short buf[FESND_MAX_SAMPLES];
+  size_t n, nframes = 0;
+  while (nframes < maxframes
+	 && (n = fesnd_decoder_read(&dec, buf, codec->frame_samples)) > 0) {
+    p->nbytes += codec->encode(&enc, p->frames + p->nbytes, buf, n);
+    p->levels[nframes++] = fesnd_level(buf, n);
+  }
+  fesnd_decoder_close(&dec);
+  return 0;
+}
+
+/**
+ * Look a prompt up, with cache_lock held
+ *
+ * Forgets it if the file changed since (st != NULL).
+ */
+static struct fesnd_prompt *cache_lookup(const char *path,
+					 enum fesnd_format format,
+					 const struct stat *st)
+{
+  struct fesnd_prompt *p;
+  for (p = buckets[hash(path, format)]; p != NULL; p = p->hnext) {
+    if (p->format == format && strcmp(p->path, path) == 0) {
+      if (st == NULL
+	  || (p->mtime.tv_sec == st->st_mtim.tv_sec
+	      && p->mtime.tv_nsec == st->st_mtim.tv_nsec
+	      && p->size == st->st_size)) {
+	return p; // Hit
+      }
+      // File changed: forget it, free once no longer played
+      cache_unhash(p);
+      p->stale = true;
+      if (p->refcount == 0) {
+	lru_unlink(p);
+	cache_free(p);
+      }
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+int fesnd_cache_get(const char *path, enum fesnd_format format,
+		    struct fesnd_prompt **prompt)
+{
+  struct stat st;
+  *prompt = NULL;
+  format = fesnd_codec(format)->cache_as;
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "Cannot open sound file %s\n", path);
+    return 1;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  struct fesnd_prompt *p;
+  // Being loaded by somebody else: wait for it, then look again
+  while ((p = cache_lookup(path, format, &st)) != NULL && p->loading)
+    pthread_cond_wait(&cache_loaded, &cache_lock);
+  if (p != NULL) {
+    lru_unlink(p);
+    lru_push(p);
+    p->refcount++;
+    cache_trim();
+    pthread_mutex_unlock(&cache_lock);
+    *prompt = p;
+    return 0;
+  }
+
+  // Miss: findable while loading, so the file is decoded only once
+  p = calloc(1, sizeof(*p));
+  if (p != NULL && (p->path = strdup(path)) == NULL) {
+    free(p);
+    p = NULL;
+  }
+  if (p == NULL) {
+    pthread_mutex_unlock(&cache_lock);
+    fprintf(stderr, "Out of memory caching %s\n", path);
+    return 1;
+  }
+  p->mtime = st.st_mtim;
+  p->size = st.st_size;
+  p->format = format;
+  p->loading = true;
+  p->refcount = 1;
+  unsigned h = hash(path, format);
+  p->hnext = buckets[h];
+  buckets[h] = p;
+  lru_push(p);
+  size_t limit = cache_limit;
+  pthread_mutex_unlock(&cache_lock);
+
+  _Bool toobig;
+  int err = cache_load(p, limit, &toobig);
+
+  pthread_mutex_lock(&cache_lock);
+  p->loading = false;
+  if (err) {
+    cache_unhash(p);
+    lru_unlink(p);
+    cache_free(p);
+    p = NULL;
+  } else {
+    cache_usage += p->nbytes;
+    cache_trim();
+  }
+  pthread_cond_broadcast(&cache_loaded);
+  pthread_mutex_unlock(&cache_lock);
+  if (p == NULL)
+    return toobig ? 0 : 1;
+  *prompt = p;
+  return 0;
+}
+
+struct fesnd_prompt *fesnd_cache_find(struct fesnd_prompt *prompt,
+				      enum fesnd_format format)
+{
+  format = fesnd_codec(format)->cache_as;
+  pthread_mutex_lock(&cache_lock);
+  struct fesnd_prompt *p = cache_lookup(prompt->path, format, NULL);
+  if (p != NULL && (p->loading || p->mtime.tv_sec != prompt->mtime.tv_sec
+		    || p->mtime.tv_nsec != prompt->mtime.tv_nsec
+		    || p->size != prompt->size))
+    p = NULL; // Not ready, or another version of the file
+  if (p != NULL) {
+    lru_unlink(p);
+    lru_push(p);
+    p->refcount++;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return p;
+}
+
+void fesnd_cache_put(struct fesnd_prompt *prompt)
+{
+  pthread_mutex_lock(&cache_lock);
+  if (--prompt->refcount == 0) {
+    if (prompt->stale) {
+      lru_unlink(prompt);
+      cache_free(prompt);
+    } else {
+      cache_trim();
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+int fesnd_cache_preload(const char *path)
+{
+  for (int format = 0; format < FESND_NFORMATS; format++) {
+    if (!(preload_formats & 1 << format))
+      continue;
+    struct fesnd_prompt *p;
+    if (fesnd_cache_get(path, format, &p) != 0)
+      return 1;
+    if (p == NULL) {
+      fprintf(stderr, "Sound file %s too big for the prompt cache\n", path);
+      return 1;
+    }
+    fesnd_cache_put(p);
+  }
+  return 0;
+}
+
+void fesnd_cache_set_preload_formats(unsigned mask)
+{
+  preload_formats = mask;
+}
+
+void fesnd_cache_set_limit(size_t bytes)
+{
+  pthread_mutex_lock(&cache_lock);
+  cache_limit = bytes;
+  cache_trim();
+  pthread_mutex_unlock(&cache_lock);
+}
+
+size_t fesnd_cache_usage(void)
+{
+  pthread_mutex_lock(&cache_lock);
+  size_t usage = cache_usage;
+  pthread_mutex_unlock(&cache_lock);
+  return usage;
+}
+
+void fesnd_cache_flush(void)
+{
+  pthread_mutex_lock(&cache_lock);
+  size_t limit = cache_limit;
+  cache_limit = 0;
+  cache_trim();
+  cache_limit = limit;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+const unsigned char *fesnd_prompt_frame(const struct fesnd_prompt *prompt,
+					size_t index, size_t *nbytes)
+{
+  size_t offset = index * prompt->frame_bytes;
+  if (offset >= prompt->nbytes)
+    return NULL;
+  *nbytes = prompt->nbytes - offset;
+  if (*nbytes > prompt->frame_bytes)
+    *nbytes = prompt->frame_bytes;
+  return prompt->frames + offset;
+}
+
+int fesnd_prompt_level(const struct fesnd_prompt *prompt, size_t index)
+{
+  if (index * prompt->frame_bytes >= prompt->nbytes)
+    return FESND_SILENT;
+  return prompt->levels[index];
+}
+
+const char *fesnd_prompt_path(const struct fesnd_prompt *prompt)
+{
+  return prompt->path;
+}
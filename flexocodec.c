@@ -0,0 +1,142 @@
+/* flexocodec — Codec registry for flexosnd
+ *
+ * One descriptor per enum fesnd_format, binding the SDP name and
+ * RTP clock to the frame size and the encoder/decoder functions.
+ */
+#include "flexosnd.h"
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include "unused.h"
+#include "flexog711.h"
+#include "flexog722.h"
+
+_Static_assert(sizeof(struct feg722) <= FESND_CODEC_STATE * sizeof(int),
+	       "FESND_CODEC_STATE too small for G.722");
+
+// ------------- G.711 (stateless) -----------------
+
+static size_t encode_alaw(struct fesnd_codec_state *UNUSED_PARAM(state),
+			  unsigned char *out, const short *in, size_t n)
+{
+  feg711_encode_alaw(out, in, n);
+  return n;
+}
+
+static size_t decode_alaw(struct fesnd_codec_state *UNUSED_PARAM(state),
+			  short *out, const unsigned char *in, size_t n)
+{
+  feg711_decode_alaw(out, in, n);
+  return n;
+}
+
+static size_t encode_ulaw(struct fesnd_codec_state *UNUSED_PARAM(state),
+			  unsigned char *out, const short *in, size_t n)
+{
+  feg711_encode_ulaw(out, in, n);
+  return n;
+}
+
+static size_t decode_ulaw(struct fesnd_codec_state *UNUSED_PARAM(state),
+			  short *out, const unsigned char *in, size_t n)
+{
+  feg711_decode_ulaw(out, in, n);
+  return n;
+}
+
+// ------------- L16 (RFC 3551 4.5.11, network byte order) -----------------
+
+static size_t encode_l16(struct fesnd_codec_state *UNUSED_PARAM(state),
+			 unsigned char *out, const short *in, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    out[2*i] = (unsigned short)in[i] >> 8;
+    out[2*i + 1] = in[i] & 0xff;
+  }
+  return 2 * n;
+}
+
+static size_t decode_l16(struct fesnd_codec_state *UNUSED_PARAM(state),
+			 short *out, const unsigned char *in, size_t nbytes)
+{
+  for (size_t i = 0; i < nbytes / 2; i++)
+    out[i] = (short)(in[2*i] << 8 | in[2*i + 1]);
+  return nbytes / 2;
+}
+
+// ------------- G.722 -----------------
+
+static struct feg722 *g722_state(struct fesnd_codec_state *state)
+{
+  struct feg722 *s = (struct feg722 *)state->state;
+  if (!state->initialized) {
+    feg722_init(s);
+    state->initialized = 1;
+  }
+  return s;
+}
+
+static size_t encode_g722(struct fesnd_codec_state *state,
+			  unsigned char *out, const short *in, size_t n)
+{
+  return feg722_encode(g722_state(state), out, in, n);
+}
+
+static size_t decode_g722(struct fesnd_codec_state *state,
+			  short *out, const unsigned char *in, size_t nbytes)
+{
+  return feg722_decode(g722_state(state), out, in, nbytes);
+}
+
+// ------------- Registry -----------------
+
+static const struct fesnd_codec codecs[FESND_NFORMATS] = {
+  [FESND_PCMA8000] = {"PCMA", 8000, 8000, 8, 160, 160, FESND_PCMA8000,
+		      encode_alaw, decode_alaw},
+  [FESND_PCMU8000] = {"PCMU", 8000, 8000, 0, 160, 160, FESND_PCMU8000,
+		      encode_ulaw, decode_ulaw},
+  // RTP clock is 8 kHz for historic reasons (RFC 3551 4.5.2)
+  [FESND_G722] = {"G722", 8000, 16000, 9, 320, 160, FESND_L16_16000,
+		  encode_g722, decode_g722},
+  [FESND_L16_16000] = {"L16", 16000, 16000, -1, 320, 640, FESND_L16_16000,
+		       encode_l16, decode_l16},
+  [FESND_L16_8000] = {"L16", 8000, 8000, -1, 160, 320, FESND_L16_8000,
+		      encode_l16, decode_l16},
+  [FESND_PCMA16000] = {"PCMA", 16000, 16000, -1, 320, 320, FESND_PCMA16000,
+		       encode_alaw, decode_alaw},
+};
+
+const struct fesnd_codec *fesnd_codec(enum fesnd_format format)
+{
+  if ((unsigned)format >= FESND_NFORMATS)
+    return NULL;
+  return &codecs[format];
+}
+
+int fesnd_codec_find(const char *name, int clock_rate)
+{
+  for (int format = 0; format < FESND_NFORMATS; format++)
+    if (codecs[format].clock_rate == clock_rate
+	&& strcasecmp(codecs[format].name, name) == 0)
+      return format;
+  return -1;
+}
+
+size_t fesnd_codec_max_bytes(enum fesnd_format format, size_t nsamples)
+{
+  const struct fesnd_codec *c = &codecs[format];
+  size_t frames = (nsamples + c->frame_samples - 1) / c->frame_samples;
+  return frames * c->frame_bytes;
+}
+
+int fesnd_level(const short *pcm, size_t n)
+{
+  long long energy = 0; // Fits: 2^30 per sample
+  for (size_t i = 0; i < n; i++)
+    energy += pcm[i] * pcm[i];
+  if (energy == 0)
+    return FESND_SILENT;
+  // Relative to the mean square of a full-scale square wave
+  double db = 10 * log10((double)energy / n / (32768.0 * 32768.0));
+  return -db < FESND_SILENT ? (int)(0.5 - db) : FESND_SILENT;
+}
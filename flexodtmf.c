@@ -0,0 +1,228 @@
+#include "flexodtmf.h"
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEDTMF_X86
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#define BLOCK_MS_X10 256 // 25.6 ms blocks (205 samples at 8 kHz)
+#define MIN_AMPLITUDE 500.0f // Per tone, about -33 dBm0
+#define NORMAL_TWIST 6.31f // Row tone may be 8 dB stronger than column
+#define REVERSE_TWIST 2.51f // Column tone may be 4 dB stronger than row
+#define GROUP_MARGIN 3.98f // 6 dB above the other tones of its group
+#define ENERGY_FRACTION 0.5f // Share of the block's energy in both tones
+
+static const float freqs[FEDTMF_TONES] = {
+  697, 770, 852, 941,		// Rows
+  1209, 1336, 1477, 1633	// Columns
+};
+static const char digit_map[4][4] = {
+  {'1', '2', '3', 'A'},
+  {'4', '5', '6', 'B'},
+  {'7', '8', '9', 'C'},
+  {'*', '0', '#', 'D'},
+};
+
+// 2·cos(2π·f/rate), for 8 and 16 kHz
+static float coeff8k[FEDTMF_TONES] __attribute__((aligned(32)));
+static float coeff16k[FEDTMF_TONES] __attribute__((aligned(32)));
+
+typedef void (*fedtmf_filter)(float *, float *, const float *,
+			      const short *, size_t);
+static fedtmf_filter filter;
+static const char *kernel_name = "scalar";
+
+// ------------- Goertzel kernels: s0 = x + c·s1 − s2 for all tones ---------
+
+static void filter_scalar(float *s1, float *s2, const float *c,
+			  const short *x, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    for (int k = 0; k < FEDTMF_TONES; k++) {
+      float s0 = x[i] + c[k] * s1[k] - s2[k];
+      s2[k] = s1[k];
+      s1[k] = s0;
+    }
+  }
+}
+
+#if defined(FEDTMF_X86) && defined(__SSE__)
+static void filter_sse(float *s1, float *s2, const float *c,
+		       const short *x, size_t n)
+{
+  // Two independent halves (rows, columns) hide some of the latency
+  __m128 c0 = _mm_loadu_ps(c), c1 = _mm_loadu_ps(c + 4);
+  __m128 a0 = _mm_loadu_ps(s1), a1 = _mm_loadu_ps(s1 + 4);
+  __m128 b0 = _mm_loadu_ps(s2), b1 = _mm_loadu_ps(s2 + 4);
+  for (size_t i = 0; i < n; i++) {
+    __m128 xv = _mm_set1_ps(x[i]);
+    __m128 t0 = _mm_add_ps(_mm_mul_ps(c0, a0), _mm_sub_ps(xv, b0));
+    __m128 t1 = _mm_add_ps(_mm_mul_ps(c1, a1), _mm_sub_ps(xv, b1));
+    b0 = a0; a0 = t0;
+    b1 = a1; a1 = t1;
+  }
+  _mm_storeu_ps(s1, a0); _mm_storeu_ps(s1 + 4, a1);
+  _mm_storeu_ps(s2, b0); _mm_storeu_ps(s2 + 4, b1);
+}
+#endif
+
+#ifdef FEDTMF_X86
+__attribute__((target("avx2,fma")))
+static void filter_avx2(float *s1, float *s2, const float *c,
+			const short *x, size_t n)
+{
+  __m256 cv = _mm256_loadu_ps(c);
+  __m256 a = _mm256_loadu_ps(s1), b = _mm256_loadu_ps(s2);
+  for (size_t i = 0; i < n; i++) {
+    __m256 t = _mm256_fmadd_ps(cv, a, _mm256_sub_ps(_mm256_set1_ps(x[i]), b));
+    b = a;
+    a = t;
+  }
+  _mm256_storeu_ps(s1, a);
+  _mm256_storeu_ps(s2, b);
+}
+#endif
+
+#ifdef __ARM_NEON
+static void filter_neon(float *s1, float *s2, const float *c,
+			const short *x, size_t n)
+{
+  float32x4_t c0 = vld1q_f32(c), c1 = vld1q_f32(c + 4);
+  float32x4_t a0 = vld1q_f32(s1), a1 = vld1q_f32(s1 + 4);
+  float32x4_t b0 = vld1q_f32(s2), b1 = vld1q_f32(s2 + 4);
+  for (size_t i = 0; i < n; i++) {
+    float32x4_t xv = vdupq_n_f32(x[i]);
+    float32x4_t t0 = vmlaq_f32(vsubq_f32(xv, b0), c0, a0);
+    float32x4_t t1 = vmlaq_f32(vsubq_f32(xv, b1), c1, a1);
+    b0 = a0; a0 = t0;
+    b1 = a1; a1 = t1;
+  }
+  vst1q_f32(s1, a0); vst1q_f32(s1 + 4, a1);
+  vst1q_f32(s2, b0); vst1q_f32(s2 + 4, b1);
+}
+#endif
+
+__attribute__((constructor))
+static void fedtmf_setup(void)
+{
+  for (int k = 0; k < FEDTMF_TONES; k++) {
+    coeff8k[k] = 2 * cos(2 * M_PI * freqs[k] / 8000);
+    coeff16k[k] = 2 * cos(2 * M_PI * freqs[k] / 16000);
+  }
+  filter = filter_scalar;
+#if defined(FEDTMF_X86) && defined(__SSE__)
+  filter = filter_sse;
+  kernel_name = "sse";
+#endif
+#ifdef FEDTMF_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    filter = filter_avx2;
+    kernel_name = "avx2";
+  }
+#endif
+#ifdef __ARM_NEON
+  filter = filter_neon;
+  kernel_name = "neon";
+#endif
+}
+
+const char *fedtmf_kernel(void)
+{
+  return kernel_name;
+}
+
+// ------------- Detection -----------------
+
+int fedtmf_init(struct fedtmf *d, int rate)
+{
+  if (rate != 8000 && rate != 16000)
+    return 1;
+  d->coeff = (rate == 8000) ? coeff8k : coeff16k;
+  d->block = rate * BLOCK_MS_X10 / 10000;
+  // Goertzel power of a sine with that amplitude: (A·N/2)²
+  d->min_power = MIN_AMPLITUDE * d->block / 2;
+  d->min_power *= d->min_power;
+  d->pos = 0;
+  d->energy = 0;
+  d->candidate = d->current = '\0';
+  for (int k = 0; k < FEDTMF_TONES; k++)
+    d->s1[k] = d->s2[k] = 0;
+  return 0;
+}
+
+/**
+ * Index of the strongest of 4 tones, -1 if not clearly dominant
+ */
+static int strongest(const float *power)
+{
+  int best = 0;
+  for (int k = 1; k < 4; k++)
+    if (power[k] > power[best])
+      best = k;
+  for (int k = 0; k < 4; k++)
+    if (k != best && power[k] * GROUP_MARGIN > power[best])
+      return -1;
+  return best;
+}
+
+/**
+ * Evaluate a full block, '\0' if it does not hold a valid digit
+ */
+static char fedtmf_block(struct fedtmf *d)
+{
+  float power[FEDTMF_TONES];
+  for (int k = 0; k < FEDTMF_TONES; k++)
+    power[k] = d->s1[k] * d->s1[k] + d->s2[k] * d->s2[k]
+      - d->coeff[k] * d->s1[k] * d->s2[k];
+  int row = strongest(power), col = strongest(power + 4);
+  if (row < 0 || col < 0)
+    return '\0';
+  float pr = power[row], pc = power[4 + col];
+  if (pr < d->min_power || pc < d->min_power)
+    return '\0';
+  if (pr > pc * NORMAL_TWIST || pc > pr * REVERSE_TWIST)
+    return '\0';
+  // Both tones must make up most of the signal (no speech, no noise)
+  if (pr + pc < ENERGY_FRACTION * d->energy * d->block / 2)
+    return '\0';
+  return digit_map[row][col];
+}
+
+int fedtmf_process(struct fedtmf *d, const short *pcm, size_t nsamples,
+		   char *digits, int maxdigits)
+{
+  int found = 0;
+  while (nsamples > 0) {
+    size_t chunk = d->block - d->pos;
+    if (chunk > nsamples)
+      chunk = nsamples;
+    filter(d->s1, d->s2, d->coeff, pcm, chunk);
+    float energy = 0;
+    for (size_t i = 0; i < chunk; i++)
+      energy += (float)pcm[i] * pcm[i];
+    d->energy += energy;
+    d->pos += chunk;
+    pcm += chunk;
+    nsamples -= chunk;
+    if (d->pos < d->block)
+      break;
+
+    char digit = fedtmf_block(d);
+    // Changes (including the end of a digit) need two equal blocks
+    if (digit == d->candidate && digit != d->current) {
+      d->current = digit;
+      if (digit != '\0' && found < maxdigits)
+	digits[found++] = digit;
+    }
+    d->candidate = digit;
+    d->pos = 0;
+    d->energy = 0;
+    for (int k = 0; k < FEDTMF_TONES; k++)
+      d->s1[k] = d->s2[k] = 0;
+  }
+  return found;
+}
@@ -0,0 +1,56 @@
+/* flexodtmf — In-band DTMF detection for flexoSIP
+ *
+ * Streaming Goertzel detector for the 8 DTMF tones, with level,
+ * twist and signal-to-energy checks. All 8 tones are filtered in
+ * one SIMD vector (AVX2+FMA, SSE, NEON or plain C, selected at
+ * program start). No allocation: embed the state where needed.
+ */
+#include <stddef.h>
+
+#define FEDTMF_TONES 8
+
+/**
+ * Detector state (per call)
+ *
+ * Treat as opaque, set up with fedtmf_init().
+ */
+struct fedtmf {
+  float s1[FEDTMF_TONES] __attribute__((aligned(32)));
+  float s2[FEDTMF_TONES] __attribute__((aligned(32)));
+  const float *coeff;		// Goertzel coefficients for the rate
+  float energy;			// Of the current block
+  float min_power;		// Per-tone level threshold
+  int block, pos;		// Block length and position in it
+  char candidate;		// Last block's result
+  char current;			// Digit currently held, '\0' = none
+};
+
+/**
+ * Set up (or reset) a detector
+ *
+ * Returns != 0 for unsupported rates
+ *
+ * @param d		The detector
+ * @param rate		Sample rate (8000 or 16000)
+ */
+int fedtmf_init(struct fedtmf *d, int rate);
+
+/**
+ * Feed audio
+ *
+ * Returns the number of digits detected (each reported once, when
+ * it has been present for two blocks, i.e. about 50 ms).
+ *
+ * @param d		The detector
+ * @param pcm		Mono PCM16 samples
+ * @param nsamples	How many
+ * @param digits	Where to put the detected digits ('0'…'9', '*', '#', 'A'…'D')
+ * @param maxdigits	Room in digits
+ */
+int fedtmf_process(struct fedtmf *d, const short *pcm, size_t nsamples,
+		   char *digits, int maxdigits);
+
+/**
+ * Name of the filter kernel in use ("avx2", "sse", "neon", "scalar")
+ */
+const char *fedtmf_kernel(void);
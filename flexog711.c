@@ -0,0 +1,380 @@
+#include "flexog711.h"
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEG711_X86
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+// Tables, indexed by magnitude as libsndfile does:
+// A-Law by |x|/16 (0…2048), µ-Law by |x|/4 (0…8192).
+// The sign is applied by clearing bit 7 for negative samples.
+static unsigned char alaw_enc[2049];
+static unsigned char ulaw_enc[8193];
+static short alaw_dec[256];
+static short ulaw_dec[256];
+
+typedef void (*feg711_encoder)(unsigned char *, const short *, size_t);
+static feg711_encoder alaw_kernel, ulaw_kernel;
+static const char *kernel_name = "table";
+
+// ------------- Reference (ITU-T G.711) conversion -----------------
+// Only used to fill the tables
+
+static unsigned char linear2alaw(int pcm_val) // pcm_val >= 0
+{
+  static const int seg_end[8] = {0x1F, 0x3F, 0x7F, 0xFF,
+				 0x1FF, 0x3FF, 0x7FF, 0xFFF};
+  int seg;
+  pcm_val >>= 3; // 13 bit
+  for (seg = 0; seg < 8 && pcm_val > seg_end[seg]; seg++)
+    ;
+  if (seg >= 8)
+    return 0x7F ^ 0xD5; // Out of range
+  int aval = seg << 4;
+  if (seg < 2)
+    aval |= (pcm_val >> 1) & 0xF;
+  else
+    aval |= (pcm_val >> seg) & 0xF;
+  return aval ^ 0xD5;
+}
+
+static unsigned char linear2ulaw(int pcm_val) // pcm_val >= 0
+{
+  static const int seg_end[8] = {0x3F, 0x7F, 0xFF, 0x1FF,
+				 0x3FF, 0x7FF, 0xFFF, 0x1FFF};
+  int seg;
+  pcm_val >>= 2; // 14 bit
+  if (pcm_val > 8159)
+    pcm_val = 8159; // Clip
+  pcm_val += 0x84 >> 2; // Bias
+  for (seg = 0; seg < 8 && pcm_val > seg_end[seg]; seg++)
+    ;
+  if (seg >= 8)
+    return 0x7F ^ 0xFF; // Out of range
+  return ((seg << 4) | ((pcm_val >> (seg + 1)) & 0xF)) ^ 0xFF;
+}
+
+static short alaw2linear(unsigned char a_val)
+{
+  a_val ^= 0x55;
+  int t = (a_val & 0xF) << 4;
+  int seg = (a_val & 0x70) >> 4;
+  switch (seg) {
+  case 0:
+    t += 8;
+    break;
+  case 1:
+    t += 0x108;
+    break;
+  default:
+    t += 0x108;
+    t <<= seg - 1;
+  }
+  return (a_val & 0x80) ? t : -t;
+}
+
+static short ulaw2linear(unsigned char u_val)
+{
+  u_val = ~u_val;
+  int t = ((u_val & 0xF) << 3) + 0x84;
+  t <<= (u_val & 0x70) >> 4;
+  return (u_val & 0x80) ? (0x84 - t) : (t - 0x84);
+}
+
+// ------------- Kernels -----------------
+
+static void encode_alaw_table(unsigned char *out, const short *in, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    int s = in[i];
+    out[i] = s >= 0 ? alaw_enc[s >> 4] : 0x7F & alaw_enc[(-s) >> 4];
+  }
+}
+
+static void encode_ulaw_table(unsigned char *out, const short *in, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    int s = in[i];
+    out[i] = s >= 0 ? ulaw_enc[s >> 2] : 0x7F & ulaw_enc[(-s) >> 2];
+  }
+}
+
+// The SIMD kernels compute the segment (exponent) by counting how many
+// segment boundaries the magnitude has crossed, and shift the mantissa
+// right by one for each of them. This needs neither gathers nor
+// per-lane variable shifts, so plain SSE2 suffices.
+
+#if defined(FEG711_X86) && defined(__SSE2__)
+static void encode_alaw_sse2(unsigned char *out, const short *in, size_t n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i neg = _mm_cmplt_epi16(x, zero);
+    // |x| as unsigned (-32768 → 32768), then /16 → 0…2048
+    __m128i idx = _mm_srli_epi16(_mm_sub_epi16(_mm_xor_si128(x, neg), neg), 4);
+    __m128i seg = zero, m = idx;
+    for (int b = 4; b < 11; b++) { // Boundaries 0x10…0x400
+      __m128i over = _mm_cmpgt_epi16(idx, _mm_set1_epi16((1 << b) - 1));
+      seg = _mm_sub_epi16(seg, over);
+      if (b > 4) // Segments 0 and 1 share the mantissa position
+	m = _mm_or_si128(_mm_andnot_si128(over, m),
+			 _mm_and_si128(over, _mm_srli_epi16(m, 1)));
+    }
+    __m128i aval = _mm_or_si128(_mm_slli_epi16(seg, 4),
+				_mm_and_si128(m, _mm_set1_epi16(0xF)));
+    __m128i clip = _mm_cmpgt_epi16(idx, _mm_set1_epi16(0x7FF));
+    aval = _mm_or_si128(aval, _mm_and_si128(clip, _mm_set1_epi16(0x7F)));
+    // Sign and even-bit inversion: 0xD5 positive, 0x55 negative
+    aval = _mm_xor_si128(aval, _mm_set1_epi16(0xD5));
+    aval = _mm_andnot_si128(_mm_and_si128(neg, _mm_set1_epi16(0x80)), aval);
+    _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(aval, aval));
+  }
+  encode_alaw_table(out + i, in + i, n - i);
+}
+
+static void encode_ulaw_sse2(unsigned char *out, const short *in, size_t n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i neg = _mm_cmplt_epi16(x, zero);
+    // |x|/4 → 0…8192, clipped and biased → 33…8192
+    __m128i v = _mm_srli_epi16(_mm_sub_epi16(_mm_xor_si128(x, neg), neg), 2);
+    v = _mm_add_epi16(_mm_min_epi16(v, _mm_set1_epi16(8159)),
+		      _mm_set1_epi16(0x84 >> 2));
+    __m128i seg = zero, m = _mm_srli_epi16(v, 1);
+    for (int b = 6; b < 13; b++) { // Boundaries 0x40…0x1000
+      __m128i over = _mm_cmpgt_epi16(v, _mm_set1_epi16((1 << b) - 1));
+      seg = _mm_sub_epi16(seg, over);
+      m = _mm_or_si128(_mm_andnot_si128(over, m),
+		       _mm_and_si128(over, _mm_srli_epi16(m, 1)));
+    }
+    __m128i uval = _mm_or_si128(_mm_slli_epi16(seg, 4),
+				_mm_and_si128(m, _mm_set1_epi16(0xF)));
+    __m128i clip = _mm_cmpgt_epi16(v, _mm_set1_epi16(0x1FFF));
+    uval = _mm_or_si128(uval, _mm_and_si128(clip, _mm_set1_epi16(0x7F)));
+    uval = _mm_xor_si128(uval, _mm_set1_epi16(0xFF));
+    uval = _mm_andnot_si128(_mm_and_si128(neg, _mm_set1_epi16(0x80)), uval);
+    _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(uval, uval));
+  }
+  encode_ulaw_table(out + i, in + i, n - i);
+}
+#endif
+
+#ifdef FEG711_X86
+__attribute__((target("avx2")))
+static void encode_alaw_avx2(unsigned char *out, const short *in, size_t n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+    __m256i neg = _mm256_cmpgt_epi16(zero, x);
+    __m256i idx = _mm256_srli_epi16(_mm256_abs_epi16(x), 4);
+    __m256i seg = zero, m = idx;
+    for (int b = 4; b < 11; b++) {
+      __m256i over = _mm256_cmpgt_epi16(idx, _mm256_set1_epi16((1 << b) - 1));
+      seg = _mm256_sub_epi16(seg, over);
+      if (b > 4)
+	m = _mm256_blendv_epi8(m, _mm256_srli_epi16(m, 1), over);
+    }
+    __m256i aval = _mm256_or_si256(_mm256_slli_epi16(seg, 4),
+				   _mm256_and_si256(m, _mm256_set1_epi16(0xF)));
+    __m256i clip = _mm256_cmpgt_epi16(idx, _mm256_set1_epi16(0x7FF));
+    aval = _mm256_or_si256(aval, _mm256_and_si256(clip, _mm256_set1_epi16(0x7F)));
+    aval = _mm256_xor_si256(aval, _mm256_set1_epi16(0xD5));
+    aval = _mm256_andnot_si256(_mm256_and_si256(neg, _mm256_set1_epi16(0x80)), aval);
+    // Pack works per 128 bit lane; bring the two 64 bit results together
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(aval, aval), 0x08);
+    _mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(packed));
+  }
+  encode_alaw_table(out + i, in + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void encode_ulaw_avx2(unsigned char *out, const short *in, size_t n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+    __m256i neg = _mm256_cmpgt_epi16(zero, x);
+    __m256i v = _mm256_srli_epi16(_mm256_abs_epi16(x), 2);
+    v = _mm256_add_epi16(_mm256_min_epi16(v, _mm256_set1_epi16(8159)),
+			 _mm256_set1_epi16(0x84 >> 2));
+    __m256i seg = zero, m = _mm256_srli_epi16(v, 1);
+    for (int b = 6; b < 13; b++) {
+      __m256i over = _mm256_cmpgt_epi16(v, _mm256_set1_epi16((1 << b) - 1));
+      seg = _mm256_sub_epi16(seg, over);
+      m = _mm256_blendv_epi8(m, _mm256_srli_epi16(m, 1), over);
+    }
+    __m256i uval = _mm256_or_si256(_mm256_slli_epi16(seg, 4),
+				   _mm256_and_si256(m, _mm256_set1_epi16(0xF)));
+    __m256i clip = _mm256_cmpgt_epi16(v, _mm256_set1_epi16(0x1FFF));
+    uval = _mm256_or_si256(uval, _mm256_and_si256(clip, _mm256_set1_epi16(0x7F)));
+    uval = _mm256_xor_si256(uval, _mm256_set1_epi16(0xFF));
+    uval = _mm256_andnot_si256(_mm256_and_si256(neg, _mm256_set1_epi16(0x80)), uval);
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(uval, uval), 0x08);
+    _mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(packed));
+  }
+  encode_ulaw_table(out + i, in + i, n - i);
+}
+#endif
+
+#ifdef __ARM_NEON
+// NEON has a per-lane leading zero count and variable shifts,
+// so the segment can be computed directly
+static void encode_alaw_neon(unsigned char *out, const short *in, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t x = vld1q_s16(in + i);
+    uint16x8_t neg = vcltq_s16(x, vdupq_n_s16(0));
+    uint16x8_t idx = vshrq_n_u16(vreinterpretq_u16_s16(vabsq_s16(x)), 4);
+    // seg = max(0, bitlength(idx) - 4)
+    uint16x8_t seg = vqsubq_u16(vdupq_n_u16(12), vclzq_u16(idx));
+    int16x8_t shift = vnegq_s16(vreinterpretq_s16_u16(vqsubq_u16(seg, vdupq_n_u16(1))));
+    uint16x8_t m = vandq_u16(vshlq_u16(idx, shift), vdupq_n_u16(0xF));
+    uint16x8_t aval = vorrq_u16(vshlq_n_u16(seg, 4), m);
+    uint16x8_t clip = vcgtq_u16(idx, vdupq_n_u16(0x7FF));
+    aval = vbslq_u16(clip, vdupq_n_u16(0x7F), aval);
+    aval = veorq_u16(aval, vdupq_n_u16(0xD5));
+    aval = vbicq_u16(aval, vandq_u16(neg, vdupq_n_u16(0x80)));
+    vst1_u8(out + i, vmovn_u16(aval));
+  }
+  encode_alaw_table(out + i, in + i, n - i);
+}
+
+static void encode_ulaw_neon(unsigned char *out, const short *in, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t x = vld1q_s16(in + i);
+    uint16x8_t neg = vcltq_s16(x, vdupq_n_s16(0));
+    uint16x8_t v = vshrq_n_u16(vreinterpretq_u16_s16(vabsq_s16(x)), 2);
+    v = vaddq_u16(vminq_u16(v, vdupq_n_u16(8159)), vdupq_n_u16(0x84 >> 2));
+    // seg = max(0, bitlength(v) - 6)
+    uint16x8_t seg = vqsubq_u16(vdupq_n_u16(10), vclzq_u16(v));
+    int16x8_t shift = vnegq_s16(vreinterpretq_s16_u16(vaddq_u16(seg, vdupq_n_u16(1))));
+    uint16x8_t m = vandq_u16(vshlq_u16(v, shift), vdupq_n_u16(0xF));
+    uint16x8_t uval = vorrq_u16(vshlq_n_u16(seg, 4), m);
+    uint16x8_t clip = vcgtq_u16(v, vdupq_n_u16(0x1FFF));
+    uval = vbslq_u16(clip, vdupq_n_u16(0x7F), uval);
+    uval = veorq_u16(uval, vdupq_n_u16(0xFF));
+    uval = vbicq_u16(uval, vandq_u16(neg, vdupq_n_u16(0x80)));
+    vst1_u8(out + i, vmovn_u16(uval));
+  }
+  encode_ulaw_table(out + i, in + i, n - i);
+}
+#endif
+
+// Runs before main(), so the encoders need no locking
+__attribute__((constructor))
+static void feg711_init(void)
+{
+  for (int i = 0; i < 2049; i++)
+    alaw_enc[i] = linear2alaw(i * 16);
+  for (int i = 0; i < 8193; i++)
+    ulaw_enc[i] = linear2ulaw(i * 4);
+  for (int i = 0; i < 256; i++) {
+    alaw_dec[i] = alaw2linear(i);
+    ulaw_dec[i] = ulaw2linear(i);
+  }
+
+  alaw_kernel = encode_alaw_table;
+  ulaw_kernel = encode_ulaw_table;
+#if defined(FEG711_X86) && defined(__SSE2__)
+  alaw_kernel = encode_alaw_sse2;
+  ulaw_kernel = encode_ulaw_sse2;
+  kernel_name = "sse2";
+#endif
+#ifdef FEG711_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    alaw_kernel = encode_alaw_avx2;
+    ulaw_kernel = encode_ulaw_avx2;
+    kernel_name = "avx2";
+  }
+#endif
+#ifdef __ARM_NEON
+  alaw_kernel = encode_alaw_neon;
+  ulaw_kernel = encode_ulaw_neon;
+  kernel_name = "neon";
+#endif
+}
+
+void feg711_encode_alaw(unsigned char *outbuf, const short *inbuf,
+			size_t nsamples)
+{
+  alaw_kernel(outbuf, inbuf, nsamples);
+}
+
+void feg711_encode_ulaw(unsigned char *outbuf, const short *inbuf,
+			size_t nsamples)
+{
+  ulaw_kernel(outbuf, inbuf, nsamples);
+}
+
+void feg711_decode_alaw(short *outbuf, const unsigned char *inbuf,
+			size_t nsamples)
+{
+  for (size_t i = 0; i < nsamples; i++)
+    outbuf[i] = alaw_dec[inbuf[i]];
+}
+
+void feg711_decode_ulaw(short *outbuf, const unsigned char *inbuf,
+			size_t nsamples)
+{
+  for (size_t i = 0; i < nsamples; i++)
+    outbuf[i] = ulaw_dec[inbuf[i]];
+}
+
+const char *feg711_kernel(void)
+{
+  return kernel_name;
+}
+
+int feg711_set_kernel(const char *name)
+{
+  feg711_encoder alaw = NULL, ulaw = NULL;
+
+  if (strcmp(name, "table") == 0) {
+    alaw = encode_alaw_table;
+    ulaw = encode_ulaw_table;
+    name = "table";
+  }
+#if defined(FEG711_X86) && defined(__SSE2__)
+  if (strcmp(name, "sse2") == 0) {
+    alaw = encode_alaw_sse2;
+    ulaw = encode_ulaw_sse2;
+    name = "sse2";
+  }
+#endif
+#ifdef FEG711_X86
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    alaw = encode_alaw_avx2;
+    ulaw = encode_ulaw_avx2;
+    name = "avx2";
+  }
+#endif
+#ifdef __ARM_NEON
+  if (strcmp(name, "neon") == 0) {
+    alaw = encode_alaw_neon;
+    ulaw = encode_ulaw_neon;
+    name = "neon";
+  }
+#endif
+  if (alaw == NULL)
+    return -1;
+  alaw_kernel = alaw;
+  ulaw_kernel = ulaw;
+  kernel_name = name;
+  return 0;
+}
@@ -0,0 +1,63 @@
+/* flexog711 — G.711 (A-Law/µ-Law) for flexoSIP
+ *
+ * Reentrant PCM16 ⇄ G.711 conversion without libsndfile.
+ * Encoding is bit-exact with libsndfile's SF_FORMAT_ALAW/SF_FORMAT_ULAW
+ * output. The tables are built and the fastest kernel (AVX2, SSE2,
+ * NEON or plain table lookup) is selected once at program start.
+ */
+#include <stddef.h>
+
+/**
+ * Encode 16bit PCM to 8bit A-Law
+ *
+ * @param outbuf	Where A-Law will end up at (nsamples bytes)
+ * @param inbuf		Where PCM16 is taken from
+ * @param nsamples	How many samples to convert
+ */
+void feg711_encode_alaw(unsigned char *outbuf, const short *inbuf,
+			size_t nsamples);
+
+/**
+ * Encode 16bit PCM to 8bit µ-Law
+ *
+ * @param outbuf	Where µ-Law will end up at (nsamples bytes)
+ * @param inbuf		Where PCM16 is taken from
+ * @param nsamples	How many samples to convert
+ */
+void feg711_encode_ulaw(unsigned char *outbuf, const short *inbuf,
+			size_t nsamples);
+
+/**
+ * Decode 8bit A-Law to 16bit PCM
+ *
+ * @param outbuf	Where PCM16 will end up at
+ * @param inbuf		Where A-Law is taken from
+ * @param nsamples	How many samples (=bytes) to convert
+ */
+void feg711_decode_alaw(short *outbuf, const unsigned char *inbuf,
+			size_t nsamples);
+
+/**
+ * Decode 8bit µ-Law to 16bit PCM
+ *
+ * @param outbuf	Where PCM16 will end up at
+ * @param inbuf		Where µ-Law is taken from
+ * @param nsamples	How many samples (=bytes) to convert
+ */
+void feg711_decode_ulaw(short *outbuf, const unsigned char *inbuf,
+			size_t nsamples);
+
+/**
+ * Name of the encoder kernel in use ("avx2", "sse2", "neon", "table")
+ */
+const char *feg711_kernel(void);
+
+/**
+ * Switch the encoder kernel, e.g. to test each one
+ *
+ * Not thread safe: only call while nothing is being encoded.
+ * Returns 0, or -1 if that kernel is not built in or the CPU lacks it.
+ *
+ * @param name		"avx2", "sse2", "neon" or "table"
+ */
+int feg711_set_kernel(const char *name);
@@ -0,0 +1,224 @@
+#include "flexog722.h"
+#include <string.h>
+
+// Block numbers refer to ITU-T G.722 (09/2012), section 6
+
+static const int q6[32] = { // QUANTL decision levels
+  0, 35, 72, 110, 150, 190, 233, 276, 323, 370, 422, 473, 530, 587,
+  650, 714, 786, 858, 940, 1023, 1121, 1219, 1339, 1458, 1612, 1765,
+  1980, 2195, 2557, 2919, 0, 0
+};
+static const int iln[32] = { // Negative low band codes
+  0, 63, 62, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18,
+  17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 0
+};
+static const int ilp[32] = { // Positive low band codes
+  0, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49, 48, 47, 46,
+  45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 32, 0
+};
+static const int qm6[64] = { // 6 bit low band inverse quantizer
+  -136, -136, -136, -136, -24808, -21904, -19008, -16704,
+  -14984, -13512, -12280, -11192, -10232, -9360, -8576, -7856,
+  -7192, -6576, -6000, -5456, -4944, -4464, -4008, -3576,
+  -3168, -2776, -2400, -2032, -1688, -1360, -1040, -728,
+  24808, 21904, 19008, 16704, 14984, 13512, 12280, 11192,
+  10232, 9360, 8576, 7856, 7192, 6576, 6000, 5456,
+  4944, 4464, 4008, 3576, 3168, 2776, 2400, 2032,
+  1688, 1360, 1040, 728, 432, 136, -432, -136
+};
+static const int qm4[16] = { // 4 bit low band inverse quantizer
+  0, -20456, -12896, -8968, -6288, -4240, -2584, -1200,
+  20456, 12896, 8968, 6288, 4240, 2584, 1200, 0
+};
+static const int qm2[4] = {-7408, -1616, 7408, 1616}; // High band
+static const int wl[8] = {-60, -30, 58, 172, 334, 538, 1198, 3042};
+static const int rl42[16] = {0, 7, 6, 5, 4, 3, 2, 1, 7, 6, 5, 4, 3, 2, 1, 0};
+static const int ilb[32] = { // Scale factor antilog
+  2048, 2093, 2139, 2186, 2233, 2282, 2332, 2383, 2435, 2489, 2543,
+  2599, 2656, 2714, 2774, 2834, 2896, 2960, 3025, 3091, 3158, 3228,
+  3298, 3371, 3444, 3520, 3597, 3676, 3756, 3838, 3922, 4008
+};
+static const int ihn[3] = {0, 1, 0};
+static const int ihp[3] = {0, 3, 2};
+static const int wh[3] = {0, -214, 798};
+static const int rh2[4] = {2, 1, 2, 1};
+static const int qmf_coeffs[12] = {
+  3, -11, 12, 32, -210, 951, 3876, -805, 362, -156, 53, -11
+};
+
+static inline int saturate(int v)
+{
+  return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+static inline int clamp(int v, int min, int max)
+{
+  return v > max ? max : (v < min ? min : v);
+}
+
+void feg722_init(struct feg722 *s)
+{
+  memset(s, 0, sizeof(*s));
+  s->band[0].det = 32;
+  s->band[1].det = 8;
+}
+
+/**
+ * Blocks 3L/3H, LOGSCL/LOGSCH and SCALEL/SCALEH: adapt the scale factor
+ */
+static void scale(struct feg722_band *b, int wd, int max, int shift)
+{
+  b->nb = clamp(((b->nb * 127) >> 7) + wd, 0, max);
+  int wd1 = (b->nb >> 6) & 31;
+  int wd2 = shift - (b->nb >> 11);
+  int wd3 = (wd2 < 0) ? (ilb[wd1] << -wd2) : (ilb[wd1] >> wd2);
+  b->det = wd3 << 2;
+}
+
+/**
+ * Block 4: update the adaptive predictor with the quantized difference
+ */
+static void predict(struct feg722_band *b, int d)
+{
+  int wd1, wd2, wd3;
+  // RECONS, PARREC
+  b->d[0] = d;
+  b->r[0] = saturate(b->s + d);
+  b->p[0] = saturate(b->sz + d);
+  // UPPOL2
+  for (int i = 0; i < 3; i++)
+    b->sg[i] = b->p[i] >> 15;
+  wd1 = saturate(b->a[1] * 4);
+  wd2 = (b->sg[0] == b->sg[1]) ? -wd1 : wd1;
+  if (wd2 > 32767)
+    wd2 = 32767;
+  wd3 = (wd2 >> 7) + ((b->sg[0] == b->sg[2]) ? 128 : -128);
+  wd3 += (b->a[2] * 32512) >> 15;
+  b->ap[2] = clamp(wd3, -12288, 12288);
+  // UPPOL1
+  wd1 = (b->sg[0] == b->sg[1]) ? 192 : -192;
+  wd2 = (b->a[1] * 32640) >> 15;
+  b->ap[1] = saturate(wd1 + wd2);
+  wd3 = saturate(15360 - b->ap[2]);
+  b->ap[1] = clamp(b->ap[1], -wd3, wd3);
+  // UPZERO
+  wd1 = (d == 0) ? 0 : 128;
+  b->sg[0] = d >> 15;
+  for (int i = 1; i < 7; i++) {
+    b->sg[i] = b->d[i] >> 15;
+    wd2 = (b->sg[i] == b->sg[0]) ? wd1 : -wd1;
+    wd3 = (b->b[i] * 32640) >> 15;
+    b->bp[i] = saturate(wd2 + wd3);
+  }
+  // DELAYA
+  for (int i = 6; i > 0; i--) {
+    b->d[i] = b->d[i - 1];
+    b->b[i] = b->bp[i];
+  }
+  for (int i = 2; i > 0; i--) {
+    b->r[i] = b->r[i - 1];
+    b->p[i] = b->p[i - 1];
+    b->a[i] = b->ap[i];
+  }
+  // FILTEP, FILTEZ, PREDIC
+  wd1 = (b->a[1] * saturate(b->r[1] + b->r[1])) >> 15;
+  wd2 = (b->a[2] * saturate(b->r[2] + b->r[2])) >> 15;
+  b->sp = saturate(wd1 + wd2);
+  b->sz = 0;
+  for (int i = 6; i > 0; i--)
+    b->sz += (b->b[i] * saturate(b->d[i] + b->d[i])) >> 15;
+  b->sz = saturate(b->sz);
+  b->s = saturate(b->sp + b->sz);
+}
+
+static unsigned char encode_pair(struct feg722 *s, int x0, int x1)
+{
+  struct feg722_band *low = &s->band[0], *high = &s->band[1];
+  // Transmit QMF: split into two 8 kHz sub-bands
+  memmove(s->x, s->x + 2, 22 * sizeof(s->x[0]));
+  s->x[22] = x0;
+  s->x[23] = x1;
+  int sumeven = 0, sumodd = 0;
+  for (int i = 0; i < 12; i++) {
+    sumodd += s->x[2*i] * qmf_coeffs[i];
+    sumeven += s->x[2*i + 1] * qmf_coeffs[11 - i];
+  }
+  // The filters' DC gain is 4096, plus 1 bit for summing two of them
+  // and 1 for G.722's 15 bit input
+  int xlow = (sumeven + sumodd) >> 14;
+  int xhigh = (sumeven - sumodd) >> 14;
+
+  // Low band: SUBTRA, QUANTL
+  int el = saturate(xlow - low->s);
+  int wd = (el >= 0) ? el : -(el + 1);
+  int i;
+  for (i = 1; i < 30; i++)
+    if (wd < ((q6[i] * low->det) >> 12))
+      break;
+  int ilow = (el < 0) ? iln[i] : ilp[i];
+  // INVQAL, adaptation
+  int ril = ilow >> 2;
+  int dlow = (low->det * qm4[ril]) >> 15;
+  scale(low, wl[rl42[ril]], 18432, 8);
+  predict(low, dlow);
+
+  // High band: SUBTRA, QUANTH
+  int eh = saturate(xhigh - high->s);
+  wd = (eh >= 0) ? eh : -(eh + 1);
+  int mih = (wd >= ((564 * high->det) >> 12)) ? 2 : 1;
+  int ihigh = (eh < 0) ? ihn[mih] : ihp[mih];
+  // INVQAH, adaptation
+  int dhigh = (high->det * qm2[ihigh]) >> 15;
+  scale(high, wh[rh2[ihigh]], 22528, 10);
+  predict(high, dhigh);
+
+  return (ihigh << 6) | ilow;
+}
+
+size_t feg722_encode(struct feg722 *s, unsigned char *outbuf,
+		     const short *inbuf, size_t nsamples)
+{
+  size_t n = 0;
+  for (size_t j = 0; j + 1 < nsamples; j += 2)
+    outbuf[n++] = encode_pair(s, inbuf[j], inbuf[j + 1]);
+  if (nsamples % 2)
+    outbuf[n++] = encode_pair(s, inbuf[nsamples - 1], 0);
+  return n;
+}
+
+size_t feg722_decode(struct feg722 *s, short *outbuf,
+		     const unsigned char *inbuf, size_t nbytes)
+{
+  struct feg722_band *low = &s->band[0], *high = &s->band[1];
+  for (size_t j = 0; j < nbytes; j++) {
+    int ilow = inbuf[j] & 0x3F, ihigh = inbuf[j] >> 6;
+
+    // Low band: INVQBL, RECONS, LIMIT (6 bits for the output)
+    int rlow = clamp(low->s + ((low->det * qm6[ilow]) >> 15), -16384, 16383);
+    // INVQAL (4 bits for the predictor, as in the encoder), adaptation
+    int ril = ilow >> 2;
+    int dlow = (low->det * qm4[ril]) >> 15;
+    scale(low, wl[rl42[ril]], 18432, 8);
+    predict(low, dlow);
+
+    // High band: INVQAH, RECONS, LIMIT, adaptation
+    int dhigh = (high->det * qm2[ihigh]) >> 15;
+    int rhigh = clamp(high->s + dhigh, -16384, 16383);
+    scale(high, wh[rh2[ihigh]], 22528, 10);
+    predict(high, dhigh);
+
+    // Receive QMF: merge the sub-bands back to 16 kHz
+    memmove(s->x, s->x + 2, 22 * sizeof(s->x[0]));
+    s->x[22] = rlow + rhigh;
+    s->x[23] = rlow - rhigh;
+    int xout1 = 0, xout2 = 0;
+    for (int i = 0; i < 12; i++) {
+      xout2 += s->x[2*i] * qmf_coeffs[i];
+      xout1 += s->x[2*i + 1] * qmf_coeffs[11 - i];
+    }
+    // DC gain 4096, less 1 bit for the 15 bit signal
+    outbuf[2*j] = saturate(xout1 >> 11);
+    outbuf[2*j + 1] = saturate(xout2 >> 11);
+  }
+  return 2 * nbytes;
+}
@@ -0,0 +1,61 @@
+/* flexog722 — G.722 (64 kbit/s wideband ADPCM) for flexoSIP
+ *
+ * 16 kHz PCM16 ⇄ G.722 mode 1 (6 bits low band, 2 bits high band),
+ * one byte per two samples. Encoder and decoder are stateful (one
+ * state per direction and stream), reentrant, and do not allocate.
+ */
+#include <stddef.h>
+
+/**
+ * One sub-band's ADPCM state
+ */
+struct feg722_band {
+  int s, sp, sz;		// Predictor outputs (total, pole, zero)
+  int r[3], a[3], ap[3], p[3];	// Pole section
+  int d[7], b[7], bp[7], sg[7];	// Zero section
+  int nb, det;			// Scale factor (log, linear)
+};
+
+/**
+ * Encoder or decoder state
+ *
+ * Treat as opaque, set up with feg722_init().
+ */
+struct feg722 {
+  int x[24];			// QMF delay line
+  struct feg722_band band[2];	// Low, high
+};
+
+/**
+ * Set up (or reset) an encoder or decoder
+ *
+ * @param s		The state
+ */
+void feg722_init(struct feg722 *s);
+
+/**
+ * Encode 16 kHz PCM16 to G.722
+ *
+ * Returns the number of bytes produced, (nsamples + 1) / 2;
+ * an odd last sample is padded with silence.
+ *
+ * @param s		The encoder state
+ * @param outbuf	Where G.722 will end up at
+ * @param inbuf		Where PCM16 is taken from
+ * @param nsamples	How many samples to convert
+ */
+size_t feg722_encode(struct feg722 *s, unsigned char *outbuf,
+		     const short *inbuf, size_t nsamples);
+
+/**
+ * Decode G.722 to 16 kHz PCM16
+ *
+ * Returns the number of samples produced, 2 * nbytes.
+ *
+ * @param s		The decoder state
+ * @param outbuf	Where PCM16 will end up at
+ * @param inbuf		Where G.722 is taken from
+ * @param nbytes	How many bytes to convert
+ */
+size_t feg722_decode(struct feg722 *s, short *outbuf,
+		     const unsigned char *inbuf, size_t nbytes);
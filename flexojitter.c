@@ -0,0 +1,368 @@
+#include "flexojitter.h"
+#include "flexosnd.h"
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+
+#define MASK (FEJITTER_SLOTS - 1)
+#define MAX_MISORDER 100 // Older packets mean the sender restarted (RFC 3550 A.1)
+#define JITTER_FACTOR 3 // Delay aimed for: a frame plus this times the jitter
+#define SHRINK_WINDOW 50 // Frames (1 s) the delay must be too large for
+#define PLC_HOLD_MS 10 // Concealment at full level,
+#define PLC_FADE_MS 50 // then fading out to silence
+#define BLEND_DIV 400 // Back to real audio over 1/400 s (2.5 ms)
+
+void fejitter_init(struct fejitter *jb, const struct fesnd_codec *codec)
+{
+  memset(jb, 0, sizeof(*jb));
+  jb->codec = codec;
+  jb->spt = codec->rate / codec->clock_rate;
+  jb->frame_ticks = codec->frame_samples / jb->spt;
+  jb->target = jb->frame_ticks; // Until the jitter is known
+}
+
+_Bool fejitter_active(const struct fejitter *jb)
+{
+  return jb->started;
+}
+
+/**
+ * Timestamp ticks of so many bytes
+ */
+static unsigned ticks_of(const struct fejitter *jb, size_t nbytes)
+{
+  return nbytes * jb->frame_ticks / jb->codec->frame_bytes;
+}
+
+/**
+ * Bytes decoding to so many samples
+ */
+static size_t bytes_of(const struct fejitter *jb, size_t nsamples)
+{
+  return nsamples * jb->codec->frame_bytes / jb->codec->frame_samples;
+}
+
+static unsigned depth(const struct fejitter *jb)
+{
+  int d = (int)(jb->end_ts - jb->play_ts);
+  return d > 0 ? (unsigned)d : 0;
+}
+
+/**
+ * Drop everything, the next packet starts afresh
+ */
+static void jitter_stop(struct fejitter *jb)
+{
+  for (int i = 0; i < FEJITTER_SLOTS; i++)
+    jb->slot[i].used = false;
+  jb->started = false;
+}
+
+/**
+ * Start playing out with a packet, at the delay aimed for
+ */
+static void jitter_start(struct fejitter *jb, unsigned short seq, unsigned ts)
+{
+  jb->started = true;
+  jb->next_seq = seq;
+  jb->offset = 0;
+  jb->play_ts = ts - jb->target;
+  jb->end_ts = ts;
+  jb->window = 0;
+  jb->min_depth = UINT_MAX;
+  if (jb->plc_samples == 0) {
+    // Silence until then, faded into
+    jb->plc_samples = 1;
+    jb->plc_pitch = 0;
+  }
+  jb->stats.resyncs++;
+}
+
+/**
+ * Update the interarrival jitter and the delay aimed for (RFC 3550 A.8)
+ */
+static void jitter_measure(struct fejitter *jb, unsigned ts,
+			   const struct timespec *arrival)
+{
+  unsigned clock = jb->codec->clock_rate;
+  // Wraps around, only differences count
+  unsigned now = (unsigned)arrival->tv_sec * clock
+    + (unsigned)((long long)arrival->tv_nsec * clock / 1000000000);
+  unsigned transit = now - ts;
+  int d = (int)(transit - jb->transit);
+  jb->transit = transit;
+  if (d < 0)
+    d = -d;
+  if (!jb->transit_set || (unsigned)d > clock) {
+    jb->transit_set = true; // First, or the timestamps jumped
+    return;
+  }
+  jb->jitter += d - ((jb->jitter + 8) >> 4);
+  unsigned target = jb->frame_ticks + JITTER_FACTOR * (jb->jitter >> 4);
+  unsigned max = (FEJITTER_SLOTS - 4) * jb->frame_ticks;
+  jb->target = target < max ? target : max;
+}
+
+void fejitter_put(struct fejitter *jb, unsigned short seq, unsigned ts,
+		  _Bool marker, const unsigned char *payload, size_t len,
+		  const struct timespec *arrival)
+{
+  if (jb->codec == NULL)
+    return;
+  jb->stats.received++;
+  jitter_measure(jb, ts, arrival);
+  short diff = (short)(seq - jb->next_seq);
+  if (jb->started && (diff < -MAX_MISORDER || diff >= FEJITTER_SLOTS)) {
+    // Restarted, or too far ahead to hold what is in between
+    jitter_stop(jb);
+    jb->transit_set = false;
+  }
+  if (!jb->started) {
+    jitter_start(jb, seq, ts);
+  } else if (diff < 0) {
+    // Played or concealed already: a frame more delay, if it may grow
+    jb->stats.late++;
+    if (!jb->grown
+	&& depth(jb) + jb->frame_ticks <= (FEJITTER_SLOTS - 4) * jb->frame_ticks) {
+      jb->play_ts -= jb->frame_ticks;
+      jb->grown = true;
+    }
+    return;
+  } else if (marker && diff == 0 && jb->offset == 0 && jb->plc_samples > 0) {
+    // A talkspurt after a pause: the time to change the delay
+    jb->play_ts = ts - jb->target;
+    jb->stats.resyncs++;
+  }
+  struct fejitter_slot *s = &jb->slot[seq & MASK];
+  if (len > FEJITTER_MAX_PAYLOAD || (s->used && s->seq == seq)) {
+    jb->stats.discarded++;
+    return;
+  }
+  s->used = true;
+  s->seq = seq;
+  s->ts = ts;
+  s->len = len;
+  memcpy(s->payload, payload, len);
+  unsigned end = ts + ticks_of(jb, len);
+  if ((int)(end - jb->end_ts) > 0)
+    jb->end_ts = end;
+}
+
+// ------------- Concealment -----------------
+
+/**
+ * Remember audio played, for the pitch search
+ */
+static void history_add(struct fejitter *jb, const short *pcm, size_t n)
+{
+  memmove(jb->history, jb->history + n,
+	  (FEJITTER_HISTORY - n) * sizeof(short));
+  memcpy(jb->history + FEJITTER_HISTORY - n, pcm, n * sizeof(short));
+}
+
+/**
+ * The pitch period of the audio played last, 0 if it was silent
+ *
+ * The lag (2.5 to 15 ms) at which the last 10 ms correlate best with
+ * the audio before (normalized cross-correlation).
+ */
+static size_t plc_pitch(const struct fejitter *jb)
+{
+  int rate = jb->codec->rate;
+  size_t min = rate / 400, max = rate * 15 / 1000, win = rate / 100;
+  const short *last = jb->history + FEJITTER_HISTORY - win;
+  float best = 0;
+  size_t pitch = max;
+  _Bool silent = true;
+  for (size_t i = 0; i < win + max && silent; i++)
+    silent = jb->history[FEJITTER_HISTORY - 1 - i] == 0;
+  if (silent)
+    return 0;
+  for (size_t lag = min; lag <= max; lag++) {
+    const short *before = last - lag;
+    float c = 0, e = 0;
+    for (size_t i = 0; i < win; i++) {
+      c += (float)last[i] * before[i];
+      e += (float)before[i] * before[i];
+    }
+    if (c > 0 && c * c > best * e) {
+      best = c * c / e;
+      pitch = lag;
+    }
+  }
+  return pitch;
+}
+
+/**
+ * The t'th sample made up since the gap started
+ */
+static int plc_sample(const struct fejitter *jb, size_t t)
+{
+  int rate = jb->codec->rate;
+  size_t hold = rate * PLC_HOLD_MS / 1000, fade = rate * PLC_FADE_MS / 1000;
+  if (jb->plc_pitch == 0 || t >= hold + fade)
+    return 0;
+  int v = jb->period[t % jb->plc_pitch];
+  if (t > hold)
+    v = v * (int)(hold + fade - t) / (int)fade;
+  return v;
+}
+
+/**
+ * Fill a gap: the last pitch period over and over, fading out
+ */
+static void conceal(struct fejitter *jb, short *out, size_t n)
+{
+  if (jb->plc_samples == 0) {
+    jb->plc_pitch = plc_pitch(jb);
+    memcpy(jb->period, jb->history + FEJITTER_HISTORY - jb->plc_pitch,
+	   jb->plc_pitch * sizeof(short));
+  }
+  for (size_t i = 0; i < n; i++) {
+    int v = plc_sample(jb, jb->plc_samples++);
+    if (v != 0)
+      jb->concealed++;
+    out[i] = v;
+  }
+  history_add(jb, out, n);
+}
+
+/**
+ * Fade from the concealment into the real audio following it
+ */
+static void conceal_end(struct fejitter *jb, short *pcm, size_t n)
+{
+  if (jb->plc_samples == 0)
+    return;
+  size_t len = jb->codec->rate / BLEND_DIV;
+  if (len > n)
+    len = n;
+  for (size_t i = 0; i < len; i++) {
+    int v = plc_sample(jb, jb->plc_samples + i);
+    pcm[i] = (v * (int)(len - i) + pcm[i] * (int)i) / (int)len;
+  }
+  jb->plc_samples = 0;
+}
+
+/**
+ * Whether concealment has faded out
+ */
+static _Bool conceal_done(const struct fejitter *jb)
+{
+  int rate = jb->codec->rate;
+  return jb->plc_samples >= (size_t)rate * (PLC_HOLD_MS + PLC_FADE_MS) / 1000;
+}
+
+// ------------- Playout -----------------
+
+/**
+ * Distance to the next packet held after the one missing, 0 = none
+ */
+static int next_held(const struct fejitter *jb)
+{
+  for (int i = 1; i < FEJITTER_SLOTS; i++) {
+    const struct fejitter_slot *s = &jb->slot[(jb->next_seq + i) & MASK];
+    if (s->used && s->seq == (unsigned short)(jb->next_seq + i))
+      return i;
+  }
+  return 0;
+}
+
+size_t fejitter_get(struct fejitter *jb, struct fesnd_codec_state *dec,
+		    short *pcm)
+{
+  if (!jb->started)
+    return 0;
+  const struct fesnd_codec *codec = jb->codec;
+  size_t n = codec->frame_samples, o = 0;
+  while (o < n) {
+    struct fejitter_slot *s = &jb->slot[jb->next_seq & MASK];
+    if (!s->used || s->seq != jb->next_seq) {
+      int ahead = next_held(jb);
+      if (ahead == 0) {
+	// Nothing there (yet): wait, concealing
+	conceal(jb, pcm + o, n - o);
+	jb->play_ts += (n - o) / jb->spt;
+	o = n;
+	break;
+      }
+      // Due now, so lost; the gap until the next is concealed below
+      jb->stats.lost += ahead;
+      jb->next_seq += ahead;
+      jb->offset = 0;
+      continue;
+    }
+    int gap = (int)(s->ts + ticks_of(jb, jb->offset) - jb->play_ts);
+    size_t left = s->len - jb->offset, k;
+    if (gap > 0) {
+      // Not due yet: a pause, a lost packet, or the delay grown
+      k = (size_t)gap * jb->spt;
+      if (k > n - o)
+	k = n - o;
+      conceal(jb, pcm + o, k);
+      o += k;
+      jb->play_ts += k / jb->spt;
+      continue;
+    } else if (gap < 0) {
+      // Partly past (the delay shrunk): decoded all the same, for the
+      // decoder's state, but not played
+      short skipped[FESND_MAX_SAMPLES];
+      k = bytes_of(jb, (size_t)-gap * jb->spt);
+      if (k > left)
+	k = left;
+      if (k > bytes_of(jb, FESND_MAX_SAMPLES))
+	k = bytes_of(jb, FESND_MAX_SAMPLES);
+      codec->decode(dec, skipped, s->payload + jb->offset, k);
+    } else {
+      k = bytes_of(jb, n - o);
+      if (k > left)
+	k = left;
+      if (k == 0 && left > 0) {
+	conceal(jb, pcm + o, n - o); // Less than a byte's worth left
+	break;
+      }
+      size_t got = codec->decode(dec, pcm + o, s->payload + jb->offset, k);
+      conceal_end(jb, pcm + o, got);
+      history_add(jb, pcm + o, got);
+      o += got;
+      jb->play_ts += got / jb->spt;
+    }
+    jb->offset += k;
+    if (jb->offset >= s->len) {
+      s->used = false;
+      jb->next_seq++;
+      jb->offset = 0;
+      jb->stats.played++;
+    }
+  }
+
+  // Shrink the delay by a frame if it was more than needed for a while
+  unsigned d = depth(jb);
+  if (d < jb->min_depth)
+    jb->min_depth = d;
+  if (++jb->window >= SHRINK_WINDOW) {
+    if (jb->min_depth > jb->target + jb->frame_ticks && jb->plc_samples == 0)
+      jb->play_ts += jb->frame_ticks;
+    jb->window = 0;
+    jb->min_depth = UINT_MAX;
+  }
+  jb->grown = false;
+  if (conceal_done(jb) && next_held(jb) == 0
+      && !(jb->slot[jb->next_seq & MASK].used
+	   && jb->slot[jb->next_seq & MASK].seq == jb->next_seq))
+    jitter_stop(jb); // The other side went quiet
+  return n;
+}
+
+void fejitter_get_stats(const struct fejitter *jb,
+			struct fejitter_stats *stats)
+{
+  *stats = jb->stats;
+  if (jb->codec == NULL)
+    return;
+  unsigned clock = jb->codec->clock_rate;
+  stats->concealed_ms = jb->concealed * 1000 / jb->codec->rate;
+  stats->depth_ms = jb->started ? depth(jb) * 1000ULL / clock : 0;
+  stats->target_ms = jb->target * 1000ULL / clock;
+  stats->jitter_ms = (jb->jitter >> 4) * 1000ULL / clock;
+}
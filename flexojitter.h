@@ -0,0 +1,130 @@
+/* flexojitter — Adaptive jitter buffer for flexoSIP
+ *
+ * Received packets go in as they arrive, in any order; audio comes out
+ * one 20 ms frame per media tick, in sequence, delayed by a few times
+ * the measured interarrival jitter (RFC 3550 6.4.1). Frames missing at
+ * their time are concealed by waveform substitution: the last pitch
+ * period is repeated, fading out. The delay is adapted between
+ * talkspurts, grown by one frame on late packets and shrunk by one
+ * frame when it has been more than needed for a second. No
+ * allocation: embed the state where needed. Not thread safe.
+ */
+#include <stddef.h>
+#include <time.h>
+
+#define FEJITTER_SLOTS 16 // Packets held, a power of two (320 ms of 20 ms packets)
+#define FEJITTER_MAX_PAYLOAD 1280 // Bytes per packet (40 ms of L16/16000)
+#define FEJITTER_HISTORY 640 // Samples kept for the pitch search (40 ms at 16 kHz)
+#define FEJITTER_MAX_PITCH 240 // Longest pitch period (15 ms at 16 kHz)
+
+struct fesnd_codec;
+struct fesnd_codec_state;
+
+/**
+ * Receive-path counters (see fejitter_get_stats())
+ */
+struct fejitter_stats {
+  unsigned long received;	// Packets put in
+  unsigned long played;		// Packets decoded
+  unsigned long late;		// Came after their time, dropped
+  unsigned long lost;		// Missing at their time, concealed
+  unsigned long discarded;	// Duplicates and oversized packets
+  unsigned long resyncs;	// Playout (re)started at a new delay
+  unsigned long concealed_ms;	// Audio made up by concealment
+  unsigned depth_ms;		// Audio buffered now
+  unsigned target_ms;		// Delay aimed for
+  unsigned jitter_ms;		// Interarrival jitter, as in RTCP
+};
+
+struct fejitter_slot {
+  _Bool used;
+  unsigned short seq;
+  unsigned short len;
+  unsigned ts;
+  unsigned char payload[FEJITTER_MAX_PAYLOAD];
+};
+
+/**
+ * Jitter buffer state (per call)
+ *
+ * Treat as opaque, set up with fejitter_init().
+ */
+struct fejitter {
+  const struct fesnd_codec *codec; // NULL = not set up
+  int spt;			// Samples per timestamp tick
+  unsigned frame_ticks;		// Timestamp ticks per 20 ms
+  _Bool started;		// Playing out, else waiting for a packet
+  unsigned short next_seq;	// Next packet to play
+  size_t offset;		// Bytes of it played already
+  unsigned play_ts;		// Timestamp of the next sample out
+  unsigned end_ts;		// End of the latest packet in
+  unsigned target;		// Delay aimed for, in ticks
+  _Bool grown;			// Delay grown since the last frame out
+  int window;			// Frames out since the last shrink check
+  unsigned min_depth;		// Least depth in that window
+  // Interarrival jitter, RFC 3550 A.8
+  _Bool transit_set;
+  unsigned transit;		// Arrival minus RTP timestamp, in ticks
+  unsigned jitter;		// In ticks, times 16
+  // Concealment
+  size_t plc_samples;		// Made up so far, 0 = not concealing
+  size_t plc_pitch;		// Period repeated, 0 = silence
+  unsigned long concealed;	// Samples made up in all
+  short period[FEJITTER_MAX_PITCH]; // The last one before the gap
+  short history[FEJITTER_HISTORY]; // Audio out, latest last
+  struct fejitter_stats stats;
+  struct fejitter_slot slot[FEJITTER_SLOTS];
+};
+
+/**
+ * Set up (or reset) a jitter buffer for a codec
+ *
+ * @param jb		The jitter buffer
+ * @param codec		The codec received (see fesnd_codec())
+ */
+void fejitter_init(struct fejitter *jb, const struct fesnd_codec *codec);
+
+/**
+ * Put a received packet in
+ *
+ * The payload is copied.
+ *
+ * @param jb		The jitter buffer
+ * @param seq		RTP sequence number
+ * @param ts		RTP timestamp
+ * @param marker	RTP marker bit (start of a talkspurt)
+ * @param payload	The encoded audio
+ * @param len		Its length in bytes
+ * @param arrival	When it was received (CLOCK_MONOTONIC)
+ */
+void fejitter_put(struct fejitter *jb, unsigned short seq, unsigned ts,
+		  _Bool marker, const unsigned char *payload, size_t len,
+		  const struct timespec *arrival);
+
+/**
+ * Take the next 20 ms of audio out
+ *
+ * Returns the codec's frame_samples, or 0 while there is nothing to
+ * play (before the first packet and after the concealment has run
+ * out, e.g. when the other side stopped sending in a pause).
+ *
+ * @param jb		The jitter buffer
+ * @param dec		The decoder state
+ * @param pcm		Room for the codec's frame_samples samples
+ */
+size_t fejitter_get(struct fejitter *jb, struct fesnd_codec_state *dec,
+		    short *pcm);
+
+/**
+ * Whether fejitter_get() may return audio
+ */
+_Bool fejitter_active(const struct fejitter *jb);
+
+/**
+ * Get the counters and the current depth
+ *
+ * @param jb		The jitter buffer
+ * @param stats		Filled in
+ */
+void fejitter_get_stats(const struct fejitter *jb,
+			struct fejitter_stats *stats);
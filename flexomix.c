@@ -0,0 +1,274 @@
+#include "flexomix.h"
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEMIX_X86
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#define GAIN_SHIFT 12 // FEMIX_UNITY == 1 << GAIN_SHIFT
+#define GAIN_ROUND (1 << (GAIN_SHIFT - 1))
+
+typedef void (*femix_add_fn)(short *, const short *, size_t, int);
+typedef void (*femix_sum_fn)(int *, const short *, size_t);
+typedef void (*femix_minus_fn)(short *, const int *, const short *, size_t);
+static femix_add_fn add;
+static femix_sum_fn sum;
+static femix_minus_fn minus;
+static const char *kernel_name = "scalar";
+
+static inline short sat16(int x)
+{
+  return x > 32767 ? 32767 : x < -32768 ? -32768 : x;
+}
+
+// ------------- Kernels -----------------
+//
+// All kernels give bit-identical results: the scaled source is rounded
+// and saturated first, then added with saturation. Each leaves the
+// tail (less than a vector) to the scalar one.
+
+static void add_scalar(short *acc, const short *src, size_t n, int gain)
+{
+  for (size_t i = 0; i < n; i++) {
+    int scaled = (src[i] * gain + GAIN_ROUND) >> GAIN_SHIFT;
+    acc[i] = sat16(acc[i] + sat16(scaled));
+  }
+}
+
+static void sum_scalar(int *total, const short *src, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    total[i] += src[i];
+}
+
+static void minus_scalar(short *out, const int *total, const short *self,
+			 size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    out[i] = sat16(total[i] - self[i]);
+}
+
+#if defined(FEMIX_X86) && defined(__SSE2__)
+static void add_sse2(short *acc, const short *src, size_t n, int gain)
+{
+  size_t i = 0;
+  if (gain == FEMIX_UNITY) {
+    for (; i + 8 <= n; i += 8) {
+      __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+      __m128i a = _mm_loadu_si128((const __m128i *)(acc + i));
+      _mm_storeu_si128((__m128i *)(acc + i), _mm_adds_epi16(a, x));
+    }
+  } else {
+    const __m128i g = _mm_set1_epi16(gain);
+    const __m128i round = _mm_set1_epi32(GAIN_ROUND);
+    for (; i + 8 <= n; i += 8) {
+      __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+      // 32 bit products from their low and high halves
+      __m128i lo = _mm_mullo_epi16(x, g), hi = _mm_mulhi_epi16(x, g);
+      __m128i p0 = _mm_unpacklo_epi16(lo, hi), p1 = _mm_unpackhi_epi16(lo, hi);
+      p0 = _mm_srai_epi32(_mm_add_epi32(p0, round), GAIN_SHIFT);
+      p1 = _mm_srai_epi32(_mm_add_epi32(p1, round), GAIN_SHIFT);
+      __m128i a = _mm_loadu_si128((const __m128i *)(acc + i));
+      _mm_storeu_si128((__m128i *)(acc + i),
+		       _mm_adds_epi16(a, _mm_packs_epi32(p0, p1)));
+    }
+  }
+  add_scalar(acc + i, src + i, n - i, gain);
+}
+
+static void sum_sse2(int *total, const short *src, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+    // Sign extension: the sample in the high half, shifted down
+    __m128i x0 = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i x1 = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    __m128i *t = (__m128i *)(total + i);
+    _mm_storeu_si128(t, _mm_add_epi32(_mm_loadu_si128(t), x0));
+    _mm_storeu_si128(t + 1, _mm_add_epi32(_mm_loadu_si128(t + 1), x1));
+  }
+  sum_scalar(total + i, src + i, n - i);
+}
+
+static void minus_sse2(short *out, const int *total, const short *self,
+		       size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(self + i));
+    __m128i x0 = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i x1 = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    const __m128i *t = (const __m128i *)(total + i);
+    __m128i d0 = _mm_sub_epi32(_mm_loadu_si128(t), x0);
+    __m128i d1 = _mm_sub_epi32(_mm_loadu_si128(t + 1), x1);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(d0, d1));
+  }
+  minus_scalar(out + i, total + i, self + i, n - i);
+}
+#endif
+
+#ifdef FEMIX_X86
+__attribute__((target("avx2")))
+static void add_avx2(short *acc, const short *src, size_t n, int gain)
+{
+  size_t i = 0;
+  const __m256i g = _mm256_set1_epi16(gain);
+  const __m256i round = _mm256_set1_epi32(GAIN_ROUND);
+  for (; i + 16 <= n; i += 16) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+    if (gain != FEMIX_UNITY) {
+      // Unpack and pack both work within 128 bit lanes, so the order
+      // comes out right
+      __m256i lo = _mm256_mullo_epi16(x, g), hi = _mm256_mulhi_epi16(x, g);
+      __m256i p0 = _mm256_unpacklo_epi16(lo, hi);
+      __m256i p1 = _mm256_unpackhi_epi16(lo, hi);
+      p0 = _mm256_srai_epi32(_mm256_add_epi32(p0, round), GAIN_SHIFT);
+      p1 = _mm256_srai_epi32(_mm256_add_epi32(p1, round), GAIN_SHIFT);
+      x = _mm256_packs_epi32(p0, p1);
+    }
+    _mm256_storeu_si256((__m256i *)(acc + i), _mm256_adds_epi16(a, x));
+  }
+  add_scalar(acc + i, src + i, n - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void sum_avx2(int *total, const short *src, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+    __m256i *t = (__m256i *)(total + i);
+    _mm256_storeu_si256(t, _mm256_add_epi32(_mm256_loadu_si256(t), x));
+  }
+  sum_scalar(total + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void minus_avx2(short *out, const int *total, const short *self,
+		       size_t n)
+{
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m256i *t = (const __m256i *)(total + i);
+    __m256i x0 = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(self + i)));
+    __m256i x1 = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(self + i + 8)));
+    __m256i d0 = _mm256_sub_epi32(_mm256_loadu_si256(t), x0);
+    __m256i d1 = _mm256_sub_epi32(_mm256_loadu_si256(t + 1), x1);
+    // Packing interleaves the lanes (d0 lo, d1 lo, d0 hi, d1 hi)
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(d0, d1), 0xd8);
+    _mm256_storeu_si256((__m256i *)(out + i), packed);
+  }
+  minus_scalar(out + i, total + i, self + i, n - i);
+}
+#endif
+
+#ifdef __ARM_NEON
+static void add_neon(short *acc, const short *src, size_t n, int gain)
+{
+  size_t i = 0;
+  const int16x4_t g = vdup_n_s16(gain);
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t x = vld1q_s16(src + i);
+    if (gain != FEMIX_UNITY) {
+      // Rounding, saturating narrow: exactly the scalar arithmetic
+      int32x4_t p0 = vmull_s16(vget_low_s16(x), g);
+      int32x4_t p1 = vmull_s16(vget_high_s16(x), g);
+      x = vcombine_s16(vqrshrn_n_s32(p0, GAIN_SHIFT),
+		       vqrshrn_n_s32(p1, GAIN_SHIFT));
+    }
+    vst1q_s16(acc + i, vqaddq_s16(vld1q_s16(acc + i), x));
+  }
+  add_scalar(acc + i, src + i, n - i, gain);
+}
+
+static void sum_neon(int *total, const short *src, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t x = vld1q_s16(src + i);
+    vst1q_s32(total + i, vaddw_s16(vld1q_s32(total + i), vget_low_s16(x)));
+    vst1q_s32(total + i + 4,
+	      vaddw_s16(vld1q_s32(total + i + 4), vget_high_s16(x)));
+  }
+  sum_scalar(total + i, src + i, n - i);
+}
+
+static void minus_neon(short *out, const int *total, const short *self,
+		       size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t x = vld1q_s16(self + i);
+    int32x4_t d0 = vsubw_s16(vld1q_s32(total + i), vget_low_s16(x));
+    int32x4_t d1 = vsubw_s16(vld1q_s32(total + i + 4), vget_high_s16(x));
+    vst1q_s16(out + i, vcombine_s16(vqmovn_s32(d0), vqmovn_s32(d1)));
+  }
+  minus_scalar(out + i, total + i, self + i, n - i);
+}
+#endif
+
+__attribute__((constructor))
+static void femix_setup(void)
+{
+  add = add_scalar;
+  sum = sum_scalar;
+  minus = minus_scalar;
+#if defined(FEMIX_X86) && defined(__SSE2__)
+  add = add_sse2;
+  sum = sum_sse2;
+  minus = minus_sse2;
+  kernel_name = "sse2";
+#endif
+#ifdef FEMIX_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    add = add_avx2;
+    sum = sum_avx2;
+    minus = minus_avx2;
+    kernel_name = "avx2";
+  }
+#endif
+#ifdef __ARM_NEON
+  add = add_neon;
+  sum = sum_neon;
+  minus = minus_neon;
+  kernel_name = "neon";
+#endif
+}
+
+const char *femix_kernel(void)
+{
+  return kernel_name;
+}
+
+// ------------- Mixing -----------------
+
+void femix_add(short *acc, const short *src, size_t n, int gain)
+{
+  if (gain < 0)
+    gain = 0;
+  else if (gain > 32767)
+    gain = 32767;
+  add(acc, src, n, gain);
+}
+
+void femix_sum(int *total, const short *src, size_t n)
+{
+  sum(total, src, n);
+}
+
+void femix_minus(short *out, const int *total, const short *self, size_t n)
+{
+  minus(out, total, self, n);
+}
+
+int femix_gain_db(double db)
+{
+  long gain = lround(FEMIX_UNITY * pow(10, db / 20));
+  return gain > 32767 ? 32767 : gain;
+}
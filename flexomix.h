@@ -0,0 +1,55 @@
+/* flexomix — Audio mixing for flexoSIP
+ *
+ * Saturating sums of PCM16 sources with per-source gain, and the
+ * building blocks of a conference bridge: everybody's audio is added
+ * up once at 32 bits, then each party gets the total minus its own
+ * contribution, i.e. N−1 mixes for the price of N subtractions.
+ * Vectorized with AVX2, SSE2 or NEON (selected at program start),
+ * plain C otherwise. No allocation.
+ */
+#include <stddef.h>
+
+#define FEMIX_UNITY 4096 // Gain of 1.0 (Q12, so up to ×8 boost)
+
+/**
+ * Add a scaled source into a mix: acc += src·gain, saturating
+ *
+ * @param acc		The mix, PCM16
+ * @param src		The source, PCM16
+ * @param n		Samples
+ * @param gain		FEMIX_UNITY is 1.0; 0..32767
+ */
+void femix_add(short *acc, const short *src, size_t n, int gain);
+
+/**
+ * Add a source into a 32 bit total (no saturation needed)
+ *
+ * @param sum		The total
+ * @param src		The source, PCM16
+ * @param n		Samples
+ */
+void femix_sum(int *sum, const short *src, size_t n);
+
+/**
+ * One party's mix: out = sum − self, saturated to 16 bit
+ *
+ * @param out		The mix for the party, PCM16
+ * @param sum		The total of all parties
+ * @param self		What the party contributed to it
+ * @param n		Samples
+ */
+void femix_minus(short *out, const int *sum, const short *self, size_t n);
+
+/**
+ * Convert a gain in dB (e.g. -6.0) to the linear factor used here
+ *
+ * Clamped to what femix_add() accepts.
+ *
+ * @param db		The gain in decibels
+ */
+int femix_gain_db(double db);
+
+/**
+ * Name of the kernels in use ("avx2", "sse2", "neon", "scalar")
+ */
+const char *femix_kernel(void);
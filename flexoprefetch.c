@@ -0,0 +1,297 @@
+/* flexoprefetch — Background opening and decoding for flexosnd
+ *
+ * One thread does all file I/O for the play queues: it resolves
+ * queued files through the prompt cache and keeps files too big for
+ * it decoded ahead into streams, which the queue then plays like any
+ * live stream. The sending thread only ever copies or encodes
+ * samples that are already in memory.
+ */
+#include "flexosnd.h"
+#include <sndfile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+enum prefetch_state {
+  PREFETCH_PENDING,		// Not opened yet
+  PREFETCH_READY,		// prompt or stream set
+  PREFETCH_FAILED		// Cannot be played
+};
+
+struct fesnd_prefetch {
+  struct fesnd_prefetch *next;	// Work list, under prefetch_lock
+  int refs;			// Entry + prefetcher, under prefetch_lock
+  atomic_bool cancelled;	// Entry no longer wants it
+  atomic_int state;		// Result published with release
+  char *path;
+  enum fesnd_format format;
+  struct fesnd_prompt *prompt;	// Result: from the cache, or
+  struct fesnd_stream *stream;	// decoded ahead by us
+  struct fesnd_decoder dec;	// Until the end of the file
+  size_t low;			// Refill below this many samples
+};
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t prefetch_tid;
+static _Bool prefetch_running;		// Under prefetch_lock
+static _Bool prefetch_stopping;		// Ditto, see fesnd_prefetch_stop()
+static struct fesnd_prefetch *work_head, *work_tail;
+
+/**
+ * Drop a reference, with prefetch_lock held
+ */
+static void prefetch_put(struct fesnd_prefetch *job)
+{
+  if (--job->refs > 0)
+    return;
+  if (job->prompt != NULL)
+    fesnd_cache_put(job->prompt);
+  fesnd_stream_free(job->stream);
+  if (job->dec.sf != NULL)
+    fesnd_decoder_close(&job->dec);
+  free(job->path);
+  free(job);
+}
+
+/**
+ * Decode into the stream until it is full
+ *
+ * Returns true at the end of the file
+ */
+static _Bool prefetch_fill(struct fesnd_prefetch *job)
+{
+  short *buf;
+  size_t n;
+  if (job->dec.sf == NULL)
+    return true;
+  while ((n = fesnd_stream_reserve(job->stream, &buf)) > 0) {
+    size_t got = fesnd_decoder_read(&job->dec, buf, n);
+    fesnd_stream_commit(job->stream, got);
+    if (got < n) {
+      fesnd_decoder_close(&job->dec);
+      fesnd_stream_end(job->stream);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Stream watermark: the queue has eaten into what we decoded ahead
+ */
+static void prefetch_wake(struct fesnd_stream *s, enum fesnd_watermark mark,
+			  void *arg)
+{
+  (void)s;
+  (void)arg;
+  if (mark != FESND_STREAM_LOW)
+    return;
+  pthread_mutex_lock(&prefetch_lock);
+  pthread_cond_signal(&prefetch_cond);
+  pthread_mutex_unlock(&prefetch_lock);
+}
+
+/**
+ * Open a queued file: from the cache if it fits, else start decoding
+ *
+ * Returns true if there is nothing more to do for it
+ */
+static _Bool prefetch_open(struct fesnd_prefetch *job)
+{
+  if (fesnd_cache_get(job->path, job->format, &job->prompt) != 0) {
+    atomic_store_explicit(&job->state, PREFETCH_FAILED, memory_order_release);
+    return true; // Diagnostic already printed
+  }
+  if (job->prompt != NULL) {
+    atomic_store_explicit(&job->state, PREFETCH_READY, memory_order_release);
+    return true;
+  }
+  // Too big for the cache
+  int rate = fesnd_format_rate(job->format);
+  size_t capacity = (size_t)rate * FESND_PREFETCH_MS / 1000;
+  job->low = capacity / 2;
+  if (fesnd_decoder_open(&job->dec, job->path, rate) != 0
+      || (job->stream = fesnd_stream_new(rate, capacity, job->low, 0,
+					 prefetch_wake, job)) == NULL) {
+    atomic_store_explicit(&job->state, PREFETCH_FAILED, memory_order_release);
+    return true; // Diagnostic already printed
+  }
+  _Bool done = prefetch_fill(job);
+  atomic_store_explicit(&job->state, PREFETCH_READY, memory_order_release);
+  return done;
+}
+
+/**
+ * Does the job need the thread now? With prefetch_lock held
+ */
+static _Bool prefetch_wanted(struct fesnd_prefetch *job)
+{
+  if (atomic_load(&job->cancelled))
+    return true;
+  if (atomic_load(&job->state) == PREFETCH_PENDING)
+    return true;
+  return fesnd_stream_level(job->stream) <= job->low;
+}
+
+static void *prefetch_thread(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&prefetch_lock);
+  while (!prefetch_stopping) {
+    struct fesnd_prefetch **pp = &work_head, *prev = NULL;
+    while (*pp != NULL && !prefetch_wanted(*pp)) {
+      prev = *pp;
+      pp = &(*pp)->next;
+    }
+    struct fesnd_prefetch *job = *pp;
+    if (job == NULL) {
+      pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+      continue;
+    }
+    // Take it off the list while working on it (it keeps our reference)
+    *pp = job->next;
+    if (work_tail == job)
+      work_tail = prev;
+    job->next = NULL;
+    pthread_mutex_unlock(&prefetch_lock);
+
+    _Bool done = atomic_load(&job->cancelled);
+    if (!done) {
+      if (atomic_load(&job->state) == PREFETCH_PENDING)
+	done = prefetch_open(job);
+      else
+	done = prefetch_fill(job);
+    }
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (done) {
+      prefetch_put(job);
+    } else {
+      // To the end, so all files get their turn
+      if (work_tail != NULL)
+	work_tail->next = job;
+      else
+	work_head = job;
+      work_tail = job;
+    }
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+  return NULL;
+}
+
+/**
+ * Start the thread if not running yet (prefetch_lock held)
+ *
+ * Returns != 0 if it cannot run; the file is then not opened at all,
+ * as that would happen in the sending thread's time.
+ */
+static int prefetch_init(void)
+{
+  static _Bool warned;
+  if (prefetch_running)
+    return 0;
+  prefetch_stopping = false;
+  int err = pthread_create(&prefetch_tid, NULL, prefetch_thread, NULL);
+  if (err != 0) {
+    if (!warned)
+      fprintf(stderr, "Cannot start prefetch thread: %s\n", strerror(err));
+    warned = true;
+    return -1;
+  }
+  prefetch_running = true;
+  return 0;
+}
+
+struct fesnd_prefetch *fesnd_prefetch_start(const char *path,
+					    enum fesnd_format format)
+{
+  struct fesnd_prefetch *job = calloc(1, sizeof(*job));
+  if (job != NULL)
+    job->path = strdup(path);
+  if (job == NULL || job->path == NULL) {
+    fprintf(stderr, "Cannot prefetch %s: Out of memory\n", path);
+    free(job);
+    return NULL;
+  }
+  atomic_init(&job->cancelled, false);
+  atomic_init(&job->state, PREFETCH_PENDING);
+  job->format = format;
+  job->refs = 2;
+  pthread_mutex_lock(&prefetch_lock);
+  if (prefetch_init() != 0) {
+    pthread_mutex_unlock(&prefetch_lock);
+    free(job->path);
+    free(job);
+    return NULL;
+  }
+  if (work_tail != NULL)
+    work_tail->next = job;
+  else
+    work_head = job;
+  work_tail = job;
+  pthread_cond_signal(&prefetch_cond);
+  pthread_mutex_unlock(&prefetch_lock);
+  return job;
+}
+
+int fesnd_prefetch_poll(struct fesnd_entry *e, int rate)
+{
+  struct fesnd_prefetch *job = e->job;
+  switch (atomic_load_explicit(&job->state, memory_order_acquire)) {
+  case PREFETCH_PENDING:
+    return 0;
+  case PREFETCH_FAILED:
+    return -1;
+  }
+  if (job->prompt != NULL) {
+    // Ours now; the job has nothing left to do
+    e->prompt = job->prompt;
+    job->prompt = NULL;
+    fesnd_prefetch_cancel(job);
+    e->job = NULL;
+    return 1;
+  }
+  // The job keeps decoding into the stream until the entry is closed
+  if (fesnd_stream_attach(e, job->stream, rate) != 0)
+    return -1;
+  return 1;
+}
+
+void fesnd_prefetch_cancel(struct fesnd_prefetch *job)
+{
+  pthread_mutex_lock(&prefetch_lock);
+  atomic_store(&job->cancelled, true);
+  prefetch_put(job);
+  pthread_cond_signal(&prefetch_cond); // Let go of its file soon
+  pthread_mutex_unlock(&prefetch_lock);
+}
+
+void fesnd_prefetch_stop(void)
+{
+  pthread_mutex_lock(&prefetch_lock);
+  if (!prefetch_running) {
+    pthread_mutex_unlock(&prefetch_lock);
+    return;
+  }
+  prefetch_stopping = true;
+  pthread_cond_signal(&prefetch_cond);
+  pthread_mutex_unlock(&prefetch_lock);
+  pthread_join(prefetch_tid, NULL);
+
+  // Drop the thread's references; entries still holding theirs see
+  // their jobs as not ready until closed
+  pthread_mutex_lock(&prefetch_lock);
+  while (work_head != NULL) {
+    struct fesnd_prefetch *job = work_head;
+    work_head = job->next;
+    job->next = NULL;
+    prefetch_put(job);
+  }
+  work_tail = NULL;
+  prefetch_running = false;
+  pthread_mutex_unlock(&prefetch_lock);
+}
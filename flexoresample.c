@@ -0,0 +1,293 @@
+#include "flexoresample.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FERESAMPLE_X86
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#define MAX_PHASES 4096 // Largest supported upsampling factor L
+#define TAP_ALIGN 8 // Taps per phase are padded to a multiple of this
+
+struct feresample {
+  int L, M;			// Upsampling/downsampling factors
+  int channels;
+  int taps;			// Per phase, multiple of TAP_ALIGN
+  int phase;			// Polyphase branch for the next output
+  size_t pos;			// Window start in hist for the next output
+  size_t hist_len, hist_cap;
+  float *coeffs;		// L × taps, phase-major, time-reversed
+  float *hist;			// Mono input history
+};
+
+static const struct {
+  int taps;			// Taps per phase at ratio 1:1
+  double beta;			// Kaiser window shape
+  double rolloff;		// Passband edge, relative to Nyquist
+} qualities[FERESAMPLE_NQUALITIES] = {
+  [FERESAMPLE_LOW]    = { 8, 4.0, 0.80},
+  [FERESAMPLE_MEDIUM] = {16, 6.0, 0.88},
+  [FERESAMPLE_HIGH]   = {32, 8.6, 0.93},
+};
+
+typedef float (*feresample_dot)(const float *, const float *, int);
+static feresample_dot dot;
+static const char *kernel_name = "scalar";
+
+// ------------- Dot product kernels (n is a multiple of TAP_ALIGN) -----------------
+
+static float dot_scalar(const float *a, const float *b, int n)
+{
+  float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  for (int i = 0; i < n; i += 4) {
+    s0 += a[i] * b[i];
+    s1 += a[i+1] * b[i+1];
+    s2 += a[i+2] * b[i+2];
+    s3 += a[i+3] * b[i+3];
+  }
+  return (s0 + s1) + (s2 + s3);
+}
+
+#if defined(FERESAMPLE_X86) && defined(__SSE__)
+static float dot_sse(const float *a, const float *b, int n)
+{
+  __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+  for (int i = 0; i < n; i += 8) {
+    s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+  s0 = _mm_add_ps(s0, s1);
+  s0 = _mm_add_ps(s0, _mm_movehl_ps(s0, s0));
+  s0 = _mm_add_ss(s0, _mm_shuffle_ps(s0, s0, 1));
+  return _mm_cvtss_f32(s0);
+}
+#endif
+
+#ifdef FERESAMPLE_X86
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int n)
+{
+  __m256 s = _mm256_setzero_ps();
+  for (int i = 0; i < n; i += 8)
+    s = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s);
+  __m128 h = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+  h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+  h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 1));
+  return _mm_cvtss_f32(h);
+}
+#endif
+
+#ifdef __ARM_NEON
+static float dot_neon(const float *a, const float *b, int n)
+{
+  float32x4_t s0 = vdupq_n_f32(0), s1 = vdupq_n_f32(0);
+  for (int i = 0; i < n; i += 8) {
+    s0 = vmlaq_f32(s0, vld1q_f32(a + i), vld1q_f32(b + i));
+    s1 = vmlaq_f32(s1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+  }
+  s0 = vaddq_f32(s0, s1);
+  float32x2_t h = vadd_f32(vget_low_f32(s0), vget_high_f32(s0));
+  return vget_lane_f32(vpadd_f32(h, h), 0);
+}
+#endif
+
+__attribute__((constructor))
+static void feresample_init(void)
+{
+  dot = dot_scalar;
+#if defined(FERESAMPLE_X86) && defined(__SSE__)
+  dot = dot_sse;
+  kernel_name = "sse";
+#endif
+#ifdef FERESAMPLE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    dot = dot_avx2;
+    kernel_name = "avx2";
+  }
+#endif
+#ifdef __ARM_NEON
+  dot = dot_neon;
+  kernel_name = "neon";
+#endif
+}
+
+const char *feresample_kernel(void)
+{
+  return kernel_name;
+}
+
+// ------------- Filter design -----------------
+
+static int gcd(int a, int b)
+{
+  while (b != 0) {
+    int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Modified Bessel function of the first kind, order 0
+static double bessel_i0(double x)
+{
+  double sum = 1, term = 1;
+  for (int k = 1; k < 50 && term > 1e-12 * sum; k++) {
+    term *= (x / (2*k)) * (x / (2*k));
+    sum += term;
+  }
+  return sum;
+}
+
+/**
+ * Fill r->coeffs with the polyphase decomposition of a Kaiser-windowed
+ * sinc lowpass at the upsampled rate
+ */
+static void design_filter(struct feresample *r, enum feresample_quality quality)
+{
+  int L = r->L, taps = r->taps;
+  int n = L * taps;
+  // Centered on an input sample, i.e. a delay of exactly taps/2 input
+  // samples (the very first coefficient then has no mirror, it is ~0)
+  double center = n / 2.0;
+  // Cutoff at the lower of both Nyquist rates, in cycles/upsampled sample
+  double fc = 0.5 * qualities[quality].rolloff / (L > r->M ? L : r->M);
+  double i0beta = bessel_i0(qualities[quality].beta);
+  double sum = 0;
+  for (int k = 0; k < n; k++) {
+    double t = k - center;
+    double x = 2 * fc * t;
+    double sinc = (x == 0) ? 1 : sin(M_PI * x) / (M_PI * x);
+    double w = t / center;
+    double win = bessel_i0(qualities[quality].beta * sqrt(fmax(0, 1 - w*w))) / i0beta;
+    double h = 2 * fc * sinc * win;
+    sum += h;
+    // Phase p = k % L, tap j = k / L, stored time-reversed
+    r->coeffs[(k % L) * taps + (taps - 1 - k / L)] = h;
+  }
+  // Unity gain at DC, after upsampling by L
+  for (int k = 0; k < n; k++)
+    r->coeffs[k] *= L / sum;
+}
+
+struct feresample *feresample_new(int in_rate, int channels, int out_rate,
+				  enum feresample_quality quality)
+{
+  if (in_rate <= 0 || out_rate <= 0 || channels < 1 || channels > 2
+      || quality < 0 || quality >= FERESAMPLE_NQUALITIES)
+    return NULL;
+  int g = gcd(in_rate, out_rate);
+  struct feresample *r = calloc(1, sizeof(*r));
+  if (r == NULL)
+    return NULL;
+  r->L = out_rate / g;
+  r->M = in_rate / g;
+  r->channels = channels;
+  if (r->L > MAX_PHASES) {
+    free(r);
+    return NULL;
+  }
+  if (r->L == r->M) {
+    // Same rate: a single-tap "filter" (still handles stereo and buffering)
+    r->taps = TAP_ALIGN;
+  } else {
+    // Longer filters when downsampling, as the cutoff is lower
+    int taps = qualities[quality].taps;
+    if (r->M > r->L)
+      taps = (taps * r->M + r->L - 1) / r->L;
+    r->taps = (taps + TAP_ALIGN - 1) / TAP_ALIGN * TAP_ALIGN;
+  }
+  r->coeffs = calloc((size_t)r->L * r->taps, sizeof(float));
+  // Room for 40 ms of input; grows if fed bigger chunks
+  r->hist_cap = r->taps + (in_rate / 25);
+  r->hist = calloc(r->hist_cap, sizeof(float));
+  if (r->coeffs == NULL || r->hist == NULL) {
+    feresample_free(r);
+    return NULL;
+  }
+  if (r->L == r->M)
+    r->coeffs[r->taps / 2 - 1] = 1; // Same delay as design_filter()
+  else
+    design_filter(r, quality);
+  // Prime with silence, so the first output sample is centered on
+  // the first input sample (no added delay)
+  r->hist_len = r->taps / 2 - 1;
+  return r;
+}
+
+void feresample_free(struct feresample *r)
+{
+  if (r != NULL) {
+    free(r->coeffs);
+    free(r->hist);
+    free(r);
+  }
+}
+
+size_t feresample_needed(const struct feresample *r, size_t nout)
+{
+  if (nout == 0)
+    return 0;
+  // Window start of the last wanted output
+  size_t last = r->pos + (r->phase + (nout - 1) * (size_t)r->M) / r->L;
+  if (last + r->taps <= r->hist_len)
+    return 0;
+  return last + r->taps - r->hist_len;
+}
+
+size_t feresample_process(struct feresample *r, const short *in,
+			  size_t nframes, short *out, size_t maxout)
+{
+  size_t produced = 0;
+  for (;;) {
+    // Append (downmixed) input
+    if (nframes > r->hist_cap - r->hist_len) {
+      size_t cap = r->hist_len + nframes;
+      float *hist = realloc(r->hist, cap * sizeof(float));
+      if (hist != NULL) {
+	r->hist = hist;
+	r->hist_cap = cap;
+      }
+    }
+    size_t take = r->hist_cap - r->hist_len;
+    if (take > nframes)
+      take = nframes;
+    float *h = r->hist + r->hist_len;
+    if (r->channels == 2) {
+      for (size_t i = 0; i < take; i++)
+	h[i] = (in[2*i] + in[2*i+1]) * 0.5f;
+    } else {
+      for (size_t i = 0; i < take; i++)
+	h[i] = in[i];
+    }
+    r->hist_len += take;
+    in += take * r->channels;
+    nframes -= take;
+
+    // Filter
+    while (produced < maxout && r->pos + r->taps <= r->hist_len) {
+      float y = dot(r->coeffs + (size_t)r->phase * r->taps, r->hist + r->pos,
+		    r->taps);
+      long v = lrintf(y);
+      out[produced++] = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+      r->phase += r->M;
+      r->pos += r->phase / r->L;
+      r->phase %= r->L;
+    }
+
+    // Drop consumed history
+    if (r->pos > 0) {
+      memmove(r->hist, r->hist + r->pos, (r->hist_len - r->pos) * sizeof(float));
+      r->hist_len -= r->pos;
+      r->pos = 0;
+    }
+    if (nframes == 0 || take == 0)
+      return produced;
+  }
+}
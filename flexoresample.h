@@ -0,0 +1,67 @@
+/* flexoresample — Sample rate conversion for flexoSIP
+ *
+ * Windowed-sinc polyphase FIR resampler for any rational ratio
+ * (e.g. 44.1 kHz stereo → 8 kHz mono). State is kept across calls,
+ * so audio can be fed in arbitrary chunks (e.g. 20 ms frames).
+ */
+#include <stddef.h>
+
+/**
+ * Resampling quality (filter length and stopband attenuation)
+ */
+enum feresample_quality {
+  FERESAMPLE_LOW,		//  8 taps/phase, ~40 dB stopband
+  FERESAMPLE_MEDIUM,		// 16 taps/phase, ~60 dB stopband
+  FERESAMPLE_HIGH,		// 32 taps/phase, ~85 dB stopband
+  FERESAMPLE_NQUALITIES
+};
+
+struct feresample;
+
+/**
+ * Create a resampler
+ *
+ * NULL means error (unsupported rates or channels, out of memory).
+ *
+ * @param in_rate	Input sample rate (Hz)
+ * @param channels	Input channels (1 or 2; output is always mono)
+ * @param out_rate	Output sample rate (Hz)
+ * @param quality	Filter quality
+ */
+struct feresample *feresample_new(int in_rate, int channels, int out_rate,
+				  enum feresample_quality quality);
+
+/**
+ * Free a resampler
+ *
+ * @param r		The resampler (NULL is ignored)
+ */
+void feresample_free(struct feresample *r);
+
+/**
+ * Number of input frames needed to produce exactly `nout` more samples
+ *
+ * @param r		The resampler
+ * @param nout		Number of output samples wanted
+ */
+size_t feresample_needed(const struct feresample *r, size_t nout);
+
+/**
+ * Resample a chunk of audio
+ *
+ * Returns the number of output samples produced (at most maxout).
+ * Input not needed for those is kept for the next call.
+ *
+ * @param r		The resampler
+ * @param in		Input samples (interleaved if stereo)
+ * @param nframes	Number of input frames (samples per channel)
+ * @param out		Output buffer (mono)
+ * @param maxout	Room in the output buffer
+ */
+size_t feresample_process(struct feresample *r, const short *in,
+			  size_t nframes, short *out, size_t maxout);
+
+/**
+ * Name of the filter kernel in use ("avx2", "sse", "neon", "scalar")
+ */
+const char *feresample_kernel(void);
@@ -1,31 +1,84 @@
+#define _GNU_SOURCE // For sendmmsg()
 #include "flexortp.h"
 #include <ortp/ortp.h>
 #include <ortp/payloadtype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
-static RtpSession *session = NULL;
-static int user_ts = 0;
-
-extern char offset0xD5;
-PayloadType payload_type_pcma16000={
-        .type = PAYLOAD_AUDIO_CONTINUOUS,
-        .clock_rate = 16000,
-        .bits_per_sample = 8,
-        .zero_pattern = &offset0xD5,
-        .pattern_length = 1,
-        .normal_bitrate = 128000,
-        .mime_type = "PCMA",
-        .channels = 1,
-        .recv_fmtp = NULL,
-        .send_fmtp = NULL,
-#ifdef PAYLOAD_TYPE_AVPF_NONE
-        .avpf={.features=PAYLOAD_TYPE_AVPF_NONE, .trr_interval=0},
-#endif
-        .flags = 0
+static _Bool scheduler_initialized = false;
+static _Bool clocked_sessions = false;
+static _Bool batched_sessions = false;
+
+// Every session sends and receives through an RtpTransport of ours:
+// packets oRTP builds are handed to the kernel right away or, for
+// batched sessions, on fertp_flush(). Those also learn where to send
+// from oRTP's first packet and then build the rest in place (see
+// batch_queue()). Receiving, it notes when
+// the kernel got each packet, as oRTP reads all that are waiting at
+// once, long after the first arrived.
+#define ARRIVALS 32 // Power of 2, more than read ahead of fertp_recv()
+
+struct fertp_arrival {
+  _Bool set;
+  unsigned short seq;		// RTP sequence number
+  struct timespec at;		// CLOCK_MONOTONIC
+};
+
+struct fertp_transport {
+  RtpTransport tr;		// First: oRTP hands us back a pointer to it
+  int fd;			// The session's RTP socket
+  struct fertp_session *rtp;	// Started on it, NULL while idle
+  _Bool to_known;		// oRTP sent the first packet of the call
+  struct sockaddr_storage to;	// There (tolen 0: connected socket)
+  socklen_t tolen;
+  struct fertp_arrival arrival[ARRIVALS]; // By sequence number
+};
+
+// Batched sending: packets of all calls, sent by fertp_flush() with
+// one sendmmsg() per run of packets on the same socket, i.e. per call.
+struct batch_packet {
+  int fd;			// Socket it goes out on
+  struct sockaddr_storage to;
+  unsigned char buf[RTP_FIXED_HEADER_SIZE + FERTP_MAX_PAYLOAD];
+};
+
+static struct batch_packet batch[FERTP_BATCH];
+static struct mmsghdr batch_msg[FERTP_BATCH];
+static struct iovec batch_iov[FERTP_BATCH];
+static int nbatch;
+static struct fertp_batch_stats batch_stats;
+
+// Local ports come in pairs: RTP on the even port, RTCP on the next.
+// Free pairs are handed out oldest first (FIFO), so a port is not
+// reused while stray packets of its last call may still arrive.
+// Idle sessions keep their pair, bound and ready for the next call.
+struct fertp_pooled {
+  RtpSession *session;
+  int port;
 };
 
-void fertp_start(const char *host, int port, int format,
-		 PayloadType *pt)
+static pthread_mutex_t port_lock = PTHREAD_MUTEX_INITIALIZER;
+static int port_min = FERTP_PORT_MIN, port_max = FERTP_PORT_MAX;
+static int npairs;			// In the range, 0 = not set up yet
+static int *free_pairs;			// Ring of pair indices
+static int free_head, nfree;
+static struct fertp_pooled *pool;	// Stack of idle sessions
+static int npool;
+static struct fertp_transport *transports; // Per pair
+
+static void fertp_setup(void)
 {
+  if (scheduler_initialized)
+    return;
+  // Shared by all sessions
   ortp_scheduler_init();
   // Difference between the Ubuntu 18.10 bundled version
   // "libortp9 (= 3.6.1-4build1)" and the git repo version
@@ -35,43 +88,709 @@ void fertp_start(const char *host, int port, int format,
 #else
   ortp_set_log_level_mask(ORTP_MESSAGE|ORTP_WARNING|ORTP_ERROR);
 #endif
-  session=rtp_session_new(RTP_SESSION_SENDONLY);	
+  scheduler_initialized = true;
+}
+
+/**
+ * (Re)build the free list for the current range (port_lock held)
+ */
+static int ports_init(void)
+{
+  int n = (port_max - port_min + 1) / 2;
+  int *pairs = malloc(n * sizeof(*pairs));
+  struct fertp_pooled *p = malloc(n * sizeof(*p));
+  struct fertp_transport *t = calloc(n, sizeof(*t));
+  if (n <= 0 || pairs == NULL || p == NULL || t == NULL) {
+    free(pairs);
+    free(p);
+    free(t);
+    return 1;
+  }
+  free(free_pairs);
+  free(pool);
+  free(transports);
+  free_pairs = pairs;
+  pool = p;
+  transports = t;
+  for (int i = 0; i < n; i++)
+    free_pairs[i] = i;
+  npairs = nfree = n;
+  free_head = npool = 0;
+  return 0;
+}
+
+/**
+ * Take the oldest free port pair (port_lock held), -1 if none
+ */
+static int port_take(void)
+{
+  if (npairs == 0 && ports_init() != 0)
+    return -1;
+  if (nfree == 0)
+    return -1;
+  int pair = free_pairs[free_head];
+  free_head = (free_head + 1) % npairs;
+  nfree--;
+  return port_min + 2 * pair;
+}
+
+static void port_give(int port)
+{
+  free_pairs[(free_head + nfree) % npairs] = (port - port_min) / 2;
+  nfree++;
+}
+
+static struct fertp_transport *transport_of(int port)
+{
+  return &transports[(port - port_min) / 2];
+}
+
+static ortp_socket_t transport_getsocket(RtpTransport *tr)
+{
+  return ((struct fertp_transport *)tr)->fd;
+}
+
+/**
+ * The next free slot for fertp_flush(), filled in by the caller
+ */
+static struct batch_packet *batch_slot(const struct fertp_transport *t,
+				       size_t len)
+{
+  if (nbatch == FERTP_BATCH)
+    fertp_flush();
+  struct batch_packet *p = &batch[nbatch];
+  p->fd = t->fd;
+  memcpy(&p->to, &t->to, t->tolen);
+  batch_iov[nbatch] = (struct iovec) { .iov_base = p->buf, .iov_len = len };
+  batch_msg[nbatch].msg_hdr = (struct msghdr) {
+    .msg_name = t->tolen > 0 ? &p->to : NULL, .msg_namelen = t->tolen,
+    .msg_iov = &batch_iov[nbatch], .msg_iovlen = 1 };
+  nbatch++;
+  return p;
+}
+
+/**
+ * Send a packet oRTP built (and counted), or queue it for fertp_flush()
+ */
+static int transport_sendto(RtpTransport *tr, mblk_t *msg, int flags,
+			    const struct sockaddr *to, socklen_t tolen)
+{
+  struct fertp_transport *t = (struct fertp_transport *)tr;
+  if (msg->b_cont != NULL)
+    msgpullup(msg, -1); // Header and payload in one block
+  size_t len = msg->b_wptr - msg->b_rptr;
+  if (t->rtp == NULL || !t->rtp->batched || len > sizeof(batch[0].buf)
+      || tolen > sizeof(t->to)) {
+    batch_stats.syscalls++;
+    batch_stats.direct++;
+    return sendto(t->fd, msg->b_rptr, len, flags, to, tolen);
+  }
+  // Where batch_queue() sends the following ones
+  t->tolen = to != NULL ? tolen : 0;
+  if (to != NULL)
+    memcpy(&t->to, to, tolen);
+  t->to_known = true;
+  struct batch_packet *p = batch_slot(t, len);
+  memcpy(p->buf, msg->b_rptr, len);
+  return len; // Sent, as far as oRTP is concerned
+}
+
+/**
+ * When the kernel received the message, on CLOCK_MONOTONIC
+ *
+ * SO_TIMESTAMPNS stamps it on CLOCK_REALTIME; shifted by how far the
+ * clocks are apart now. Without a stamp, the time it is read.
+ */
+static void arrival_of(struct msghdr *mh, struct timespec *at)
+{
+  clock_gettime(CLOCK_MONOTONIC, at);
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(mh); c != NULL;
+       c = CMSG_NXTHDR(mh, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS)
+      continue;
+    struct timespec kernel, real;
+    memcpy(&kernel, CMSG_DATA(c), sizeof(kernel));
+    clock_gettime(CLOCK_REALTIME, &real);
+    long ago = (real.tv_sec - kernel.tv_sec) * 1000000000L
+      + (real.tv_nsec - kernel.tv_nsec);
+    if (ago <= 0 || ago >= 1000000000L)
+      return; // Clock stepped in between
+    at->tv_nsec -= ago;
+    if (at->tv_nsec < 0) {
+      at->tv_nsec += 1000000000L;
+      at->tv_sec--;
+    }
+    return;
+  }
+}
 
-  rtp_session_set_scheduling_mode(session, 1);
-  rtp_session_set_blocking_mode(session, 1);
+/**
+ * Receive a packet for oRTP, noting when it arrived
+ */
+static int transport_recvfrom(RtpTransport *tr, mblk_t *msg, int flags,
+			      struct sockaddr *from, socklen_t *fromlen)
+{
+  struct fertp_transport *t = (struct fertp_transport *)tr;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(struct timespec))];
+  } control;
+  struct iovec iov = { .iov_base = msg->b_wptr,
+		       .iov_len = msg->b_datap->db_lim - msg->b_wptr };
+  struct msghdr mh = {
+    .msg_name = from, .msg_namelen = fromlen != NULL ? *fromlen : 0,
+    .msg_iov = &iov, .msg_iovlen = 1,
+    .msg_control = &control, .msg_controllen = sizeof(control) };
+  ssize_t n = recvmsg(t->fd, &mh, flags);
+  if (n < 0)
+    return n;
+  if (fromlen != NULL)
+    *fromlen = mh.msg_namelen;
+  if (n >= RTP_FIXED_HEADER_SIZE) {
+    unsigned short seq = msg->b_wptr[2] << 8 | msg->b_wptr[3];
+    struct fertp_arrival *a = &t->arrival[seq & (ARRIVALS - 1)];
+    a->set = true;
+    a->seq = seq;
+    arrival_of(&mh, &a->at);
+  }
+  return n;
+}
+
+/**
+ * A new session bound to the port, not started (port_lock held)
+ */
+static RtpSession *session_new(int port)
+{
+  RtpSession *session = rtp_session_new(RTP_SESSION_SENDRECV);
+  if (session == NULL)
+    return NULL;
+  rtp_session_set_scheduling_mode(session, FALSE);
+  rtp_session_set_blocking_mode(session, FALSE);
   rtp_session_set_connected_mode(session, TRUE);
-  rtp_session_set_local_addr(session, "0.0.0.0", 5070, -1);
-  rtp_session_set_remote_addr(session, host, port);
-  if (format >= 96) {
-    // User-defined payload
-    static RtpProfile *myProfile;
-    if (myProfile == NULL) {
-      myProfile = rtp_profile_clone(&av_profile);
-      rtp_profile_set_name(myProfile, "withPCMA/1600");
+  // Received packets are handed out as they arrive
+  rtp_session_enable_jitter_buffer(session, FALSE);
+  if (rtp_session_set_local_addr(session, "0.0.0.0", port, -1) != 0) {
+    rtp_session_destroy(session);
+    return NULL;
+  }
+  struct fertp_transport *t = transport_of(port);
+  t->tr = (RtpTransport) {
+    .t_getsocket = transport_getsocket,
+    .t_sendto = transport_sendto,
+    .t_recvfrom = transport_recvfrom,
+  };
+  t->fd = rtp_session_get_rtp_socket(session); // Before it asks us
+  t->rtp = NULL;
+  int on = 1;
+  if (setsockopt(t->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0)
+    fprintf(stderr, "flexortp: No receive timestamps (%s), "
+	    "using the time packets are read\n", strerror(errno));
+  rtp_session_set_transports(session, &t->tr, NULL); // RTCP as usual
+  return session;
+}
+
+static void session_destroy(RtpSession *session)
+{
+  rtp_session_set_transports(session, NULL, NULL); // Ours, not oRTP's
+  rtp_session_destroy(session);
+}
+
+/**
+ * A new session on a free port (port_lock held)
+ *
+ * Ports that cannot be bound (used by someone else) are skipped
+ * and not handed out again.
+ */
+static RtpSession *session_take(int *port)
+{
+  for (;;) {
+    *port = port_take();
+    if (*port < 0)
+      return NULL;
+    RtpSession *session = session_new(*port);
+    if (session != NULL)
+      return session;
+    fprintf(stderr, "Cannot bind RTP port %d, skipping it\n", *port);
+  }
+}
+
+/**
+ * Close all idle sessions, returning their ports (port_lock held)
+ */
+static void pool_drain(void)
+{
+  while (npool > 0) {
+    npool--;
+    session_destroy(pool[npool].session);
+    port_give(pool[npool].port);
+  }
+}
+
+int fertp_set_port_range(int min, int max)
+{
+  int retval = 0;
+  if (min % 2)
+    min++; // RTP on even ports
+  pthread_mutex_lock(&port_lock);
+  pool_drain();
+  if (npairs > 0 && nfree < npairs) {
+    fprintf(stderr, "fertp_set_port_range(): RTP ports still in use\n");
+    retval = 1;
+  } else {
+    int old_min = port_min, old_max = port_max;
+    port_min = min;
+    port_max = max;
+    if (ports_init() != 0) {
+      fprintf(stderr, "fertp_set_port_range(): Invalid range %d-%d\n",
+	      min, max);
+      port_min = old_min;
+      port_max = old_max;
+      retval = 1;
+    }
+  }
+  pthread_mutex_unlock(&port_lock);
+  return retval;
+}
+
+int fertp_pool_prewarm(int nsessions)
+{
+  int added = 0;
+  fertp_setup();
+  pthread_mutex_lock(&port_lock);
+  for (; added < nsessions; added++) {
+    int port;
+    RtpSession *session = session_take(&port);
+    if (session == NULL)
+      break;
+    pool[npool].session = session;
+    pool[npool].port = port;
+    npool++;
+  }
+  pthread_mutex_unlock(&port_lock);
+  return added;
+}
+
+void fertp_pool_drain(void)
+{
+  pthread_mutex_lock(&port_lock);
+  pool_drain();
+  pthread_mutex_unlock(&port_lock);
+}
+
+int fertp_open(struct fertp_session *rtp)
+{
+  if (rtp->bound != NULL)
+    return rtp->local_port;
+  fertp_setup();
+  pthread_mutex_lock(&port_lock);
+  RtpSession *session;
+  int port;
+  if (npool > 0) {
+    npool--;
+    session = pool[npool].session;
+    port = pool[npool].port;
+  } else {
+    session = session_take(&port);
+  }
+  pthread_mutex_unlock(&port_lock);
+  if (session == NULL) {
+    fprintf(stderr, "No free RTP port in %d-%d\n", port_min, port_max);
+    return -1;
+  }
+  rtp->bound = session;
+  rtp->local_port = port;
+  return port;
+}
+
+void fertp_start(struct fertp_session *rtp,
+		 const char *host, int port, int format,
+		 const char *mime, int clock_rate)
+{
+  if (fertp_open(rtp) < 0)
+    return; // Diagnostic already printed
+  RtpSession *session = rtp->bound;
+  if (rtp->session != NULL) {
+    // Restarted (e.g., re-INVITE): same session, new parameters
+    rtp->session = NULL;
+    if (rtp->profile != NULL) {
+      rtp_session_set_profile(session, &av_profile);
+      rtp_profile_destroy(rtp->profile);
+      rtp->profile = NULL;
     }
-    rtp_profile_set_payload(myProfile, format, pt);
-    rtp_session_set_profile(session, myProfile);
-    fprintf(stderr, "My Profile payload %d %s/%d\n", format, myProfile->payload[format]->mime_type, myProfile->payload[format]->clock_rate);
   } else {
-    fprintf(stderr, "AV Profile payload %d %s/%d\n", format, av_profile.payload[format]->mime_type, av_profile.payload[format]->clock_rate);
+    // Whatever reached the port since the last call
+    rtp_session_flush_sockets(session);
+    rtp->clocked = clocked_sessions;
+    if (!rtp->clocked) {
+      // Cannot be undone: such sessions are not reused (see fertp_stop())
+      rtp_session_set_scheduling_mode(session, TRUE);
+      rtp_session_set_blocking_mode(session, TRUE);
+      rtp->scheduled = true;
+    }
+    memset(&rtp->stats, 0, sizeof(rtp->stats));
   }
+  rtp->session = session;
+  rtp->pacing = false;
+  rtp->epoch_set = false;
+  rtp->recv_ts = 0;
+  rtp_session_set_remote_addr(session, host, port);
+  PayloadType *known = av_profile.payload[format];
+  if (known == NULL || known->clock_rate != clock_rate
+      || strcasecmp(known->mime_type, mime) != 0) {
+    // Dynamic (or unusual) payload type: describe it in our own profile
+    PayloadType *pt = payload_type_new();
+    pt->type = PAYLOAD_AUDIO_CONTINUOUS;
+    pt->clock_rate = clock_rate;
+    pt->mime_type = ortp_strdup(mime);
+    pt->channels = 1;
+    rtp->profile = rtp_profile_clone(&av_profile);
+    rtp_profile_set_payload(rtp->profile, format, pt);
+    rtp_session_set_profile(session, rtp->profile);
+  }
+  fprintf(stderr, "RTP payload %d %s/%d\n", format, mime, clock_rate);
+  rtp->clock_rate = clock_rate;
+  rtp->payload_type = format;
   rtp_session_set_payload_type(session, format);
-  fertp_resume();
+  rtp->batched = rtp->clocked && batched_sessions;
+  struct fertp_transport *t = transport_of(rtp->local_port);
+  t->rtp = rtp;
+  t->to_known = false; // The next packet goes through oRTP
+  memset(t->arrival, 0, sizeof(t->arrival)); // Of the previous call
+
+  fertp_resume(rtp);
 }
 
-void fertp_resume(void)
+void fertp_set_clocked(_Bool clocked)
 {
-  user_ts = rtp_session_get_current_send_ts(session);
+  clocked_sessions = clocked;
 }
 
-void fertp_send_alaw(const unsigned char *buf, ssize_t nbytes, ssize_t nsamples)
+void fertp_set_batched(_Bool batched)
 {
-  //fprintf(stderr, "Advancing by %zd=%zd\n", nbytes, nsamples);
-  rtp_session_send_with_ts(session, buf, nbytes, user_ts);
-  user_ts += nsamples;
+  batched_sessions = batched;
 }
 
-void fertp_stop(void)
+void fertp_resume(struct fertp_session *rtp)
 {
-  rtp_session_destroy(session);
+  rtp->pacing = false;
+  // Clocked sessions: the timestamp keeps following the clock
+  if (rtp->session != NULL && !rtp->clocked)
+    rtp->user_ts = rtp_session_get_current_send_ts(rtp->session);
+}
+
+int fertp_hist_bucket(unsigned long us)
+{
+  const unsigned long sub = 1 << FERTP_HIST_SHIFT;
+  if (us < sub)
+    return us;
+  int e = 8 * sizeof(us) - 1 - __builtin_clzl(us); // >= FERTP_HIST_SHIFT
+  int bucket = (e - FERTP_HIST_SHIFT + 1) * sub
+    + ((us >> (e - FERTP_HIST_SHIFT)) & (sub - 1));
+  return bucket < FERTP_HIST_BUCKETS ? bucket : FERTP_HIST_BUCKETS - 1;
+}
+
+unsigned long fertp_hist_value(int bucket)
+{
+  const int sub = 1 << FERTP_HIST_SHIFT;
+  if (bucket < sub)
+    return bucket;
+  int e = bucket / sub + FERTP_HIST_SHIFT - 1;
+  return (unsigned long)(sub + bucket % sub) << (e - FERTP_HIST_SHIFT);
+}
+
+long fertp_hist_percentile(const unsigned *hist, double fraction)
+{
+  unsigned long total = 0, seen = 0;
+  for (int i = 0; i < FERTP_HIST_BUCKETS; i++)
+    total += hist[i];
+  if (total == 0)
+    return -1;
+  for (int i = 0; i < FERTP_HIST_BUCKETS - 1; i++) {
+    seen += hist[i];
+    if (seen >= fraction * total)
+      return fertp_hist_value(i + 1) - 1;
+  }
+  return fertp_hist_value(FERTP_HIST_BUCKETS - 1);
+}
+
+static long ns_since(const struct timespec *then, const struct timespec *now)
+{
+  return (now->tv_sec - then->tv_sec) * 1000000000L
+    + (now->tv_nsec - then->tv_nsec);
+}
+
+/**
+ * Account for a frame sent from t0 to t1
+ *
+ * A handful of additions per frame; the clock is read via the vDSO.
+ */
+static void fertp_account(struct fertp_session *rtp, unsigned ts,
+			  ssize_t nticks, const struct timespec *t0,
+			  const struct timespec *t1, const struct timespec *when)
+{
+  struct fertp_stats *st = &rtp->stats;
+  long frame_ns = nticks * 1000000000L / rtp->clock_rate;
+  st->frames++;
+  st->send_ns += ns_since(t0, t1);
+  if (when != NULL) {
+    long late = ns_since(when, t0);
+    if (late > FERTP_LATE_NS)
+      st->late++;
+    st->lateness[fertp_hist_bucket(late > 0 ? late / 1000 : 0)]++;
+  }
+  if (rtp->pacing) {
+    long interval = ns_since(&rtp->last_sent, t0);
+    st->interval[fertp_hist_bucket(interval / 1000)]++;
+    // The last frame of a file may be short
+    long period = frame_ns > rtp->last_frame_ns ? frame_ns : rtp->last_frame_ns;
+    if (interval > period * 3 / 2)
+      st->skipped += (interval + period / 2) / period - 1;
+    long long played = (long long)(int)(ts - rtp->drift_ts0) * 1000000000LL
+      / rtp->clock_rate;
+    st->drift_ns = ns_since(&rtp->drift_t0, t0) - played;
+    long abs_drift = st->drift_ns < 0 ? -st->drift_ns : st->drift_ns;
+    if (abs_drift > st->max_drift_ns)
+      st->max_drift_ns = abs_drift;
+  } else {
+    rtp->pacing = true;
+    rtp->drift_t0 = *t0;
+    rtp->drift_ts0 = ts;
+  }
+  rtp->last_sent = *t0;
+  rtp->last_frame_ns = frame_ns;
+}
+
+// ------------- Batched sending -----------------
+
+/**
+ * Build a packet of a batched session in the next free slot
+ *
+ * Nothing is allocated and the payload is copied once. The sequence
+ * number is oRTP's; oRTP has no call to count a packet it did not
+ * send, so its sender report counters (and the timestamp it reports
+ * with them) are updated here as its own send path would.
+ */
+static void batch_queue(struct fertp_session *rtp, int pt,
+			const unsigned char *buf, size_t nbytes,
+			unsigned ts, _Bool marker)
+{
+  RtpSession *session = rtp->session;
+  size_t len = RTP_FIXED_HEADER_SIZE + nbytes;
+  unsigned char *h = batch_slot(transport_of(rtp->local_port), len)->buf;
+  uint16_t seq = rtp_session_get_seq_number(session);
+  uint32_t ssrc = htonl(rtp_session_get_send_ssrc(session));
+  uint32_t nts = htonl(ts);
+  rtp_session_set_seq_number(session, seq + 1);
+  session->rtp.snd_last_ts = ts;
+  session->stats.packet_sent++;
+  session->stats.sent += len;
+
+  h[0] = 0x80; // Version 2, no padding, extension or CSRCs
+  h[1] = (marker ? 0x80 : 0) | pt;
+  h[2] = seq >> 8;
+  h[3] = seq & 0xff;
+  memcpy(h + 4, &nts, 4);
+  memcpy(h + 8, &ssrc, 4);
+  memcpy(h + RTP_FIXED_HEADER_SIZE, buf, nbytes);
+}
+
+void fertp_flush(void)
+{
+  if (nbatch == 0)
+    return;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < nbatch;) {
+    // Consecutive packets on the same socket (i.e. of one call, such
+    // as a telephone-event and a frame, or frames caught up on) go
+    // together
+    int fd = batch[i].fd, n = 1;
+    while (i + n < nbatch && batch[i + n].fd == fd)
+      n++;
+    int sent = n == 1 // Somewhat cheaper for one
+      ? (sendmsg(fd, &batch_msg[i].msg_hdr, MSG_DONTWAIT) >= 0 ? 1 : -1)
+      : sendmmsg(fd, batch_msg + i, n, MSG_DONTWAIT);
+    batch_stats.syscalls++;
+    if (sent > 0) {
+      batch_stats.packets += sent;
+      i += sent;
+    } else if (errno == EAGAIN || errno == ENOBUFS) {
+      batch_stats.dropped += n; // No room for the rest either
+      i += n;
+    } else {
+      batch_stats.dropped++; // Skip the one it failed on
+      i++;
+    }
+  }
+  nbatch = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  batch_stats.flushes++;
+  batch_stats.flush_ns += ns_since(&t0, &t1);
+}
+
+void fertp_batch_get_stats(struct fertp_batch_stats *stats)
+{
+  *stats = batch_stats;
+}
+
+// ------------- Sending -----------------
+
+static void fertp_send_frame(struct fertp_session *rtp,
+			     const unsigned char *buf, ssize_t nbytes,
+			     unsigned ts, ssize_t nticks,
+			     const struct timespec *when)
+{
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (rtp->mark || (rtp->batched && nbytes <= FERTP_MAX_PAYLOAD))
+    fertp_send_pt(rtp, rtp->payload_type, buf, nbytes, ts, rtp->mark);
+  else
+    rtp_session_send_with_ts(rtp->session, buf, nbytes, ts);
+  rtp->mark = false;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  fertp_account(rtp, ts, nticks, &t0, &t1, when);
+}
+
+void fertp_send(struct fertp_session *rtp,
+		const unsigned char *buf, ssize_t nbytes, ssize_t nticks)
+{
+  fertp_send_frame(rtp, buf, nbytes, rtp->user_ts, nticks, NULL);
+  rtp->user_ts += nticks;
+}
+
+unsigned fertp_timestamp(struct fertp_session *rtp, const struct timespec *when)
+{
+  if (!rtp->clocked || when == NULL)
+    return rtp->user_ts;
+  if (!rtp->epoch_set) {
+    rtp->epoch = *when;
+    rtp->epoch_set = true;
+  }
+  long long ns = (when->tv_sec - rtp->epoch.tv_sec) * 1000000000LL
+    + (when->tv_nsec - rtp->epoch.tv_nsec);
+  // Round to the nearest sample; unsigned wrap-around is intended
+  return rtp->user_ts
+    + (unsigned)((ns * rtp->clock_rate + 500000000) / 1000000000);
+}
+
+void fertp_skip(struct fertp_session *rtp, ssize_t nticks)
+{
+  rtp->pacing = false; // Not a gap in the audio
+  if (!rtp->clocked)
+    rtp->user_ts += nticks;
+}
+
+void fertp_mark(struct fertp_session *rtp)
+{
+  rtp->mark = true;
+}
+
+void fertp_send_at(struct fertp_session *rtp,
+		   const unsigned char *buf, ssize_t nbytes,
+		   ssize_t nticks, const struct timespec *when)
+{
+  if (!rtp->clocked) {
+    fertp_send_frame(rtp, buf, nbytes, rtp->user_ts, nticks, when);
+    rtp->user_ts += nticks;
+    return;
+  }
+  fertp_send_frame(rtp, buf, nbytes, fertp_timestamp(rtp, when), nticks, when);
+}
+
+void fertp_send_pt(struct fertp_session *rtp, int pt,
+		   const unsigned char *buf, size_t nbytes,
+		   unsigned ts, _Bool marker)
+{
+  if (rtp->batched && nbytes <= FERTP_MAX_PAYLOAD
+      && transport_of(rtp->local_port)->to_known) {
+    batch_queue(rtp, pt, buf, nbytes, ts, marker);
+    return;
+  }
+  mblk_t *mp = rtp_session_create_packet(rtp->session, RTP_FIXED_HEADER_SIZE,
+					 buf, nbytes);
+  if (mp == NULL)
+    return;
+  rtp_set_payload_type(mp, pt);
+  rtp_set_markbit(mp, marker);
+  rtp_session_sendm_with_ts(rtp->session, mp, ts); // Via transport_sendto()
+}
+
+int fertp_fd(const struct fertp_session *rtp)
+{
+  if (rtp->bound == NULL)
+    return -1;
+  return rtp_session_get_rtp_socket(rtp->bound);
+}
+
+int fertp_recv(struct fertp_session *rtp, struct fertp_packet *pkt)
+{
+  if (rtp->rx != NULL) {
+    freemsg(rtp->rx);
+    rtp->rx = NULL;
+  }
+  if (rtp->session == NULL)
+    return 0;
+  // Non-blocking and without jitter buffer, the timestamp is only
+  // used for oRTP's statistics
+  mblk_t *mp = rtp_session_recvm_with_ts(rtp->session, rtp->recv_ts);
+  if (mp == NULL)
+    return 0;
+  unsigned char *payload;
+  int len = rtp_get_payload(mp, &payload);
+  pkt->payload = payload;
+  pkt->len = len > 0 ? len : 0;
+  pkt->pt = rtp_get_payload_type(mp);
+  pkt->marker = rtp_get_markbit(mp);
+  pkt->seq = rtp_get_seqnumber(mp);
+  pkt->ts = rtp_get_timestamp(mp);
+  struct fertp_arrival *a = &transport_of(rtp->local_port)
+    ->arrival[pkt->seq & (ARRIVALS - 1)];
+  if (a->set && a->seq == pkt->seq) {
+    pkt->arrival = a->at;
+    a->set = false;
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &pkt->arrival); // Read too far ahead
+  }
+  rtp->recv_ts = pkt->ts;
+  rtp->rx = mp;
+  return 1;
+}
+
+void fertp_stop(struct fertp_session *rtp)
+{
+  if (rtp->rx != NULL) {
+    freemsg(rtp->rx);
+    rtp->rx = NULL;
+  }
+  if (rtp->batched) {
+    fertp_flush(); // Its packets still refer to the socket
+    rtp->batched = false;
+  }
+  if (rtp->bound != NULL)
+    transport_of(rtp->local_port)->rtp = NULL;
+  RtpSession *session = rtp->bound;
+  rtp->session = rtp->bound = NULL;
+  if (session != NULL) {
+    if (rtp->profile != NULL)
+      rtp_session_set_profile(session, &av_profile);
+    pthread_mutex_lock(&port_lock);
+    if (!rtp->scheduled) {
+      // Back to the pool, as good as new
+      rtp_session_reset(session);
+      rtp_session_set_ssrc(session, ortp_random());
+      pool[npool].session = session;
+      pool[npool].port = rtp->local_port;
+      npool++;
+    } else {
+      // oRTP's scheduler does not let go of it
+      session_destroy(session);
+      port_give(rtp->local_port);
+    }
+    pthread_mutex_unlock(&port_lock);
+    rtp->scheduled = false;
+  }
+  if (rtp->profile != NULL) {
+    rtp_profile_destroy(rtp->profile); // Also frees our payload type
+    rtp->profile = NULL;
+  }
 }
@@ -1,15 +1,324 @@
 #include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
 #include <ortp/payloadtype.h>
+
+#define FERTP_PORT_MIN 5070 // Default local RTP port range (RTP+RTCP pairs)
+#define FERTP_PORT_MAX 5199
+
+#define FERTP_LATE_NS 2000000 // Frames sent later than this after due are late
+#define FERTP_HIST_SHIFT 3 // 8 sub-buckets per power of two (±6%)
+#define FERTP_HIST_BUCKETS 176 // Intervals up to 2^24 µs (16 s)
+#define FERTP_BATCH 256 // Packets sent by one sendmmsg() at most
+#define FERTP_MAX_PAYLOAD 1024 // Larger packets are sent by oRTP right away
+
+struct _RtpSession;
+struct msgb;
+
+/**
+ * Send-path telemetry of a session, since fertp_start()
+ *
+ * Updated by the sender only, without locks or atomics: copy it from
+ * the thread sending (or while it cannot send, e.g. media_lock held).
+ */
+struct fertp_stats {
+  unsigned long frames;		// Audio frames sent
+  unsigned long late;		// Sent more than FERTP_LATE_NS after due
+  unsigned long skipped;	// Frame periods without a frame while playing
+  long drift_ns;		// Send time ahead (-) or behind (+) the RTP
+				// timestamp, relative to playback start
+  long max_drift_ns;		// Largest |drift_ns| seen
+  unsigned long suppressed;	// Silent frames not sent (DTX, by the caller)
+  unsigned long cn;		// Comfort noise updates sent (ditto)
+  unsigned long long encode_ns;	// Encoding the frames (added by the caller)
+  unsigned long long send_ns;	// Handing them to oRTP and the kernel
+				// (plus oRTP's pacing, unless clocked)
+  unsigned interval[FERTP_HIST_BUCKETS]; // Time between frames, in µs,
+				// log-linear (see fertp_hist_bucket())
+  unsigned lateness[FERTP_HIST_BUCKETS]; // Send time after due, in µs
+				// (fertp_send_at() only)
+};
+
+/**
+ * RTP state of a single call
+ *
+ * Treat as opaque, initialize to all zeroes.
+ */
+struct fertp_session {
+  struct _RtpSession *session;	// Started, NULL = not (yet)
+  struct _RtpSession *bound;	// Reserved by fertp_open()
+  int local_port;
+  _Bool scheduled;		// By oRTP, cannot be reused
+  int user_ts;
+  int clock_rate;
+  _Bool clocked;		// Paced by the caller, see fertp_set_clocked()
+  _Bool epoch_set;
+  struct timespec epoch;	// CLOCK_MONOTONIC time of user_ts
+  unsigned recv_ts;
+  struct msgb *rx;		// Packet last returned by fertp_recv()
+  RtpProfile *profile;		// Own profile for dynamic payload types
+  struct fertp_stats stats;
+  _Bool pacing;			// Frames sent back to back since last_sent
+  struct timespec last_sent;
+  long last_frame_ns;
+  struct timespec drift_t0;	// Reference for drift_ns
+  unsigned drift_ts0;
+  _Bool batched;		// Sent by fertp_flush(), see fertp_set_batched()
+  _Bool mark;			// Marker bit on the next frame
+  int payload_type;
+};
+
+/**
+ * Counters of RTP sending (see fertp_set_batched())
+ */
+struct fertp_batch_stats {
+  unsigned long packets;	// Handed to the kernel by fertp_flush()
+  unsigned long dropped;	// Refused by it (e.g. send buffer full)
+  unsigned long direct;		// Sent right away, not batched
+  unsigned long syscalls;	// System calls for all of them
+  unsigned long flushes;	// fertp_flush() calls with packets
+  unsigned long long flush_ns;	// Time spent in them
+};
+
+/**
+ * Histogram bucket of a value (HDR-style: exact below 8, then 8
+ * buckets per power of two)
+ *
+ * @param us		Microseconds
+ */
+int fertp_hist_bucket(unsigned long us);
+
+/**
+ * Smallest value falling into a histogram bucket
+ *
+ * @param bucket	0…FERTP_HIST_BUCKETS-1
+ */
+unsigned long fertp_hist_value(int bucket);
+
+/**
+ * Value below which the given fraction of a histogram lies
+ *
+ * Returns the upper end of the bucket (µs for struct fertp_stats),
+ * -1 if the histogram is empty
+ *
+ * @param hist		FERTP_HIST_BUCKETS counters, e.g. stats->interval
+ * @param fraction	E.g. 0.99 for the 99th percentile
+ */
+long fertp_hist_percentile(const unsigned *hist, double fraction);
+
+/**
+ * RTP timestamp of a frame due at the given time
+ *
+ * For clocked sessions derived from `when`, else the next timestamp
+ * fertp_send() would use (`when` may then be NULL).
+ *
+ * @param rtp		The per-call RTP state
+ * @param when		The frame's scheduled time (CLOCK_MONOTONIC)
+ */
+unsigned fertp_timestamp(struct fertp_session *rtp, const struct timespec *when);
+
+/**
+ * Advance the timestamp as if a frame had been sent
+ *
+ * Only needed for sessions that are not clocked.
+ *
+ * @param rtp		The per-call RTP state
+ * @param nticks	The RTP clock ticks the frame would have covered
+ */
+void fertp_skip(struct fertp_session *rtp, ssize_t nticks);
+
+/**
+ * Set the marker bit on the next frame sent
+ *
+ * E.g. on the first after frames were suppressed (RFC 3551 4.1).
+ *
+ * @param rtp		The per-call RTP state
+ */
+void fertp_mark(struct fertp_session *rtp);
+
+/**
+ * Send a packet with another payload type than the session's
+ * (e.g., an RFC 4733 telephone-event)
+ *
+ * @param rtp		The per-call RTP state
+ * @param pt		The payload type
+ * @param buf		The payload
+ * @param nbytes	Its length
+ * @param ts		The RTP timestamp
+ * @param marker	Set the marker bit?
+ */
+void fertp_send_pt(struct fertp_session *rtp, int pt,
+		   const unsigned char *buf, size_t nbytes,
+		   unsigned ts, _Bool marker);
+
+/**
+ * A received RTP packet (header fields in host byte order)
+ */
+struct fertp_packet {
+  const unsigned char *payload;
+  size_t len;
+  int pt;			// Payload type
+  _Bool marker;
+  unsigned short seq;
+  unsigned ts;
+  struct timespec arrival;	// When the kernel got it (CLOCK_MONOTONIC)
+};
+
+/**
+ * Let the caller pace sessions started afterwards
+ *
+ * Clocked sessions do not use oRTP's scheduler and never block;
+ * fertp_send_at() derives their timestamps from the send time.
+ *
+ * @param clocked	Whether new sessions are clocked
+ */
+void fertp_set_clocked(_Bool clocked);
+
+/**
+ * Send the frames of clocked sessions started afterwards in batches
+ *
+ * After the first packet of a call, which oRTP builds and sends as
+ * usual, their packets are built in place in a static queue: no
+ * allocation, one copy of the payload, oRTP's sequence numbers and
+ * sender report counters kept up to date. fertp_flush() sends them
+ * with one sendmmsg() per call, as each call has a socket of its own.
+ *
+ * So it saves a system call only where a call has several packets in
+ * a period: frames caught up on after a late tick, or a
+ * telephone-event along with a frame. With one frame per call and
+ * period, the normal case, there are still 50 system calls per second
+ * and call; what goes away is oRTP's allocation of every packet.
+ *
+ * @param batched	Whether new clocked sessions are batched
+ */
+void fertp_set_batched(_Bool batched);
+
+/**
+ * Send the packets of batched sessions queued so far
+ *
+ * Call once per frame period, from the thread that sends (or with the
+ * lock it holds while sending).
+ */
+void fertp_flush(void);
+
+/**
+ * Get the counters of the batched send path
+ *
+ * @param stats		Filled in (same rules as struct fertp_stats)
+ */
+void fertp_batch_get_stats(struct fertp_batch_stats *stats);
+
+/**
+ * Set the local ports RTP sessions use
+ *
+ * RTP goes to even ports, RTCP to the odd port above. Only possible
+ * while no session is open (idle pooled sessions are closed).
+ *
+ * Returns != 0 on error
+ *
+ * @param min		Lowest port (default FERTP_PORT_MIN)
+ * @param max		Highest port (default FERTP_PORT_MAX)
+ */
+int fertp_set_port_range(int min, int max);
+
+/**
+ * Create sessions ahead of time, bound and ready for fertp_open()
+ *
+ * Stopped sessions also return to this pool (unless they were paced
+ * by oRTP's scheduler, see fertp_set_clocked()), so calls do not
+ * create sockets while setting up.
+ *
+ * Returns the number of sessions added (less if out of ports)
+ *
+ * @param nsessions	How many
+ */
+int fertp_pool_prewarm(int nsessions);
+
+/**
+ * Close all idle sessions of the pool, e.g. before ortp_exit()
+ */
+void fertp_pool_drain(void);
+
 /**
- * Start an RTP session
+ * Reserve a session and its local port for a call
  *
+ * Takes a pooled session if available, else binds a new one to the
+ * oldest free port. Idempotent until fertp_stop().
+ *
+ * Returns the local RTP port, -1 if no port is free
+ *
+ * @param rtp		The per-call RTP state
+ */
+int fertp_open(struct fertp_session *rtp);
+
+/**
+ * Start an RTP session (opening it first if necessary)
+ *
+ * @param rtp		The per-call RTP state
  * @param host		The remote host's address
  * @param port		The remote host's port
  * @param format	The payload type
- * @param pt		For user-defined payload types (>=96), the description
+ * @param mime		The encoding name (e.g., "PCMA")
+ * @param clock_rate	The RTP clock rate
+ */
+void fertp_start(struct fertp_session *rtp,
+		 const char *host, int port, int format,
+		 const char *mime, int clock_rate);
+void fertp_resume(struct fertp_session *rtp);
+
+/**
+ * Send an encoded frame with the session's payload type
+ *
+ * @param rtp		The per-call RTP state
+ * @param buf		The encoded frame
+ * @param nbytes	Its length
+ * @param nticks	The RTP clock ticks it covers
+ */
+void fertp_send(struct fertp_session *rtp,
+		const unsigned char *buf, ssize_t nbytes, ssize_t nticks);
+
+/**
+ * Send a frame scheduled for a given time
+ *
+ * For clocked sessions, the RTP timestamp is locked to `when`, so late
+ * wakeups or skipped frames do not make it drift from the wall clock.
+ * Other sessions behave as with fertp_send().
+ *
+ * @param rtp		The per-call RTP state
+ * @param buf		The encoded frame
+ * @param nbytes	Its length
+ * @param nticks	The RTP clock ticks it covers
+ * @param when		Its scheduled time (CLOCK_MONOTONIC)
+ */
+void fertp_send_at(struct fertp_session *rtp,
+		   const unsigned char *buf, ssize_t nbytes,
+		   ssize_t nticks, const struct timespec *when);
+
+/**
+ * The socket received RTP arrives on, for poll()/epoll
+ *
+ * Returns -1 if no session is open.
+ *
+ * @param rtp		The per-call RTP state
+ */
+int fertp_fd(const struct fertp_session *rtp);
+
+/**
+ * Get the next received packet, in order of arrival (non-blocking)
+ *
+ * Returns 0 if there is none. The payload points into oRTP's buffer
+ * (no copy) and stays valid until the next fertp_recv()/fertp_stop().
+ * Its arrival is the kernel's receive timestamp, not when it was read:
+ * all packets waiting are read at once.
+ *
+ * @param rtp		The per-call RTP state
+ * @param pkt		Filled in with the packet
  */
-void fertp_start(const char *host, int port, int format, PayloadType *pt);
-void fertp_resume(void);
-void fertp_send_alaw(const unsigned char *buf, ssize_t nbytes, ssize_t nsamples);
-void fertp_stop(void);
+int fertp_recv(struct fertp_session *rtp, struct fertp_packet *pkt);
 
+/**
+ * Stop the session and give it (with its port) back to the pool
+ *
+ * @param rtp		The per-call RTP state
+ */
+void fertp_stop(struct fertp_session *rtp);
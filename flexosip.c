@@ -1,4 +1,4 @@
-#define _GNU_SOURCE // For strcasestr()
+#define _GNU_SOURCE // For strcasestr(), pthread_setaffinity_np()
 #include <string.h>
 #include "flexosip.h"
 #include <stdio.h>
@@ -10,24 +10,122 @@
 #include <stdbool.h>
 #include "flexosnd.h"
 #include "flexortp.h"
+#include "flexodtmf.h"
+#include "flexomix.h"
+#include "flexoresample.h"
+#include "flexowheel.h"
+#include "flexojitter.h"
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #define REGISTRATION_WAIT 15 // By when it should be successful
-#define REGISTRATION_TIMEOUT 1800 // How often to refresh
-#define RTP_PORT 5070 // Default port number
-
-//#define TRY_PCMA16000
+#define REGISTRATION_TIMEOUT 1800 // Registration time asked for by default
+#define REGISTER_IN_FLIGHT 16 // REGISTER transactions outstanding at once
+#define REGISTER_TIMEOUT 40 // Give up on one (s); eXosip's own is 32 s
+#define REGISTER_BACKOFF_BASE 30UL // Retry after failures (s), RFC 5626 4.5
+#define REGISTER_BACKOFF_MAX 1800UL
+#define FRAME_NS 20000000L // 20 ms between audio frames
+#define MEDIA_MAX_LATE 3 // Frames to catch up on before skipping ahead
+#define DTMF_PT 101 // Our telephone-event payload type
+#define DTMF_QUEUE 32 // Digits waiting to be sent
+#define DTMF_TONE_TICKS 5 // 100 ms per digit
+#define DTMF_GAP_TICKS 3 // 60 ms between digits
+#define DTMF_END_REPEAT 3 // End packets are sent thrice (RFC 4733 2.5.1.4)
+#define DTMF_VOLUME 10 // -10 dBm0
+#define CN_PT 13 // Comfort noise payload type at 8000 Hz (RFC 3389)
+#define CN_WIDE_PT 103 // Ours at 16000 Hz
+#define DTX_LEVEL 55 // Frames at -55 dBov or below are silence
+#define DTX_HANGOVER 5 // Silent frames still sent (100 ms)
+#define DTX_LEVEL_STEP 6 // Level change (dB) sending another CN packet
+#define SDP_MAX 4096 // Bytes in our SDP
+#define SDP_ANSWERS 8 // Answer templates kept (codec and payload types)
+#define IDLE_NS 5000000000L // eXosip_automatic_action() when nothing else happens
+#define REACTOR_EVENTS 32 // Ready descriptors handled per epoll_wait()
+#define CONF_BUFFER (3*FESND_MAX_SAMPLES) // Conference audio held per party
 
 #define SIP_RINGING 180
 #define SIP_BUSY 486
 
 static struct eXosip_t *ctx;
-static int cid = -1, did = -1, tid = -1;
 static int quit_registered;
-static int rtp_port=RTP_PORT;
-static _Bool call_in_progress = false;
 static _Bool clean_up_please = false;
 
+// Media state (live[], each call's queue and RTP session) is shared
+// with the media thread. Lock order: eXosip_lock() before media_lock.
+// Recursive, as event handlers called with it held may fesip_play().
+static pthread_mutex_t media_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static pthread_t media_thread;
+static volatile _Bool media_running;
+static struct fesip_media_stats media_stats;
+static _Bool inband_dtmf = true;
+static _Bool dtx = true;		// Offer comfort noise, see fesip_set_dtx()
+// Codecs we accept, most preferred first (see fesip_set_codecs())
+static enum fesnd_format codec_prefs[FESND_NFORMATS] = {
+  FESND_PCMA8000, FESND_PCMU8000, FESND_G722
+};
+static int ncodec_prefs = 3;
+// Reactor (see fesip_run()): all descriptors in one epoll set
+static int reactor_fd = -1, timer_fd = -1, wake_fd = -1;
+enum { // epoll tags besides the call slots
+  POLL_SIP = FESIP_MAX_CALLS,
+  POLL_TIMER,
+  POLL_WAKE,
+  POLL_ADDR,				// addr_fd
+};
+static _Bool timer_media;		// Timer runs at the frame rate
+static struct timespec timer_next;	// When the next frame is due then
+static volatile _Bool run_stop;
+static volatile sig_atomic_t stats_please; // Dump on the next occasion
+// Events handed out by the last fesip_wait_events()
+static eXosip_event_t *batch[FESIP_EVENT_BATCH];
+static int nbatch;
+static struct fesip_event_stats event_stats;
+// Worker thread mode (see fesip_async_start())
+// Read by the workers, hence atomic; async_fd stays open while they
+// may use it and is only replaced by the next fesip_async_start()
+static atomic_bool async_on;
+static atomic_int async_commanding;	// Workers in fesip_async_command()
+static int async_fd = -1;		// Counts the events in async_events
+static unsigned call_serial;		// Last one handed out
+static unsigned long media_ticks;	// Frame ticks so far
+static atomic_bool dtmf_pending;	// Some call's dtmf_rx is not empty
+static __thread _Bool in_audio_event;	// In fesip_event_audio()
+// Local address for SDP, probed again only after the kernel reports
+// a change (see fesip_addr_listen()); under eXosip_lock
+static char local_ip4[128];
+static _Bool addr_stale = true;
+static _Bool addr_tried;		// To open addr_fd
+static int addr_fd = -1;		// Netlink, else probed for every SDP
+static unsigned sdp_gen = 1;		// Of addresses and codec preferences
+
+static void fesip_terminate_all_nolock(void);
+static void fesip_reg_clear(void);
+struct fesip_call;
+static void fesip_poll_add(struct fesip_call *call);
+static void fesip_poll_del(struct fesip_call *call);
+static void fesip_media_wake(void);
+static int fesip_reactor_init(void);
+static int fesip_epoll_add(int fd, uint32_t tag);
+static void fesip_batch_free(void);
+static void fesip_async_close(void);
+static ssize_t fesip_mix_frame(struct fesip_call *call,
+			       const unsigned char **frame);
+static void fesip_conf_receive(struct fesip_call *call, const short *pcm,
+			       size_t n);
+static int fesip_member_set_rate(struct fesip_call *call);
+static void fesip_sdp_warm(void);
+
 struct eXosip_t *fesip_ctx(void)
 {
   if (ctx == NULL) {
@@ -41,8 +139,6 @@ struct eXosip_t *fesip_ctx(void)
 	eXosip_quit(ctx);
 	ctx = NULL;
       } else {
-	// Renew it on every initialization
-	cid = did = -1;
 	// register dealloc only once
 	if (!quit_registered) {
 	  atexit(fesip_quit);
@@ -56,12 +152,30 @@ struct eXosip_t *fesip_ctx(void)
 
 void fesip_quit(void)
 {
+  fesip_media_stop();
   if (ctx != NULL) {
-    fesip_terminate_nolock();
+    fesip_terminate_all_nolock();
     eXosip_quit(ctx);
+    fesip_reg_clear();
   }
+  fesip_batch_free();
+  fesip_async_close();
+  fesnd_prefetch_stop(); // The calls' queues are closed by now
   ctx = NULL;
-  cid = did = -1;
+  if (addr_fd >= 0) {
+    close(addr_fd);
+    addr_fd = -1;
+  }
+  addr_tried = false;
+  addr_stale = true;
+  if (reactor_fd >= 0) {
+    close(reactor_fd);
+    close(timer_fd);
+    close(wake_fd);
+    reactor_fd = timer_fd = wake_fd = -1;
+    fertp_set_clocked(false);
+  }
+  fertp_pool_drain();
   ortp_exit();
 }
 
@@ -78,74 +192,10 @@ int fesip_listen(int proto, int secure, int port)
     fprintf(stderr, "flexosip: Could not initialize transport layer\n");
     return -1;
   }
-  return 0;
-}
-
-int fesip_register(const char *url,
-		   const char *registrar,
-		   const char *login,
-		   const char *password)
-{
-  fesip_ctx();
-  osip_message_t *reg = NULL;
-  int rid;
-  int i;
-  eXosip_lock(ctx);
-  rid = eXosip_register_build_initial_register(ctx, url, registrar, NULL, REGISTRATION_TIMEOUT, &reg);
-  if (rid < 0) {
-    eXosip_unlock(ctx);
-    fprintf(stderr, "eXosip_register_build_initial_register() failed with %d\n", rid);
-    return rid;
-  }
-  // specifying the registrar here does not seem to work, as the
-  // registrar in eXosip_find_authentication_info() includes the double quotes
-  eXosip_add_authentication_info(ctx, login, login, password, NULL, NULL);
-
-  osip_message_set_supported(reg, "100rel");
-  osip_message_set_supported(reg, "path");
-  i = eXosip_register_send_register(ctx, rid, reg);
-  eXosip_unlock(ctx);
-  if (i < 0) {
-    fprintf(stderr, "eXosip_register_send_register() failed with %d\n", i);
-    return i;
-  } else {
-    return rid;
-  }
-}
-
-int fesip_wait_registered(void)
-{
-  int tries=1;
-  int timeout=REGISTRATION_WAIT;
-  eXosip_event_t *evt;
-  for (; timeout > 0; timeout--) {
-    evt = fesip_wait_event(1, 0);
-    if (evt != NULL) {
-      if (evt->type == EXOSIP_REGISTRATION_FAILURE) {
-	tries--;
-	if (tries < 0)
-	  return OSIP_NO_RIGHTS;
-      } else if (evt->type == EXOSIP_REGISTRATION_SUCCESS) {
-	return OSIP_SUCCESS;
-      }
-    }
-  }
-  return OSIP_TIMEOUT;
-}
-
-int fesip_unregister(int rid)
-{
-  fesip_ctx();
-  osip_message_t *reg = NULL;
-  int i;
-  eXosip_lock(ctx);
-  i = eXosip_register_build_register(ctx, rid, 0, &reg);
-  if (i < 0) {
-    eXosip_unlock(ctx);
-    return -1;
-  }
-  eXosip_register_send_register(ctx, rid, reg);
-  eXosip_unlock(ctx);
+  // Before any call, so all are paced by its timer; without it,
+  // fesip_handle_event() falls back to polling
+  fesip_reactor_init();
+  fesip_sdp_warm();
   return 0;
 }
 
@@ -224,451 +274,3095 @@ static const char *fesip_strevent(int event)
 }
 
 #define HOSTLEN 128
-static char remote_host[HOSTLEN];
-static int remote_port;
-static int payload_format;
-static int codec_samples;
-static char *codec_name;
-#ifdef TRY_PCMA16000
-// Use 96, but adapt to remote side (for beauty only)
-static int pcma16000_payload_format = 96;
-#endif
+#define DTMF_DIGITS "0123456789*#ABCD" // By RFC 4733 event code
+#define CID_BUCKETS (4*FESIP_MAX_CALLS) // Keeps probe sequences short
+#define RID_BUCKETS (2*FESIP_MAX_ACCOUNTS)
 
 /**
- * Get address of remote connection
+ * Per-call state
  *
- * (proto, addr) options:
- * - (---, NULL):        No entry
- * - ("other", "other"): Non-IP
- * - ("IP4", ip4addr):   IPv4 address
- * - ("IP6", ip6addr):   IPv6 address
- *
- * @param sdp		The SDP message to analyze
- * @param pos_media	Which media entry (-1=global)
- * @param pos		Which connection entry in the media
- * @param proto		Set to the proto to be used
+ * All calls live in one dense table, calls[]. Fields touched on every
+ * event or media tick come first.
  */
-static char *fesip_connection(sdp_message_t *sdp, int pos_media, int pos,
-	char **proto)
+struct fesip_call {
+  int cid, did, tid;		// eXosip identifiers, -1 = not (yet) known
+  int slot;			// Index into calls[]
+  int live_index;		// Index into live[]
+  unsigned serial;		// Tells reuses of the slot apart
+  _Bool in_use;
+  _Bool in_progress;		// Answered (in either direction)
+  _Bool is_playing;
+  _Bool polled;			// RTP socket is in the reactor's set
+  int payload_format;		// RTP payload type of the codec
+  const struct fesnd_codec *codec; // Negotiated, NULL = not yet
+  int dtmf_pt;			// Remote's telephone-event payload type, -1 = none
+  int cn_pt;			// Remote's comfort noise payload type, -1 = none
+  unsigned sdp_version;		// Of the next SDP we send (o= line)
+  int remote_port;
+  int local_port;		// Our RTP port
+  void *reference;		// Application reference
+  struct fertp_session rtp;
+  struct fesnd_queue queue;
+  struct fesnd_queue layer[FESIP_LAYERS - 1]; // Mixed over queue
+  int gain[FESIP_LAYERS];	// Of queue and layer[], FEMIX_UNITY = 1.0
+  struct fesip_member *member;	// Conference it is in, if any
+  // RFC 4733 telephone-events
+  char dtmf_tx[DTMF_QUEUE];	// Digits to send (FIFO)
+  int dtmf_head, dtmf_tail;
+  int dtmf_ticks;		// Into the digit being sent, 0 = none
+  unsigned dtmf_ts;		// Timestamp of the event being sent
+  unsigned char dtmf_event;
+  _Bool dtmf_rx_seen;
+  unsigned dtmf_rx_ts;		// Timestamp of the last event received
+  char dtmf_rx[DTMF_QUEUE];	// Received, for the event loop (FIFO)
+  int dtmf_rx_head, dtmf_rx_tail;
+  struct fedtmf inband;		// In-band DTMF detector
+  // RFC 3389 comfort noise
+  int silent_frames;		// In a row, up to DTX_HANGOVER + 1
+  int cn_level;			// Last sent, -1 = sending audio
+  struct fesnd_codec_state dec;	// Decoder of the received audio
+  struct timespec rx_due;	// When the next frame is played out of jitter
+  struct fejitter jitter;	// Received audio, see fesip_playout()
+  char remote_host[HOSTLEN];
+};
+
+static struct fesip_call calls[FESIP_MAX_CALLS];
+static struct fesip_call *live[FESIP_MAX_CALLS]; // Dense list of calls in use
+static int nlive;
+static int free_slots[FESIP_MAX_CALLS];
+static int nfree = -1; // -1: not yet initialized
+// Open addressing (linear probing) from cid to calls[] index + 1; 0 = empty
+static short cid_map[CID_BUCKETS];
+
+static void fesip_calls_init(void)
 {
-  char *net;
-  if ((net = sdp_message_c_nettype_get(sdp, pos_media, pos)) == NULL
-   && pos_media >= 0 && pos == 0) {
-    // No per-media connection at all, revert to global connection
-    // for the first media connection
-    return fesip_connection(sdp, -1, 0, proto);
-  }
-  // Non-IP: proto, addr = "other"
-  if (strcmp(net, "IN") != 0) {
-    *proto = "other";
-    return *proto;
+  for (int i = 0; i < FESIP_MAX_CALLS; i++) {
+    calls[i].slot = i;
+    free_slots[i] = FESIP_MAX_CALLS - 1 - i; // Hand out low slots first
   }
-  // "IP4" or "IP6"
-  *proto = sdp_message_c_addrtype_get(sdp, pos_media, pos);
-  return sdp_message_c_addr_get(sdp, pos_media, pos);
+  nfree = FESIP_MAX_CALLS;
+  nlive = 0;
+  memset(cid_map, 0, sizeof(cid_map));
 }
 
 /**
- * Find a rtpmap entry with the requested codec and return
- * its RTP payload type.
- * 
- * Returns -1 if none found.
- * 
- * @param sdp		The SDP message to analyze
- * @param pos_media	Which media entry to scan for this codec
- * @param codec		The codec to look for
+ * Allocate a call slot
+ *
+ * NULL if all FESIP_MAX_CALLS slots or all RTP ports are in use
  */
-static int fesip_has_format(sdp_message_t *sdp, int pos_media,
-      const char *codec)
+static struct fesip_call *fesip_call_alloc(void)
 {
-  int pos = 0;
-  char *field, *value;
-  int payload;
-  
-  while ((field = sdp_message_a_att_field_get(sdp, pos_media, pos)) != NULL) {
-    if (strcmp(field, "rtpmap") == 0) {
-      value = sdp_message_a_att_value_get(sdp, pos_media, pos);
-      // Look for "<payload-type-num> <codec-str>"
-      char *end;
-      payload = strtoul(value, &end, 10);
-      if (end != value // Number found
-       && *end == ' ') {
-	if (strcmp(end + 1, codec) == 0) {
-	  return payload;
-	}
-      }
-    }
-    pos++;
+  pthread_mutex_lock(&media_lock);
+  if (nfree < 0)
+    fesip_calls_init();
+  if (nfree == 0) {
+    pthread_mutex_unlock(&media_lock);
+    return NULL;
   }
-  return -1;
+  int slot = free_slots[--nfree];
+  struct fesip_call *call = &calls[slot];
+  memset(call, 0, sizeof(*call));
+  call->slot = slot;
+  call->serial = ++call_serial;
+  call->cid = call->did = call->tid = -1;
+  call->dtmf_pt = -1;
+  call->cn_pt = -1;
+  call->cn_level = -1;
+  for (int l = 0; l < FESIP_LAYERS; l++)
+    call->gain[l] = FEMIX_UNITY;
+  call->local_port = fertp_open(&call->rtp);
+  if (call->local_port < 0) {
+    free_slots[nfree++] = slot;
+    pthread_mutex_unlock(&media_lock);
+    return NULL;
+  }
+  call->in_use = true;
+  call->live_index = nlive;
+  live[nlive++] = call;
+  pthread_mutex_unlock(&media_lock);
+  return call;
 }
 
-int fesip_remote_params(osip_message_t *msg)
+/**
+ * Add an entry to an open addressing (linear probing) map
+ *
+ * @param map		Table index + 1 per bucket, 0 = empty
+ * @param buckets	Its size
+ * @param key		The eXosip id (>= 0)
+ * @param value		The entry's table index + 1
+ */
+static void fesip_map_put(short *map, int buckets, int key, int value)
 {
-  sdp_message_t *sdp = eXosip_get_sdp_info(msg);
-  int pos_media = 0;
-  const char *media;
-  
-  if (sdp == NULL)
-    return 0;
-
-  while ((media = sdp_message_m_media_get(sdp, pos_media)) != NULL) {
-    if (strcmp(media, "audio") == 0
-     && strcmp(sdp_message_m_proto_get(sdp, pos_media), "RTP/AVP") == 0) {
-      remote_port = atoi(sdp_message_m_port_get(sdp, pos_media));
-
-      // Look for an IPv4 address
-      int pos = 0;
-      char *addr, *proto;
-      remote_host[0] = '\0';
-      while ((addr = fesip_connection(sdp, pos_media, pos, &proto)) != NULL) {
-	if (strcmp(proto, "IP4") == 0 && strlen(addr) < HOSTLEN) {
-	  strncpy(remote_host, addr, HOSTLEN);
-	  break;
-	}
-	pos++;
-      }
-      if (remote_host[0] == '\0') {
-	return 0;
-      }
+  int h = key % buckets;
+  while (map[h] != 0)
+    h = (h + 1) % buckets;
+  map[h] = value;
+}
 
-      // Any supported codec?
-#ifdef TRY_PCMA16000
-      payload_format = fesip_has_format(sdp, pos_media, "PCMA/16000");
-      if (payload_format >= 0) {
-	codec_name = "PCMA/16000";
-	codec_samples = 320;
-	pcma16000_payload_format = payload_format;
-	return payload_format;
-      }
-#endif
-      payload_format = fesip_has_format(sdp, pos_media, "PCMA/8000");
-      if (payload_format >= 0) {
-	codec_name = "PCMA/8000";
-	codec_samples = 160;
-	return payload_format;
-      }
-      // XXX Hack, fall back to PCMA/8000, even if no rtpmap entry exists for it
-      // (Fritz!Boxes announce it in the m= header, but not in a=rtpmap:)
-      fprintf(stderr, "Falling back to unannounced PCMA/8000\n");
-      codec_name = "PCMA/8000";
-      codec_samples = 160;
-      payload_format = 8;
-      return payload_format;
+/**
+ * Remove an entry from an open addressing (linear probing) map
+ *
+ * @param map		Table index + 1 per bucket, 0 = empty
+ * @param buckets	Its size
+ * @param value		The entry's table index + 1
+ * @param key_of	The key of any table index + 1 in the map
+ */
+static void fesip_map_del(short *map, int buckets, int value,
+			  int (*key_of)(int value))
+{
+  int h = key_of(value) % buckets;
+  while (map[h] != value) {
+    if (map[h] == 0)
+      return; // Not mapped
+    h = (h + 1) % buckets;
+  }
+  // Backward-shift deletion, keeps the probe sequences intact
+  int j = h;
+  for (;;) {
+    map[h] = 0;
+    for (;;) {
+      j = (j + 1) % buckets;
+      if (map[j] == 0)
+	return;
+      int home = key_of(map[j]) % buckets;
+      // Entry j may fill the hole at h only if its home is not in (h, j]
+      if (h <= j ? (home <= h || home > j) : (home <= h && home > j))
+	break;
     }
-    pos_media++;
+    map[h] = map[j];
+    h = j;
   }
-  return 0;
 }
 
-static _Bool is_playing = false;
-
-void fesip_play_after_delay(int delay, const char *filename)
+/**
+ * Make the call findable by its eXosip call id
+ */
+static void fesip_call_map(struct fesip_call *call, int cid)
 {
-  fesnd_add_after_delay(delay, filename);
-  if (!is_playing) {
-    is_playing = true;
-    fertp_resume();
-  }
+  call->cid = cid;
+  fesip_map_put(cid_map, CID_BUCKETS, cid, call->slot + 1);
 }
 
-void fesip_play(const char *filename)
+static int fesip_call_key(int value)
 {
-  fesip_play_after_delay(0, filename);
+  return calls[value - 1].cid;
 }
 
-static void fesip_build_sdp(osip_message_t *invite)
+static void fesip_call_unmap(struct fesip_call *call)
 {
-  char tmp[4096];
-  char lenstr[100];
-  char localip4[128], localip6[128];
-  eXosip_guess_localip(ctx, AF_INET, localip4, 128);
-  eXosip_guess_localip(ctx, AF_INET6, localip6, 128);
-  snprintf(tmp, sizeof(tmp),
-	    "v=0\r\n"
-	    "o=cowbell 0 0 IN IP4 %s\r\n"
-	    "s=call\r\n"
-	    "c=IN IP4 %s\r\n"
-	    "t=0 0\r\n"
-#ifdef TRY_PCMA16000
-	    "m=audio %d RTP/AVP 8 %d\r\n"
-#else
-	    "m=audio %d RTP/AVP 8\r\n"
-#endif
-	    "a=rtpmap:8 PCMA/8000\r\n"
-#ifdef TRY_PCMA16000
-	    "a=rtpmap:%d PCMA/16000\r\n"
-#endif
-	    ,
-	    localip4, //localip6,
-	    localip4, //localip6,
-	    rtp_port
-#ifdef TRY_PCMA16000
-	    ,
-	    pcma16000_payload_format,
-	    pcma16000_payload_format
-#endif
-	    );
-  osip_message_set_body(invite, tmp, strlen(tmp));
-  snprintf(lenstr, sizeof(lenstr), "%zd", strlen(tmp));
-  osip_message_set_content_length(invite, lenstr);
-  osip_message_set_content_type(invite, "application/sdp");
+  fesip_map_del(cid_map, CID_BUCKETS, call->slot + 1, fesip_call_key);
 }
 
-void fesip_answer(void)
+static void fesip_call_release(struct fesip_call *call)
 {
-  extern PayloadType payload_type_pcma16000;
-  int i;
-  osip_message_t *answer = NULL;
-  fesip_ctx();
-  eXosip_lock(ctx);
-
-  i = eXosip_call_build_answer(ctx, tid, 200, &answer);
-  if (i != 0) {
-    eXosip_call_send_answer(ctx, tid, 400, NULL);
-  } else {
-    fesip_build_sdp(answer);
-    eXosip_call_send_answer(ctx, tid, 200, answer);
-  }
-  // if the format is dynamic, the payload type will always be PCMA/16000
-  // (as long as we just support PCMA/8000 and PCMA/16000)
-  fertp_start(remote_host, remote_port, payload_format, &payload_type_pcma16000);
-  eXosip_unlock(ctx);
+  if (!call->in_use)
+    return;
+  pthread_mutex_lock(&media_lock);
+  fesip_poll_del(call);
+  fertp_stop(&call->rtp);
+  fesnd_close(&call->queue);
+  for (int l = 0; l < FESIP_LAYERS - 1; l++)
+    fesnd_close(&call->layer[l]);
+  fesip_conf_leave(call);
+  if (call->cid >= 0)
+    fesip_call_unmap(call);
+  // Swap-remove from the dense list
+  struct fesip_call *last = live[--nlive];
+  live[call->live_index] = last;
+  last->live_index = call->live_index;
+  call->in_use = false;
+  free_slots[nfree++] = call->slot;
+  pthread_mutex_unlock(&media_lock);
 }
 
-eXosip_event_t *fesip_wait_event(int seconds, int milliseconds)
+fesip_call_t *fesip_find_call(int cid)
 {
-  fesip_ctx();
-  eXosip_event_t *evt = eXosip_event_wait(ctx, seconds, milliseconds);
-  if (clean_up_please) {
-    fprintf(stderr, "Cleaning up...\n");
-    fesip_terminate();
-    fesip_quit();
-    exit(0);
-  }
-  eXosip_lock(ctx);
-  eXosip_automatic_action(ctx);
-  if (evt != NULL) {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wswitch" // We do not handle all enumerations
-    switch (evt->type)
-    {
-    case EXOSIP_CALL_INVITE:
-      if (call_in_progress) {
-	// Already an existing call: Terminate incoming call and drop the event
-	eXosip_call_send_answer(ctx, evt->tid, SIP_BUSY, NULL);
-	evt = NULL;
-      } else {
-	if (fesip_remote_params(evt->request)) {
-	  tid = evt->tid; // For fesip_answer()
-	  int code = fesip_event_invite(evt, remote_host, remote_port, payload_format);
-	  // Should be SIP_RINGING or SIP_BUSY_HERE
-	  // Returning SIP_OK directly will cause problems
-	  eXosip_call_send_answer(ctx, evt->tid, code, NULL);
-	} else {
-	  eXosip_call_send_answer(ctx, evt->tid, SIP_NOT_ACCEPTABLE_HERE, NULL);
-	}
-      }
-      break;
-    case EXOSIP_CALL_ANSWERED:
-      if (fesip_remote_params(evt->response)) {
-	fprintf(stderr, "Call answered with req=%p, resp=%p, ack=%p!\n",
-		evt->request, evt->response, evt->ack);
-	eXosip_call_build_ack(ctx, evt->did, &evt->ack);
-	eXosip_call_send_ack(ctx, evt->did, evt->ack);
-	did = evt->did;
-	cid = evt->cid;
-	call_in_progress = true;
-	fesip_event_answered(evt, remote_host, remote_port, payload_format);
-      }
-      break;
-    case EXOSIP_CALL_NOANSWER:
-    case EXOSIP_CALL_REQUESTFAILURE: // Error in the request
-    case EXOSIP_CALL_GLOBALFAILURE: // Also when BUSYing the call
-    case EXOSIP_CALL_CANCELLED:
-    case EXOSIP_CALL_CLOSED:
-    case EXOSIP_CALL_RELEASED:
-      fprintf(stderr, "Closing request %s\n", fesip_strevent(evt->type));
-      if (call_in_progress &&
-          !(evt->type == EXOSIP_CALL_REQUESTFAILURE
-	    && evt->response->status_code == SIP_UNAUTHORIZED)) {
-	// Probably too eager
-	if (evt->response != NULL) {
-	  fprintf(stderr, "Terminating call because of response %s (%d)\n",
-		  fesip_strevent(evt->type), evt->response->status_code);
-	} else if (evt->request != NULL) {
-	  fprintf(stderr, "Terminating call because of request %s (%d)\n",
-		  fesip_strevent(evt->type), evt->request->status_code);
-	} else {
-	  // Should never happen…
-	  fprintf(stderr, "Terminating call because of unexpected %s\n",
-		  fesip_strevent(evt->type));
-	}
-	fesip_event_terminate(evt);
-	fesip_terminate_nolock();
-      }
-      break;
-    case EXOSIP_CALL_MESSAGE_NEW:
-      if (strcasecmp(evt->request->sip_method, "INFO") == 0 &&
-	  strcmp(evt->request->content_type->type, "application") == 0 &&
-	  strcmp(evt->request->content_type->subtype, "dtmf-relay") == 0) {
-	osip_list_iterator_t it;
-        osip_body_t *body = (osip_body_t *)osip_list_get_first(&evt->request->bodies, &it);
-	char *match = strcasestr(body->body, "Signal=");
-	if (match != NULL && match[7] != '\0') {
-	  fesip_event_dtmf(match[7]);
-	}
-	eXosip_call_build_ack(ctx, evt->did, &evt->ack);
-	eXosip_call_send_ack(ctx, evt->did, evt->ack);
-      }
-      break;
-    default:
-      fprintf(stderr, "Received event %s\n", fesip_strevent(evt->type));
-      break;
-    }
-#pragma GCC diagnostic pop
+  if (cid < 0 || nfree < 0)
+    return NULL;
+  for (int h = cid % CID_BUCKETS; cid_map[h] != 0; h = (h + 1) % CID_BUCKETS) {
+    struct fesip_call *call = &calls[cid_map[h] - 1];
+    if (call->cid == cid)
+      return call;
   }
-  eXosip_unlock(ctx);
-  return evt;
+  return NULL;
 }
 
-eXosip_event_t *fesip_handle_event(void)
+int fesip_call_id(const fesip_call_t *call)
 {
-  eXosip_event_t *evt = fesip_wait_event(0, 10); // Shorter than 20ms inter-packet time
-  if (is_playing) {
-    short buf[ALAW16K_BUF20MS];
-    assert(codec_samples <= ALAW16K_BUF20MS);
-    ssize_t nsamples = fesnd_read(buf, ALAW16K_BUF20MS);
-    if (nsamples > 0) {
-      unsigned char alawbuf[ALAW16K_BUF20MS];
-      if (codec_samples != ALAW16K_BUF20MS) {
-	// Need to downsample
-	fesnd_encode_alaw(alawbuf, buf, nsamples, true);
-	fertp_send_alaw(alawbuf, nsamples/2, nsamples/2);
-      } else {
-	fesnd_encode_alaw(alawbuf, buf, nsamples, false);
-	fertp_send_alaw(alawbuf, nsamples, nsamples);
-      }
-    } else {
-      is_playing = false;
-    }
-  }
-  return evt;
+  return call->cid;
 }
 
-int fesip_call(const char *from, const char *to, const char *subject,
-	       void *reference)
+void *fesip_call_reference(const fesip_call_t *call)
 {
-  osip_message_t *invite;
-  int i;
-
-  fesip_ctx();
-  // Already a call in progress?
-  eXosip_lock(ctx);
-  if (did >= 0 || cid >= 0 || call_in_progress) {
-    OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_ERROR, NULL,
-			  "fesip_call() while call is already active\r\n"));
-    eXosip_unlock(ctx);
-    return OSIP_TOOMUCHCALL;
-  }
-  i = eXosip_call_build_initial_invite(ctx, &invite, to, from,
-				       NULL, // optional route header
-				       subject);
-  if (i != 0) {
-    return -1;
-  }
-  osip_message_set_supported(invite, "100rel");
-
-  cid = eXosip_call_send_initial_invite(ctx, invite);
-  if (cid > 0) {
-    eXosip_call_set_reference(ctx, cid, reference);
-    call_in_progress = true;
-  }
-  eXosip_unlock(ctx);
-  return cid;
+  return call->reference;
 }
 
-int fesip_ringback(eXosip_event_t *evt)
+void fesip_call_set_reference(fesip_call_t *call, void *reference)
 {
-  fesip_ctx();
-  eXosip_lock(ctx);
-  eXosip_call_send_answer(ctx, evt->tid, SIP_RINGING, NULL);
-  eXosip_unlock(ctx);
-  return 0;
+  call->reference = reference;
 }
 
-int fesip_terminate(void)
+int fesip_calls_active(void)
 {
-  fesip_ctx();
-  eXosip_lock(ctx);
-  fesip_terminate_nolock();
-  eXosip_unlock(ctx);
-  return 0;
+  return nlive;
 }
 
-void fesip_terminate_nolock(void)
+// ------------- Registrations -----------------
+//
+// Accounts are registered, refreshed and retried from here, under
+// eXosip_lock(). What is due next for each (refresh, retry, or giving
+// up on a transaction) is a timer on a wheel ticking in seconds,
+// advanced with every batch of events (i.e. at least every IDLE_NS).
+// A due account joins reg_queue, and REGISTERs go out from there
+// while fewer than reg_limit are outstanding.
+
+struct fesip_account {
+  struct fewheel_timer timer;	// First, see fesip_reg_due()
+  struct fesip_account *next;	// In reg_queue
+  int rid;			// eXosip's registration id
+  int slot;			// Index into accounts[]
+  enum fesip_reg_state state;
+  _Bool in_use;
+  _Bool challenged;		// Authenticating, eXosip resends
+  int expires;			// Asked for (s)
+  unsigned long until;		// Registered until (tick), 0 = never was
+  unsigned failures;		// In a row
+  osip_message_t *initial;	// Built, not yet sent
+  void *reference;		// Application reference
+};
+
+static struct fesip_account accounts[FESIP_MAX_ACCOUNTS];
+static int free_accounts[FESIP_MAX_ACCOUNTS];
+static int nfree_accounts = -1; // -1: not yet initialized
+static short rid_map[RID_BUCKETS]; // Like cid_map
+static struct fewheel reg_wheel;
+static struct fesip_account *reg_queue, **reg_queue_tail = &reg_queue;
+static int reg_limit = REGISTER_IN_FLIGHT;
+static struct fesip_register_stats reg_stats;
+static unsigned reg_seed;		// For the jitter
+
+/**
+ * Now, in registration timer ticks (seconds)
+ */
+static unsigned long fesip_reg_now(void)
 {
-  if (cid >= 0 || did >= 0) {
-    eXosip_call_terminate(ctx, cid, did);
-  }
-  call_in_progress = false;
-  cid = did = -1;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
 }
 
-void fesip_send_dtmf(char digit)
+static void fesip_accounts_init(void)
 {
-  fesip_ctx();
-  osip_message_t *info;
-  char dtmf_body[1000];
-  int i;
+  for (int i = 0; i < FESIP_MAX_ACCOUNTS; i++)
+    free_accounts[i] = FESIP_MAX_ACCOUNTS - 1 - i;
+  nfree_accounts = FESIP_MAX_ACCOUNTS;
+  memset(rid_map, 0, sizeof(rid_map));
+  fewheel_init(&reg_wheel, fesip_reg_now());
+  reg_seed = time(NULL) ^ getpid();
+}
 
-  if (did < 0) {
-    OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_ERROR, NULL,
-			  "No call to send DTMF digit\r\n"));
-  }
-  eXosip_lock(ctx);
-  i = eXosip_call_build_info(ctx, did, &info);
-  if (i == 0)
-  {
-     snprintf(dtmf_body, 999, "Signal=%c\r\nDuration=250\r\n", digit);
-     osip_message_set_content_type(info, "application/dtmf-relay");
-     osip_message_set_body(info, dtmf_body, strlen (dtmf_body));
-     i = eXosip_call_send_request(ctx, did, info);
+static struct fesip_account *fesip_find_account(int rid)
+{
+  if (rid < 0 || nfree_accounts < 0)
+    return NULL;
+  for (int h = rid % RID_BUCKETS; rid_map[h] != 0; h = (h + 1) % RID_BUCKETS) {
+    struct fesip_account *a = &accounts[rid_map[h] - 1];
+    if (a->rid == rid)
+      return a;
   }
-  eXosip_unlock(ctx);
+  return NULL;
 }
 
-void fesip_cleanup(int sig)
+static int fesip_account_key(int value)
 {
-  fprintf(stderr, "Received signal %d; repeat if we don't exit now...\n", sig);
-  signal(sig, SIG_DFL); // Next signal of the same type will kill the program ungracefully
-  clean_up_please = true;
+  return accounts[value - 1].rid;
 }
 
-// Weak methods, ready to be overridden
+/**
+ * Uniformly distributed in [lo, hi]
+ */
+static unsigned long fesip_reg_jitter(unsigned long lo, unsigned long hi)
+{
+  return lo + rand_r(&reg_seed) % (hi - lo + 1);
+}
 
-void __attribute__((weak)) fesip_event_answered(eXosip_event_t *UNUSED_PARAM(evt),
-    const char *UNUSED_PARAM(host), int UNUSED_PARAM(port), int UNUSED_PARAM(format))
+static void fesip_reg_enqueue(struct fesip_account *a)
 {
-  OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_INFO3, NULL,
-			"answered call\r\n"));
+  a->state = FESIP_REG_QUEUED;
+  a->next = NULL;
+  *reg_queue_tail = a;
+  reg_queue_tail = &a->next;
+  reg_stats.queued++;
 }
 
-int __attribute__((weak)) fesip_event_invite(eXosip_event_t *UNUSED_PARAM(evt),
-    const char *UNUSED_PARAM(host), int UNUSED_PARAM(port), int UNUSED_PARAM(format))
+static void fesip_reg_dequeue(struct fesip_account *a)
 {
-  OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_INFO3, NULL,
+  struct fesip_account **p = &reg_queue;
+  while (*p != a)
+    p = &(*p)->next;
+  *p = a->next;
+  if (reg_queue_tail == &a->next)
+    reg_queue_tail = p;
+  reg_stats.queued--;
+}
+
+/**
+ * The transaction is over, successful or not
+ */
+static void fesip_reg_done(struct fesip_account *a)
+{
+  reg_stats.in_flight--;
+  a->challenged = false;
+  fewheel_del(&reg_wheel, &a->timer);
+}
+
+/**
+ * Schedule the retry of a failed registration
+ *
+ * min(30 s · 2^failures, 30 min), of which 50–100% (RFC 5626 4.5)
+ */
+static void fesip_reg_failed(struct fesip_account *a, int status)
+{
+  unsigned long now = fesip_reg_now();
+  unsigned long wait = REGISTER_BACKOFF_MAX;
+  a->failures++;
+  if (a->failures < 8 && REGISTER_BACKOFF_BASE << a->failures < wait)
+    wait = REGISTER_BACKOFF_BASE << a->failures;
+  reg_stats.failures++;
+  a->state = FESIP_REG_BACKOFF;
+  fewheel_add(&reg_wheel, &a->timer, now + fesip_reg_jitter(wait / 2, wait));
+  fprintf(stderr, "flexosip: Registration %d failed (%d), retrying in up to %lus\n",
+	  a->rid, status, wait);
+  fesip_event_registration(a, FESIP_REG_BACKOFF, status);
+}
+
+/**
+ * Send the account's REGISTER (eXosip_lock held)
+ */
+static void fesip_reg_send(struct fesip_account *a)
+{
+  osip_message_t *reg = a->initial;
+  int i = 0;
+  if (reg == NULL)
+    i = eXosip_register_build_register(ctx, a->rid, a->expires, &reg);
+  a->initial = NULL;
+  if (i >= 0)
+    i = eXosip_register_send_register(ctx, a->rid, reg);
+  reg_stats.in_flight++;
+  if (i < 0) {
+    fprintf(stderr, "eXosip_register_send_register() failed with %d\n", i);
+    fesip_reg_done(a);
+    fesip_reg_failed(a, 0);
+    return;
+  }
+  reg_stats.sent++;
+  if (a->until > fesip_reg_now())
+    reg_stats.refreshes++;
+  a->state = FESIP_REG_SENT;
+  // In case eXosip never reports back
+  fewheel_add(&reg_wheel, &a->timer, fesip_reg_now() + REGISTER_TIMEOUT);
+}
+
+/**
+ * Send queued REGISTERs, as far as the limit allows (eXosip_lock held)
+ */
+static void fesip_reg_pump(void)
+{
+  while (reg_queue != NULL && reg_stats.in_flight < reg_limit) {
+    struct fesip_account *a = reg_queue;
+    fesip_reg_dequeue(a);
+    fesip_reg_send(a);
+  }
+}
+
+/**
+ * An account's timer fired: a refresh or retry is due, or its
+ * REGISTER went unanswered
+ */
+static void fesip_reg_due(struct fewheel_timer *timer, void *UNUSED_PARAM(arg))
+{
+  struct fesip_account *a = (struct fesip_account *)timer;
+  if (a->state == FESIP_REG_SENT) {
+    fesip_reg_done(a);
+    fesip_reg_failed(a, 0);
+  } else {
+    fesip_reg_enqueue(a);
+  }
+}
+
+/**
+ * Fire the timers due and send what is queued (eXosip_lock held)
+ */
+static void fesip_reg_tick(void)
+{
+  if (nfree_accounts < 0)
+    return;
+  fewheel_advance(&reg_wheel, fesip_reg_now(), fesip_reg_due, NULL);
+  fesip_reg_pump();
+}
+
+/**
+ * The registration time granted: Expires in the response, or that of
+ * the (first) Contact, or what we asked for
+ */
+static int fesip_reg_granted(osip_message_t *response, int expires)
+{
+  osip_header_t *header;
+  osip_contact_t *contact;
+  osip_generic_param_t *param;
+  const char *value = NULL;
+  if (osip_message_header_get_byname(response, "expires", 0, &header) >= 0)
+    value = header->hvalue;
+  else if (osip_message_get_contact(response, 0, &contact) >= 0
+	   && osip_contact_param_get_byname(contact, "expires", &param) >= 0)
+    value = param->gvalue;
+  int granted = value != NULL ? atoi(value) : 0;
+  return granted > 0 ? granted : expires;
+}
+
+/**
+ * Handle the outcome of a REGISTER (eXosip_lock held)
+ */
+static void fesip_reg_event(eXosip_event_t *evt)
+{
+  struct fesip_account *a = fesip_find_account(evt->rid);
+  if (a == NULL)
+    return; // Removed in the meantime, or not ours
+  int status = evt->response != NULL ? evt->response->status_code : 0;
+  osip_header_t *header;
+  if (evt->type == EXOSIP_REGISTRATION_FAILURE && a->state == FESIP_REG_SENT) {
+    if ((status == SIP_UNAUTHORIZED
+	 || status == SIP_PROXY_AUTHENTICATION_REQUIRED) && !a->challenged) {
+      // Normal: the first REGISTER goes out without credentials.
+      // eXosip resends it with them; do not wait for the next batch.
+      a->challenged = true;
+      eXosip_automatic_action(ctx);
+      return;
+    }
+    if (status == SIP_INTERVAL_TOO_BRIEF
+	&& osip_message_header_get_byname(evt->response, "min-expires", 0,
+					  &header) >= 0
+	&& atoi(header->hvalue) > a->expires) {
+      // Ask again right away, for as long as the registrar wants
+      a->expires = atoi(header->hvalue);
+      fesip_reg_done(a);
+      fesip_reg_enqueue(a);
+      fesip_reg_pump();
+      return;
+    }
+  }
+  if (a->state == FESIP_REG_SENT)
+    fesip_reg_done(a);
+  else if (a->state != FESIP_REG_REGISTERED)
+    return; // Late, the transaction was given up on already
+  // Else eXosip refreshed by itself; take the outcome all the same
+  if (evt->type == EXOSIP_REGISTRATION_FAILURE) {
+    fesip_reg_failed(a, status);
+  } else {
+    unsigned long now = fesip_reg_now();
+    unsigned long granted = fesip_reg_granted(evt->response, a->expires);
+    a->until = now + granted;
+    a->failures = 0;
+    a->state = FESIP_REG_REGISTERED;
+    fewheel_add(&reg_wheel, &a->timer,
+		now + fesip_reg_jitter(granted / 2 + 1, granted * 4 / 5 + 1));
+    fesip_event_registration(a, FESIP_REG_REGISTERED, status);
+  }
+  fesip_reg_pump();
+}
+
+/**
+ * Forget all accounts, eXosip is going away (eXosip_lock not needed)
+ */
+static void fesip_reg_clear(void)
+{
+  for (int i = 0; i < FESIP_MAX_ACCOUNTS; i++)
+    if (accounts[i].initial != NULL)
+      osip_message_free(accounts[i].initial);
+  memset(accounts, 0, sizeof(accounts));
+  memset(&reg_stats, 0, sizeof(reg_stats));
+  reg_queue = NULL;
+  reg_queue_tail = &reg_queue;
+  nfree_accounts = -1;
+}
+
+fesip_account_t *fesip_account_add(const char *url, const char *registrar,
+				   const char *login, const char *password,
+				   int expires)
+{
+  if (fesip_ctx() == NULL)
+    return NULL;
+  if (expires <= 0)
+    expires = REGISTRATION_TIMEOUT;
+  eXosip_lock(ctx);
+  if (nfree_accounts < 0)
+    fesip_accounts_init();
+  if (nfree_accounts == 0) {
+    eXosip_unlock(ctx);
+    fprintf(stderr, "flexosip: All %d accounts in use\n", FESIP_MAX_ACCOUNTS);
+    return NULL;
+  }
+  osip_message_t *reg = NULL;
+  int rid = eXosip_register_build_initial_register(ctx, url, registrar, NULL,
+						   expires, &reg);
+  if (rid < 0) {
+    eXosip_unlock(ctx);
+    fprintf(stderr, "eXosip_register_build_initial_register() failed with %d\n", rid);
+    return NULL;
+  }
+  // specifying the registrar here does not seem to work, as the
+  // registrar in eXosip_find_authentication_info() includes the double quotes
+  eXosip_add_authentication_info(ctx, login, login, password, NULL, NULL);
+  osip_message_set_supported(reg, "100rel");
+  osip_message_set_supported(reg, "path");
+
+  int slot = free_accounts[--nfree_accounts];
+  struct fesip_account *a = &accounts[slot];
+  memset(a, 0, sizeof(*a));
+  a->slot = slot;
+  a->rid = rid;
+  a->expires = expires;
+  a->initial = reg;
+  a->in_use = true;
+  fesip_map_put(rid_map, RID_BUCKETS, rid, slot + 1);
+  reg_stats.accounts++;
+  fesip_reg_enqueue(a);
+  fesip_reg_pump();
+  eXosip_unlock(ctx);
+  return a;
+}
+
+void fesip_account_remove(fesip_account_t *a)
+{
+  eXosip_lock(ctx);
+  if (!a->in_use) {
+    eXosip_unlock(ctx);
+    return;
+  }
+  if (a->state == FESIP_REG_QUEUED)
+    fesip_reg_dequeue(a);
+  else if (a->state == FESIP_REG_SENT)
+    fesip_reg_done(a);
+  fewheel_del(&reg_wheel, &a->timer);
+  if (a->initial != NULL) {
+    osip_message_free(a->initial); // Never sent, nothing to undo
+  } else {
+    osip_message_t *reg = NULL;
+    if (eXosip_register_build_register(ctx, a->rid, 0, &reg) >= 0)
+      eXosip_register_send_register(ctx, a->rid, reg);
+  }
+  reg_stats.accounts--;
+  fesip_map_del(rid_map, RID_BUCKETS, a->slot + 1, fesip_account_key);
+  a->in_use = false;
+  free_accounts[nfree_accounts++] = a->slot;
+  fesip_reg_pump();
+  eXosip_unlock(ctx);
+}
+
+enum fesip_reg_state fesip_account_state(const fesip_account_t *a,
+					 int *expires)
+{
+  if (expires != NULL) {
+    unsigned long now = fesip_reg_now();
+    *expires = a->until > now ? (int)(a->until - now) : 0;
+  }
+  return a->state;
+}
+
+void *fesip_account_reference(const fesip_account_t *a)
+{
+  return a->reference;
+}
+
+void fesip_account_set_reference(fesip_account_t *a, void *reference)
+{
+  a->reference = reference;
+}
+
+void fesip_set_register_limit(int in_flight)
+{
+  if (fesip_ctx() == NULL)
+    return;
+  eXosip_lock(ctx);
+  reg_limit = in_flight > 0 ? in_flight : 1;
+  fesip_reg_tick();
+  eXosip_unlock(ctx);
+}
+
+void fesip_register_get_stats(struct fesip_register_stats *stats)
+{
+  if (ctx == NULL) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  unsigned long now = fesip_reg_now();
+  eXosip_lock(ctx);
+  *stats = reg_stats;
+  stats->registered = 0;
+  for (int i = 0; i < FESIP_MAX_ACCOUNTS; i++)
+    stats->registered += accounts[i].in_use && accounts[i].until > now;
+  eXosip_unlock(ctx);
+}
+
+int fesip_register(const char *url,
+		   const char *registrar,
+		   const char *login,
+		   const char *password)
+{
+  fesip_account_t *a = fesip_account_add(url, registrar, login, password,
+					  REGISTRATION_TIMEOUT);
+  return a != NULL ? a->rid : -1;
+}
+
+int fesip_unregister(int rid)
+{
+  fesip_ctx();
+  eXosip_lock(ctx);
+  struct fesip_account *a = fesip_find_account(rid);
+  eXosip_unlock(ctx);
+  if (a != NULL) {
+    fesip_account_remove(a);
+    return 0;
+  }
+  // Not one of ours (any more)
+  osip_message_t *reg = NULL;
+  eXosip_lock(ctx);
+  int i = eXosip_register_build_register(ctx, rid, 0, &reg);
+  if (i < 0) {
+    eXosip_unlock(ctx);
+    return -1;
+  }
+  eXosip_register_send_register(ctx, rid, reg);
+  eXosip_unlock(ctx);
+  return 0;
+}
+
+int fesip_wait_registered(void)
+{
+  eXosip_event_t *evts[FESIP_EVENT_BATCH];
+  for (int timeout = REGISTRATION_WAIT; timeout > 0; timeout--) {
+    fesip_wait_events(1, 0, evts, FESIP_EVENT_BATCH);
+    _Bool failed = false, waiting = false;
+    eXosip_lock(ctx);
+    for (int i = 0; i < FESIP_MAX_ACCOUNTS; i++) {
+      if (!accounts[i].in_use)
+	continue;
+      failed |= accounts[i].failures > 0;
+      waiting |= accounts[i].until == 0;
+    }
+    eXosip_unlock(ctx);
+    if (failed)
+      return OSIP_NO_RIGHTS;
+    if (!waiting)
+      return OSIP_SUCCESS;
+  }
+  return OSIP_TIMEOUT;
+}
+
+/**
+ * Get address of remote connection
+ *
+ * (proto, addr) options:
+ * - (---, NULL):        No entry
+ * - ("other", "other"): Non-IP
+ * - ("IP4", ip4addr):   IPv4 address
+ * - ("IP6", ip6addr):   IPv6 address
+ *
+ * @param sdp		The SDP message to analyze
+ * @param pos_media	Which media entry (-1=global)
+ * @param pos		Which connection entry in the media
+ * @param proto		Set to the proto to be used
+ */
+static char *fesip_connection(sdp_message_t *sdp, int pos_media, int pos,
+	char **proto)
+{
+  char *net;
+  if ((net = sdp_message_c_nettype_get(sdp, pos_media, pos)) == NULL
+   && pos_media >= 0 && pos == 0) {
+    // No per-media connection at all, revert to global connection
+    // for the first media connection
+    return fesip_connection(sdp, -1, 0, proto);
+  }
+  if (net == NULL) {
+    return NULL;
+  }
+  // Non-IP: proto, addr = "other"
+  if (strcmp(net, "IN") != 0) {
+    *proto = "other";
+    return *proto;
+  }
+  // "IP4" or "IP6"
+  *proto = sdp_message_c_addrtype_get(sdp, pos_media, pos);
+  return sdp_message_c_addr_get(sdp, pos_media, pos);
+}
+
+/**
+ * Find the RTP payload type the SDP uses for a codec
+ *
+ * Looks for an rtpmap entry with the codec's name and clock rate. A
+ * static payload type also counts if it is only listed in the m= line
+ * (Fritz!Boxes announce PCMA/8000 like that).
+ *
+ * Returns -1 if none found.
+ * 
+ * @param sdp		The SDP message to analyze
+ * @param pos_media	Which media entry to scan for this codec
+ * @param name		The encoding name to look for
+ * @param clock_rate	Its RTP clock rate
+ * @param static_pt	Its static payload type, -1 = none
+ */
+static int fesip_find_format(sdp_message_t *sdp, int pos_media,
+      const char *name, int clock_rate, int static_pt)
+{
+  int pos = 0;
+  char *field, *value;
+  int payload;
+  _Bool static_mapped = false;
+  
+  while ((field = sdp_message_a_att_field_get(sdp, pos_media, pos)) != NULL) {
+    if (strcmp(field, "rtpmap") == 0) {
+      value = sdp_message_a_att_value_get(sdp, pos_media, pos);
+      // Look for "<payload-type-num> <name>/<clock-rate>[/1]"
+      char *end;
+      payload = strtoul(value, &end, 10);
+      if (end != value // Number found
+       && *end == ' ') {
+	char *codec = end + 1, *slash = strchr(codec, '/');
+	if (slash != NULL && (size_t)(slash - codec) == strlen(name)
+	    && strncasecmp(codec, name, slash - codec) == 0
+	    && strtol(slash + 1, &end, 10) == clock_rate
+	    && (*end == '\0' || strcmp(end, "/1") == 0)) {
+	  return payload;
+	}
+	if (payload == static_pt)
+	  static_mapped = true; // Reused for something else
+      }
+    }
+    pos++;
+  }
+  if (static_pt >= 0 && !static_mapped) {
+    char *fmt;
+    for (pos = 0; (fmt = sdp_message_m_payload_get(sdp, pos_media, pos)) != NULL;
+	 pos++) {
+      if (atoi(fmt) == static_pt)
+	return static_pt;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Extract remote address, port, and codec from the SDP into the call
+ *
+ * The codec is the first one in our preference list (see
+ * fesip_set_codecs()) the SDP offers, or in an answer, accepts.
+ *
+ * Returns 0 if no usable audio stream was found.
+ *
+ * @param call		The call to update
+ * @param msg		The INVITE or answer carrying the SDP
+ */
+static int fesip_remote_params(struct fesip_call *call, osip_message_t *msg)
+{
+  sdp_message_t *sdp = eXosip_get_sdp_info(msg);
+  int pos_media = 0;
+  const char *media;
+  int retval = 0;
+  
+  if (sdp == NULL)
+    return 0;
+
+  while ((media = sdp_message_m_media_get(sdp, pos_media)) != NULL) {
+    if (strcmp(media, "audio") == 0
+     && strcmp(sdp_message_m_proto_get(sdp, pos_media), "RTP/AVP") == 0) {
+      call->remote_port = atoi(sdp_message_m_port_get(sdp, pos_media));
+
+      // Look for an IPv4 address
+      int pos = 0;
+      char *addr, *proto;
+      call->remote_host[0] = '\0';
+      while ((addr = fesip_connection(sdp, pos_media, pos, &proto)) != NULL) {
+	if (strcmp(proto, "IP4") == 0 && strlen(addr) < HOSTLEN) {
+	  strncpy(call->remote_host, addr, HOSTLEN);
+	  break;
+	}
+	pos++;
+      }
+      if (call->remote_host[0] == '\0') {
+	break;
+      }
+
+      // Any supported codec?
+      enum fesnd_format format = FESND_PCMA8000;
+      const struct fesnd_codec *codec = NULL;
+      int pt = -1;
+      for (int i = 0; i < ncodec_prefs && pt < 0; i++) {
+	format = codec_prefs[i];
+	codec = fesnd_codec(format);
+	pt = fesip_find_format(sdp, pos_media, codec->name, codec->clock_rate,
+			       codec->static_pt);
+      }
+      if (pt < 0) {
+	fprintf(stderr, "No common audio codec\n");
+	break;
+      }
+      // RFC 4733 DTMF? (Must have the codec's clock rate)
+      int dtmf_pt = fesip_find_format(sdp, pos_media, "telephone-event",
+				      codec->clock_rate, -1);
+      // RFC 3389 comfort noise? (Likewise)
+      int cn_pt = !dtx ? -1
+	: fesip_find_format(sdp, pos_media, "CN", codec->clock_rate,
+			    codec->clock_rate == 8000 ? CN_PT : -1);
+
+      pthread_mutex_lock(&media_lock);
+      if (codec != call->codec) {
+	memset(&call->dec, 0, sizeof(call->dec));
+	fejitter_init(&call->jitter, codec);
+      }
+      call->codec = codec;
+      call->payload_format = pt;
+      call->dtmf_pt = dtmf_pt;
+      call->cn_pt = cn_pt;
+      fesnd_set_format(&call->queue, format);
+      for (int l = 0; l < FESIP_LAYERS - 1; l++)
+	fesnd_set_format(&call->layer[l], format);
+      if (call->member != NULL)
+	fesip_member_set_rate(call);
+      pthread_mutex_unlock(&media_lock);
+      retval = 1;
+      break;
+    }
+    pos_media++;
+  }
+  sdp_message_free(sdp);
+  return retval;
+}
+
+/**
+ * Check a file, then queue it for the call to play
+ */
+static void fesip_play_queue(struct fesip_call *call, int layer, int delay,
+			     const char *filename)
+{
+  // Check the file before taking the lock, so the media thread is not
+  // held up by the disk; it is decoded in the background. Not from
+  // fesip_event_audio(), in the media tick: the prefetch thread opens
+  // it anyway, and drops it from the queue if it cannot be played.
+  if (!in_audio_event && fesnd_check(filename) != 0)
+    return; // Diagnostic already printed
+  pthread_mutex_lock(&media_lock);
+  struct fesnd_queue *q = layer == 0 ? &call->queue : &call->layer[layer - 1];
+  if (fesnd_add_checked(q, delay, filename) == 0 && !call->is_playing) {
+    call->is_playing = true;
+    fertp_resume(&call->rtp);
+    fesip_media_wake();
+  }
+  pthread_mutex_unlock(&media_lock);
+}
+
+void fesip_play_after_delay(fesip_call_t *call, int delay, const char *filename)
+{
+  fesip_play_queue(call, 0, delay, filename);
+}
+
+void fesip_play(fesip_call_t *call, const char *filename)
+{
+  fesip_play_after_delay(call, 0, filename);
+}
+
+int fesip_play_layer(fesip_call_t *call, int layer, const char *filename)
+{
+  if (layer < 0 || layer >= FESIP_LAYERS) {
+    fprintf(stderr, "fesip_play_layer(): No layer %d\n", layer);
+    return 1;
+  }
+  fesip_play_queue(call, layer, 0, filename);
+  return 0;
+}
+
+int fesip_set_gain(fesip_call_t *call, int layer, int gain)
+{
+  if (layer < 0 || layer >= FESIP_LAYERS) {
+    fprintf(stderr, "fesip_set_gain(): No layer %d\n", layer);
+    return 1;
+  }
+  pthread_mutex_lock(&media_lock);
+  call->gain[layer] = gain;
+  pthread_mutex_unlock(&media_lock);
+  return 0;
+}
+
+int fesip_play_stream(fesip_call_t *call, struct fesnd_stream *stream)
+{
+  pthread_mutex_lock(&media_lock);
+  int retval = fesnd_add_stream(&call->queue, stream);
+  if (retval == 0 && !call->is_playing) {
+    call->is_playing = true;
+    fertp_resume(&call->rtp);
+    fesip_media_wake();
+  }
+  pthread_mutex_unlock(&media_lock);
+  return retval;
+}
+
+int fesip_play_broadcast(fesip_call_t *call, struct fesnd_broadcast *b)
+{
+  pthread_mutex_lock(&media_lock);
+  int retval = fesnd_add_broadcast(&call->queue, b);
+  if (retval == 0 && !call->is_playing) {
+    call->is_playing = true;
+    fertp_resume(&call->rtp);
+    fesip_media_wake();
+  }
+  pthread_mutex_unlock(&media_lock);
+  return retval;
+}
+
+void fesip_stop(fesip_call_t *call)
+{
+  pthread_mutex_lock(&media_lock);
+  fesnd_close(&call->queue);
+  for (int l = 0; l < FESIP_LAYERS - 1; l++)
+    fesnd_close(&call->layer[l]);
+  call->is_playing = call->member != NULL; // The conference goes on
+  pthread_mutex_unlock(&media_lock);
+}
+
+// ------------- SDP -----------------
+//
+// Building the SDP is on the way to every 200 OK, so nothing is
+// probed or formatted there: the local address is cached until the
+// kernel announces a change, and the SDP text is kept as a template,
+// with only the session version and port filled in per call.
+
+/**
+ * A prepared SDP, missing the session version and port
+ */
+struct fesip_sdp_template {
+  unsigned gen;			// sdp_gen when made, 0 = unused
+  const struct fesnd_codec *codec; // Answer, NULL = the offer
+  int pt, dtmf_pt, cn_pt;
+  size_t version_at, port_at;	// Where they go into text
+  size_t len;
+  char text[SDP_MAX];
+};
+
+static struct fesip_sdp_template sdp_offer, sdp_answers[SDP_ANSWERS];
+static int sdp_next_answer;		// Replaced next
+
+/**
+ * Mark the local address stale if the kernel reported any address or
+ * route change since (eXosip_lock held)
+ *
+ * Called when the reactor finds addr_fd readable, and before every
+ * probe for the other modes.
+ */
+static void fesip_addr_drain(void)
+{
+  char buf[8192];
+  while (addr_fd >= 0) {
+    // What changed does not matter; overflow (ENOBUFS) counts as well
+    if (recv(addr_fd, buf, sizeof(buf), 0) >= 0 || errno == ENOBUFS) {
+      addr_stale = true;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    } else if (errno != EINTR) {
+      fprintf(stderr, "flexosip: Cannot watch local addresses (%s), "
+	      "probing for every call\n", strerror(errno));
+      close(addr_fd); // Also leaves the epoll set
+      addr_fd = -1;
+    }
+  }
+}
+
+/**
+ * Subscribe to the kernel's IPv4 address and route changes, once
+ * (eXosip_lock held)
+ *
+ * IPv6 changes are not watched: only the IPv4 address goes into the
+ * SDP. The socket is read from the event loop (see POLL_ADDR) or right
+ * before the address is needed; either way, no thread of its own.
+ */
+static void fesip_addr_listen(void)
+{
+  if (addr_tried)
+    return;
+  addr_tried = true;
+  struct sockaddr_nl sa = { .nl_family = AF_NETLINK,
+			    .nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE };
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		  NETLINK_ROUTE);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+    fprintf(stderr, "flexosip: Cannot watch local addresses (%s), "
+	    "probing for every call\n", strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  addr_fd = fd;
+  if (reactor_fd >= 0)
+    fesip_epoll_add(addr_fd, POLL_ADDR); // Else drained when needed
+}
+
+/**
+ * Probe the local address if it may have changed (eXosip_lock held)
+ */
+static void fesip_addr_refresh(void)
+{
+  fesip_addr_listen();
+  fesip_addr_drain();
+  // Cleared first: a change reported while probing is seen next time
+  _Bool stale = addr_stale || addr_fd < 0;
+  addr_stale = false;
+  if (!stale)
+    return;
+  char ip[sizeof(local_ip4)];
+  if (eXosip_guess_localip(ctx, AF_INET, ip, sizeof(ip)) != 0) {
+    addr_stale = true; // Try again next time
+    return;
+  }
+  if (strcmp(ip, local_ip4) != 0) {
+    strcpy(local_ip4, ip);
+    sdp_gen++;
+  }
+}
+
+/**
+ * Add a payload type to the m= line and describe it
+ *
+ * telephone-event types also get their events (the 16 DTMF digits).
+ */
+static void fesip_sdp_format(char *fmts, size_t fmtlen, char *maps,
+			     size_t maplen, int pt, const char *name,
+			     int clock_rate)
+{
+  size_t len = strlen(fmts);
+  snprintf(fmts + len, fmtlen - len, " %d", pt);
+  len = strlen(maps);
+  len += snprintf(maps + len, maplen - len, "a=rtpmap:%d %s/%d\r\n",
+		  pt, name, clock_rate);
+  if (strcmp(name, "telephone-event") == 0 && len < maplen)
+    snprintf(maps + len, maplen - len, "a=fmtp:%d 0-15\r\n", pt);
+}
+
+/**
+ * Prepare an SDP: an offer listing all codecs we accept (codec
+ * NULL), or, once the codec has been negotiated, the answer with just
+ * that one (eXosip_lock held)
+ */
+static void fesip_sdp_prepare(struct fesip_sdp_template *t,
+			      const struct fesnd_codec *codec, int pt,
+			      int dtmf_pt, int cn_pt)
+{
+  char fmts[256] = "", maps[2048] = "";
+  if (codec != NULL) {
+    // Answer only with the telephone-event and CN types offered
+    fesip_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps),
+		     pt, codec->name, codec->clock_rate);
+    if (dtmf_pt >= 0)
+      fesip_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps),
+		       dtmf_pt, "telephone-event", codec->clock_rate);
+    if (cn_pt >= 0)
+      fesip_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps),
+		       cn_pt, "CN", codec->clock_rate);
+  } else {
+    // Dynamic payload types from 96 (at most a handful, below DTMF_PT)
+    int dynamic_pt = 96, dtmf_rates = 0;
+    for (int i = 0; i < ncodec_prefs; i++) {
+      const struct fesnd_codec *c = fesnd_codec(codec_prefs[i]);
+      int p = c->static_pt >= 0 ? c->static_pt : dynamic_pt++;
+      fesip_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps),
+		       p, c->name, c->clock_rate);
+      dtmf_rates |= c->clock_rate == 16000 ? 2 : 1;
+    }
+    // Telephone-events need the codec's clock rate
+    if (dtmf_rates & 1)
+      fesip_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps),
+		       DTMF_PT, "telephone-event", 8000);
+    if (dtmf_rates & 2)
+      fesip_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps),
+		       DTMF_PT + 1, "telephone-event", 16000);
+    // So does comfort noise
+    if (dtx && (dtmf_rates & 1))
+      fesip_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps),
+		       CN_PT, "CN", 8000);
+    if (dtx && (dtmf_rates & 2))
+      fesip_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps),
+		       CN_WIDE_PT, "CN", 16000);
+  }
+  // "o=<user> <session id> <version> ..." and "m=audio <port> ..."
+  size_t size = sizeof(t->text), n = 0;
+  n += snprintf(t->text, size, "v=0\r\no=cowbell 0 ");
+  t->version_at = n;
+  n += snprintf(t->text + n, size - n,
+		" IN IP4 %s\r\n"
+		"s=call\r\n"
+		"c=IN IP4 %s\r\n"
+		"t=0 0\r\n"
+		"m=audio ",
+		local_ip4, local_ip4);
+  t->port_at = n;
+  // Fits: fmts and maps are far smaller
+  n += snprintf(t->text + n, size - n, " RTP/AVP%s\r\n%s", fmts, maps);
+  t->len = n;
+  t->codec = codec;
+  t->pt = pt;
+  t->dtmf_pt = dtmf_pt;
+  t->cn_pt = cn_pt;
+  t->gen = sdp_gen;
+}
+
+/**
+ * The template for a call's SDP, prepared if need be (eXosip_lock held)
+ */
+static const struct fesip_sdp_template *fesip_sdp_lookup(struct fesip_call *call)
+{
+  fesip_addr_refresh();
+  if (call->codec == NULL) {
+    if (sdp_offer.gen != sdp_gen)
+      fesip_sdp_prepare(&sdp_offer, NULL, 0, -1, -1);
+    return &sdp_offer;
+  }
+  for (int i = 0; i < SDP_ANSWERS; i++) {
+    struct fesip_sdp_template *t = &sdp_answers[i];
+    if (t->gen == sdp_gen && t->codec == call->codec
+	&& t->pt == call->payload_format && t->dtmf_pt == call->dtmf_pt
+	&& t->cn_pt == call->cn_pt)
+      return t;
+  }
+  struct fesip_sdp_template *t = &sdp_answers[sdp_next_answer];
+  sdp_next_answer = (sdp_next_answer + 1) % SDP_ANSWERS;
+  fesip_sdp_prepare(t, call->codec, call->payload_format, call->dtmf_pt,
+		    call->cn_pt);
+  return t;
+}
+
+/**
+ * Probe the local address and prepare our offer before the first call
+ */
+static void fesip_sdp_warm(void)
+{
+  eXosip_lock(ctx);
+  fesip_addr_refresh();
+  if (sdp_offer.gen != sdp_gen)
+    fesip_sdp_prepare(&sdp_offer, NULL, 0, -1, -1);
+  eXosip_unlock(ctx);
+}
+
+/**
+ * Decimal digits of n at buf, returns their number
+ */
+static size_t fesip_utoa(char *buf, unsigned n)
+{
+  char digits[10];
+  size_t len = 0;
+  do {
+    digits[len++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  for (size_t i = 0; i < len; i++)
+    buf[i] = digits[len - 1 - i];
+  return len;
+}
+
+/**
+ * Attach our SDP (see fesip_sdp_prepare())
+ */
+static void fesip_build_sdp(struct fesip_call *call, osip_message_t *msg)
+{
+  const struct fesip_sdp_template *t = fesip_sdp_lookup(call);
+  char body[SDP_MAX + 16];
+  char lenstr[16];
+  size_t n = t->version_at;
+  memcpy(body, t->text, n);
+  n += fesip_utoa(body + n, call->sdp_version++);
+  memcpy(body + n, t->text + t->version_at, t->port_at - t->version_at);
+  n += t->port_at - t->version_at;
+  n += fesip_utoa(body + n, call->local_port);
+  memcpy(body + n, t->text + t->port_at, t->len - t->port_at);
+  n += t->len - t->port_at;
+  osip_message_set_body(msg, body, n);
+  lenstr[fesip_utoa(lenstr, n)] = '\0';
+  osip_message_set_content_length(msg, lenstr);
+  osip_message_set_content_type(msg, "application/sdp");
+}
+
+/**
+ * Start sending RTP to the remote party
+ */
+static void fesip_start_rtp(struct fesip_call *call)
+{
+  pthread_mutex_lock(&media_lock);
+  fertp_start(&call->rtp, call->remote_host,
+	      call->remote_port, call->payload_format,
+	      call->codec->name, call->codec->clock_rate);
+  fedtmf_init(&call->inband, call->codec->rate);
+  fesip_poll_add(call);
+  if (call->is_playing)
+    fesip_media_wake(); // Queued before the answer
+  pthread_mutex_unlock(&media_lock);
+}
+
+void fesip_answer(fesip_call_t *call)
+{
+  int i;
+  osip_message_t *answer = NULL;
+  fesip_ctx();
+  eXosip_lock(ctx);
+
+  i = eXosip_call_build_answer(ctx, call->tid, 200, &answer);
+  if (i != 0) {
+    eXosip_call_send_answer(ctx, call->tid, 400, NULL);
+  } else {
+    fesip_build_sdp(call, answer);
+    eXosip_call_send_answer(ctx, call->tid, 200, answer);
+  }
+  fesip_start_rtp(call);
+  call->in_progress = true;
+  eXosip_unlock(ctx);
+}
+
+static void fesip_terminate_all_nolock(void)
+{
+  while (nlive > 0) {
+    fesip_terminate_nolock(live[nlive - 1]);
+  }
+}
+
+static void timespec_add_ns(struct timespec *ts, long ns)
+{
+  ts->tv_nsec += ns;
+  while (ts->tv_nsec >= 1000000000L) {
+    ts->tv_nsec -= 1000000000L;
+    ts->tv_sec++;
+  }
+}
+
+static long timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+  return (a->tv_sec - b->tv_sec) * 1000000000L + (a->tv_nsec - b->tv_nsec);
+}
+
+// ------------- Worker threads -----------------
+
+/**
+ * Bounded multi-producer, multi-consumer queue
+ *
+ * Each slot's sequence number tells whose turn it is (Vyukov's
+ * scheme): producers and consumers only race for the head or tail
+ * index, never take a lock, and a full queue is reported instead of
+ * waited for.
+ */
+struct fesip_ring {
+  _Alignas(64) atomic_size_t head;	// Next to take
+  _Alignas(64) atomic_size_t tail;	// Next to fill
+  atomic_size_t seq[FESIP_ASYNC_QUEUE];
+  unsigned char *data;			// FESIP_ASYNC_QUEUE elements
+  size_t size;				// Bytes per element
+};
+
+/**
+ * A command for the event loop (see fesip_async_answer() and co.)
+ */
+struct fesip_command {
+  enum { CMD_ANSWER, CMD_PLAY, CMD_STOP, CMD_HANGUP, CMD_DTMF } type;
+  struct fesip_call *call;
+  unsigned serial;
+  char digit;
+  char *filename;		// CMD_PLAY, freed once played
+};
+
+_Static_assert((FESIP_ASYNC_QUEUE & (FESIP_ASYNC_QUEUE - 1)) == 0,
+	       "FESIP_ASYNC_QUEUE must be a power of two");
+static struct fesip_async_event async_event_data[FESIP_ASYNC_QUEUE];
+static struct fesip_command async_command_data[FESIP_ASYNC_QUEUE];
+static struct fesip_ring async_events, async_commands;
+static atomic_ulong async_posted, async_dropped, async_executed, async_stale;
+
+static void fesip_ring_init(struct fesip_ring *ring, void *data, size_t size)
+{
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  for (size_t i = 0; i < FESIP_ASYNC_QUEUE; i++)
+    atomic_init(&ring->seq[i], i);
+  ring->data = data;
+  ring->size = size;
+}
+
+/**
+ * Append an element, returns != 0 if the queue is full
+ */
+static int fesip_ring_put(struct fesip_ring *ring, const void *elem)
+{
+  size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  for (;;) {
+    size_t seq = atomic_load_explicit(&ring->seq[pos % FESIP_ASYNC_QUEUE],
+				      memory_order_acquire);
+    long diff = (long)(seq - pos);
+    if (diff < 0)
+      return -1; // Still holds what was put FESIP_ASYNC_QUEUE ago
+    if (diff > 0)
+      pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    else if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+						   memory_order_relaxed,
+						   memory_order_relaxed))
+      break; // Slot is ours
+  }
+  memcpy(ring->data + pos % FESIP_ASYNC_QUEUE * ring->size, elem, ring->size);
+  atomic_store_explicit(&ring->seq[pos % FESIP_ASYNC_QUEUE], pos + 1,
+			memory_order_release);
+  return 0;
+}
+
+/**
+ * Take the oldest element, returns != 0 if the queue is empty
+ * (or its oldest element is still being put)
+ */
+static int fesip_ring_get(struct fesip_ring *ring, void *elem)
+{
+  size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  for (;;) {
+    size_t seq = atomic_load_explicit(&ring->seq[pos % FESIP_ASYNC_QUEUE],
+				      memory_order_acquire);
+    long diff = (long)(seq - (pos + 1));
+    if (diff < 0)
+      return -1;
+    if (diff > 0)
+      pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    else if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+						   memory_order_relaxed,
+						   memory_order_relaxed))
+      break;
+  }
+  memcpy(elem, ring->data + pos % FESIP_ASYNC_QUEUE * ring->size, ring->size);
+  atomic_store_explicit(&ring->seq[pos % FESIP_ASYNC_QUEUE],
+			pos + FESIP_ASYNC_QUEUE, memory_order_release);
+  return 0;
+}
+
+int fesip_async_start(void)
+{
+  if (atomic_load_explicit(&async_on, memory_order_acquire))
+    return 0;
+  // The workers of the last round are done by now (see fesip_async_next())
+  int fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "flexosip: Cannot create the event queue: %s\n",
+	    strerror(errno));
+    return -1;
+  }
+  if (async_fd >= 0)
+    close(async_fd); // Still counting fesip_async_close()'s wakeups
+  async_fd = fd;
+  fesip_ring_init(&async_events, async_event_data, sizeof(async_event_data[0]));
+  fesip_ring_init(&async_commands, async_command_data,
+		  sizeof(async_command_data[0]));
+  atomic_store_explicit(&async_on, true, memory_order_release);
+  return 0;
+}
+
+int fesip_async_fd(void)
+{
+  return async_fd;
+}
+
+/**
+ * Hand an event to the workers (any thread, never blocks)
+ */
+static void fesip_async_post(enum fesip_async_type type,
+			     struct fesip_call *call, int status, char digit)
+{
+  struct fesip_async_event evt = {
+    .type = type, .call = call, .serial = call->serial,
+    .reference = call->reference, .format = call->payload_format,
+    .status = status, .digit = digit,
+  };
+  uint64_t one = 1;
+  if (fesip_ring_put(&async_events, &evt) != 0) {
+    atomic_fetch_add_explicit(&async_dropped, 1, memory_order_relaxed);
+    return;
+  }
+  atomic_fetch_add_explicit(&async_posted, 1, memory_order_relaxed);
+  if (write(async_fd, &one, sizeof(one)) < 0) {
+    // Cannot overflow with FESIP_ASYNC_QUEUE events
+  }
+}
+
+int fesip_async_next(struct fesip_async_event *evt, int timeout_ms)
+{
+  uint64_t one;
+  if (!atomic_load_explicit(&async_on, memory_order_acquire))
+    return -1;
+  struct pollfd pfd = { .fd = async_fd, .events = POLLIN };
+  while (read(async_fd, &one, sizeof(one)) < 0) {
+    if (errno != EAGAIN)
+      return -1;
+    int n = poll(&pfd, 1, timeout_ms);
+    if (n == 0)
+      return 0;
+    if (n < 0 && errno != EINTR)
+      return -1;
+    // Else retry, another worker may have taken it
+  }
+  if (!atomic_load_explicit(&async_on, memory_order_acquire))
+    return -1; // Woken by fesip_async_close(), maybe without an event
+  // One event is ours; a producer ahead of the one who counted it may
+  // still be copying
+  while (fesip_ring_get(&async_events, evt) != 0)
+    sched_yield();
+  return 1;
+}
+
+static int fesip_async_command(struct fesip_command *cmd)
+{
+  int retval = 0;
+  // Counted first, so fesip_async_close() either waits for us or we
+  // see the queues closed (both sequentially consistent)
+  atomic_fetch_add(&async_commanding, 1);
+  if (!atomic_load(&async_on) || cmd->call == NULL
+      || fesip_ring_put(&async_commands, cmd) != 0) {
+    free(cmd->filename);
+    retval = -1;
+  } else {
+    fesip_wakeup();
+  }
+  atomic_fetch_sub(&async_commanding, 1);
+  return retval;
+}
+
+int fesip_async_answer(fesip_call_t *call, unsigned serial)
+{
+  struct fesip_command cmd = { CMD_ANSWER, call, serial, 0, NULL };
+  return fesip_async_command(&cmd);
+}
+
+int fesip_async_play(fesip_call_t *call, unsigned serial, const char *filename)
+{
+  struct fesip_command cmd = { CMD_PLAY, call, serial, 0, strdup(filename) };
+  if (cmd.filename == NULL)
+    return -1;
+  return fesip_async_command(&cmd);
+}
+
+int fesip_async_stop(fesip_call_t *call, unsigned serial)
+{
+  struct fesip_command cmd = { CMD_STOP, call, serial, 0, NULL };
+  return fesip_async_command(&cmd);
+}
+
+int fesip_async_hangup(fesip_call_t *call, unsigned serial)
+{
+  struct fesip_command cmd = { CMD_HANGUP, call, serial, 0, NULL };
+  return fesip_async_command(&cmd);
+}
+
+int fesip_async_dtmf(fesip_call_t *call, unsigned serial, char digit)
+{
+  struct fesip_command cmd = { CMD_DTMF, call, serial, digit, NULL };
+  return fesip_async_command(&cmd);
+}
+
+/**
+ * Carry out the queued commands (event loop, no locks held)
+ */
+static void fesip_async_execute(void)
+{
+  struct fesip_command cmd;
+  if (!async_on)
+    return;
+  while (fesip_ring_get(&async_commands, &cmd) == 0) {
+    struct fesip_call *call = cmd.call;
+    if (!call->in_use || call->serial != cmd.serial) {
+      // Ended before the worker's command arrived
+      atomic_fetch_add_explicit(&async_stale, 1, memory_order_relaxed);
+      free(cmd.filename);
+      continue;
+    }
+    switch (cmd.type) {
+    case CMD_ANSWER:
+      fesip_answer(call);
+      break;
+    case CMD_PLAY:
+      fesip_play(call, cmd.filename);
+      break;
+    case CMD_STOP:
+      fesip_stop(call);
+      break;
+    case CMD_HANGUP:
+      // Posted first, the reference is still valid then
+      fesip_async_post(FESIP_ASYNC_TERMINATED, call, 0, '\0');
+      fesip_terminate(call);
+      break;
+    case CMD_DTMF:
+      fesip_send_dtmf(call, cmd.digit);
+      break;
+    }
+    free(cmd.filename);
+    atomic_fetch_add_explicit(&async_executed, 1, memory_order_relaxed);
+  }
+}
+
+/**
+ * Close the queues, dropping whatever is left in them
+ *
+ * Workers waiting in fesip_async_next() are woken and return -1;
+ * async_fd stays open for them. Commands being given are waited for,
+ * so none is left behind (or wakes the loop) once the loop is gone.
+ */
+static void fesip_async_close(void)
+{
+  struct fesip_command cmd;
+  uint64_t many = 1UL << 30; // One for every worker, and then some
+  if (!atomic_exchange(&async_on, false))
+    return;
+  while (atomic_load(&async_commanding) > 0)
+    sched_yield(); // A ring_put() and a write() at most
+  while (fesip_ring_get(&async_commands, &cmd) == 0)
+    free(cmd.filename);
+  if (write(async_fd, &many, sizeof(many)) < 0) {
+    // Cannot overflow, it counts FESIP_ASYNC_QUEUE events at most
+  }
+}
+
+void fesip_async_get_stats(struct fesip_async_stats *stats)
+{
+  stats->events = atomic_load(&async_posted);
+  stats->dropped = atomic_load(&async_dropped);
+  stats->commands = atomic_load(&async_executed);
+  stats->stale = atomic_load(&async_stale);
+}
+
+// Event handlers, or in worker thread mode, the queue
+
+static int fesip_notify_invite(struct fesip_call *call, eXosip_event_t *evt)
+{
+  if (!async_on)
+    return fesip_event_invite(call, evt, call->remote_host, call->remote_port,
+			      call->payload_format);
+  fesip_async_post(FESIP_ASYNC_INVITE, call, 0, '\0');
+  return SIP_RINGING;
+}
+
+static void fesip_notify_answered(struct fesip_call *call, eXosip_event_t *evt)
+{
+  if (!async_on)
+    fesip_event_answered(call, evt, call->remote_host, call->remote_port,
+			 call->payload_format);
+  else
+    fesip_async_post(FESIP_ASYNC_ANSWERED, call, 0, '\0');
+}
+
+static void fesip_notify_terminate(struct fesip_call *call, eXosip_event_t *evt)
+{
+  if (!async_on)
+    fesip_event_terminate(call, evt);
+  else
+    fesip_async_post(FESIP_ASYNC_TERMINATED, call,
+		     evt->response != NULL && evt->response->status_code >= 300
+		     ? evt->response->status_code : 0, '\0');
+}
+
+static void fesip_notify_dtmf(struct fesip_call *call, char digit)
+{
+  if (!async_on)
+    fesip_event_dtmf(call, digit);
+  else
+    fesip_async_post(FESIP_ASYNC_DTMF, call, 0, digit);
+}
+
+/**
+ * Report a digit the media tick received, as telephone-event or
+ * in-band (media_lock held)
+ *
+ * Not by calling fesip_event_dtmf() from here: the tick holds
+ * media_lock and walks live[], and the handler might hang up. The
+ * event loop hands it over instead, like SIP INFO digits.
+ */
+static void fesip_queue_dtmf(struct fesip_call *call, char digit)
+{
+  if (async_on) {
+    fesip_async_post(FESIP_ASYNC_DTMF, call, 0, digit); // Never blocks
+    return;
+  }
+  int next = (call->dtmf_rx_head + 1) % DTMF_QUEUE;
+  if (next == call->dtmf_rx_tail)
+    return; // Nobody is taking them
+  call->dtmf_rx[call->dtmf_rx_head] = digit;
+  call->dtmf_rx_head = next;
+  atomic_store(&dtmf_pending, true);
+  fesip_wakeup();
+}
+
+/**
+ * Hand the digits queued by the media tick to fesip_event_dtmf()
+ * (eXosip_lock held, so no call is released meanwhile except by the
+ * handler itself)
+ */
+static void fesip_deliver_dtmf_nolock(void)
+{
+  if (!atomic_exchange(&dtmf_pending, false))
+    return;
+  for (int i = 0; i < FESIP_MAX_CALLS; i++) {
+    struct fesip_call *call = &calls[i];
+    for (;;) {
+      pthread_mutex_lock(&media_lock);
+      if (!call->in_use || call->dtmf_rx_tail == call->dtmf_rx_head) {
+	pthread_mutex_unlock(&media_lock);
+	break;
+      }
+      char digit = call->dtmf_rx[call->dtmf_rx_tail];
+      call->dtmf_rx_tail = (call->dtmf_rx_tail + 1) % DTMF_QUEUE;
+      pthread_mutex_unlock(&media_lock);
+      fesip_notify_dtmf(call, digit);
+    }
+  }
+}
+
+static void fesip_deliver_dtmf(void)
+{
+  if (!atomic_load(&dtmf_pending))
+    return;
+  eXosip_lock(ctx);
+  fesip_deliver_dtmf_nolock();
+  eXosip_unlock(ctx);
+}
+
+/**
+ * Handle one event (eXosip_lock held)
+ */
+static void fesip_process_event(eXosip_event_t *evt)
+{
+  struct fesip_call *call;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch" // We do not handle all enumerations
+  switch (evt->type)
+  {
+  case EXOSIP_REGISTRATION_SUCCESS:
+  case EXOSIP_REGISTRATION_FAILURE:
+    fesip_reg_event(evt);
+    break;
+  case EXOSIP_CALL_INVITE:
+    call = fesip_call_alloc();
+    if (call == NULL) {
+      // Call table full: Terminate incoming call
+      eXosip_call_send_answer(ctx, evt->tid, SIP_BUSY, NULL);
+    } else {
+      fesip_call_map(call, evt->cid);
+      call->did = evt->did;
+      call->tid = evt->tid; // For fesip_answer()
+      if (fesip_remote_params(call, evt->request)) {
+	int code = fesip_notify_invite(call, evt);
+	// Should be SIP_RINGING or SIP_BUSY_HERE
+	// Returning SIP_OK directly will cause problems
+	eXosip_call_send_answer(ctx, evt->tid, code, NULL);
+	if (code >= 300) {
+	  fesip_call_release(call);
+	}
+      } else {
+	eXosip_call_send_answer(ctx, evt->tid, SIP_NOT_ACCEPTABLE_HERE, NULL);
+	fesip_call_release(call);
+      }
+    }
+    break;
+  case EXOSIP_CALL_ANSWERED:
+    call = fesip_find_call(evt->cid);
+    if (call != NULL) {
+      fprintf(stderr, "Call answered with req=%p, resp=%p, ack=%p!\n",
+	      evt->request, evt->response, evt->ack);
+      eXosip_call_build_ack(ctx, evt->did, &evt->ack);
+      eXosip_call_send_ack(ctx, evt->did, evt->ack);
+      call->did = evt->did;
+      if (call->in_progress) {
+	// Retransmitted 200 OK
+      } else if (fesip_remote_params(call, evt->response)) {
+	call->in_progress = true;
+	fesip_start_rtp(call);
+	fesip_notify_answered(call, evt);
+      } else {
+	// Accepted none of the codecs we offered
+	fprintf(stderr, "Terminating call without usable audio\n");
+	fesip_notify_terminate(call, evt);
+	fesip_terminate_nolock(call);
+      }
+    }
+    break;
+  case EXOSIP_CALL_NOANSWER:
+  case EXOSIP_CALL_REQUESTFAILURE: // Error in the request
+  case EXOSIP_CALL_GLOBALFAILURE: // Also when BUSYing the call
+  case EXOSIP_CALL_CANCELLED:
+  case EXOSIP_CALL_CLOSED:
+  case EXOSIP_CALL_RELEASED:
+    fprintf(stderr, "Closing request %s\n", fesip_strevent(evt->type));
+    call = fesip_find_call(evt->cid);
+    if (call != NULL &&
+	!(evt->type == EXOSIP_CALL_REQUESTFAILURE && evt->response != NULL
+	  && evt->response->status_code == SIP_UNAUTHORIZED)) {
+      // Probably too eager
+      if (evt->response != NULL) {
+	fprintf(stderr, "Terminating call because of response %s (%d)\n",
+		fesip_strevent(evt->type), evt->response->status_code);
+      } else if (evt->request != NULL) {
+	fprintf(stderr, "Terminating call because of request %s (%d)\n",
+		fesip_strevent(evt->type), evt->request->status_code);
+      } else {
+	// Should never happen…
+	fprintf(stderr, "Terminating call because of unexpected %s\n",
+		fesip_strevent(evt->type));
+      }
+      fesip_notify_terminate(call, evt);
+      fesip_terminate_nolock(call);
+    }
+    break;
+  case EXOSIP_CALL_MESSAGE_NEW:
+    if (strcasecmp(evt->request->sip_method, "INFO") == 0 &&
+	evt->request->content_type != NULL &&
+	strcmp(evt->request->content_type->type, "application") == 0 &&
+	strcmp(evt->request->content_type->subtype, "dtmf-relay") == 0) {
+      osip_list_iterator_t it;
+      osip_body_t *body = (osip_body_t *)osip_list_get_first(&evt->request->bodies, &it);
+      char *match = strcasestr(body->body, "Signal=");
+      call = fesip_find_call(evt->cid);
+      if (call != NULL && match != NULL && match[7] != '\0') {
+	fesip_notify_dtmf(call, match[7]);
+      }
+      eXosip_call_build_ack(ctx, evt->did, &evt->ack);
+      eXosip_call_send_ack(ctx, evt->did, evt->ack);
+    }
+    break;
+  default:
+    fprintf(stderr, "Received event %s\n", fesip_strevent(evt->type));
+    break;
+  }
+#pragma GCC diagnostic pop
+}
+
+/**
+ * Free the previous batch, its events are no longer handed out
+ */
+static void fesip_batch_free(void)
+{
+  for (int i = 0; i < nbatch; i++)
+    eXosip_event_free(batch[i]);
+  nbatch = 0;
+}
+
+int fesip_wait_events(int seconds, int milliseconds,
+		      eXosip_event_t **evts, int max)
+{
+  fesip_ctx();
+  eXosip_event_t *evt = eXosip_event_wait(ctx, seconds, milliseconds);
+  if (clean_up_please) {
+    fprintf(stderr, "Cleaning up...\n");
+    eXosip_lock(ctx);
+    fesip_terminate_all_nolock();
+    eXosip_unlock(ctx);
+    fesip_quit();
+    exit(0);
+  }
+  if (max > FESIP_EVENT_BATCH)
+    max = FESIP_EVENT_BATCH;
+  // Take all that is pending now (eXosip's queue has its own lock)
+  struct timespec fetched, now; // Handler latency, see fesip_event_stats
+  clock_gettime(CLOCK_MONOTONIC, &fetched);
+  int n = 0;
+  if (evt != NULL) {
+    fesip_batch_free();
+    batch[n++] = evt;
+    while (n < max && (evt = eXosip_event_wait(ctx, 0, 0)) != NULL)
+      batch[n++] = evt;
+    nbatch = n;
+  }
+  long latency, latency_sum = 0, latency_max = 0;
+  eXosip_lock(ctx);
+  eXosip_automatic_action(ctx); // Once per batch
+  fesip_reg_tick();
+  for (int i = 0; i < n; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    latency = timespec_diff_ns(&now, &fetched);
+    latency_sum += latency;
+    if (latency > latency_max)
+      latency_max = latency;
+    fesip_process_event(batch[i]);
+  }
+  fesip_deliver_dtmf_nolock();
+  if (n > 0)
+    fesip_event_batch(batch, n);
+  eXosip_unlock(ctx);
+  if (n > 0) {
+    pthread_mutex_lock(&media_lock);
+    event_stats.batches++;
+    event_stats.events += n;
+    if (n > event_stats.max_batch)
+      event_stats.max_batch = n;
+    if (n == max && max > 1) // Not one at a time by fesip_wait_event()
+      event_stats.full++;
+    event_stats.latency_ns += latency_sum;
+    if (latency_max > event_stats.max_latency_ns)
+      event_stats.max_latency_ns = latency_max;
+    pthread_mutex_unlock(&media_lock);
+  }
+  memcpy(evts, batch, n * sizeof(batch[0]));
+  return n;
+}
+
+eXosip_event_t *fesip_wait_event(int seconds, int milliseconds)
+{
+  eXosip_event_t *evt;
+  return fesip_wait_events(seconds, milliseconds, &evt, 1) > 0 ? evt : NULL;
+}
+
+void fesip_event_get_stats(struct fesip_event_stats *stats)
+{
+  pthread_mutex_lock(&media_lock);
+  *stats = event_stats;
+  pthread_mutex_unlock(&media_lock);
+}
+
+/**
+ * RTP clock ticks per 20 ms frame of the call's codec
+ */
+static int fesip_frame_ticks(const struct fesip_call *call)
+{
+  return call->codec->clock_rate / (1000000000L / FRAME_NS);
+}
+
+/**
+ * Whether to hold back a frame as silence (media_lock held)
+ *
+ * After DTX_HANGOVER silent frames, sends a comfort noise packet with
+ * the frame's level instead, and then only when it changes by
+ * DTX_LEVEL_STEP or more. The first frame sent again gets the marker
+ * bit (RFC 3389 4).
+ *
+ * @param call		The call
+ * @param level		The frame's level, see fesnd_level()
+ * @param nticks	Its length in timestamp ticks
+ * @param when		When the frame is due (NULL: now)
+ */
+static _Bool fesip_dtx(struct fesip_call *call, int level, ssize_t nticks,
+		       const struct timespec *when)
+{
+  if (level < DTX_LEVEL) {
+    call->silent_frames = 0;
+    if (call->cn_level >= 0) {
+      call->cn_level = -1;
+      fertp_mark(&call->rtp);
+    }
+    return false;
+  }
+  if (call->silent_frames <= DTX_HANGOVER) {
+    call->silent_frames++;
+    return false;
+  }
+  if (call->cn_level < 0 || abs(level - call->cn_level) >= DTX_LEVEL_STEP) {
+    // RFC 3389 3.1: the noise level in -dBov, no spectral information
+    unsigned char noise = level;
+    fertp_send_pt(&call->rtp, call->cn_pt, &noise, 1,
+		  fertp_timestamp(&call->rtp, when), false);
+    call->cn_level = level;
+    call->rtp.stats.cn++;
+  }
+  call->rtp.stats.suppressed++;
+  fertp_skip(&call->rtp, nticks);
+  return true;
+}
+
+/**
+ * Send the next audio chunk of a call, if any (media_lock held)
+ *
+ * @param call		The call
+ * @param when		When the frame is due (NULL: now)
+ */
+static void fesip_send_frame(struct fesip_call *call, const struct timespec *when)
+{
+  const unsigned char *frame;
+  if (call->rtp.session == NULL)
+    return; // Not answered yet, keep the queue for later
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  ssize_t nbytes = fesip_mix_frame(call, &frame);
+  if (nbytes < 0) // Nothing to mix
+    nbytes = fesnd_next_frame(&call->queue, &frame);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  call->rtp.stats.encode_ns += timespec_diff_ns(&t1, &t0);
+  if (nbytes > 0) {
+    // The last frame of a file may be short
+    ssize_t nticks = nbytes * fesip_frame_ticks(call)
+      / (ssize_t)call->codec->frame_bytes;
+    if (call->cn_pt >= 0 && fesip_dtx(call, call->queue.level, nticks, when))
+      return;
+    if (when != NULL)
+      fertp_send_at(&call->rtp, frame, nbytes, nticks, when);
+    else
+      fertp_send(&call->rtp, frame, nbytes, nticks);
+  } else {
+    call->is_playing = false;
+  }
+}
+
+/**
+ * Report an RFC 4733 telephone-event (media_lock held)
+ *
+ * All packets of an event share its start timestamp. The digit is
+ * reported on the first one seen, so it arrives without waiting for
+ * the end of the event; the rest (including the repeated end packets)
+ * are ignored.
+ */
+static void fesip_receive_dtmf(struct fesip_call *call,
+			       const struct fertp_packet *pkt)
+{
+  if (pkt->len < 4)
+    return;
+  if (call->dtmf_rx_seen && pkt->ts == call->dtmf_rx_ts)
+    return; // Same event
+  call->dtmf_rx_seen = true;
+  call->dtmf_rx_ts = pkt->ts;
+  if (pkt->payload[0] < sizeof(DTMF_DIGITS) - 1)
+    fesip_queue_dtmf(call, DTMF_DIGITS[pkt->payload[0]]);
+}
+
+/**
+ * Send the RFC 4733 telephone-event due now, if any (media_lock held)
+ *
+ * Returns true while a digit is being sent; audio is paused then.
+ *
+ * @param call		The call
+ * @param when		When the frame is due (NULL: now)
+ */
+static _Bool fesip_send_dtmf_tick(struct fesip_call *call,
+				  const struct timespec *when)
+{
+  if (call->dtmf_ticks == 0) {
+    if (call->dtmf_head == call->dtmf_tail)
+      return false;
+    const char *digit = strchr(DTMF_DIGITS, call->dtmf_tx[call->dtmf_tail]);
+    call->dtmf_tail = (call->dtmf_tail + 1) % DTMF_QUEUE;
+    call->dtmf_event = digit - DTMF_DIGITS; // Validated when queued
+    call->dtmf_ts = fertp_timestamp(&call->rtp, when);
+  }
+  call->dtmf_ticks++;
+  if (call->dtmf_ticks > DTMF_TONE_TICKS) {
+    // Pause between digits, audio may go on
+    if (call->dtmf_ticks >= DTMF_TONE_TICKS + DTMF_GAP_TICKS)
+      call->dtmf_ticks = 0;
+    return false;
+  }
+  _Bool end = (call->dtmf_ticks == DTMF_TONE_TICKS);
+  unsigned duration = call->dtmf_ticks * fesip_frame_ticks(call);
+  unsigned char payload[4] = {
+    call->dtmf_event,
+    (end ? 0x80 : 0) | DTMF_VOLUME,
+    duration >> 8, duration & 0xff
+  };
+  for (int i = 0; i < (end ? DTMF_END_REPEAT : 1); i++) {
+    fertp_send_pt(&call->rtp, call->dtmf_pt, payload, sizeof(payload),
+		  call->dtmf_ts, call->dtmf_ticks == 1);
+  }
+  fertp_skip(&call->rtp, fesip_frame_ticks(call));
+  return true;
+}
+
+/**
+ * Take in the packets received on a call (media_lock held)
+ *
+ * Audio goes into the jitter buffer, to be played out by
+ * fesip_playout(); telephone-events are reported right away.
+ */
+static void fesip_receive(struct fesip_call *call)
+{
+  struct fertp_packet pkt;
+  _Bool audio = false;
+  while (fertp_recv(&call->rtp, &pkt)) {
+    if (pkt.pt == call->dtmf_pt) {
+      fesip_receive_dtmf(call, &pkt);
+      continue;
+    }
+    if (pkt.pt != call->payload_format)
+      continue; // E.g., comfort noise
+    audio = true;
+    fejitter_put(&call->jitter, pkt.seq, pkt.ts, pkt.marker, pkt.payload,
+		 pkt.len, &pkt.arrival);
+  }
+  if (audio && fejitter_active(&call->jitter))
+    fesip_media_wake(); // Played out from the frame timer
+}
+
+/**
+ * Deliver the next 20 ms of received audio, if due (media_lock held)
+ *
+ * Out of the jitter buffer, in order, with lost packets concealed,
+ * to the in-band DTMF detector, the conference, and
+ * fesip_event_audio(). Paced by its own 20 ms schedule, as media
+ * ticks may come more often when nothing is sent.
+ *
+ * @param call		The call
+ * @param when		When the frame is due (NULL: now)
+ */
+static void fesip_playout(struct fesip_call *call, const struct timespec *when)
+{
+  struct timespec now;
+  if (when == NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    when = &now;
+  }
+  if (!fejitter_active(&call->jitter)) {
+    call->rx_due = *when;
+    return;
+  }
+  long ahead = timespec_diff_ns(&call->rx_due, when);
+  if (ahead > 0)
+    return;
+  if (ahead <= -MEDIA_MAX_LATE * FRAME_NS)
+    call->rx_due = *when; // Skip ahead rather than burst
+  timespec_add_ns(&call->rx_due, FRAME_NS);
+
+  short pcm[FESND_MAX_SAMPLES];
+  size_t n = fejitter_get(&call->jitter, &call->dec, pcm);
+  if (n == 0)
+    return;
+  if (inband_dtmf && call->dtmf_pt < 0) {
+    // Only if the digits do not come as telephone-events
+    char digits[4];
+    int ndigits = fedtmf_process(&call->inband, pcm, n, digits, 4);
+    for (int i = 0; i < ndigits; i++)
+      fesip_queue_dtmf(call, digits[i]);
+  }
+  if (call->member != NULL)
+    fesip_conf_receive(call, pcm, n);
+  in_audio_event = true;
+  fesip_event_audio(call, pcm, n);
+  in_audio_event = false;
+}
+
+/**
+ * Send and receive the audio of all calls (media_lock held)
+ *
+ * @param when		When the frames are due (NULL: now)
+ */
+static void fesip_media_tick(const struct timespec *when)
+{
+  media_ticks++; // Conferences mix once per tick
+  for (int i = 0; i < nlive; i++) {
+    struct fesip_call *call = live[i];
+    if (call->rtp.session == NULL)
+      continue;
+    if (fesip_send_dtmf_tick(call, when))
+      ; // Audio paused for the digit
+    else if (call->is_playing)
+      fesip_send_frame(call, when);
+    fesip_receive(call);
+    fesip_playout(call, when);
+  }
+  fertp_flush(); // Batched sessions' frames, all at once
+}
+
+// ------------- Mixing and conferences -----------------
+
+/**
+ * A conference: everybody hears everybody else
+ *
+ * Each frame tick, the audio received from all parties (and the
+ * conference's own play queue) is summed once; each party then gets
+ * the sum minus what it contributed.
+ */
+struct fesip_conf {
+  int rate;			// Mixed at
+  size_t frame;			// Samples per 20 ms
+  unsigned long mixed_tick;	// Media tick sum[] is for
+  int nmembers;
+  struct fesip_call *members[FESIP_MAX_CALLS];
+  struct fesnd_queue queue;	// Heard by all
+  int sum[FESND_MAX_SAMPLES];
+};
+
+/**
+ * A call's part in a conference
+ */
+struct fesip_member {
+  struct fesip_conf *conf;
+  int gain;			// Applied to what it says
+  int rate;			// The call's, when the resamplers were set up
+  struct feresample *rx_rs;	// Call → conference rate, NULL if equal
+  struct feresample *tx_rs;	// Conference → call rate, NULL if equal
+  short rx[CONF_BUFFER];	// Received, at the conference's rate
+  size_t nrx;
+  short self[FESND_MAX_SAMPLES]; // Its share of the current sum
+  short tx[CONF_BUFFER];	// Resampled mix not sent yet
+  size_t ntx;
+};
+
+/**
+ * Sum up this tick's audio of all parties (media_lock held)
+ */
+static void fesip_conf_mix(struct fesip_conf *conf)
+{
+  size_t n = conf->frame;
+  memset(conf->sum, 0, n * sizeof(int));
+  for (int i = 0; i < conf->nmembers; i++) {
+    struct fesip_member *m = conf->members[i]->member;
+    // Whatever arrived, up to a frame; missing samples are silence
+    size_t k = m->nrx < n ? m->nrx : n;
+    memset(m->self, 0, n * sizeof(short));
+    femix_add(m->self, m->rx, k, m->gain);
+    m->nrx -= k;
+    memmove(m->rx, m->rx + k, m->nrx * sizeof(short));
+    femix_sum(conf->sum, m->self, n);
+  }
+  short pcm[FESND_MAX_SAMPLES];
+  ssize_t k = fesnd_next_pcm(&conf->queue, pcm);
+  if (k > 0)
+    femix_sum(conf->sum, pcm, k);
+  conf->mixed_tick = media_ticks;
+}
+
+/**
+ * The conference as heard by this call (media_lock held)
+ *
+ * Returns the samples put into out, a frame at the call's rate
+ */
+static size_t fesip_conf_frame(struct fesip_call *call, short *out)
+{
+  struct fesip_member *m = call->member;
+  struct fesip_conf *conf = m->conf;
+  if (conf->mixed_tick != media_ticks)
+    fesip_conf_mix(conf);
+  if (m->tx_rs == NULL) {
+    femix_minus(out, conf->sum, m->self, conf->frame);
+    return conf->frame;
+  }
+  short mix[FESND_MAX_SAMPLES];
+  femix_minus(mix, conf->sum, m->self, conf->frame);
+  m->ntx += feresample_process(m->tx_rs, mix, conf->frame, m->tx + m->ntx,
+			       CONF_BUFFER - m->ntx);
+  size_t want = call->codec->frame_samples;
+  size_t k = m->ntx < want ? m->ntx : want;
+  memcpy(out, m->tx, k * sizeof(short));
+  memset(out + k, 0, (want - k) * sizeof(short)); // Filter still filling
+  m->ntx -= k;
+  memmove(m->tx, m->tx + k, m->ntx * sizeof(short));
+  return want;
+}
+
+/**
+ * Take received audio into the call's conference (media_lock held)
+ */
+static void fesip_conf_receive(struct fesip_call *call, const short *pcm,
+			       size_t n)
+{
+  struct fesip_member *m = call->member;
+  short resampled[2*FESND_MAX_SAMPLES + 16];
+  if (m->rx_rs != NULL) {
+    n = feresample_process(m->rx_rs, pcm, n, resampled,
+			   sizeof(resampled) / sizeof(short));
+    pcm = resampled;
+  }
+  if (n > CONF_BUFFER) {
+    pcm += n - CONF_BUFFER;
+    n = CONF_BUFFER;
+  }
+  if (m->nrx + n > CONF_BUFFER) {
+    // Arriving faster than mixed: drop the oldest, keeping delay low
+    size_t drop = m->nrx + n - CONF_BUFFER;
+    m->nrx -= drop;
+    memmove(m->rx, m->rx + drop, m->nrx * sizeof(short));
+  }
+  memcpy(m->rx + m->nrx, pcm, n * sizeof(short));
+  m->nrx += n;
+}
+
+/**
+ * Set up resampling for the call's (possibly new) rate (media_lock held)
+ */
+static int fesip_member_set_rate(struct fesip_call *call)
+{
+  struct fesip_member *m = call->member;
+  int rate = fesip_call_rate(call);
+  if (rate == m->rate)
+    return 0;
+  struct feresample *rx_rs = NULL, *tx_rs = NULL;
+  if (rate != m->conf->rate) {
+    rx_rs = feresample_new(rate, 1, m->conf->rate, FERESAMPLE_MEDIUM);
+    tx_rs = feresample_new(m->conf->rate, 1, rate, FERESAMPLE_MEDIUM);
+    if (rx_rs == NULL || tx_rs == NULL) {
+      fprintf(stderr, "Cannot resample between %d and %d samples/s\n",
+	      rate, m->conf->rate);
+      feresample_free(rx_rs);
+      feresample_free(tx_rs);
+      return 1;
+    }
+  }
+  feresample_free(m->rx_rs);
+  feresample_free(m->tx_rs);
+  m->rx_rs = rx_rs;
+  m->tx_rs = tx_rs;
+  m->rate = rate;
+  m->nrx = m->ntx = 0;
+  return 0;
+}
+
+/**
+ * Mix the call's play queues and conference into one frame (media_lock held)
+ *
+ * Returns the encoded bytes, 0 if there is nothing left to play, and
+ * -1 if there is nothing to mix (only the plain play queue, at unity
+ * gain), so frames can be taken from it as they are.
+ */
+static ssize_t fesip_mix_frame(struct fesip_call *call,
+			       const unsigned char **frame)
+{
+  _Bool mixing = call->member != NULL || call->gain[0] != FEMIX_UNITY;
+  for (int l = 0; l < FESIP_LAYERS - 1 && !mixing; l++)
+    mixing = fesnd_pending(&call->layer[l]);
+  if (!mixing)
+    return -1;
+
+  short mix[FESND_MAX_SAMPLES], pcm[FESND_MAX_SAMPLES];
+  size_t n = 0;
+  if (call->member != NULL)
+    n = fesip_conf_frame(call, mix);
+  else
+    memset(mix, 0, sizeof(mix));
+  for (int l = 0; l < FESIP_LAYERS; l++) {
+    struct fesnd_queue *q = l == 0 ? &call->queue : &call->layer[l - 1];
+    ssize_t k = fesnd_next_pcm(q, pcm);
+    if (k > 0) {
+      femix_add(mix, pcm, k, call->gain[l]);
+      if ((size_t)k > n)
+	n = k;
+    }
+  }
+  if (n == 0)
+    return 0;
+  call->queue.level = fesnd_level(mix, n);
+  // The play queue's encoder, so stateful codecs continue seamlessly
+  *frame = call->queue.scratch;
+  return call->codec->encode(&call->queue.enc, call->queue.scratch, mix, n);
+}
+
+fesip_conf_t *fesip_conf_new(int rate)
+{
+  enum fesnd_format format;
+  if (rate == 8000) {
+    format = FESND_L16_8000;
+  } else if (rate == 16000) {
+    format = FESND_L16_16000;
+  } else {
+    fprintf(stderr, "fesip_conf_new(): %d samples/s, should be 8000 or 16000\n",
+	    rate);
+    return NULL;
+  }
+  struct fesip_conf *conf = calloc(1, sizeof(*conf));
+  if (conf == NULL) {
+    fprintf(stderr, "fesip_conf_new(): Out of memory\n");
+    return NULL;
+  }
+  conf->rate = rate;
+  conf->frame = fesnd_codec(format)->frame_samples;
+  fesnd_set_format(&conf->queue, format);
+  return conf;
+}
+
+int fesip_conf_join(fesip_conf_t *conf, fesip_call_t *call, int gain)
+{
+  struct fesip_member *m = calloc(1, sizeof(*m));
+  if (m == NULL) {
+    fprintf(stderr, "fesip_conf_join(): Out of memory\n");
+    return 1;
+  }
+  m->conf = conf;
+  m->gain = gain;
+  pthread_mutex_lock(&media_lock);
+  fesip_conf_leave(call);
+  call->member = m;
+  if (fesip_member_set_rate(call) != 0) {
+    call->member = NULL;
+    pthread_mutex_unlock(&media_lock);
+    free(m);
+    return 1;
+  }
+  conf->members[conf->nmembers++] = call;
+  if (!call->is_playing) {
+    call->is_playing = true;
+    fertp_resume(&call->rtp);
+    fesip_media_wake();
+  }
+  pthread_mutex_unlock(&media_lock);
+  return 0;
+}
+
+void fesip_conf_leave(fesip_call_t *call)
+{
+  pthread_mutex_lock(&media_lock);
+  struct fesip_member *m = call->member;
+  if (m != NULL) {
+    struct fesip_conf *conf = m->conf;
+    for (int i = 0; i < conf->nmembers; i++) {
+      if (conf->members[i] == call) {
+	conf->members[i] = conf->members[--conf->nmembers];
+	break;
+      }
+    }
+    feresample_free(m->rx_rs);
+    feresample_free(m->tx_rs);
+    free(m);
+    call->member = NULL;
+  }
+  pthread_mutex_unlock(&media_lock);
+}
+
+int fesip_conf_play(fesip_conf_t *conf, const char *filename)
+{
+  if (fesnd_check(filename) != 0)
+    return 1; // Diagnostic already printed
+  pthread_mutex_lock(&media_lock);
+  int retval = fesnd_add_checked(&conf->queue, 0, filename);
+  pthread_mutex_unlock(&media_lock);
+  return retval;
+}
+
+void fesip_conf_free(fesip_conf_t *conf)
+{
+  pthread_mutex_lock(&media_lock);
+  while (conf->nmembers > 0)
+    fesip_conf_leave(conf->members[0]);
+  fesnd_close(&conf->queue);
+  pthread_mutex_unlock(&media_lock);
+  free(conf);
+}
+
+// ------------- Telemetry -----------------
+
+int fesip_call_get_stats(const fesip_call_t *call, struct fertp_stats *stats)
+{
+  pthread_mutex_lock(&media_lock);
+  int retval = call->in_use ? 0 : -1;
+  if (retval == 0)
+    *stats = call->rtp.stats;
+  pthread_mutex_unlock(&media_lock);
+  return retval;
+}
+
+int fesip_call_get_receive_stats(const fesip_call_t *call,
+				 struct fejitter_stats *stats)
+{
+  pthread_mutex_lock(&media_lock);
+  int retval = call->in_use ? 0 : -1;
+  if (retval == 0)
+    fejitter_get_stats(&call->jitter, stats);
+  pthread_mutex_unlock(&media_lock);
+  return retval;
+}
+
+void fesip_stats_dump(FILE *f)
+{
+  struct fesip_media_stats media;
+  struct fesip_event_stats events;
+  struct fesip_async_stats async;
+  struct fertp_batch_stats batch;
+  struct fesip_register_stats reg;
+  fesip_media_get_stats(&media);
+  fesip_event_get_stats(&events);
+  fesip_async_get_stats(&async);
+  fesip_register_get_stats(&reg);
+  pthread_mutex_lock(&media_lock); // Updated by the sender
+  fertp_batch_get_stats(&batch);
+  pthread_mutex_unlock(&media_lock);
+  fprintf(f, "{\"media\":{\"ticks\":%lu,\"late\":%lu,\"skipped\":%lu,"
+	  "\"max_late_us\":%ld},\"events\":{\"batches\":%lu,\"events\":%lu,"
+	  "\"full\":%lu,\"max_batch\":%d,\"latency_us\":%.1f,"
+	  "\"max_latency_us\":%ld},\"async\":{\"events\":%lu,\"dropped\":%lu,"
+	  "\"commands\":%lu,\"stale\":%lu},\"batch\":{"
+	  "\"packets\":%lu,\"dropped\":%lu,\"direct\":%lu,\"syscalls\":%lu,"
+	  "\"flush_us\":%.1f},\"register\":{\"accounts\":%d,"
+	  "\"registered\":%d,\"in_flight\":%d,\"queued\":%d,\"sent\":%lu,"
+	  "\"refreshes\":%lu,\"failures\":%lu}}\n",
+	  media.ticks, media.late, media.skipped, media.max_late_ns / 1000,
+	  events.batches, events.events, events.full, events.max_batch,
+	  events.events ? events.latency_ns / 1e3 / events.events : 0.0,
+	  events.max_latency_ns / 1000, async.events, async.dropped,
+	  async.commands, async.stale,
+	  batch.packets, batch.dropped, batch.direct, batch.syscalls,
+	  batch.flushes ? batch.flush_ns / 1e3 / batch.flushes : 0.0,
+	  reg.accounts, reg.registered, reg.in_flight, reg.queued, reg.sent,
+	  reg.refreshes, reg.failures);
+  // One call at a time, so printing does not hold up the media
+  for (int i = 0; i < FESIP_MAX_CALLS; i++) {
+    struct fertp_stats st;
+    struct fejitter_stats rx;
+    int cid;
+    pthread_mutex_lock(&media_lock);
+    _Bool active = calls[i].in_use && (calls[i].rtp.stats.frames > 0
+				       || calls[i].jitter.stats.received > 0);
+    if (active) {
+      st = calls[i].rtp.stats;
+      fejitter_get_stats(&calls[i].jitter, &rx);
+      cid = calls[i].cid;
+    }
+    pthread_mutex_unlock(&media_lock);
+    if (!active)
+      continue;
+    unsigned long frames = st.frames > 0 ? st.frames : 1;
+    fprintf(f, "{\"call\":%d,\"frames\":%lu,\"late\":%lu,\"skipped\":%lu,"
+	    "\"suppressed\":%lu,\"cn\":%lu,\"drift_us\":%ld,\"max_drift_us\":%ld,"
+	    "\"encode_us_per_frame\":%.2f,\"send_us_per_frame\":%.2f,"
+	    "\"interval_us\":{\"p50\":%ld,\"p99\":%ld,\"p999\":%ld,"
+	    "\"max\":%ld},\"late_us\":{\"p50\":%ld,\"p99\":%ld},"
+	    "\"rx\":{\"packets\":%lu,\"late\":%lu,\"lost\":%lu,"
+	    "\"concealed_ms\":%lu,\"depth_ms\":%u,\"target_ms\":%u,"
+	    "\"jitter_ms\":%u}}\n",
+	    cid, st.frames, st.late, st.skipped, st.suppressed, st.cn,
+	    st.drift_ns / 1000, st.max_drift_ns / 1000,
+	    st.encode_ns / 1e3 / frames, st.send_ns / 1e3 / frames,
+	    fertp_hist_percentile(st.interval, 0.5),
+	    fertp_hist_percentile(st.interval, 0.99),
+	    fertp_hist_percentile(st.interval, 0.999),
+	    fertp_hist_percentile(st.interval, 1.0),
+	    fertp_hist_percentile(st.lateness, 0.5),
+	    fertp_hist_percentile(st.lateness, 0.99),
+	    rx.received, rx.late, rx.lost, rx.concealed_ms, rx.depth_ms,
+	    rx.target_ms, rx.jitter_ms);
+  }
+}
+
+void fesip_stats_signal(int UNUSED_PARAM(sig))
+{
+  stats_please = true;
+  fesip_wakeup();
+}
+
+/**
+ * Dump if asked to by fesip_stats_signal()
+ */
+static void fesip_stats_check(void)
+{
+  if (stats_please && __atomic_exchange_n(&stats_please, 0, __ATOMIC_ACQ_REL))
+    fesip_stats_dump(stderr);
+}
+
+// ------------- Media thread -----------------
+
+/**
+ * Handle every call's audio for the frame due at *next (media_lock held)
+ *
+ * Part of an absolute 20 ms schedule: a wakeup that is a little late
+ * is caught up on by the following ones, which are then due
+ * immediately. When more than MEDIA_MAX_LATE frames behind, the
+ * schedule (*next) skips ahead instead of bursting; the RTP timestamps
+ * follow the schedule, so the receiver sees a gap but no drift.
+ */
+static void fesip_media_period(struct timespec *next)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long late = timespec_diff_ns(&now, next);
+  media_stats.ticks++;
+  if (late > FRAME_NS / 10)
+    media_stats.late++;
+  if (late > media_stats.max_late_ns)
+    media_stats.max_late_ns = late;
+  if (late >= MEDIA_MAX_LATE * FRAME_NS) {
+    long skip = late / FRAME_NS;
+    media_stats.skipped += skip;
+    timespec_add_ns(next, skip * FRAME_NS);
+  }
+  fesip_media_tick(next);
+}
+
+static void *fesip_media_main(void *UNUSED_PARAM(arg))
+{
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (media_running) {
+    timespec_add_ns(&next, FRAME_NS);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+      ;
+    pthread_mutex_lock(&media_lock);
+    fesip_media_period(&next);
+    pthread_mutex_unlock(&media_lock);
+    fesip_stats_check();
+  }
+  return NULL;
+}
+
+int fesip_media_start(int priority, int cpu)
+{
+  pthread_attr_t attr;
+  if (media_running)
+    return 0;
+  pthread_attr_init(&attr);
+  if (priority > 0) {
+    struct sched_param param = { .sched_priority = priority };
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+  }
+  // Only sessions started from now on can be paced by us
+  fertp_set_clocked(true);
+  media_running = true;
+  int i = pthread_create(&media_thread, &attr, fesip_media_main, NULL);
+  if (i == EPERM && priority > 0) {
+    fprintf(stderr, "flexosip: No permission for SCHED_FIFO, "
+	    "media thread runs with normal priority\n");
+    pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+    i = pthread_create(&media_thread, &attr, fesip_media_main, NULL);
+  }
+  pthread_attr_destroy(&attr);
+  if (i != 0) {
+    fprintf(stderr, "flexosip: Cannot create media thread: %s\n", strerror(i));
+    media_running = false;
+    fertp_set_clocked(reactor_fd >= 0);
+    return -1;
+  }
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    i = pthread_setaffinity_np(media_thread, sizeof(set), &set);
+    if (i != 0)
+      fprintf(stderr, "flexosip: Cannot pin media thread to CPU %d: %s\n",
+	      cpu, strerror(i));
+  }
+  return 0;
+}
+
+void fesip_media_stop(void)
+{
+  if (!media_running)
+    return;
+  media_running = false;
+  pthread_join(media_thread, NULL);
+  fertp_set_clocked(reactor_fd >= 0);
+}
+
+// ------------- Reactor -----------------
+
+static int fesip_epoll_add(int fd, uint32_t tag)
+{
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = tag };
+  return epoll_ctl(reactor_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * Arm the timer (media_lock held)
+ *
+ * At the frame rate while audio or DTMF is to be sent or received
+ * audio played out, else every IDLE_NS for eXosip's housekeeping.
+ */
+static void fesip_timer_arm(_Bool media)
+{
+  struct itimerspec its = {0};
+  timer_media = media;
+  if (media) {
+    its.it_value = timer_next;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+  } else {
+    its.it_value.tv_sec = its.it_interval.tv_sec = IDLE_NS / 1000000000L;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = IDLE_NS % 1000000000L;
+    timerfd_settime(timer_fd, 0, &its, NULL);
+  }
+}
+
+/**
+ * Whether any call has audio or DTMF to send, or received audio to
+ * play out (media_lock held)
+ */
+static _Bool fesip_media_busy(void)
+{
+  for (int i = 0; i < nlive; i++) {
+    struct fesip_call *call = live[i];
+    if (call->rtp.session != NULL && (call->is_playing || call->dtmf_ticks > 0
+				      || call->dtmf_head != call->dtmf_tail
+				      || fejitter_active(&call->jitter)))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * Start the frame timer, there is something to send or play out
+ * (media_lock held)
+ */
+static void fesip_media_wake(void)
+{
+  if (reactor_fd < 0 || media_running || timer_media)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &timer_next); // Due right away
+  fesip_timer_arm(true);
+}
+
+/**
+ * Watch the call's RTP socket (media_lock held)
+ *
+ * Not while the media thread runs, it receives on every tick anyway.
+ */
+static void fesip_poll_add(struct fesip_call *call)
+{
+  if (reactor_fd < 0 || media_running || call->polled)
+    return;
+  int fd = fertp_fd(&call->rtp);
+  if (fd >= 0 && fesip_epoll_add(fd, call->slot) == 0)
+    call->polled = true;
+}
+
+static void fesip_poll_del(struct fesip_call *call)
+{
+  if (!call->polled)
+    return;
+  // Stays open in the session pool, so remove explicitly
+  epoll_ctl(reactor_fd, EPOLL_CTL_DEL, fertp_fd(&call->rtp), NULL);
+  call->polled = false;
+}
+
+/**
+ * Set up the epoll set, once
+ *
+ * Returns != 0 on error
+ */
+static int fesip_reactor_init(void)
+{
+  if (reactor_fd >= 0)
+    return 0;
+  if (fesip_ctx() == NULL)
+    return -1;
+  reactor_fd = epoll_create1(EPOLL_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (reactor_fd < 0 || timer_fd < 0 || wake_fd < 0
+      || fesip_epoll_add(eXosip_event_geteventsocket(ctx), POLL_SIP) != 0
+      || fesip_epoll_add(timer_fd, POLL_TIMER) != 0
+      || fesip_epoll_add(wake_fd, POLL_WAKE) != 0) {
+    fprintf(stderr, "flexosip: Cannot set up the event loop: %s\n",
+	    strerror(errno));
+    if (reactor_fd >= 0)
+      close(reactor_fd);
+    if (timer_fd >= 0)
+      close(timer_fd);
+    if (wake_fd >= 0)
+      close(wake_fd);
+    reactor_fd = timer_fd = wake_fd = -1;
+    return -1;
+  }
+  if (addr_fd >= 0)
+    fesip_epoll_add(addr_fd, POLL_ADDR); // Else drained when needed
+  // Frames are sent on our timer, as by the media thread
+  fertp_set_clocked(true);
+  pthread_mutex_lock(&media_lock);
+  fesip_timer_arm(false);
+  for (int i = 0; i < nlive; i++)
+    fesip_poll_add(live[i]);
+  if (fesip_media_busy())
+    fesip_media_wake();
+  pthread_mutex_unlock(&media_lock);
+  return 0;
+}
+
+/**
+ * The timer expired: send the frame due or do the housekeeping
+ */
+static eXosip_event_t *fesip_timer_expired(void)
+{
+  uint64_t expirations;
+  if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+    return NULL; // Spurious, e.g. re-armed in the meantime
+  pthread_mutex_lock(&media_lock);
+  if (timer_media) {
+    fesip_media_period(&timer_next);
+    if (fesip_media_busy()) {
+      timespec_add_ns(&timer_next, FRAME_NS);
+      fesip_timer_arm(true);
+    } else {
+      fesip_timer_arm(false);
+    }
+    pthread_mutex_unlock(&media_lock);
+    return NULL;
+  }
+  pthread_mutex_unlock(&media_lock);
+  return fesip_wait_event(0, 0); // Runs eXosip_automatic_action()
+}
+
+/**
+ * Wait for and handle whatever is ready
+ *
+ * Returns the last SIP event handled (or NULL) in *evt,
+ * and < 0 on error.
+ */
+static int fesip_reactor_wait(int timeout_ms, eXosip_event_t **evt)
+{
+  struct epoll_event ready[REACTOR_EVENTS];
+  int n = epoll_wait(reactor_fd, ready, REACTOR_EVENTS, timeout_ms);
+  if (n < 0) {
+    if (errno != EINTR)
+      return -1;
+    n = 0;
+  }
+  if (clean_up_please)
+    fesip_wait_event(0, 0); // Does not return
+  fesip_stats_check();
+  for (int i = 0; i < n; i++) {
+    uint32_t tag = ready[i].data.u32;
+    eXosip_event_t *e, *evts[FESIP_EVENT_BATCH];
+    char buf[512];
+    int nevts;
+    switch (tag) {
+    case POLL_SIP:
+      // eXosip writes a byte per event, but reads them only when
+      // its queue is empty: drain here, or epoll would keep firing
+      if (read(eXosip_event_geteventsocket(ctx), buf, sizeof(buf)) < 0) {
+	// Nothing there after all, the queue is checked anyway
+      }
+      do {
+	nevts = fesip_wait_events(0, 0, evts, FESIP_EVENT_BATCH);
+	if (nevts > 0)
+	  *evt = evts[nevts - 1];
+      } while (nevts == FESIP_EVENT_BATCH);
+      break;
+    case POLL_TIMER:
+      e = fesip_timer_expired();
+      if (e != NULL)
+	*evt = e;
+      break;
+    case POLL_WAKE:
+      if (read(wake_fd, buf, sizeof(uint64_t)) < 0) {
+	// Already reset
+      }
+      break;
+    case POLL_ADDR:
+      eXosip_lock(ctx);
+      fesip_addr_drain();
+      eXosip_unlock(ctx);
+      break;
+    default:
+      pthread_mutex_lock(&media_lock);
+      if (calls[tag].polled)
+	fesip_receive(&calls[tag]);
+      pthread_mutex_unlock(&media_lock);
+      break;
+    }
+  }
+  fesip_deliver_dtmf(); // Received by the media thread or timer
+  fesip_async_execute();
+  return n;
+}
+
+int fesip_fd(void)
+{
+  if (fesip_reactor_init() != 0)
+    return -1;
+  return reactor_fd;
+}
+
+int fesip_get_fds(struct pollfd *fds, int max)
+{
+  if (fesip_reactor_init() != 0)
+    return -1;
+  int n = 0;
+  int fixed[4] = { eXosip_event_geteventsocket(ctx), timer_fd, wake_fd,
+		   addr_fd };
+  for (int i = 0; i < 4; i++) {
+    if (fixed[i] < 0)
+      continue; // No netlink socket
+    if (n < max)
+      fds[n] = (struct pollfd) { .fd = fixed[i], .events = POLLIN };
+    n++;
+  }
+  pthread_mutex_lock(&media_lock);
+  for (int i = 0; i < nlive; i++) {
+    if (!live[i]->polled)
+      continue;
+    if (n < max)
+      fds[n] = (struct pollfd) { .fd = fertp_fd(&live[i]->rtp),
+				 .events = POLLIN };
+    n++;
+  }
+  pthread_mutex_unlock(&media_lock);
+  return n;
+}
+
+int fesip_dispatch(void)
+{
+  eXosip_event_t *evt = NULL;
+  if (fesip_reactor_init() != 0)
+    return -1;
+  return fesip_reactor_wait(0, &evt);
+}
+
+eXosip_event_t *fesip_handle_event(void)
+{
+  eXosip_event_t *evt = NULL;
+  if (fesip_reactor_init() != 0) {
+    // Poll instead
+    evt = fesip_wait_event(0, 10); // Shorter than 20ms inter-packet time
+    fesip_async_execute();
+    if (media_running)
+      return evt; // The media thread does the sending
+    pthread_mutex_lock(&media_lock);
+    fesip_media_tick(NULL);
+    pthread_mutex_unlock(&media_lock);
+    fesip_deliver_dtmf();
+    return evt;
+  }
+  fesip_reactor_wait(-1, &evt);
+  return evt;
+}
+
+int fesip_run(void)
+{
+  eXosip_event_t *evt;
+  if (fesip_reactor_init() != 0)
+    return -1;
+  run_stop = false;
+  while (!run_stop)
+    if (fesip_reactor_wait(-1, &evt) < 0) {
+      fprintf(stderr, "flexosip: epoll_wait(): %s\n", strerror(errno));
+      return -1;
+    }
+  return 0;
+}
+
+void fesip_run_stop(void)
+{
+  run_stop = true;
+  fesip_wakeup();
+}
+
+void fesip_wakeup(void)
+{
+  uint64_t one = 1;
+  if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0) {
+    // Counter full, a wakeup is pending anyway
+  }
+}
+
+void fesip_set_inband_dtmf(_Bool enable)
+{
+  inband_dtmf = enable;
+}
+
+void fesip_set_dtx(_Bool enable)
+{
+  dtx = enable;
+  sdp_gen++; // The offer changes
+}
+
+int fesip_set_codecs(const char *codecs)
+{
+  enum fesnd_format prefs[FESND_NFORMATS];
+  int n = 0;
+  unsigned mask = 0;
+  char name[32];
+  while (*codecs != '\0') {
+    // "<name>/<clock-rate>", separated by commas or blanks
+    size_t len = strcspn(codecs, ", ");
+    if (len > 0) {
+      snprintf(name, sizeof(name), "%.*s", (int)len, codecs);
+      char *slash = strchr(name, '/');
+      int format = -1;
+      if (slash != NULL) {
+	*slash = '\0';
+	format = fesnd_codec_find(name, atoi(slash + 1));
+      }
+      if (format < 0) {
+	fprintf(stderr, "flexosip: Unknown codec %.*s\n", (int)len, codecs);
+	return -1;
+      }
+      if (!(mask & 1 << format)) {
+	prefs[n++] = format;
+	mask |= 1 << format;
+      }
+      codecs += len;
+    } else {
+      codecs++;
+    }
+  }
+  if (n == 0) {
+    fprintf(stderr, "flexosip: No codecs given\n");
+    return -1;
+  }
+  memcpy(codec_prefs, prefs, n * sizeof(prefs[0]));
+  ncodec_prefs = n;
+  sdp_gen++; // The offer changes
+  fesnd_cache_set_preload_formats(mask);
+  return 0;
+}
+
+int fesip_call_rate(const fesip_call_t *call)
+{
+  return call->codec != NULL ? call->codec->rate
+    : fesnd_format_rate(FESND_PCMA8000);
+}
+
+void fesip_media_get_stats(struct fesip_media_stats *stats)
+{
+  pthread_mutex_lock(&media_lock);
+  *stats = media_stats;
+  pthread_mutex_unlock(&media_lock);
+}
+
+fesip_call_t *fesip_call(const char *from, const char *to, const char *subject,
+	       void *reference)
+{
+  osip_message_t *invite;
+  struct fesip_call *call;
+  int i;
+
+  fesip_ctx();
+  eXosip_lock(ctx);
+  call = fesip_call_alloc();
+  if (call == NULL) {
+    OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_ERROR, NULL,
+			  "fesip_call(): all %d call slots in use\r\n",
+			  FESIP_MAX_CALLS));
+    eXosip_unlock(ctx);
+    return NULL;
+  }
+  i = eXosip_call_build_initial_invite(ctx, &invite, to, from,
+				       NULL, // optional route header
+				       subject);
+  if (i != 0) {
+    fesip_call_release(call);
+    eXosip_unlock(ctx);
+    return NULL;
+  }
+  osip_message_set_supported(invite, "100rel");
+  fesip_build_sdp(call, invite); // Offer
+
+  i = eXosip_call_send_initial_invite(ctx, invite);
+  if (i > 0) {
+    fesip_call_map(call, i);
+    call->reference = reference;
+    eXosip_call_set_reference(ctx, i, reference);
+  } else {
+    fesip_call_release(call);
+    call = NULL;
+  }
+  eXosip_unlock(ctx);
+  return call;
+}
+
+int fesip_ringback(fesip_call_t *call)
+{
+  fesip_ctx();
+  eXosip_lock(ctx);
+  eXosip_call_send_answer(ctx, call->tid, SIP_RINGING, NULL);
+  eXosip_unlock(ctx);
+  return 0;
+}
+
+int fesip_terminate(fesip_call_t *call)
+{
+  fesip_ctx();
+  eXosip_lock(ctx);
+  fesip_terminate_nolock(call);
+  eXosip_unlock(ctx);
+  return 0;
+}
+
+void fesip_terminate_nolock(fesip_call_t *call)
+{
+  if (call == NULL || !call->in_use)
+    return;
+  if (call->cid >= 0 || call->did >= 0) {
+    eXosip_call_terminate(ctx, call->cid, call->did);
+  }
+  fesip_call_release(call);
+}
+
+void fesip_send_dtmf(fesip_call_t *call, char digit)
+{
+  fesip_ctx();
+  osip_message_t *info;
+  char dtmf_body[1000];
+  int i;
+
+  if (call->dtmf_pt >= 0) {
+    // In the RTP stream (RFC 4733), sent by the next media ticks
+    if (digit == '\0' || strchr(DTMF_DIGITS, digit) == NULL) {
+      OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_ERROR, NULL,
+			    "Invalid DTMF digit %c\r\n", digit));
+      return;
+    }
+    pthread_mutex_lock(&media_lock);
+    int nexthead = (call->dtmf_head + 1) % DTMF_QUEUE;
+    if (nexthead != call->dtmf_tail) {
+      call->dtmf_tx[call->dtmf_head] = digit;
+      call->dtmf_head = nexthead;
+      fesip_media_wake();
+    } else {
+      OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_ERROR, NULL,
+			    "DTMF queue full, dropping %c\r\n", digit));
+    }
+    pthread_mutex_unlock(&media_lock);
+    return;
+  }
+  if (call->did < 0) {
+    OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_ERROR, NULL,
+			  "No call to send DTMF digit\r\n"));
+    return;
+  }
+  eXosip_lock(ctx);
+  i = eXosip_call_build_info(ctx, call->did, &info);
+  if (i == 0)
+  {
+     snprintf(dtmf_body, 999, "Signal=%c\r\nDuration=250\r\n", digit);
+     osip_message_set_content_type(info, "application/dtmf-relay");
+     osip_message_set_body(info, dtmf_body, strlen (dtmf_body));
+     i = eXosip_call_send_request(ctx, call->did, info);
+  }
+  eXosip_unlock(ctx);
+}
+
+void fesip_cleanup(int sig)
+{
+  fprintf(stderr, "Received signal %d; repeat if we don't exit now...\n", sig);
+  signal(sig, SIG_DFL); // Next signal of the same type will kill the program ungracefully
+  clean_up_please = true;
+}
+
+// Weak methods, ready to be overridden
+
+void __attribute__((weak)) fesip_event_answered(fesip_call_t *UNUSED_PARAM(call),
+    eXosip_event_t *UNUSED_PARAM(evt),
+    const char *UNUSED_PARAM(host), int UNUSED_PARAM(port), int UNUSED_PARAM(format))
+{
+  OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_INFO3, NULL,
+			"answered call\r\n"));
+}
+
+int __attribute__((weak)) fesip_event_invite(fesip_call_t *UNUSED_PARAM(call),
+    eXosip_event_t *UNUSED_PARAM(evt),
+    const char *UNUSED_PARAM(host), int UNUSED_PARAM(port), int UNUSED_PARAM(format))
+{
+  OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_INFO3, NULL,
 			"invite (incoming call)\r\n"));
   return SIP_RINGING;
 }
 
-void __attribute__((weak)) fesip_event_terminate(eXosip_event_t *UNUSED_PARAM(evt))
+void __attribute__((weak)) fesip_event_terminate(fesip_call_t *UNUSED_PARAM(call),
+    eXosip_event_t *UNUSED_PARAM(evt))
 {
   OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_INFO3, NULL,
 			"Terminate existing call\r\n"));
 }
-void __attribute__((weak)) fesip_event_dtmf(char digit)
+void __attribute__((weak)) fesip_event_dtmf(fesip_call_t *UNUSED_PARAM(call), char digit)
 {
   OSIP_TRACE(osip_trace(__FILE__, __LINE__, OSIP_INFO3, NULL,
 			"received DTMF digit %c\r\n", digit));
 }
+
+void __attribute__((weak)) fesip_event_registration(fesip_account_t *UNUSED_PARAM(account),
+    enum fesip_reg_state UNUSED_PARAM(state), int UNUSED_PARAM(status))
+{
+  // Failures are reported on stderr already
+}
+
+void __attribute__((weak)) fesip_event_batch(eXosip_event_t *const *UNUSED_PARAM(evts),
+    int UNUSED_PARAM(n))
+{
+  // Each has been handled already
+}
+
+void __attribute__((weak)) fesip_event_audio(fesip_call_t *UNUSED_PARAM(call),
+    const short *UNUSED_PARAM(pcm), size_t UNUSED_PARAM(n))
+{
+  // Discard
+}
@@ -1,10 +1,56 @@
 #include <eXosip2/eXosip.h>
 #include <ortp/ortp.h>
 #include <stdbool.h>
+#include <stdio.h>
+
+struct pollfd;
+struct fertp_stats;
+struct fejitter_stats;
+struct fesnd_stream;
+struct fesnd_broadcast;
 
 #define ALAW8K_BUF20MS 160 // 160 bytes=160 samples≡20 ms (with A-Law 8 kHz)
 #define ALAW16K_BUF20MS 320 // 320 bytes=320 samples≡20 ms (with A-Law 16 kHz)
 
+#ifndef FESIP_MAX_CALLS
+#define FESIP_MAX_CALLS 64 // # of simultaneous calls (incoming and outgoing)
+#endif
+
+#ifndef FESIP_EVENT_BATCH
+#define FESIP_EVENT_BATCH 32 // Max. SIP events handled under one lock
+#endif
+
+#ifndef FESIP_LAYERS
+#define FESIP_LAYERS 4 // Play queues mixed per call
+#endif
+
+#ifndef FESIP_MAX_ACCOUNTS
+#define FESIP_MAX_ACCOUNTS 1024 // # of SIP identities registered at once
+#endif
+
+#ifndef FESIP_ASYNC_QUEUE
+#define FESIP_ASYNC_QUEUE 256 // Events/commands queued for/by workers (2^n)
+#endif
+
+/**
+ * Handle for a single call, incoming or outgoing (opaque)
+ *
+ * Valid from the fesip_call()/fesip_event_invite() which created it
+ * until the call terminates (i.e., after fesip_event_terminate()
+ * returns or fesip_terminate() is called).
+ */
+typedef struct fesip_call fesip_call_t;
+
+/**
+ * Handle for a conference bridge (opaque), see fesip_conf_new()
+ */
+typedef struct fesip_conf fesip_conf_t;
+
+/**
+ * Handle for a registered SIP identity (opaque), see fesip_account_add()
+ */
+typedef struct fesip_account fesip_account_t;
+
 /**
  * Obtain the context handle
  *
@@ -30,6 +76,9 @@ int fesip_listen(int proto, int secure, int port);
 /**
  * Register a session
  *
+ * Same as fesip_account_add() with a 1800 s registration, returning
+ * its registration ID (< 0 on error).
+ *
  * @param url		The SIP user's URL, e.g. "sip:User Name <user.name@example.com>"
  * @param registrar	Host name of the registrar
  * @param login		The user's login
@@ -48,16 +97,131 @@ int fesip_register(const char *url,
 int fesip_unregister(int rid);
 
 /**
- * Wait for the registration to succeed
+ * Wait for all registrations to succeed
  *
- * This works only if this is the first and only registration.
+ * Handles SIP events for up to 15 s, until every account is either
+ * registered (OSIP_SUCCESS) or at least one has failed (OSIP_NO_RIGHTS).
+ * OSIP_TIMEOUT otherwise.
  */
 int fesip_wait_registered(void);
 
 /**
- * Wait for an event, but at most the specified time
+ * Where an account's registration is at
+ */
+enum fesip_reg_state {
+  FESIP_REG_QUEUED,		// Waiting for its turn to send REGISTER
+  FESIP_REG_SENT,		// REGISTER outstanding
+  FESIP_REG_REGISTERED,		// Refresh scheduled
+  FESIP_REG_BACKOFF,		// Failed, retry scheduled
+};
+
+/**
+ * Add a SIP identity, to be registered and kept registered
+ *
+ * The REGISTER is sent as soon as fewer than the limit set with
+ * fesip_set_register_limit() are outstanding. It is refreshed after
+ * 50–80% of the time granted (spread at random, so accounts added
+ * together do not stay in lockstep); failures are retried after
+ * exponentially growing pauses (30 s up to 30 min, RFC 5626 4.5).
+ *
+ * NULL means error (all FESIP_MAX_ACCOUNTS in use, or eXosip refused
+ * the URLs). Not from within an event handler.
+ *
+ * @param url		The SIP user's URL, e.g. "sip:User Name <user.name@example.com>"
+ * @param registrar	Host name of the registrar
+ * @param login		The user's login
+ * @param password	The user's password
+ * @param expires	Registration time asked for (s), 0 = 1800
+ */
+fesip_account_t *fesip_account_add(const char *url, const char *registrar,
+				   const char *login, const char *password,
+				   int expires);
+
+/**
+ * Unregister an account and forget it
  *
- * NULL means no (interesting) event happened.
+ * The handle is invalid afterwards. Not from within an event handler.
+ *
+ * @param account	The account
+ */
+void fesip_account_remove(fesip_account_t *account);
+
+/**
+ * State of an account's registration
+ *
+ * @param account	The account
+ * @param expires	Set to the seconds left of the registration
+ *			(0 = not registered), unless NULL
+ */
+enum fesip_reg_state fesip_account_state(const fesip_account_t *account,
+					 int *expires);
+
+/**
+ * Application reference of an account (NULL until set)
+ */
+void *fesip_account_reference(const fesip_account_t *account);
+
+/**
+ * Set the application reference of an account
+ */
+void fesip_account_set_reference(fesip_account_t *account, void *reference);
+
+/**
+ * Limit the REGISTER transactions outstanding at once (default 16)
+ *
+ * Initial registrations, refreshes and retries all wait for their
+ * turn, so a registrar is not flooded at startup or when it comes
+ * back.
+ *
+ * @param in_flight	The limit, >= 1
+ */
+void fesip_set_register_limit(int in_flight);
+
+/**
+ * Counters of the registration manager
+ */
+struct fesip_register_stats {
+  int accounts;			// Added and not removed
+  int registered;		// Of them, with a registration in effect
+  int in_flight;		// REGISTERs outstanding
+  int queued;			// Waiting to be sent
+  unsigned long sent;		// REGISTERs sent (incl. refreshes, retries)
+  unsigned long refreshes;	// Of them, refreshes
+  unsigned long failures;	// Transactions failed or timed out
+};
+
+/**
+ * Get the counters of the registration manager
+ *
+ * @param stats		Filled in
+ */
+void fesip_register_get_stats(struct fesip_register_stats *stats);
+
+/**
+ * Wait for events, but at most the specified time, then handle all
+ * that are pending (up to max) as one batch
+ *
+ * The batch is taken from eXosip's queue at once and handled under a
+ * single eXosip_lock(), with eXosip_automatic_action() run once.
+ * fesip_event_batch() sees it afterwards.
+ *
+ * Returns the number of events handled, 0 if none. They stay valid
+ * until a later call returns events (and are freed then).
+ *
+ * @param seconds	Full seconds
+ * @param milliseconds	Milliseconds
+ * @param evts		Filled in with the events handled
+ * @param max		Room in evts (at most FESIP_EVENT_BATCH are used)
+ */
+int fesip_wait_events(int seconds, int milliseconds,
+		      eXosip_event_t **evts, int max);
+
+/**
+ * Wait for an event, but at most the specified time, and handle it
+ *
+ * One event at a time, as a batch of one (see fesip_wait_events()).
+ *
+ * NULL means no event happened, else the event handled.
  *
  * @param seconds	Full seconds
  * @param milliseconds	Milliseconds
@@ -65,80 +229,468 @@ int fesip_wait_registered(void);
 eXosip_event_t *fesip_wait_event(int seconds, int milliseconds);
 
 /**
- * Send audio chunk, if any, and wait for next event.
- * Return in time to be able to send another audio chunk.
+ * Counters of the SIP event batches
+ *
+ * The handler latency is from taking a batch off eXosip's queue to
+ * handling each of its events, i.e. what the events before it in the
+ * batch cost. Time spent in eXosip's queue before is not included
+ * (eXosip does not timestamp its events).
+ */
+struct fesip_event_stats {
+  unsigned long batches;	// Non-empty batches handled
+  unsigned long events;		// Events in them
+  unsigned long full;		// Batches that hit the limit
+  int max_batch;		// Most events in one batch
+  long long latency_ns;		// Handler latency, summed over all events
+  long max_latency_ns;		// Longest for a single event
+};
+
+/**
+ * Get the counters of the SIP event batches
+ *
+ * Average batch size is events / batches, average delay
+ * latency_ns / events.
+ *
+ * @param stats		Filled in
+ */
+void fesip_event_get_stats(struct fesip_event_stats *stats);
+
+/**
+ * Wait until something happens, then handle it
+ *
+ * That is, a SIP event, received audio, or an audio frame to be sent
+ * (every 20 ms while playing, unless the media thread does that), or
+ * eXosip's housekeeping (every 5 s). An idle device thus sleeps.
+ *
+ * Returns the last SIP event handled, NULL if none.
  */
 eXosip_event_t *fesip_handle_event(void);
 
+/**
+ * Handle everything until fesip_run_stop()
+ *
+ * Same as calling fesip_handle_event() in a loop. The application
+ * then acts from the event handlers only (fesip_wakeup() and its own
+ * descriptors, see fesip_fd(), help with that).
+ *
+ * Returns != 0 on error
+ */
+int fesip_run(void);
+
+/**
+ * Make fesip_run() return (callable from any thread or signal handler)
+ */
+void fesip_run_stop(void);
+
+/**
+ * Make the waiting fesip_handle_event() return (any thread or signal
+ * handler), e.g. from fesip_event_audio() in the media thread
+ */
+void fesip_wakeup(void);
+
+/**
+ * A descriptor to wait on in the application's own event loop
+ *
+ * An epoll set of all of flexosip's descriptors (see fesip_get_fds()).
+ * When it is readable, call fesip_dispatch(). Call before making or
+ * accepting calls, as audio frames are then sent from there, paced by
+ * its timer, unless the media thread runs.
+ *
+ * Returns -1 on error
+ */
+int fesip_fd(void);
+
+/**
+ * The individual descriptors, e.g. for poll() (all with POLLIN)
+ *
+ * The eXosip event socket, the timer, the wakeup eventfd, the netlink
+ * socket watching the local address (once there is one), and the RTP
+ * socket of each call. The set changes as calls come and go: get it
+ * again after each fesip_dispatch().
+ *
+ * Returns the number of descriptors, which may be more than max
+ * (then only the first max are filled in), -1 on error
+ *
+ * @param fds		Filled in
+ * @param max		Room in fds
+ */
+int fesip_get_fds(struct pollfd *fds, int max);
+
+/**
+ * Handle whatever is ready on fesip_fd(), without blocking
+ *
+ * Returns the number of descriptors handled, < 0 on error
+ */
+int fesip_dispatch(void);
+
+/**
+ * Counters of the media thread (or of the reactor's frame timer)
+ */
+struct fesip_media_stats {
+  unsigned long ticks;		// 20 ms periods handled
+  unsigned long late;		// Wakeups more than 2 ms late
+  unsigned long skipped;	// Periods skipped after falling far behind
+  long max_late_ns;		// Latest wakeup seen
+};
+
+/**
+ * Send audio from a dedicated media thread
+ *
+ * Frames of all calls are then sent on an absolute 20 ms schedule
+ * with RTP timestamps locked to CLOCK_MONOTONIC, independent of event
+ * handling; fesip_handle_event() only waits for events. Call before
+ * making or accepting calls; sessions already started keep being paced
+ * by oRTP.
+ *
+ * Returns != 0 on error
+ *
+ * @param priority	SCHED_FIFO priority (1..99), 0 for normal scheduling.
+ *			Falls back to normal scheduling if not permitted.
+ * @param cpu		CPU to pin the thread to, -1 for any
+ */
+int fesip_media_start(int priority, int cpu);
+
+/**
+ * Stop the media thread (fesip_quit() does this as well)
+ */
+void fesip_media_stop(void);
+
+/**
+ * Get the media thread's counters
+ *
+ * @param stats		Filled in
+ */
+void fesip_media_get_stats(struct fesip_media_stats *stats);
+
+/**
+ * Get the send-path telemetry of a call (see struct fertp_stats)
+ *
+ * Returns != 0 if the call is gone
+ *
+ * @param call		The call handle
+ * @param stats		Filled in
+ */
+int fesip_call_get_stats(const fesip_call_t *call, struct fertp_stats *stats);
+
+/**
+ * Get the receive-path telemetry of a call (see struct fejitter_stats)
+ *
+ * Packets received, late and lost, the audio concealed, and the
+ * jitter buffer's current and target depth.
+ *
+ * Returns != 0 if the call is gone
+ *
+ * @param call		The call handle
+ * @param stats		Filled in
+ */
+int fesip_call_get_receive_stats(const fesip_call_t *call,
+				 struct fejitter_stats *stats);
+
+/**
+ * Print all counters, one JSON object per line: the media and event
+ * counters, then the telemetry of each call sending audio
+ *
+ * @param f		Where to, e.g. stderr
+ */
+void fesip_stats_dump(FILE *f);
+
+/**
+ * Signal handler dumping the counters to stderr
+ *
+ * E.g. signal(SIGUSR1, fesip_stats_signal). The dump is done from the
+ * media thread or the event loop, whichever comes first.
+ *
+ * @param sig		Signal it was called from
+ */
+void fesip_stats_signal(int sig);
+
+/**
+ * Detect DTMF tones in the received audio (default: on)
+ *
+ * Only used for calls without RFC 4733 telephone-events; digits
+ * are reported through fesip_event_dtmf() like all others.
+ *
+ * @param enable	Whether to run the in-band detector
+ */
+void fesip_set_inband_dtmf(_Bool enable);
+
+/**
+ * Stop sending during silence (default: on)
+ *
+ * With peers accepting RFC 3389 comfort noise, frames quieter than
+ * -55 dBov (delays, pauses in the files, silent conferences) are not
+ * sent after a short hangover; one comfort noise packet tells the
+ * peer the level to fill in instead, another one only if it changes
+ * noticeably. Sending resumes with the RTP marker bit set. Off, comfort
+ * noise is no longer offered either. Applies to calls negotiated
+ * afterwards.
+ *
+ * @param enable	Whether to offer comfort noise and suppress silence
+ */
+void fesip_set_dtx(_Bool enable);
+
+/**
+ * Set the codecs to offer and accept, most preferred first
+ *
+ * Default: "PCMA/8000,PCMU/8000,G722/8000". Also available are
+ * "L16/16000", "L16/8000", and the non-standard "PCMA/16000".
+ * fesnd_cache_preload() then encodes prompts in these codecs.
+ *
+ * Returns != 0 on unknown codecs
+ *
+ * @param codecs	"<name>/<RTP clock rate>", separated by commas
+ */
+int fesip_set_codecs(const char *codecs);
+
+/**
+ * Sample rate of the call's audio (depends on the negotiated codec)
+ *
+ * @param call		The call handle
+ */
+int fesip_call_rate(const fesip_call_t *call);
+
 /**
  * Initiate a call
  *
+ * NULL means error (including OSIP_TOOMUCHCALL, i.e., all
+ * FESIP_MAX_CALLS slots in use).
+ *
  * @param from		SIP source URL
  * @param to		SIP destination URL
  * @param subject	SIP subject (if desired)
  * @param reference	Application reference (if desired)
  */
-int fesip_call(const char *from, const char *to, const char *subject,
+fesip_call_t *fesip_call(const char *from, const char *to, const char *subject,
 	       void *reference);
 
+/**
+ * Find a call by its eXosip call id (O(1))
+ *
+ * NULL means no such (active) call.
+ *
+ * @param cid		The eXosip call id, e.g. evt->cid
+ */
+fesip_call_t *fesip_find_call(int cid);
+
+/**
+ * The eXosip call id of the call
+ *
+ * @param call		The call handle
+ */
+int fesip_call_id(const fesip_call_t *call);
+
+/**
+ * The application reference passed to fesip_call() or set by
+ * fesip_call_set_reference()
+ *
+ * @param call		The call handle
+ */
+void *fesip_call_reference(const fesip_call_t *call);
+
+/**
+ * Attach an application reference to the call
+ *
+ * @param call		The call handle
+ * @param reference	Application reference
+ */
+void fesip_call_set_reference(fesip_call_t *call, void *reference);
+
+/**
+ * Number of calls currently in the call table
+ */
+int fesip_calls_active(void);
+
 /**
  * Tell the other party it is ringing here now (in response to an
  * incoming call)
  *
- * @param evt		The EXOSIP_CALL_NEW event received
+ * @param call		The call handle passed to fesip_event_invite()
  */
-int fesip_ringback(eXosip_event_t *evt);
+int fesip_ringback(fesip_call_t *call);
 
 /**
  * Answer the incoming call
+ *
+ * @param call		The call handle passed to fesip_event_invite()
  */
-void fesip_answer(void);
+void fesip_answer(fesip_call_t *call);
 
 /**
  * Terminate the call:
  * - Tell the other party it is busy here (in response to an
  *   incoming call)
  * - Hangup (with ongoing call)
+ *
+ * The handle is invalid afterwards.
+ *
+ * @param call		The call handle
  */
-int fesip_terminate(void);
+int fesip_terminate(fesip_call_t *call);
 
 /**
  * Terminate the call
  *
  * To be called from within an event handler
+ *
+ * @param call		The call handle
  */
-void fesip_terminate_nolock(void);
+void fesip_terminate_nolock(fesip_call_t *call);
 
 /**
  * Send a file or add to FIFO queue
  *
+ * @param call		The call to play into
  * @param filename	Path to WAV file (16kHz mono)
  */
-void fesip_play(const char *filename);
+void fesip_play(fesip_call_t *call, const char *filename);
 
 /**
  * Send a file or add to FIFO queue
  *
+ * @param call		The call to play into
  * @param milliseconds	Delay to insert before the file
  * @param filename	Path to WAV file (16kHz mono)
  */
-void fesip_play_after_delay(int milliseconds, const char *filename);
+void fesip_play_after_delay(fesip_call_t *call, int milliseconds,
+			    const char *filename);
+
+/**
+ * Append a live stream to the call's play queue
+ *
+ * Audio written to the stream afterwards goes out with the next frame,
+ * see fesnd_stream_new() in flexosnd.h. Write it at fesip_call_rate()
+ * to spare the resampling.
+ *
+ * Returns != 0 on error (out of memory)
+ *
+ * @param call		The call
+ * @param stream	The stream (the queue takes its own reference)
+ */
+int fesip_play_stream(fesip_call_t *call, struct fesnd_stream *stream);
+
+/**
+ * Append a broadcast to the call's play queue
+ *
+ * Play the same file to many calls at once: its frames are prepared
+ * once per codec and shared by all of them, see fesnd_broadcast_new()
+ * in flexosnd.h.
+ *
+ * Returns != 0 on error (out of memory)
+ *
+ * @param call		The call
+ * @param b		The broadcast (the queue takes its own reference)
+ */
+int fesip_play_broadcast(fesip_call_t *call, struct fesnd_broadcast *b);
+
+/**
+ * Play a file mixed over what the call is playing otherwise
+ *
+ * Each layer is a play queue of its own; layer 0 is the one of
+ * fesip_play(). While more than one has something to play (or the
+ * call is in a conference), their audio is summed, frame by frame.
+ *
+ * Returns != 0 for invalid layers
+ *
+ * @param call		The call
+ * @param layer		0..FESIP_LAYERS-1
+ * @param filename	Sound file, as for fesip_play()
+ */
+int fesip_play_layer(fesip_call_t *call, int layer, const char *filename);
+
+/**
+ * Set the volume of a layer
+ *
+ * Returns != 0 for invalid layers
+ *
+ * @param call		The call
+ * @param layer		0..FESIP_LAYERS-1
+ * @param gain		FEMIX_UNITY (4096) is unchanged, see
+ *			femix_gain_db() in flexomix.h
+ */
+int fesip_set_gain(fesip_call_t *call, int layer, int gain);
+
+/**
+ * Stop playing and flush the call's play queues (all layers)
+ *
+ * @param call		The call handle
+ */
+void fesip_stop(fesip_call_t *call);
+
+/**
+ * Create a conference bridge
+ *
+ * Everybody in it hears everybody else, plus what is played into the
+ * conference, plus their own play queues. Calls at another rate are
+ * resampled.
+ *
+ * Returns NULL on error (diagnostic printed to stderr)
+ *
+ * @param rate		Rate to mix at, 8000 or 16000
+ */
+fesip_conf_t *fesip_conf_new(int rate);
+
+/**
+ * Add a call to a conference (leaving any other one)
+ *
+ * Returns != 0 on error (diagnostic printed to stderr)
+ *
+ * @param conf		The conference
+ * @param call		The call
+ * @param gain		Applied to what the call says, FEMIX_UNITY = 1.0
+ */
+int fesip_conf_join(fesip_conf_t *conf, fesip_call_t *call, int gain);
+
+/**
+ * Take a call out of its conference, if any
+ *
+ * Done automatically when the call ends.
+ *
+ * @param call		The call
+ */
+void fesip_conf_leave(fesip_call_t *call);
+
+/**
+ * Play a file to everybody in the conference
+ *
+ * Returns != 0 on error (diagnostic printed to stderr)
+ *
+ * @param conf		The conference
+ * @param filename	Sound file, as for fesip_play()
+ */
+int fesip_conf_play(fesip_conf_t *conf, const char *filename);
+
+/**
+ * Dissolve a conference (the calls go on)
+ *
+ * @param conf		The conference
+ */
+void fesip_conf_free(fesip_conf_t *conf);
 
 /**
  * Send a DTMF digit
  *
- * @param did		The dialog id
+ * As RFC 4733 telephone-event in the RTP stream if the other side
+ * supports it (queued, 100 ms each), else as SIP INFO.
+ *
+ * @param call		The call handle
  * @param digit		The digit to send ('0'…'9', '*', '#')
  */
-void fesip_send_dtmf(char digit);
+void fesip_send_dtmf(fesip_call_t *call, char digit);
 
 /**
  * Event handler, ready to be overridden by application
  * (weak symbol)
  *
+ * The RTP session has already been started when this is called,
+ * so fesip_play() can be used right away.
+ *
+ * @param call		The call handle (as returned by fesip_call())
  * @param evt		The answering event
+ * @param host		Where our audio goes to
+ * @param port		Ditto
+ * @param format	The RTP payload type of the negotiated codec
  */
-void fesip_event_answered(eXosip_event_t *evt,
+void fesip_event_answered(fesip_call_t *call, eXosip_event_t *evt,
     const char *host, int port, int format);
 
 /**
@@ -146,27 +698,69 @@ void fesip_event_answered(eXosip_event_t *evt,
  * (weak symbol)
  *
  * Returns the SIP code to be returned to the inviter.
+ * Any code >= 300 releases the call handle again.
  *
+ * @param call		The newly allocated call handle
  * @param evt		The invite event
+ * @param host		Where our audio goes to
+ * @param port		Ditto
+ * @param format	The RTP payload type of the negotiated codec
  */
-int fesip_event_invite(eXosip_event_t *evt,
+int fesip_event_invite(fesip_call_t *call, eXosip_event_t *evt,
     const char *host, int port, int format);
 
 /**
  * Event handler, ready to be overridden by application
  * (weak symbol)
  *
+ * The handle is invalid after this returns.
+ *
+ * @param call		The call handle
  * @param evt		The terminating event
  */
-void fesip_event_terminate(eXosip_event_t *evt);
+void fesip_event_terminate(fesip_call_t *call, eXosip_event_t *evt);
 
 /**
  * Event handler, ready to be overridden by application
  * (weak symbol)
  *
+ * Called from the event loop with eXosip locked, like the other
+ * event handlers, however the digit was received: as RFC 4733
+ * telephone-event or in-band (queued by the media thread, which wakes
+ * the loop up) or as SIP INFO.
+ *
+ * @param call		The call the digit was received on
  * @param digit		The digit received
  */
-void fesip_event_dtmf(char digit);
+void fesip_event_dtmf(fesip_call_t *call, char digit);
+
+/**
+ * Event handler, ready to be overridden by application
+ * (weak symbol)
+ *
+ * Called once per batch of SIP events, after each has been handled
+ * (and the per-event handlers called), with eXosip locked. E.g. to
+ * act on a burst at once.
+ *
+ * @param evts		The events, in order of arrival
+ * @param n		How many
+ */
+void fesip_event_batch(eXosip_event_t *const *evts, int n);
+
+/**
+ * Event handler, ready to be overridden by application
+ * (weak symbol)
+ *
+ * Called with eXosip locked whenever a registration succeeds or
+ * fails (after the first authentication challenge, which eXosip
+ * answers by itself).
+ *
+ * @param account	The account
+ * @param state		FESIP_REG_REGISTERED or FESIP_REG_BACKOFF
+ * @param status	SIP status of the response, 0 = none (timeout)
+ */
+void fesip_event_registration(fesip_account_t *account,
+			      enum fesip_reg_state state, int status);
 
 /**
  * Signal handler for cleanup
@@ -174,3 +768,106 @@ void fesip_event_dtmf(char digit);
  * @param sig		Signal it was called from
  */
 void fesip_cleanup(int sig);
+
+/**
+ * Event handler, ready to be overridden by application
+ * (weak symbol)
+ *
+ * Called with the decoded audio received, 20 ms at a time at the
+ * call's sample rate (see fesip_call_rate()): in order, with lost
+ * packets concealed, out of a jitter buffer. Runs in the media
+ * thread if started (else in fesip_handle_event()) with the media state
+ * locked: do not call fesip_*() other than fesip_play() from here,
+ * and return quickly. The file is not checked then (that would read
+ * the disk in the media tick); one that cannot be played is dropped
+ * from the queue when its turn comes, with a diagnostic on stderr.
+ *
+ * @param call		The call the audio was received on
+ * @param pcm		Mono PCM16 samples, valid during the call only
+ * @param n		Number of samples
+ */
+void fesip_event_audio(fesip_call_t *call, const short *pcm, size_t n);
+
+/**
+ * What happened to a call, for worker threads (see fesip_async_start())
+ */
+enum fesip_async_type {
+  FESIP_ASYNC_INVITE,		// Incoming call, ringing: answer or hang up
+  FESIP_ASYNC_ANSWERED,		// Outgoing call answered, RTP running
+  FESIP_ASYNC_TERMINATED,	// Call ended, the last event for it
+  FESIP_ASYNC_DTMF,		// Digit received
+};
+
+struct fesip_async_event {
+  enum fesip_async_type type;
+  fesip_call_t *call;		// Only pass it to the fesip_async_*()
+  unsigned serial;		// commands (with this), it may be gone
+  void *reference;		// The call's reference at the time
+  int format;			// RTP payload type of the codec
+  int status;			// TERMINATED: SIP status if it failed, else 0
+  char digit;			// DTMF
+};
+
+struct fesip_async_stats {
+  unsigned long events;		// Queued for the workers
+  unsigned long dropped;	// Lost, the queue was full
+  unsigned long commands;	// Carried out
+  unsigned long stale;		// Ignored, for calls already gone
+};
+
+/**
+ * Hand call events to worker threads instead of the fesip_event_*()
+ * handlers
+ *
+ * The event loop then never waits for application code: it queues
+ * the events for fesip_async_next() and carries out the commands
+ * given with fesip_async_answer() and co. Incoming calls are always
+ * put on SIP_RINGING first. fesip_event_audio() is still called.
+ *
+ * Call before making or accepting calls. Returns != 0 on error.
+ */
+int fesip_async_start(void);
+
+/**
+ * Wait for the next call event (from any number of threads)
+ *
+ * Returns 1 if *evt was filled in, 0 on timeout, < 0 on error or once
+ * fesip_quit() closed the queues: workers waiting then return as well,
+ * and commands given afterwards are dropped. Let all workers return
+ * before calling fesip_async_start() again.
+ *
+ * @param evt		Filled in
+ * @param timeout_ms	-1 = forever
+ */
+int fesip_async_next(struct fesip_async_event *evt, int timeout_ms);
+
+/**
+ * Readable while events are queued, to poll() for instead of blocking
+ * in fesip_async_next()
+ */
+int fesip_async_fd(void);
+
+/**
+ * Commands for the event loop, carried out by it in order
+ *
+ * They only queue (and wake up the loop), so they can be called from
+ * any thread. Commands for calls which ended in the meantime are
+ * ignored. fesip_async_hangup() is followed by FESIP_ASYNC_TERMINATED.
+ *
+ * Return != 0 if the queue is full.
+ *
+ * @param call		From the event
+ * @param serial	From the event
+ */
+int fesip_async_answer(fesip_call_t *call, unsigned serial);
+int fesip_async_play(fesip_call_t *call, unsigned serial, const char *filename);
+int fesip_async_stop(fesip_call_t *call, unsigned serial);
+int fesip_async_hangup(fesip_call_t *call, unsigned serial);
+int fesip_async_dtmf(fesip_call_t *call, unsigned serial, char digit);
+
+/**
+ * Get the counters of the event and command queues
+ *
+ * @param stats		Filled in
+ */
+void fesip_async_get_stats(struct fesip_async_stats *stats);
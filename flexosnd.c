@@ -1,176 +1,470 @@
 #include "flexosnd.h"
 #include <sndfile.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <alloca.h>
 #include "unused.h"
+#include "flexog711.h"
+#include "flexoresample.h"
 
-// FIFO
-static SNDFILE *sf[FESND_MAX_DEPTH];
-static int waittime[FESND_MAX_DEPTH];
-static int head, tail;
+#define DECODE_CHUNK 1024 // Frames read from a sound file at once
 
-static int fesnd_close_all(const char *message);
+static int resample_quality = FERESAMPLE_HIGH;
 
-int fesnd_add(const char *path)
+static int fesnd_close_all(struct fesnd_queue *q, const char *message);
+static void fesnd_queue_prefetch(struct fesnd_queue *q);
+static int fesnd_decoder_set_rate(struct fesnd_decoder *d, int rate);
+
+// Encoded for delays (in the queue's encoder, as the codec may be stateful)
+static const short silence[FESND_MAX_SAMPLES];
+
+size_t fesnd_frame_bytes(enum fesnd_format format)
 {
-  return fesnd_add_after_delay(0, path);
+  return fesnd_codec(format)->frame_bytes;
 }
 
-int fesnd_add_after_delay(int delay, const char *path)
+int fesnd_format_rate(enum fesnd_format format)
 {
-  int nexthead = (head+1) % FESND_MAX_DEPTH;
-  if (nexthead == tail) {
-    fprintf(stderr, "fesnd_add(%s) ignored: FIFO full\n",
-	    path);
+  return fesnd_codec(format)->rate;
+}
+
+int fesnd_add(struct fesnd_queue *q, const char *path)
+{
+  return fesnd_add_after_delay(q, 0, path);
+}
+
+int fesnd_add_after_delay(struct fesnd_queue *q, int delay, const char *path)
+{
+  if (fesnd_check(path) != 0)
+    return 1; // Diagnostic already printed
+  return fesnd_add_checked(q, delay, path);
+}
+
+int fesnd_add_checked(struct fesnd_queue *q, int delay, const char *path)
+{
+  struct fesnd_entry *e = fesnd_queue_reserve(q);
+  if (e == NULL)
+    return 1; // Diagnostic already printed
+  e->waittime = delay / 20; // Number of delay segments
+  e->path = strdup(path);
+  if (e->path == NULL) {
+    fprintf(stderr, "fesnd_add(%s): Out of memory\n", path);
     return 1;
   }
-  
-  int retval = 0;
-  SF_INFO info;
-  info.format = 0; // Auto-determine
-  sf[head] = sf_open(path, SFM_READ, &info);
-  waittime[head] = delay / 20; // Number of delay segments
-  if (sf[head] == NULL) {
-    fprintf(stderr, "Cannot open sound file %s\n", path);
-    return 1; // Return directly, no file to close
+  fesnd_queue_commit(q);
+  fesnd_queue_prefetch(q);
+  return 0;
+}
+
+struct fesnd_entry *fesnd_queue_reserve(struct fesnd_queue *q)
+{
+  if (q->size == 0 || (q->head + 1) % q->size == q->tail) {
+    // Full (one slot stays free to tell full from empty): double it,
+    // unwrapping the entries to the start
+    int size = q->size > 0 ? 2 * q->size : FESND_QUEUE_INITIAL;
+    struct fesnd_entry *entry = malloc(size * sizeof(*entry));
+    if (entry == NULL) {
+      fprintf(stderr, "Play queue: Out of memory\n");
+      return NULL;
+    }
+    int n = 0;
+    for (int i = q->tail; i != q->head; i = (i + 1) % q->size)
+      entry[n++] = q->entry[i];
+    free(q->entry);
+    q->entry = entry;
+    q->size = size;
+    q->tail = 0;
+    q->head = n;
   }
-  if (info.channels != 1) {
-    fprintf(stderr, "Sound file %p has %d channels, should be 1\n",
-	    path, info.channels);
-    retval = 1;
+  struct fesnd_entry *e = &q->entry[q->head];
+  memset(e, 0, sizeof(*e));
+  return e;
+}
+
+void fesnd_queue_commit(struct fesnd_queue *q)
+{
+  q->head = (q->head + 1) % q->size; // "Commit"
+}
+
+/**
+ * Have the next few files opened in the background
+ */
+static void fesnd_queue_prefetch(struct fesnd_queue *q)
+{
+  int i = q->tail;
+  for (int ahead = 0; ahead < FESND_PREFETCH_AHEAD && i != q->head; ahead++) {
+    struct fesnd_entry *e = &q->entry[i];
+    if (e->path != NULL && e->job == NULL
+	&& e->prompt == NULL && e->stream == NULL)
+      e->job = fesnd_prefetch_start(e->path, q->format); // Else next time
+    i = (i + 1) % q->size;
   }
-  if (info.samplerate != 16000) {
-    fprintf(stderr, "Sound file %p has %d samples/s, should be 16000\n",
-	    path, info.samplerate);
-    retval = 1;
+}
+
+int fesnd_open(struct fesnd_queue *q, const char *path)
+{
+  fesnd_close_all(q, "fesnd_open(): Still files in FIFO\n");
+  return fesnd_add(q, path);
+}
+
+void fesnd_set_format(struct fesnd_queue *q, enum fesnd_format format)
+{
+  if (format == q->format)
+    return;
+  q->format = format;
+  memset(&q->enc, 0, sizeof(q->enc));
+  // Frame numbers are the same in all formats, so positions stay valid
+  for (int i = q->tail; i != q->head; i = (i + 1) % q->size) {
+    struct fesnd_entry *e = &q->entry[i];
+    if (e->prompt != NULL && e->pos > 0) {
+      // Continue at the same frame; if the cache does not have it in
+      // this format yet, have it loaded in the background (silence
+      // until then; a file too big for the cache starts over)
+      struct fesnd_prompt *p = fesnd_cache_find(e->prompt, format);
+      if (p == NULL && e->job == NULL)
+	e->job = fesnd_prefetch_start(e->path, format);
+      if (p != NULL || e->job != NULL) {
+	fesnd_cache_put(e->prompt);
+	e->prompt = p;
+      }
+    } else if (e->stream != NULL) {
+      fesnd_stream_set_rate(e, e->stream, fesnd_format_rate(format));
+    } else if (e->bc != NULL) {
+      fesnd_broadcast_attach(e, e->bc, format);
+    } else if (e->path != NULL) {
+      // Not playing yet: start over in the new format
+      if (e->prompt != NULL)
+	fesnd_cache_put(e->prompt);
+      e->prompt = NULL;
+      if (e->job != NULL)
+	fesnd_prefetch_cancel(e->job);
+      e->job = NULL;
+    }
   }
-  if (retval == 0) {
-    head = nexthead; // "Commit"
-  } else {
-    sf_close(sf[head]); // "Rollback"
-    sf[head] = NULL;
+  fesnd_queue_prefetch(q);
+}
+
+/**
+ * Close the entry at the tail and proceed to the next FIFO entry, if any
+ */
+static int fesnd_close_tail(struct fesnd_queue *q)
+{
+  struct fesnd_entry *e = &q->entry[q->tail];
+  if (e->prompt != NULL) {
+    fesnd_cache_put(e->prompt);
+    e->prompt = NULL;
   }
-  return retval;
+  if (e->stream != NULL)
+    fesnd_stream_close(e);
+  if (e->bc != NULL)
+    fesnd_broadcast_close(e);
+  if (e->job != NULL) {
+    fesnd_prefetch_cancel(e->job);
+    e->job = NULL;
+  }
+  free(e->path);
+  e->path = NULL;
+  q->tail = (q->tail +  1) % q->size;
+  return 0;
 }
 
-int fesnd_open(const char *path)
+/**
+ * Encode a frame of silence, for delays and while waiting for audio
+ */
+static ssize_t fesnd_silence(struct fesnd_queue *q,
+			     const struct fesnd_codec *codec,
+			     const unsigned char **frame)
 {
-  fesnd_close_all("fesnd_open(): Still files in FIFO\n");
-  return fesnd_add(path);
+  *frame = q->scratch;
+  q->level = FESND_SILENT;
+  return codec->encode(&q->enc, q->scratch, silence, codec->frame_samples);
 }
 
-ssize_t fesnd_read(short *buf, ssize_t nsamples)
+/**
+ * Deliver a frame in the codec's cache_as format (from the prompt
+ * cache or a broadcast) in the queue's format
+ */
+static ssize_t fesnd_shared_frame(struct fesnd_queue *q,
+				  const struct fesnd_codec *codec,
+				  const unsigned char *f, size_t nbytes,
+				  const unsigned char **frame)
 {
-  if (head == tail) {
-    fprintf(stderr, "Reading without open sound file\n");
-    return 0;
+  if (codec->cache_as != (int)q->format) {
+    // Stateful codec: encode the cached PCM for this stream only
+    short buf[FESND_MAX_SAMPLES];
+    size_t n = fesnd_codec(codec->cache_as)->decode(NULL, buf, f, nbytes);
+    *frame = q->scratch;
+    return codec->encode(&q->enc, q->scratch, buf, n);
   }
+  *frame = f;
+  return nbytes;
+}
+
+/**
+ * The entry the next frame comes from, NULL if the queue is empty
+ *
+ * Sets *silent if a delay or a file not opened in time calls for
+ * silence instead.
+ */
+static struct fesnd_entry *fesnd_current(struct fesnd_queue *q,
+					 _Bool *silent)
+{
+  if (q->head == q->tail)
+    return NULL;
+  fesnd_queue_prefetch(q);
+  struct fesnd_entry *e = &q->entry[q->tail];
+  *silent = true;
   // Pause first?
-  if (waittime[tail] > 0) {
-    waittime[tail]--;
-    memset(buf, 0, sizeof(short)*nsamples);
-    return nsamples;
-  }
-  // Pause done, send real file bytes
-  int retval = sf_read_short(sf[tail], buf, nsamples);
-  if (retval == nsamples) {
-    // All is well
-    return retval;
-  } else {
-    sf_close(sf[tail]);
-    sf[tail] = NULL;
-    // Proceed to next FIFO entry, if any
-    tail = (tail +  1) % FESND_MAX_DEPTH;
-    return retval; // No more files
+  if (e->waittime > 0) {
+    e->waittime--;
+    return e;
+  }
+  // Pause done, send real file bytes (once opened)
+  if (e->path != NULL && e->prompt == NULL && e->stream == NULL) {
+    int ready = e->job != NULL
+      ? fesnd_prefetch_poll(e, fesnd_format_rate(q->format)) : 0;
+    if (ready == 0)
+      return e; // Not in time
   }
+  *silent = false;
+  return e;
 }
 
-int fesnd_close(void)
+ssize_t fesnd_next_frame(struct fesnd_queue *q, const unsigned char **frame)
 {
-  return fesnd_close_all(NULL);
+  const struct fesnd_codec *codec = fesnd_codec(q->format);
+  struct fesnd_entry *e;
+  _Bool silent;
+  while ((e = fesnd_current(q, &silent)) != NULL) {
+    if (silent)
+      return fesnd_silence(q, codec, frame);
+    if (e->prompt != NULL) {
+      size_t nbytes;
+      const unsigned char *f = fesnd_prompt_frame(e->prompt, e->pos, &nbytes);
+      if (f != NULL) {
+	q->level = fesnd_prompt_level(e->prompt, e->pos++);
+	return fesnd_shared_frame(q, codec, f, nbytes, frame);
+      }
+    } else if (e->stream != NULL) {
+      ssize_t nbytes = fesnd_stream_frame(e, codec, &q->enc, q->scratch);
+      if (nbytes > 0) {
+	q->level = e->level;
+	*frame = q->scratch;
+	return nbytes;
+      }
+      if (nbytes == 0)
+	return fesnd_silence(q, codec, frame); // Underrun: keep the stream
+    } else if (e->bc != NULL) {
+      const unsigned char *f;
+      ssize_t nbytes = fesnd_broadcast_frame(e, q->format, &f);
+      q->level = e->level;
+      if (nbytes > 0)
+	return fesnd_shared_frame(q, codec, f, nbytes, frame);
+      if (nbytes == 0)
+	return fesnd_silence(q, codec, frame); // Not ready yet
+    }
+    fesnd_close_tail(q);
+  }
+  return 0; // No more files
 }
 
-static int fesnd_close_all(const char *message)
+ssize_t fesnd_next_pcm(struct fesnd_queue *q, short *pcm)
+{
+  const struct fesnd_codec *codec = fesnd_codec(q->format);
+  struct fesnd_entry *e;
+  _Bool silent;
+  while ((e = fesnd_current(q, &silent)) != NULL) {
+    if (silent) {
+      memset(pcm, 0, codec->frame_samples * sizeof(short));
+      return codec->frame_samples;
+    }
+    if (e->prompt != NULL) {
+      size_t nbytes;
+      const unsigned char *f = fesnd_prompt_frame(e->prompt, e->pos, &nbytes);
+      if (f != NULL) {
+	e->pos++;
+	// Cached as G.711 or L16, both decoded without state
+	return fesnd_codec(codec->cache_as)->decode(NULL, pcm, f, nbytes);
+      }
+    } else if (e->stream != NULL) {
+      ssize_t n = fesnd_stream_read(e, codec->frame_samples, pcm);
+      if (n > 0)
+	return n;
+      if (n == 0) {
+	memset(pcm, 0, codec->frame_samples * sizeof(short));
+	return codec->frame_samples; // Underrun: keep the stream
+      }
+    } else if (e->bc != NULL) {
+      const unsigned char *f;
+      ssize_t nbytes = fesnd_broadcast_frame(e, q->format, &f);
+      if (nbytes > 0)
+	return fesnd_codec(codec->cache_as)->decode(NULL, pcm, f, nbytes);
+      if (nbytes == 0) {
+	memset(pcm, 0, codec->frame_samples * sizeof(short));
+	return codec->frame_samples; // Not ready yet
+      }
+    }
+    fesnd_close_tail(q);
+  }
+  return 0; // No more files
+}
+
+_Bool fesnd_pending(const struct fesnd_queue *q)
+{
+  return q->head != q->tail;
+}
+
+int fesnd_close(struct fesnd_queue *q)
+{
+  int retval = fesnd_close_all(q, NULL);
+  free(q->entry);
+  q->entry = NULL;
+  q->size = q->head = q->tail = 0;
+  return retval;
+}
+
+static int fesnd_close_all(struct fesnd_queue *q, const char *message)
 {
   int retval = 0;
-  while (head != tail) {
+  while (q->head != q->tail) {
     if (message != NULL)
       fputs(message, stderr);
-    retval = sf_close(sf[tail]);
-    sf[tail] = NULL;
-    tail = (tail +  1) % FESND_MAX_DEPTH;
+    retval = fesnd_close_tail(q);
   }
   return retval;
 }
 
-// ------------- Sound encoding -----------------
+// ------------- Sound file decoding -----------------
 
-typedef struct {
-  unsigned char *buf;
-  ssize_t len;
-} userdata;
+/**
+ * Can we play a sound file with this format?
+ */
+static int fesnd_check_info(const char *path, const SF_INFO *info)
+{
+  int retval = 0;
+  if (info->channels < 1 || info->channels > 2) {
+    fprintf(stderr, "Sound file %s has %d channels, should be 1 or 2\n",
+	    path, info->channels);
+    retval = 1;
+  }
+  if (info->samplerate < FESND_MIN_RATE || info->samplerate > FESND_MAX_RATE) {
+    fprintf(stderr, "Sound file %s has %d samples/s, should be %d..%d\n",
+	    path, info->samplerate, FESND_MIN_RATE, FESND_MAX_RATE);
+    retval = 1;
+  }
+  return retval;
+}
 
-sf_count_t fesnd_vwrite(const void *ptr, sf_count_t count, void *user_data)
+int fesnd_check(const char *path)
 {
-  userdata *ud = user_data;
-  if (count > ud->len) {
-    fprintf(stderr, "fesnd_vwrite() count %zd > ud->len %zd\n", (ssize_t)count, ud->len);
-    count = ud->len;
+  SF_INFO info;
+  info.format = 0; // Auto-determine
+  SNDFILE *sf = sf_open(path, SFM_READ, &info);
+  if (sf == NULL) {
+    fprintf(stderr, "Cannot open sound file %s\n", path);
+    return 1;
   }
-  memcpy(ud->buf, ptr, count);
-  return count;
+  int retval = fesnd_check_info(path, &info);
+  sf_close(sf);
+  return retval;
 }
 
-sf_count_t fesnd_vfilelen(void *UNUSED_PARAM(user_data))
+int fesnd_decoder_open(struct fesnd_decoder *d, const char *path, int rate)
 {
+  SF_INFO info;
+  info.format = 0; // Auto-determine
+  memset(d, 0, sizeof(*d));
+  d->sf = sf_open(path, SFM_READ, &info);
+  if (d->sf == NULL) {
+    fprintf(stderr, "Cannot open sound file %s\n", path);
+    return 1; // Return directly, no file to close
+  }
+  int retval = fesnd_check_info(path, &info);
+  if (retval == 0) {
+    d->channels = info.channels;
+    d->in_rate = d->rate = info.samplerate;
+    d->left = info.frames;
+    if (fesnd_decoder_set_rate(d, rate) != 0) {
+      fprintf(stderr, "Cannot resample %s from %d to %d samples/s\n",
+	      path, info.samplerate, rate);
+      retval = 1;
+    }
+  }
+  if (retval != 0) {
+    sf_close(d->sf); // "Rollback"
+    d->sf = NULL;
+    return retval;
+  }
   return 0;
 }
 
-sf_count_t fesnd_vtell(void *UNUSED_PARAM(user_data))
+/**
+ * (Re)create the resampler for a new output rate
+ *
+ * Samples buffered in the old resampler (a few ms) are dropped.
+ */
+static int fesnd_decoder_set_rate(struct fesnd_decoder *d, int rate)
 {
+  struct feresample *rs = feresample_new(d->in_rate, d->channels, rate,
+					 resample_quality);
+  if (rs == NULL)
+    return 1;
+  feresample_free(d->rs);
+  d->rs = rs;
+  // Same duration, rounded up
+  d->left = (d->left * rate + d->rate - 1) / d->rate;
+  d->rate = rate;
   return 0;
 }
 
-sf_count_t fesnd_vseek(sf_count_t UNUSED_PARAM(offset), int UNUSED_PARAM(whence), void *UNUSED_PARAM(user_data))
+size_t fesnd_decoder_read(struct fesnd_decoder *d, short *outbuf,
+			  size_t nsamples)
 {
-  return 0;
+  short buf[2*DECODE_CHUNK];
+  size_t got = 0;
+  if ((sf_count_t)nsamples > d->left)
+    nsamples = d->left;
+  while (got < nsamples) {
+    // Read exactly what the filter needs, so nothing is left over
+    size_t need = feresample_needed(d->rs, nsamples - got);
+    if (need > DECODE_CHUNK)
+      need = DECODE_CHUNK;
+    sf_count_t n = need > 0 ? sf_readf_short(d->sf, buf, need) : 0;
+    if (n < (sf_count_t)need) {
+      // End of file: flush the filter with silence
+      if (n < 0)
+	n = 0;
+      memset(buf + n * d->channels, 0,
+	     (need - n) * d->channels * sizeof(short));
+    }
+    got += feresample_process(d->rs, buf, need, outbuf + got, nsamples - got);
+  }
+  d->left -= got;
+  return got;
+}
+
+int fesnd_decoder_close(struct fesnd_decoder *d)
+{
+  int retval = sf_close(d->sf);
+  feresample_free(d->rs);
+  memset(d, 0, sizeof(*d));
+  return retval;
 }
 
-static SF_VIRTUAL_IO vio = {
-  .get_filelen = fesnd_vfilelen,
-  .write = fesnd_vwrite,
-  // The following are included only for compatbility with
-  // libsndfile < git-c11deaa (will probably go into v1.0.29)
-  .seek = fesnd_vseek,
-  .tell = fesnd_vtell
-};
-
-static userdata ud;
-
-// Sample rate does not really matter here,
-// can also be used for 8kHz
-static SF_INFO alaw8k = {
-  .frames = 0,
-  .samplerate = 8000,
-  .channels = 1,
-  .format = SF_FORMAT_RAW | SF_FORMAT_ALAW | SF_ENDIAN_LITTLE,
-  .sections = 0,
-  .seekable = 0
-};
-static SNDFILE *viof;
+void fesnd_set_resample_quality(int quality)
+{
+  if (quality >= 0 && quality < FERESAMPLE_NQUALITIES)
+    resample_quality = quality;
+}
+
+// ------------- Sound encoding -----------------
 
 ssize_t fesnd_encode_alaw(unsigned char *outbuf, short *inbuf,
     ssize_t nsamples, _Bool downsample)
 {
-  if (viof == NULL) {
-    viof = sf_open_virtual(&vio, SFM_WRITE, &alaw8k, &ud);
-    if (viof == NULL) {
-      fprintf(stderr, "fesnd_encode_alaw(): Could not create vio\n");
-      exit(1);
-    }
-  }
   if (downsample) {
     nsamples /= 2;
     short *downbuf = alloca(nsamples * sizeof(short));
@@ -182,11 +476,10 @@ ssize_t fesnd_encode_alaw(unsigned char *outbuf, short *inbuf,
       downbuf[i] = (*inbuf + *(inbuf+1))/2;
       inbuf += 2;
     }
-    // This is the new input to sf_write_short, along with the new sample count
+    // This is the new input to the encoder, along with the new sample count
     inbuf = downbuf;
   }
 
-  ud.buf = outbuf;
-  ud.len = nsamples; // should be so many bytes
-  return sf_write_short(viof, inbuf, nsamples);
+  feg711_encode_alaw(outbuf, inbuf, nsamples);
+  return nsamples;
 }
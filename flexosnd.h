@@ -1,57 +1,752 @@
 /* flexosnd — The sound library for flexoSIP
  * 
  * Provides a simple, single-file interface
- * for reading/writing A-Law 8kHz encoded files
+ * for reading sound files and encoding them for RTP
  */
 #include <sndfile.h>
-#define FESND_MAX_DEPTH 32 // # of pending fesnd_push()es
+#define FESND_QUEUE_INITIAL 8 // Play queue entries before it grows
+#define FESND_PREFETCH_AHEAD 2 // Queue entries opened before they play
+#define FESND_PREFETCH_MS 320 // Audio decoded ahead of the sender
+#define FESND_MAX_FRAME 640 // Bytes in the largest 20 ms frame (L16/16000)
+#define FESND_MAX_SAMPLES 320 // Samples in the largest 20 ms frame (16 kHz)
+#define FESND_CODEC_STATE 128 // ints of per-stream codec state
+
+/**
+ * Formats the play queue and prompt cache can deliver frames in
+ *
+ * One per entry in the codec registry, see fesnd_codec().
+ */
+enum fesnd_format {
+  FESND_PCMA8000,		// G.711 A-Law 8 kHz, 160 bytes/20 ms (the default)
+  FESND_PCMU8000,		// G.711 µ-Law 8 kHz, 160 bytes/20 ms
+  FESND_G722,			// G.722 16 kHz, 160 bytes/20 ms
+  FESND_L16_16000,		// Linear 16 kHz, 640 bytes/20 ms
+  FESND_L16_8000,		// Linear 8 kHz, 320 bytes/20 ms
+  FESND_PCMA16000,		// A-Law 16 kHz, 320 bytes/20 ms (non-standard)
+  FESND_NFORMATS
+};
+
+/**
+ * Encoder or decoder state of one stream
+ *
+ * Treat as opaque, initialize to all zeroes.
+ */
+struct fesnd_codec_state {
+  _Bool initialized;
+  int state[FESND_CODEC_STATE];
+};
+
+struct fesnd_prompt;
+struct fesnd_stream;
+struct fesnd_prefetch;
+struct fesnd_broadcast;
+struct fesnd_bframe;
+struct feresample;
+
+/**
+ * Sound file decoder, delivering mono PCM at a fixed rate
+ *
+ * Input may be 8-48 kHz, mono or stereo; it is resampled as needed.
+ */
+struct fesnd_decoder {
+  SNDFILE *sf;
+  struct feresample *rs;
+  int channels;
+  int in_rate, rate;		// Sound file's and delivered sample rates
+  sf_count_t left;		// Output samples still to be delivered
+};
+
+/**
+ * One play queue entry
+ */
+struct fesnd_entry {
+  char *path;			// File to play, opened shortly before
+  struct fesnd_prefetch *job;	// Opening/decoding it in the background
+  struct fesnd_prompt *prompt;	// Served from the prompt cache, or
+  struct fesnd_stream *stream;	// decoded ahead (too big for the cache)
+				// or live from the application, or
+  struct fesnd_broadcast *bc;	// shared with other queues
+  struct fesnd_bframe *held;	// Frame of bc last returned
+  struct feresample *rs;	// Stream at another rate than the queue
+  size_t pos;			// Next frame in prompt (or bc)
+  int waittime;			// # of 20 ms silence frames before
+  int level;			// Of the frame last taken, see fesnd_level()
+};
+
+/**
+ * Play queue (FIFO of sound files)
+ *
+ * Each call has its own; treat as opaque, initialize to all zeroes.
+ * It grows as needed; fesnd_close() releases it.
+ */
+struct fesnd_queue {
+  struct fesnd_entry *entry;	// Ring of `size` entries
+  int size, head, tail;
+  enum fesnd_format format;
+  struct fesnd_codec_state enc;	// For streamed files and silence
+  unsigned char scratch[FESND_MAX_FRAME]; // Encoded streamed frame
+  int level;			// Of the last frame, see fesnd_level()
+};
 
 /**
  * Open a sound file and check format
  * 
  * Returns != 0 on error and prints diagnostic to stderr
  * 
+ * @param q		The play queue
  * @param path		File name
  */
-int fesnd_open(const char *path);
+int fesnd_open(struct fesnd_queue *q, const char *path);
 
 /**
  * Enqueue the next file, which should be automatically opened
  * 
  * Otherwise behaves as fesnd_open()
  */
- int fesnd_add(const char *path);
+ int fesnd_add(struct fesnd_queue *q, const char *path);
 
 /**
  * Enqueue the next file, which should be automatically opened
  * 
  * Otherwise behaves as fesnd_open().
+ * The file is checked now (see fesnd_check()), but only opened when
+ * it is among the next FESND_PREFETCH_AHEAD entries to play. Then a
+ * background thread takes it from (or puts it into) the prompt cache
+ * in the queue's format or, if too big for the cache, keeps
+ * FESND_PREFETCH_MS of it decoded ahead, so nothing is decoded while
+ * sending. Should it not be ready in time, silence is sent.
+ * @param	q		The play queue
  * @param	delay		Number of milliseconds of silence to play before the file. Only multiples of 20ms are accepted.
  * @param	path		The sound file to play
  */
- int fesnd_add_after_delay(int delay, const char *path);
+ int fesnd_add_after_delay(struct fesnd_queue *q, int delay, const char *path);
 
 /**
- * Read from an opened sound file
- * 
- * Returns numbers of bytes read, 0 on EOF/error.
- * 
- * Reading EOF closes the file (and continues with the next file
- * in the FIFO, if any). Each file must have at least as many
- * samples as the maximum `len` requested, otherwise the auto-next
- * feature will return short reads.
- * 
- * @param buf		The buffer to read into
- * @param nsamples	The number of samples to read
+ * Enqueue a file already checked with fesnd_check()
+ *
+ * Does no file I/O, so the lock the queue is used under need not be
+ * held while checking. Otherwise behaves as fesnd_add_after_delay().
+ */
+int fesnd_add_checked(struct fesnd_queue *q, int delay, const char *path);
+
+/**
+ * Enqueue a live stream (see fesnd_stream_new())
+ *
+ * It is played as the application writes to it, until it is ended
+ * and drained; then the queue continues with the next entry. While
+ * the application falls behind, silence is sent. A stream may only be
+ * in one queue at a time.
+ *
+ * Returns != 0 on error, diagnostic printed to stderr
+ *
+ * @param q		The play queue
+ * @param s		The stream (the queue takes its own reference)
+ */
+int fesnd_add_stream(struct fesnd_queue *q, struct fesnd_stream *s);
+
+/**
+ * Set the format frames are to be delivered in
+ *
+ * Already queued files are switched over to the new format.
+ *
+ * @param q		The play queue
+ * @param format	The format negotiated for the call
+ */
+void fesnd_set_format(struct fesnd_queue *q, enum fesnd_format format);
+
+/**
+ * Get the next encoded 20 ms frame
+ *
+ * Returns the number of bytes in the frame, 0 when the queue is empty.
+ *
+ * Reaching the end of a file continues with the next file in the
+ * FIFO, if any. The last frame of a file may be short. Its level
+ * (e.g. for silence suppression) is left in q->level: FESND_SILENT
+ * for delays, measured before encoding otherwise.
+ *
+ * @param q		The play queue
+ * @param frame		Set to the frame; valid until the next call
+ */
+ssize_t fesnd_next_frame(struct fesnd_queue *q, const unsigned char **frame);
+
+/**
+ * Get the next 20 ms frame as PCM, for mixing
+ *
+ * Like fesnd_next_frame(), but returns the number of mono samples
+ * at the queue format's rate (0 when the queue is empty). Delays and
+ * files not ready yet come as zeroes.
+ *
+ * @param q		The play queue
+ * @param pcm		Room for FESND_MAX_SAMPLES samples
  */
-ssize_t fesnd_read(short *buf, ssize_t nsamples);
+ssize_t fesnd_next_pcm(struct fesnd_queue *q, short *pcm);
 
 /**
- * Close the previously opened sound file
+ * Is anything (file or pending delay) left in the queue?
+ *
+ * @param q		The play queue
+ */
+_Bool fesnd_pending(const struct fesnd_queue *q);
+
+/**
+ * Close the previously opened sound file (and flush the queue)
  * 
  * Returns != 0 on error
+ *
+ * @param q		The play queue
+ */
+int fesnd_close(struct fesnd_queue *q);
+
+/**
+ * Make room for another entry at the head of the queue
+ *
+ * Returns the zeroed entry, to be committed with fesnd_queue_commit(),
+ * or NULL when out of memory (diagnostic printed to stderr)
+ *
+ * @param q		The play queue
+ */
+struct fesnd_entry *fesnd_queue_reserve(struct fesnd_queue *q);
+
+/**
+ * Append the entry filled in after fesnd_queue_reserve()
+ *
+ * @param q		The play queue
+ */
+void fesnd_queue_commit(struct fesnd_queue *q);
+
+/**
+ * Bytes in a 20 ms frame of the given format
+ *
+ * @param format	The frame format
+ */
+size_t fesnd_frame_bytes(enum fesnd_format format);
+
+/**
+ * Sample rate of the given format
+ *
+ * @param format	The frame format
+ */
+int fesnd_format_rate(enum fesnd_format format);
+
+// Codec registry
+//
+// Everything flexoSIP needs to know about a codec: how it is
+// announced in SDP, its frame size, and how to encode and decode it.
+// Prompts are encoded once per codec (see the prompt cache), so
+// calls only copy ready-made frames. Stateful codecs (G.722) cannot
+// share an encoded stream, as each receiver's decoder follows its
+// sender's encoder: their prompts are cached as L16 at the codec's
+// rate and encoded by each play queue.
+
+/**
+ * Codec descriptor
+ */
+struct fesnd_codec {
+  const char *name;		// Encoding name, as in a=rtpmap
+  int clock_rate;		// RTP clock rate, as in a=rtpmap
+  int rate;			// Sample rate of the audio
+  int static_pt;		// Static RTP payload type, -1 = dynamic
+  size_t frame_samples;		// Samples per 20 ms frame
+  size_t frame_bytes;		// Encoded bytes per 20 ms frame
+  int cache_as;			// Format prompts are cached in (see below)
+  /**
+   * Encode PCM16, returns the number of bytes produced
+   */
+  size_t (*encode)(struct fesnd_codec_state *state, unsigned char *outbuf,
+		   const short *inbuf, size_t nsamples);
+  /**
+   * Decode to PCM16, returns the number of samples produced
+   */
+  size_t (*decode)(struct fesnd_codec_state *state, short *outbuf,
+		   const unsigned char *inbuf, size_t nbytes);
+};
+
+/**
+ * The codec descriptor for a format
+ *
+ * Returns NULL for invalid formats.
+ *
+ * @param format	The format
+ */
+const struct fesnd_codec *fesnd_codec(enum fesnd_format format);
+
+/**
+ * Look up a codec by its SDP encoding name and clock rate
+ *
+ * Returns the format, -1 if unknown.
+ *
+ * @param name		Encoding name (case-insensitive, e.g. "PCMA")
+ * @param clock_rate	RTP clock rate (e.g. 8000)
+ */
+int fesnd_codec_find(const char *name, int clock_rate);
+
+/**
+ * Upper bound of the bytes needed to encode some samples
+ *
+ * @param format	The format
+ * @param nsamples	How many samples
+ */
+size_t fesnd_codec_max_bytes(enum fesnd_format format, size_t nsamples);
+
+#define FESND_SILENT 127 // Level of digital silence (see fesnd_level())
+
+/**
+ * Level of some audio, as in RFC 3389 comfort noise
+ *
+ * Returns the RMS level in -dBov (0 = full-scale square wave, e.g.
+ * 60 for -60 dBov), FESND_SILENT for all zeroes or below.
+ *
+ * @param pcm		The audio, PCM16
+ * @param n		Samples
+ */
+int fesnd_level(const short *pcm, size_t n);
+
+// Live streams
+//
+// A ring of mono PCM samples, written by one application thread and
+// read by the play queue's frame ticks, without locks. Write either
+// in place (fesnd_stream_reserve(), fill, fesnd_stream_commit()) or
+// by copying (fesnd_stream_write()). Frames are encoded straight out
+// of the ring, so audio reaches RTP one frame after it is committed.
+
+/**
+ * Fill level crossings reported to the producer
+ */
+enum fesnd_watermark {
+  FESND_STREAM_LOW,		// At or below low (or ran dry): write more
+  FESND_STREAM_HIGH,		// At or above high: hold back
+};
+
+/**
+ * Watermark callback
+ *
+ * FESND_STREAM_LOW comes from the thread sending the audio (the
+ * media thread, with the media lock held): only note it, e.g. signal
+ * a condition or write to a pipe. FESND_STREAM_HIGH comes from the
+ * producer's own commit. Each is reported once per crossing.
+ */
+typedef void (*fesnd_stream_notify)(struct fesnd_stream *s,
+				    enum fesnd_watermark mark, void *arg);
+
+/**
+ * Create a stream
+ *
+ * Returns NULL on error (diagnostic printed to stderr)
+ *
+ * @param rate		Sample rate written (8-48 kHz); resampled to the
+ *			call's rate if different (see fesip_call_rate())
+ * @param capacity	Samples the ring holds at least (rounded up to a
+ *			power of two, 2048 at least)
+ * @param low		Low watermark, in samples
+ * @param high		High watermark, in samples (0: when full)
+ * @param notify	Watermark callback, may be NULL
+ * @param arg		Passed to it
+ */
+struct fesnd_stream *fesnd_stream_new(int rate, size_t capacity,
+				      size_t low, size_t high,
+				      fesnd_stream_notify notify, void *arg);
+
+/**
+ * Drop the application's reference
+ *
+ * The stream is freed once no queue plays it any longer. End it
+ * first, unless the queue should play silence until it is stopped.
+ *
+ * @param s		The stream
+ */
+void fesnd_stream_free(struct fesnd_stream *s);
+
+/**
+ * Room to write to in place
+ *
+ * Returns how many samples may be written to *buf (up to the ring's
+ * wrap-around; call again after committing for the rest).
+ *
+ * @param s		The stream
+ * @param buf		Set to where the next samples go
+ */
+size_t fesnd_stream_reserve(struct fesnd_stream *s, short **buf);
+
+/**
+ * Make samples written in place available to the queue
+ *
+ * @param s		The stream
+ * @param nsamples	At most what fesnd_stream_reserve() returned
+ */
+void fesnd_stream_commit(struct fesnd_stream *s, size_t nsamples);
+
+/**
+ * Copy samples into the stream
+ *
+ * Returns how many were taken, less than `nsamples` if it is full.
+ *
+ * @param s		The stream
+ * @param pcm		Mono PCM16 at the stream's rate
+ * @param nsamples	How many
+ */
+size_t fesnd_stream_write(struct fesnd_stream *s, const short *pcm,
+			  size_t nsamples);
+
+/**
+ * No more samples will follow; the queue moves on once it is drained
+ *
+ * @param s		The stream
+ */
+void fesnd_stream_end(struct fesnd_stream *s);
+
+/**
+ * Samples written but not yet played
+ *
+ * @param s		The stream
+ */
+size_t fesnd_stream_level(struct fesnd_stream *s);
+
+/**
+ * Sample rate the stream is written at
+ *
+ * @param s		The stream
+ */
+int fesnd_stream_rate(const struct fesnd_stream *s);
+
+/**
+ * Frames sent as silence because the producer was behind
+ *
+ * @param s		The stream
+ */
+unsigned long fesnd_stream_underruns(const struct fesnd_stream *s);
+
+// For the play queue
+
+/**
+ * Set up an entry to play the stream at the given rate
+ *
+ * The entry takes its own reference.
+ */
+int fesnd_stream_attach(struct fesnd_entry *e, struct fesnd_stream *s,
+			int rate);
+
+/**
+ * Switch a stream entry to another rate
+ */
+int fesnd_stream_set_rate(struct fesnd_entry *e, struct fesnd_stream *s,
+			  int rate);
+
+/**
+ * Encode the next frame of a stream entry
+ *
+ * Returns the bytes encoded into out, 0 if the producer is behind
+ * (nothing consumed), -1 once it is ended and drained. e->level is
+ * set to the frame's.
+ */
+ssize_t fesnd_stream_frame(struct fesnd_entry *e,
+			   const struct fesnd_codec *codec,
+			   struct fesnd_codec_state *enc, unsigned char *out);
+
+/**
+ * Like fesnd_stream_frame(), but deliver PCM samples
+ *
+ * Returns the samples put into out (at most frame_samples), 0 if the
+ * producer is behind, -1 once it is ended and drained
+ */
+ssize_t fesnd_stream_read(struct fesnd_entry *e, size_t frame_samples,
+			  short *out);
+
+/**
+ * Release a stream entry
+ */
+void fesnd_stream_close(struct fesnd_entry *e);
+
+// Broadcasts
+//
+// One sound file played to many queues at once, e.g. an announcement
+// to everybody alerted. Each frame is taken from the prompt cache, or
+// decoded and encoded, once per format; the queues share it (only
+// stateful codecs are still encoded by each queue). All queues play
+// the same frame at the same time: one added later joins in the
+// middle. Use from one thread at a time per queue, as the queues.
+
+/**
+ * Counters of a broadcast
+ */
+struct fesnd_broadcast_stats {
+  int listeners;		// Queue entries playing it
+  unsigned long frames;		// Frame periods, all formats
+  unsigned long encoded;	// Frames encoded (not from the cache)
+  unsigned long delivered;	// Frames handed to queues
+};
+
+/**
+ * Create a broadcast of a sound file
+ *
+ * The file is checked now and opened in the background once a queue
+ * plays it (see Prefetching).
+ *
+ * Returns NULL on error (diagnostic printed to stderr)
+ *
+ * @param path		The sound file (8-48 kHz, mono or stereo)
+ */
+struct fesnd_broadcast *fesnd_broadcast_new(const char *path);
+
+/**
+ * Drop the application's reference
+ *
+ * The broadcast goes on for the queues playing it and is freed after.
+ *
+ * @param b		The broadcast
+ */
+void fesnd_broadcast_free(struct fesnd_broadcast *b);
+
+/**
+ * Enqueue a broadcast
+ *
+ * Returns != 0 on error (out of memory), diagnostic printed to stderr
+ *
+ * @param q		The play queue
+ * @param b		The broadcast (the queue takes its own reference)
+ */
+int fesnd_add_broadcast(struct fesnd_queue *q, struct fesnd_broadcast *b);
+
+/**
+ * Get the counters of a broadcast
+ *
+ * @param b		The broadcast
+ * @param stats		Filled in
+ */
+void fesnd_broadcast_get_stats(struct fesnd_broadcast *b,
+			       struct fesnd_broadcast_stats *stats);
+
+// For the play queue
+
+/**
+ * Set up an entry to play the broadcast in the given format
+ *
+ * Also used when the queue's format changes.
+ */
+int fesnd_broadcast_attach(struct fesnd_entry *e, struct fesnd_broadcast *b,
+			   enum fesnd_format format);
+
+/**
+ * The next frame of a broadcast entry, in the format's cache_as format
+ *
+ * Returns its length, 0 for silence (not ready), -1 at the end. The
+ * frame stays valid until the next call or fesnd_broadcast_close().
+ */
+ssize_t fesnd_broadcast_frame(struct fesnd_entry *e, enum fesnd_format format,
+			      const unsigned char **frame);
+
+/**
+ * Release a broadcast entry
+ */
+void fesnd_broadcast_close(struct fesnd_entry *e);
+
+// Sound file decoding
+
+#define FESND_MIN_RATE 8000 // Sound files may have these sample rates
+#define FESND_MAX_RATE 48000
+
+/**
+ * Check that a sound file can be played, without keeping it open
+ *
+ * Returns != 0 on error and prints diagnostic to stderr
+ *
+ * @param path		The sound file (8-48 kHz, mono or stereo)
+ */
+int fesnd_check(const char *path);
+
+/**
+ * Open a sound file for decoding
+ *
+ * Returns != 0 on error and prints diagnostic to stderr
+ *
+ * @param d		The decoder
+ * @param path		The sound file (8-48 kHz, mono or stereo)
+ * @param rate		Sample rate to deliver
+ */
+int fesnd_decoder_open(struct fesnd_decoder *d, const char *path, int rate);
+
+/**
+ * Decode the next samples
+ *
+ * Returns the number of samples delivered; less than `nsamples`
+ * only at the end of the file.
+ *
+ * @param d		The decoder
+ * @param outbuf	Where mono PCM16 will end up at
+ * @param nsamples	How many samples to deliver
+ */
+size_t fesnd_decoder_read(struct fesnd_decoder *d, short *outbuf,
+			  size_t nsamples);
+
+/**
+ * Close the sound file
+ *
+ * Returns != 0 on error
+ *
+ * @param d		The decoder
+ */
+int fesnd_decoder_close(struct fesnd_decoder *d);
+
+/**
+ * Set the resampling quality for sound files opened afterwards
+ *
+ * Prompts already in the cache keep their quality until flushed.
+ *
+ * @param quality	An enum feresample_quality (default FERESAMPLE_HIGH)
+ */
+void fesnd_set_resample_quality(int quality);
+
+// Prefetching
+//
+// Queue entries are opened by a background thread shortly before they
+// play: looked up in (or loaded into) the prompt cache, or, for files
+// too big for it, decoded into a stream that the thread keeps filled
+// FESND_PREFETCH_MS ahead. The thread is started on first use.
+
+/**
+ * Start preparing a file for a queue entry
+ *
+ * Returns NULL when out of memory or if the thread cannot be started
+ * (diagnostic printed to stderr); the file is never opened by the
+ * caller's thread instead.
+ *
+ * @param path		The sound file
+ * @param format	The queue's format
+ */
+struct fesnd_prefetch *fesnd_prefetch_start(const char *path,
+					    enum fesnd_format format);
+
+/**
+ * Hand a prepared file over to its queue entry
+ *
+ * Returns 1 once it has been, setting the entry's prompt or stream;
+ * 0 if not ready yet; -1 if it could not be opened (diagnostic
+ * printed to stderr). The job stays with the entry until closed.
+ *
+ * @param e		The queue entry, with its job
+ * @param rate		The queue's sample rate
+ */
+int fesnd_prefetch_poll(struct fesnd_entry *e, int rate);
+
+/**
+ * Stop preparing or decoding, dropping the entry's reference
+ *
+ * @param job		From fesnd_prefetch_start()
+ */
+void fesnd_prefetch_cancel(struct fesnd_prefetch *job);
+
+/**
+ * Stop the thread and wait for it (e.g. on shutdown)
+ *
+ * Jobs not done yet stay unready; a later fesnd_prefetch_start()
+ * starts the thread again.
+ */
+void fesnd_prefetch_stop(void);
+
+// Prompt cache
+//
+// Decoded, resampled and encoded prompts, shared by all calls.
+// Keyed by path and modification time; entries not used by any
+// queue are evicted least recently used first when over the limit.
+
+#define FESND_CACHE_LIMIT (16*1024*1024) // Default memory limit in bytes
+
+/**
+ * Get a prompt from the cache, loading it if necessary
+ *
+ * Returns 0 with *prompt set on success (one reference taken),
+ * 0 with *prompt NULL if the file is too big for the cache,
+ * != 0 on error (diagnostic printed to stderr).
+ *
+ * @param path		The sound file (8-48 kHz, mono or stereo)
+ * @param format	The format to play the frames in (the prompt holds
+ *			them in the codec's cache_as format)
+ * @param prompt	Set to the cached prompt
+ */
+int fesnd_cache_get(const char *path, enum fesnd_format format,
+		    struct fesnd_prompt **prompt);
+
+/**
+ * Get the same prompt in another format, only if already cached
+ *
+ * Never loads (so may be called from the sending thread): returns
+ * NULL if not cached yet, still being loaded, or the file changed.
+ *
+ * @param prompt	A cached prompt
+ * @param format	The format wanted
+ */
+struct fesnd_prompt *fesnd_cache_find(struct fesnd_prompt *prompt,
+				      enum fesnd_format format);
+
+/**
+ * Drop a reference obtained by fesnd_cache_get() or fesnd_cache_find()
+ *
+ * @param prompt	The cached prompt
+ */
+void fesnd_cache_put(struct fesnd_prompt *prompt);
+
+/**
+ * Load a prompt into the cache in all preload formats (e.g., at startup)
+ *
+ * Returns != 0 on error
+ *
+ * @param path		The sound file (8-48 kHz, mono or stereo)
+ */
+int fesnd_cache_preload(const char *path);
+
+/**
+ * Set the formats fesnd_cache_preload() encodes prompts in
+ *
+ * (By default A-Law, µ-Law and G.722.)
+ *
+ * @param mask		Bit (1 << format) for every format wanted
+ */
+void fesnd_cache_set_preload_formats(unsigned mask);
+
+/**
+ * Set the cache's memory limit
+ *
+ * @param bytes		Limit for the encoded frames of all prompts
+ */
+void fesnd_cache_set_limit(size_t bytes);
+
+/**
+ * Memory currently used by the cache, in bytes
+ */
+size_t fesnd_cache_usage(void);
+
+/**
+ * Drop all prompts not currently in use
+ */
+void fesnd_cache_flush(void);
+
+/**
+ * Access an encoded frame of a cached prompt
+ *
+ * Returns NULL past the end.
+ *
+ * @param prompt	The cached prompt
+ * @param index		Frame number (20 ms each)
+ * @param nbytes	Set to the frame's length
+ */
+const unsigned char *fesnd_prompt_frame(const struct fesnd_prompt *prompt,
+					size_t index, size_t *nbytes);
+
+/**
+ * Level of a frame of a cached prompt (see fesnd_level())
+ *
+ * Measured once, when the prompt was cached; FESND_SILENT past the end.
+ *
+ * @param prompt	The cached prompt
+ * @param index		Frame number (20 ms each)
+ */
+int fesnd_prompt_level(const struct fesnd_prompt *prompt, size_t index);
+
+/**
+ * The path a cached prompt was loaded from
+ *
+ * @param prompt	The cached prompt
  */
-int fesnd_close(void);
+const char *fesnd_prompt_path(const struct fesnd_prompt *prompt);
 
 // Sound encoding functions
 
@@ -59,12 +754,12 @@ int fesnd_close(void);
  * Encode 16bit PCM to 8bit ALAW
  *
  * Returns the number of samples (which equals bytes here) that
- * have been converted.
+ * have been converted. Reentrant, see flexog711.h.
  *
  * @param outbuf	Where ALAW will end up at
  * @param inbuf		Where PCM16 is taken from
  * @param nsamples	How many samples to convert
- * @param downsample	Skip every second sample?
+ * @param downsample	Halve the sample rate (16 kHz → 8 kHz)?
  */
 ssize_t fesnd_encode_alaw(unsigned char *outbuf, short *inbuf,
 			  ssize_t nsamples, _Bool downsample);
@@ -0,0 +1,292 @@
+/* flexostream — Live audio sources for flexosnd
+ *
+ * A stream is a ring of PCM samples with exactly one producer (the
+ * application, writing straight into the ring) and one consumer (the
+ * play queue, encoding straight out of it). Neither side locks; each
+ * only advances its own index.
+ */
+#include "flexosnd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "flexoresample.h"
+
+#define STREAM_MAX_INPUT 2048 // Samples taken for one frame (20 ms at 48 kHz + filter)
+
+struct fesnd_stream {
+  _Alignas(64) atomic_size_t head;	// Consumed up to (play queue)
+  _Alignas(64) atomic_size_t tail;	// Written up to (producer)
+  atomic_bool ended;			// No more writes
+  atomic_int refs;			// Application + queue entries
+  int rate;
+  size_t size;				// Samples, a power of two
+  size_t low, high;			// Watermarks, in samples
+  fesnd_stream_notify notify;
+  void *arg;
+  _Bool low_signalled;			// Consumer's, until above low again
+  _Bool high_signalled;			// Producer's, until below high again
+  unsigned long underruns;		// Frames sent as silence
+  short buf[];
+};
+
+struct fesnd_stream *fesnd_stream_new(int rate, size_t capacity,
+				      size_t low, size_t high,
+				      fesnd_stream_notify notify, void *arg)
+{
+  if (rate < FESND_MIN_RATE || rate > FESND_MAX_RATE) {
+    fprintf(stderr, "fesnd_stream_new(): %d samples/s, should be %d..%d\n",
+	    rate, FESND_MIN_RATE, FESND_MAX_RATE);
+    return NULL;
+  }
+  // At least what one frame may take (the consumer needs it contiguous
+  // or copies it), rounded up so positions wrap by masking
+  size_t size = STREAM_MAX_INPUT;
+  while (size < capacity)
+    size *= 2;
+  struct fesnd_stream *s = calloc(1, sizeof(*s) + size * sizeof(short));
+  if (s == NULL) {
+    fprintf(stderr, "fesnd_stream_new(): Out of memory\n");
+    return NULL;
+  }
+  atomic_init(&s->head, 0);
+  atomic_init(&s->tail, 0);
+  atomic_init(&s->ended, false);
+  atomic_init(&s->refs, 1);
+  s->rate = rate;
+  s->size = size;
+  s->low = low;
+  s->high = high > 0 && high <= size ? high : size;
+  s->notify = notify;
+  s->arg = arg;
+  return s;
+}
+
+void fesnd_stream_free(struct fesnd_stream *s)
+{
+  if (s != NULL && atomic_fetch_sub(&s->refs, 1) == 1)
+    free(s);
+}
+
+int fesnd_stream_rate(const struct fesnd_stream *s)
+{
+  return s->rate;
+}
+
+size_t fesnd_stream_level(struct fesnd_stream *s)
+{
+  return atomic_load_explicit(&s->tail, memory_order_acquire)
+    - atomic_load_explicit(&s->head, memory_order_acquire);
+}
+
+unsigned long fesnd_stream_underruns(const struct fesnd_stream *s)
+{
+  return s->underruns;
+}
+
+// ------------- Producer -----------------
+
+size_t fesnd_stream_reserve(struct fesnd_stream *s, short **buf)
+{
+  size_t tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&s->head, memory_order_acquire);
+  size_t room = s->size - (tail - head);
+  size_t pos = tail & (s->size - 1);
+  if (room > s->size - pos)
+    room = s->size - pos; // Up to the wrap, the rest comes next time
+  *buf = s->buf + pos;
+  return room;
+}
+
+void fesnd_stream_commit(struct fesnd_stream *s, size_t nsamples)
+{
+  size_t tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&s->head, memory_order_acquire);
+  atomic_store_explicit(&s->tail, tail + nsamples, memory_order_release);
+  size_t level = tail + nsamples - head;
+  if (level < s->high) {
+    s->high_signalled = false;
+  } else if (!s->high_signalled) {
+    s->high_signalled = true;
+    if (s->notify != NULL)
+      s->notify(s, FESND_STREAM_HIGH, s->arg);
+  }
+}
+
+size_t fesnd_stream_write(struct fesnd_stream *s, const short *pcm,
+			  size_t nsamples)
+{
+  size_t done = 0;
+  while (done < nsamples) {
+    short *buf;
+    size_t n = fesnd_stream_reserve(s, &buf);
+    if (n == 0)
+      break; // Full
+    if (n > nsamples - done)
+      n = nsamples - done;
+    memcpy(buf, pcm + done, n * sizeof(short));
+    fesnd_stream_commit(s, n);
+    done += n;
+  }
+  return done;
+}
+
+void fesnd_stream_end(struct fesnd_stream *s)
+{
+  atomic_store_explicit(&s->ended, true, memory_order_release);
+}
+
+// ------------- Consumer (play queue) -----------------
+
+int fesnd_add_stream(struct fesnd_queue *q, struct fesnd_stream *s)
+{
+  struct fesnd_entry *e = fesnd_queue_reserve(q);
+  if (e == NULL)
+    return 1; // Diagnostic already printed
+  if (fesnd_stream_attach(e, s, fesnd_format_rate(q->format)) != 0)
+    return 1;
+  fesnd_queue_commit(q);
+  return 0;
+}
+
+int fesnd_stream_attach(struct fesnd_entry *e, struct fesnd_stream *s,
+			int rate)
+{
+  if (fesnd_stream_set_rate(e, s, rate) != 0)
+    return 1;
+  atomic_fetch_add(&s->refs, 1);
+  e->stream = s;
+  return 0;
+}
+
+int fesnd_stream_set_rate(struct fesnd_entry *e, struct fesnd_stream *s,
+			  int rate)
+{
+  struct feresample *rs = NULL;
+  if (s->rate != rate) {
+    rs = feresample_new(s->rate, 1, rate, FERESAMPLE_MEDIUM);
+    if (rs == NULL) {
+      fprintf(stderr, "Cannot resample stream from %d to %d samples/s\n",
+	      s->rate, rate);
+      return 1;
+    }
+  }
+  feresample_free(e->rs);
+  e->rs = rs;
+  return 0;
+}
+
+/**
+ * Where the next frame's samples are, resampled if need be
+ *
+ * Returns the number of samples at *pcm (0: producer behind, -1:
+ * ended and drained) and sets *used to the samples to consume after.
+ */
+static ssize_t stream_peek(struct fesnd_entry *e, size_t frame_samples,
+			   const short **pcm, short *copy, short *resampled,
+			   size_t *used)
+{
+  struct fesnd_stream *s = e->stream;
+  // Ended first: whatever tail we see afterwards is the final one
+  _Bool ended = atomic_load_explicit(&s->ended, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+  size_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+  size_t avail = tail - head;
+  size_t want = e->rs != NULL
+    ? feresample_needed(e->rs, frame_samples) : frame_samples;
+  if (want > STREAM_MAX_INPUT)
+    want = STREAM_MAX_INPUT;
+
+  if (avail < want) {
+    if (ended) {
+      if (avail == 0)
+	return -1; // Drained
+      want = avail; // Short last frame
+    } else {
+      // Producer behind: the caller sends silence, we ask for more
+      s->underruns++;
+      if (!s->low_signalled && s->notify != NULL) {
+	s->low_signalled = true;
+	s->notify(s, FESND_STREAM_LOW, s->arg);
+      }
+      return 0;
+    }
+  }
+  // Straight from the ring unless the frame wraps around
+  size_t pos = head & (s->size - 1);
+  *pcm = s->buf + pos;
+  if (pos + want > s->size) {
+    size_t first = s->size - pos;
+    memcpy(copy, *pcm, first * sizeof(short));
+    memcpy(copy + first, s->buf, (want - first) * sizeof(short));
+    *pcm = copy;
+  }
+  *used = want;
+  if (e->rs != NULL) {
+    size_t n = feresample_process(e->rs, *pcm, want, resampled, frame_samples);
+    *pcm = resampled;
+    return n;
+  }
+  return want;
+}
+
+/**
+ * Release the samples of the frame just taken
+ */
+static void stream_consume(struct fesnd_entry *e, size_t used)
+{
+  struct fesnd_stream *s = e->stream;
+  _Bool ended = atomic_load_explicit(&s->ended, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+  size_t head = atomic_load_explicit(&s->head, memory_order_relaxed) + used;
+  atomic_store_explicit(&s->head, head, memory_order_release);
+
+  if (tail - head > s->low) {
+    s->low_signalled = false;
+  } else if (!s->low_signalled && !ended) {
+    s->low_signalled = true;
+    if (s->notify != NULL)
+      s->notify(s, FESND_STREAM_LOW, s->arg);
+  }
+}
+
+ssize_t fesnd_stream_frame(struct fesnd_entry *e,
+			   const struct fesnd_codec *codec,
+			   struct fesnd_codec_state *enc, unsigned char *out)
+{
+  short copy[STREAM_MAX_INPUT], resampled[FESND_MAX_SAMPLES];
+  const short *pcm;
+  size_t used;
+  ssize_t n = stream_peek(e, codec->frame_samples, &pcm, copy, resampled,
+			  &used);
+  if (n <= 0)
+    return n;
+  // Encoded while the samples are still in the ring
+  e->level = fesnd_level(pcm, n);
+  ssize_t nbytes = codec->encode(enc, out, pcm, n);
+  stream_consume(e, used);
+  return nbytes;
+}
+
+ssize_t fesnd_stream_read(struct fesnd_entry *e, size_t frame_samples,
+			  short *out)
+{
+  short copy[STREAM_MAX_INPUT], resampled[FESND_MAX_SAMPLES];
+  const short *pcm;
+  size_t used;
+  ssize_t n = stream_peek(e, frame_samples, &pcm, copy, resampled, &used);
+  if (n <= 0)
+    return n;
+  memcpy(out, pcm, n * sizeof(short));
+  stream_consume(e, used);
+  return n;
+}
+
+void fesnd_stream_close(struct fesnd_entry *e)
+{
+  feresample_free(e->rs);
+  e->rs = NULL;
+  fesnd_stream_free(e->stream);
+  e->stream = NULL;
+}
@@ -0,0 +1,153 @@
+#include "flexowheel.h"
+#include <stdbool.h>
+
+#define MASK (FEWHEEL_SLOTS - 1)
+#define SPAN(level) (1UL << (FEWHEEL_BITS * ((level) + 1))) // Ticks covered
+
+static void list_init(struct fewheel_timer *head)
+{
+  head->next = head->prev = head;
+}
+
+static void list_append(struct fewheel_timer *head, struct fewheel_timer *t)
+{
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static void list_unlink(struct fewheel_timer *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+/**
+ * Move a slot's timers to another (empty) list head
+ */
+static void list_take(struct fewheel_timer *head, struct fewheel_timer *to)
+{
+  if (head->next == head) {
+    list_init(to);
+    return;
+  }
+  *to = *head;
+  to->next->prev = to;
+  to->prev->next = to;
+  list_init(head);
+}
+
+void fewheel_init(struct fewheel *w, unsigned long now)
+{
+  w->now = now;
+  w->pending = 0;
+  for (int l = 0; l < FEWHEEL_LEVELS; l++)
+    for (int i = 0; i < FEWHEEL_SLOTS; i++)
+      list_init(&w->slot[l][i]);
+}
+
+/**
+ * Put a timer into the slot for its expiry (not pending)
+ *
+ * The level is by how far away it is: level l holds the timers due
+ * within SPAN(l) ticks, in slots of SPAN(l-1) ticks each. Since
+ * w->now has not fired yet, those slots never wrap onto one still to
+ * be moved down in this round.
+ */
+static void wheel_insert(struct fewheel *w, struct fewheel_timer *t)
+{
+  if ((long)(t->expires - w->now) < 0)
+    t->expires = w->now; // Overdue: fires with the next tick
+  unsigned long delta = t->expires - w->now;
+  int level = 0;
+  while (level < FEWHEEL_LEVELS - 1 && delta >= SPAN(level))
+    level++;
+  unsigned long at = t->expires;
+  if (delta >= SPAN(FEWHEEL_LEVELS - 1))
+    at = w->now + SPAN(FEWHEEL_LEVELS - 1) - 1; // Comes round again
+  list_append(&w->slot[level][(at >> (FEWHEEL_BITS * level)) & MASK], t);
+}
+
+void fewheel_add(struct fewheel *w, struct fewheel_timer *t,
+		 unsigned long expires)
+{
+  if (fewheel_pending(t))
+    list_unlink(t);
+  else
+    w->pending++;
+  t->expires = expires;
+  wheel_insert(w, t);
+}
+
+void fewheel_del(struct fewheel *w, struct fewheel_timer *t)
+{
+  if (!fewheel_pending(t))
+    return;
+  list_unlink(t);
+  w->pending--;
+}
+
+_Bool fewheel_pending(const struct fewheel_timer *t)
+{
+  return t->next != NULL;
+}
+
+/**
+ * Move the timers of a level's current slot down, and the next
+ * level's if this one wrapped around
+ */
+static void wheel_cascade(struct fewheel *w, int level)
+{
+  unsigned long index = (w->now >> (FEWHEEL_BITS * level)) & MASK;
+  struct fewheel_timer list;
+  list_take(&w->slot[level][index], &list);
+  while (list.next != &list) {
+    struct fewheel_timer *t = list.next;
+    list_unlink(t);
+    wheel_insert(w, t);
+  }
+  if (index == 0 && level < FEWHEEL_LEVELS - 1)
+    wheel_cascade(w, level + 1);
+}
+
+size_t fewheel_advance(struct fewheel *w, unsigned long now,
+		       fewheel_fn fn, void *arg)
+{
+  size_t fired = 0;
+  while ((long)(now - w->now) >= 0) {
+    if (w->pending == 0) {
+      w->now = now + 1; // Nothing to move down or fire on the way
+      break;
+    }
+    if ((w->now & MASK) == 0)
+      wheel_cascade(w, 1);
+    struct fewheel_timer list;
+    list_take(&w->slot[0][w->now & MASK], &list);
+    w->now++; // Timers added again from fn go after this tick
+    while (list.next != &list) {
+      struct fewheel_timer *t = list.next;
+      list_unlink(t);
+      w->pending--;
+      fired++;
+      fn(t, arg);
+    }
+  }
+  return fired;
+}
+
+unsigned long fewheel_next(const struct fewheel *w)
+{
+  if (w->pending == 0)
+    return (unsigned long)-1;
+  // The next time timers come down from level 1, unless one on
+  // level 0 is due before
+  unsigned long next = (w->now + MASK) & ~(unsigned long)MASK;
+  for (unsigned long t = w->now; t < next; t++) {
+    const struct fewheel_timer *head = &w->slot[0][t & MASK];
+    if (head->next != head)
+      return t;
+  }
+  return next;
+}
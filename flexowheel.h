@@ -0,0 +1,94 @@
+/* flexowheel — Hierarchical timer wheel for flexoSIP
+ *
+ * Timers counted in ticks (the caller decides how long one is), kept
+ * in FEWHEEL_LEVELS wheels of FEWHEEL_SLOTS slots, each level 64 times
+ * as coarse as the one below. Adding and removing a timer is O(1),
+ * however many there are; on its way to firing, a timer moves down a
+ * level at most FEWHEEL_LEVELS-1 times. The timers are embedded in
+ * the caller's structures, so nothing is allocated. Not thread safe.
+ */
+#include <stddef.h>
+
+#define FEWHEEL_BITS 6
+#define FEWHEEL_SLOTS (1 << FEWHEEL_BITS)
+#define FEWHEEL_LEVELS 4 // 2^24 ticks ahead; timers further out wait longer in the top level
+
+/**
+ * A timer, embedded in whatever it is for
+ *
+ * Zeroed means not pending.
+ */
+struct fewheel_timer {
+  struct fewheel_timer *next, *prev; // NULL when not pending
+  unsigned long expires;	// Tick it fires at
+};
+
+struct fewheel {
+  unsigned long now;		// Next tick to fire
+  size_t pending;		// Timers in the wheels
+  struct fewheel_timer slot[FEWHEEL_LEVELS][FEWHEEL_SLOTS]; // List heads
+};
+
+/**
+ * Called for each timer firing
+ *
+ * The timer is no longer pending then; it may be added again.
+ */
+typedef void (*fewheel_fn)(struct fewheel_timer *timer, void *arg);
+
+/**
+ * Set up an empty wheel
+ *
+ * @param w		The wheel
+ * @param now		The current tick
+ */
+void fewheel_init(struct fewheel *w, unsigned long now);
+
+/**
+ * Start a timer, or move it if it is pending already
+ *
+ * A tick in the past fires on the next fewheel_advance().
+ *
+ * @param w		The wheel
+ * @param t		The timer
+ * @param expires	The tick to fire at
+ */
+void fewheel_add(struct fewheel *w, struct fewheel_timer *t,
+		 unsigned long expires);
+
+/**
+ * Stop a timer (if pending)
+ *
+ * @param w		The wheel
+ * @param t		The timer
+ */
+void fewheel_del(struct fewheel *w, struct fewheel_timer *t);
+
+/**
+ * Whether a timer is pending
+ */
+_Bool fewheel_pending(const struct fewheel_timer *t);
+
+/**
+ * Fire all timers due up to and including a tick
+ *
+ * Returns the number of timers fired.
+ *
+ * @param w		The wheel
+ * @param now		The current tick
+ * @param fn		Called for each timer, tick by tick
+ * @param arg		Passed to fn
+ */
+size_t fewheel_advance(struct fewheel *w, unsigned long now,
+		       fewheel_fn fn, void *arg);
+
+/**
+ * The earliest tick a timer may fire at
+ *
+ * Exact for timers less than FEWHEEL_SLOTS ticks away; with later
+ * ones pending, it may be earlier than needed (when timers move down
+ * a level). (unsigned long)-1 when no timer is pending.
+ *
+ * @param w		The wheel
+ */
+unsigned long fewheel_next(const struct fewheel *w);
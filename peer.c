@@ -0,0 +1,842 @@
+/* peer — A SIP peer to test flexoSIP against, without a PBX
+ *
+ * Accepts every REGISTER (so flexoSIP can use it as its registrar) and
+ * answers incoming calls; with a destination, it also places calls at
+ * a given rate. Every call it answers or places sends silence in the
+ * negotiated codec, optionally DTMF digits, and hangs up after the
+ * hold time.
+ *
+ * Prints one JSON object per line (every -s seconds and at the end):
+ * calls attempted, answered, failed (by status class), refused for
+ * lack of slots, concurrent calls, and setup latency percentiles from
+ * the INVITE to the 200 OK and to the first RTP packet received.
+ *
+ *   peer -p 5062			# Registrar and callee
+ *   peer -r 20 -n 1000 -H 3000 sip:cow-bell@127.0.0.1:5060
+ */
+#include "flexosnd.h"
+#include "flexortp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <eXosip2/eXosip.h>
+#include <ortp/ortp.h>
+#include "unused.h"
+
+#define PEER_MAX_CALLS 1024
+#define PEER_SIP_PORT 5062
+#define PEER_RTP_MIN 20000 // Apart from flexoSIP's FERTP_PORT_MIN/MAX
+#define PEER_RTP_MAX (PEER_RTP_MIN + 2 * PEER_MAX_CALLS - 1)
+#define FRAME_NS 20000000LL
+#define MS_NS 1000000LL
+#define HOSTLEN 64
+#define MAX_CODECS 8
+#define DTMF_PT 101
+#define DTMF_DIGITS "0123456789*#ABCD" // RFC 4733 event codes 0…15
+#define DTMF_TONE_TICKS 5 // 100 ms per digit
+#define DTMF_GAP_TICKS 5
+#define DTMF_END_REPEAT 3
+#define DTMF_VOLUME 10 // -10 dBm0
+
+/**
+ * One call, incoming or outgoing
+ */
+struct peer_call {
+  _Bool used;
+  _Bool outgoing;
+  _Bool answered;		// 200 OK sent or received
+  _Bool media;			// First RTP packet received
+  int cid, did, tid;
+  long long start;		// INVITE sent or received (ns)
+  long long answer_at;		// Incoming: when to send the 200 OK
+  long long hangup_at;		// 0 = wait for the other side
+  long long dtmf_at;		// Next digit not before
+  const char *dtmf;		// Digits still to send
+  int dtmf_ticks;		// Into the current telephone-event
+  int dtmf_event;
+  unsigned dtmf_ts;
+  _Bool dtmf_rx_seen;
+  unsigned dtmf_rx_ts;
+  const struct fesnd_codec *codec; // NULL until negotiated
+  int pt, dtmf_pt;		// Payload types, -1 = none
+  char host[HOSTLEN];		// Where audio goes to
+  int port;
+  struct fesnd_codec_state enc;
+  struct fertp_session rtp;
+};
+
+/**
+ * What happened so far
+ */
+struct peer_stats {
+  unsigned long attempts;	// INVITEs sent
+  unsigned long incoming;	// INVITEs received
+  unsigned long answered;	// Either direction
+  unsigned long completed;	// Hung up by us after the hold time
+  unsigned long failed[4];	// Unanswered: timeout/other, 4xx, 5xx, 6xx
+  unsigned long refused;	// No call slot or RTP port free
+  unsigned long no_media;	// Answered, but ended without RTP
+  unsigned long registers;
+  unsigned long dtmf_rx;	// Digits received (RTP or INFO)
+  int active, max_active;
+  unsigned answer[FERTP_HIST_BUCKETS]; // INVITE → 200 OK, µs
+  unsigned first_rtp[FERTP_HIST_BUCKETS]; // INVITE → first RTP, µs
+};
+
+static struct eXosip_t *ctx;
+static struct peer_call calls[PEER_MAX_CALLS];
+static struct peer_stats stats;
+static volatile sig_atomic_t stop_please;
+
+// Options
+static int sip_port = PEER_SIP_PORT;
+static enum fesnd_format codecs[MAX_CODECS] = {FESND_PCMA8000};
+static int ncodecs = 1;
+static _Bool offer_events = true, info_dtmf = false;
+static const char *dtmf_digits = "";
+static int dtmf_delay_ms = 1000, answer_ms = 0, hold_ms = 5000;
+static int reject_code = 0;
+static double cps = 1;
+static long ncalls = 1;
+static int max_active = PEER_MAX_CALLS;
+static int report_s = 1;
+static const char *from_uri, *to_uri;
+
+static long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void peer_stop(int UNUSED_PARAM(sig))
+{
+  stop_please = 1;
+}
+
+static int frame_ticks(const struct fesnd_codec *codec)
+{
+  return codec->frame_samples * codec->clock_rate / codec->rate;
+}
+
+// ------------- Calls -----------------
+
+static struct peer_call *peer_alloc(void)
+{
+  if (stats.active >= max_active)
+    return NULL;
+  for (int i = 0; i < PEER_MAX_CALLS; i++) {
+    struct peer_call *call = &calls[i];
+    if (!call->used) {
+      memset(call, 0, sizeof(*call));
+      call->used = true;
+      call->cid = call->did = call->tid = -1;
+      call->pt = call->dtmf_pt = -1;
+      call->dtmf = dtmf_digits;
+      if (++stats.active > stats.max_active)
+	stats.max_active = stats.active;
+      return call;
+    }
+  }
+  return NULL;
+}
+
+static struct peer_call *peer_find(int cid)
+{
+  for (int i = 0; i < PEER_MAX_CALLS; i++)
+    if (calls[i].used && calls[i].cid == cid)
+      return &calls[i];
+  return NULL;
+}
+
+static void peer_release(struct peer_call *call)
+{
+  if (call->answered && !call->media)
+    stats.no_media++;
+  fertp_stop(&call->rtp);
+  call->used = false;
+  stats.active--;
+}
+
+/**
+ * Count an unanswered outgoing call
+ *
+ * @param code		Final SIP status, 0 = none (timeout, CANCEL, …)
+ */
+static void peer_failed(struct peer_call *call, int code)
+{
+  stats.failed[code >= 400 && code < 700 ? code / 100 - 3 : 0]++;
+  peer_release(call);
+}
+
+static void peer_hangup(struct peer_call *call)
+{
+  eXosip_lock(ctx);
+  eXosip_call_terminate(ctx, call->cid, call->did);
+  eXosip_unlock(ctx);
+  stats.completed++;
+  peer_release(call);
+}
+
+// ------------- SDP -----------------
+
+/**
+ * Find the payload type the SDP uses for a codec (rtpmap, or a static
+ * type only listed in the m= line), -1 if none
+ */
+static int peer_find_format(sdp_message_t *sdp, int pos_media,
+			    const char *name, int clock_rate, int static_pt)
+{
+  char *field, *fmt;
+  _Bool static_mapped = false;
+  for (int pos = 0;
+       (field = sdp_message_a_att_field_get(sdp, pos_media, pos)) != NULL;
+       pos++) {
+    if (strcmp(field, "rtpmap") != 0)
+      continue;
+    char *value = sdp_message_a_att_value_get(sdp, pos_media, pos), *end;
+    int pt = strtol(value, &end, 10);
+    if (end == value || *end != ' ')
+      continue;
+    char *codec = end + 1, *slash = strchr(codec, '/');
+    if (slash != NULL && (size_t)(slash - codec) == strlen(name)
+	&& strncasecmp(codec, name, slash - codec) == 0
+	&& atoi(slash + 1) == clock_rate)
+      return pt;
+    if (pt == static_pt)
+      static_mapped = true; // Reused for something else
+  }
+  if (static_pt >= 0 && !static_mapped)
+    for (int pos = 0; (fmt = sdp_message_m_payload_get(sdp, pos_media, pos))
+	   != NULL; pos++)
+      if (atoi(fmt) == static_pt)
+	return static_pt;
+  return -1;
+}
+
+/**
+ * Take address, port and codec of the first audio stream
+ *
+ * Returns 0 if there is none we can use.
+ *
+ * @param call		The call to update
+ * @param msg		The INVITE or 200 OK carrying the SDP
+ */
+static int peer_remote_sdp(struct peer_call *call, osip_message_t *msg)
+{
+  sdp_message_t *sdp = eXosip_get_sdp_info(msg);
+  const char *media;
+  int retval = 0;
+
+  if (sdp == NULL)
+    return 0;
+  for (int pos_media = 0;
+       (media = sdp_message_m_media_get(sdp, pos_media)) != NULL;
+       pos_media++) {
+    if (strcmp(media, "audio") != 0
+	|| strcmp(sdp_message_m_proto_get(sdp, pos_media), "RTP/AVP") != 0)
+      continue;
+    const char *addr = sdp_message_c_addr_get(sdp, pos_media, 0);
+    if (addr == NULL)
+      addr = sdp_message_c_addr_get(sdp, -1, 0);
+    if (addr == NULL || strlen(addr) >= HOSTLEN)
+      break;
+    strcpy(call->host, addr);
+    call->port = atoi(sdp_message_m_port_get(sdp, pos_media));
+    for (int i = 0; i < ncodecs && call->pt < 0; i++) {
+      call->codec = fesnd_codec(codecs[i]);
+      call->pt = peer_find_format(sdp, pos_media, call->codec->name,
+				  call->codec->clock_rate,
+				  call->codec->static_pt);
+    }
+    if (call->pt < 0) {
+      call->codec = NULL;
+      break;
+    }
+    if (offer_events)
+      call->dtmf_pt = peer_find_format(sdp, pos_media, "telephone-event",
+				       call->codec->clock_rate, -1);
+    retval = 1;
+    break;
+  }
+  sdp_message_free(sdp);
+  return retval;
+}
+
+static void peer_sdp_format(char *fmts, size_t fmtlen, char *maps,
+			    size_t maplen, int pt, const char *name,
+			    int clock_rate)
+{
+  size_t len = strlen(fmts);
+  snprintf(fmts + len, fmtlen - len, " %d", pt);
+  len = strlen(maps);
+  snprintf(maps + len, maplen - len, "a=rtpmap:%d %s/%d\r\n",
+	   pt, name, clock_rate);
+}
+
+/**
+ * Attach an offer with all our codecs, or the answer with the one
+ * negotiated
+ */
+static void peer_sdp(struct peer_call *call, osip_message_t *msg)
+{
+  char body[2048], localip[128], lenstr[32];
+  char fmts[256] = "", maps[1024] = "";
+  if (call->codec != NULL) {
+    peer_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps), call->pt,
+		    call->codec->name, call->codec->clock_rate);
+    if (call->dtmf_pt >= 0)
+      peer_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps), call->dtmf_pt,
+		      "telephone-event", call->codec->clock_rate);
+  } else {
+    int dynamic_pt = 96, rates = 0;
+    for (int i = 0; i < ncodecs; i++) {
+      const struct fesnd_codec *codec = fesnd_codec(codecs[i]);
+      peer_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps),
+		      codec->static_pt >= 0 ? codec->static_pt : dynamic_pt++,
+		      codec->name, codec->clock_rate);
+      rates |= codec->clock_rate == 16000 ? 2 : 1;
+    }
+    if (offer_events && (rates & 1))
+      peer_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps), DTMF_PT,
+		      "telephone-event", 8000);
+    if (offer_events && (rates & 2))
+      peer_sdp_format(fmts, sizeof(fmts), maps, sizeof(maps), DTMF_PT + 1,
+		      "telephone-event", 16000);
+  }
+  eXosip_guess_localip(ctx, AF_INET, localip, sizeof(localip));
+  snprintf(body, sizeof(body),
+	   "v=0\r\n"
+	   "o=peer 0 0 IN IP4 %s\r\n"
+	   "s=call\r\n"
+	   "c=IN IP4 %s\r\n"
+	   "t=0 0\r\n"
+	   "m=audio %d RTP/AVP%s\r\n"
+	   "%s",
+	   localip, localip, call->rtp.local_port, fmts, maps);
+  osip_message_set_body(msg, body, strlen(body));
+  snprintf(lenstr, sizeof(lenstr), "%zu", strlen(body));
+  osip_message_set_content_length(msg, lenstr);
+  osip_message_set_content_type(msg, "application/sdp");
+}
+
+// ------------- Media -----------------
+
+static void peer_media_start(struct peer_call *call, long long now)
+{
+  fertp_start(&call->rtp, call->host, call->port, call->pt,
+	      call->codec->name, call->codec->clock_rate);
+  call->dtmf_at = now + dtmf_delay_ms * MS_NS;
+  call->hangup_at = hold_ms > 0 ? now + hold_ms * MS_NS : 0;
+}
+
+static void peer_send_info(struct peer_call *call, char digit)
+{
+  osip_message_t *info;
+  char body[64];
+  eXosip_lock(ctx);
+  if (eXosip_call_build_info(ctx, call->did, &info) == 0) {
+    snprintf(body, sizeof(body), "Signal=%c\r\nDuration=100\r\n", digit);
+    osip_message_set_content_type(info, "application/dtmf-relay");
+    osip_message_set_body(info, body, strlen(body));
+    eXosip_call_send_request(ctx, call->did, info);
+  }
+  eXosip_unlock(ctx);
+}
+
+/**
+ * Send the DTMF due in this frame period, if any
+ *
+ * Returns true while a telephone-event replaces the audio.
+ */
+static _Bool peer_dtmf_tick(struct peer_call *call, long long now,
+			    const struct timespec *when)
+{
+  if (call->dtmf_ticks == 0) {
+    if (*call->dtmf == '\0' || now < call->dtmf_at)
+      return false;
+    char digit = toupper((unsigned char)*call->dtmf++);
+    if (info_dtmf || call->dtmf_pt < 0) {
+      peer_send_info(call, digit);
+      call->dtmf_at = now + (DTMF_TONE_TICKS + DTMF_GAP_TICKS) * FRAME_NS;
+      return false;
+    }
+    call->dtmf_event = strchr(DTMF_DIGITS, digit) - DTMF_DIGITS;
+    call->dtmf_ts = fertp_timestamp(&call->rtp, when);
+  }
+  call->dtmf_ticks++;
+  if (call->dtmf_ticks > DTMF_TONE_TICKS) {
+    if (call->dtmf_ticks >= DTMF_TONE_TICKS + DTMF_GAP_TICKS)
+      call->dtmf_ticks = 0;
+    return false;
+  }
+  _Bool end = (call->dtmf_ticks == DTMF_TONE_TICKS);
+  unsigned duration = call->dtmf_ticks * frame_ticks(call->codec);
+  unsigned char payload[4] = {
+    call->dtmf_event, (end ? 0x80 : 0) | DTMF_VOLUME,
+    duration >> 8, duration & 0xff
+  };
+  for (int i = 0; i < (end ? DTMF_END_REPEAT : 1); i++)
+    fertp_send_pt(&call->rtp, call->dtmf_pt, payload, sizeof(payload),
+		  call->dtmf_ts, call->dtmf_ticks == 1);
+  return true;
+}
+
+/**
+ * Note the first RTP packet of a call
+ */
+static void peer_first_rtp(struct peer_call *call, long long now)
+{
+  call->media = true;
+  stats.first_rtp[fertp_hist_bucket((now - call->start) / 1000)]++;
+}
+
+/**
+ * Drain the received packets, counting telephone-events
+ */
+static void peer_receive(struct peer_call *call, long long now)
+{
+  struct fertp_packet pkt;
+  while (fertp_recv(&call->rtp, &pkt)) {
+    if (!call->media)
+      peer_first_rtp(call, now);
+    if (pkt.pt == call->dtmf_pt && pkt.len >= 4
+	&& !(call->dtmf_rx_seen && pkt.ts == call->dtmf_rx_ts)) {
+      call->dtmf_rx_seen = true;
+      call->dtmf_rx_ts = pkt.ts;
+      stats.dtmf_rx++;
+    }
+  }
+}
+
+/**
+ * Send one frame of silence on every answered call
+ *
+ * @param now		The current time
+ * @param when		When the frame was due
+ */
+static void peer_media_tick(long long now, long long when_ns)
+{
+  static const short silence[FESND_MAX_FRAME];
+  unsigned char frame[FESND_MAX_FRAME];
+  struct timespec when = {when_ns / 1000000000LL, when_ns % 1000000000LL};
+  for (int i = 0; i < PEER_MAX_CALLS; i++) {
+    struct peer_call *call = &calls[i];
+    if (!call->used || !call->answered || call->codec == NULL)
+      continue;
+    peer_receive(call, now);
+    if (call->hangup_at != 0 && now >= call->hangup_at) {
+      peer_hangup(call);
+      continue;
+    }
+    if (peer_dtmf_tick(call, now, &when))
+      continue;
+    size_t n = call->codec->encode(&call->enc, frame, silence,
+				   call->codec->frame_samples);
+    fertp_send_at(&call->rtp, frame, n, frame_ticks(call->codec), &when);
+  }
+}
+
+// ------------- SIP -----------------
+
+static void peer_invite(long long now)
+{
+  osip_message_t *invite;
+  struct peer_call *call = peer_alloc();
+  if (call == NULL) {
+    stats.refused++;
+    return;
+  }
+  if (fertp_open(&call->rtp) < 0) {
+    stats.refused++;
+    peer_release(call);
+    return;
+  }
+  call->outgoing = true;
+  call->start = now;
+  stats.attempts++;
+  eXosip_lock(ctx);
+  if (eXosip_call_build_initial_invite(ctx, &invite, to_uri, from_uri,
+				       NULL, "peer") != 0) {
+    eXosip_unlock(ctx);
+    peer_failed(call, 0);
+    return;
+  }
+  peer_sdp(call, invite);
+  call->cid = eXosip_call_send_initial_invite(ctx, invite);
+  eXosip_unlock(ctx);
+  if (call->cid <= 0)
+    peer_failed(call, 0);
+}
+
+static void peer_answer(struct peer_call *call, long long now)
+{
+  osip_message_t *answer;
+  int code = 200;
+  eXosip_lock(ctx);
+  if (fertp_open(&call->rtp) < 0) {
+    code = 503;
+  } else if (eXosip_call_build_answer(ctx, call->tid, 200, &answer) != 0) {
+    code = 500;
+  } else {
+    peer_sdp(call, answer);
+    eXosip_call_send_answer(ctx, call->tid, 200, answer);
+  }
+  if (code != 200)
+    eXosip_call_send_answer(ctx, call->tid, code, NULL);
+  eXosip_unlock(ctx);
+  if (code != 200) {
+    stats.refused++;
+    peer_release(call);
+    return;
+  }
+  call->answered = true;
+  stats.answered++;
+  stats.answer[fertp_hist_bucket((now - call->start) / 1000)]++;
+  peer_media_start(call, now);
+}
+
+/**
+ * Answer a request outside of calls; REGISTER always succeeds
+ */
+static void peer_request(eXosip_event_t *evt)
+{
+  osip_message_t *answer;
+  osip_contact_t *contact;
+  char *str;
+  const char *method = evt->request->sip_method;
+  _Bool registering = strcasecmp(method, "REGISTER") == 0;
+  int code = registering || strcasecmp(method, "OPTIONS") == 0 ? 200 : 405;
+
+  eXosip_lock(ctx);
+  if (eXosip_message_build_answer(ctx, evt->tid, code, &answer) == 0) {
+    if (registering) {
+      stats.registers++;
+      if (osip_message_get_contact(evt->request, 0, &contact) >= 0
+	  && osip_contact_to_str(contact, &str) == 0) {
+	osip_message_set_contact(answer, str);
+	osip_free(str);
+      }
+      osip_message_set_expires(answer, "3600");
+    }
+    eXosip_message_send_answer(ctx, evt->tid, code, answer);
+  }
+  eXosip_unlock(ctx);
+}
+
+static void peer_event(eXosip_event_t *evt, long long now)
+{
+  struct peer_call *call = evt->cid > 0 ? peer_find(evt->cid) : NULL;
+  osip_message_t *msg;
+
+  switch (evt->type) {
+  case EXOSIP_MESSAGE_NEW:
+    peer_request(evt);
+    break;
+  case EXOSIP_CALL_INVITE:
+    stats.incoming++;
+    eXosip_lock(ctx);
+    if (reject_code != 0) {
+      eXosip_call_send_answer(ctx, evt->tid, reject_code, NULL);
+    } else if ((call = peer_alloc()) == NULL) {
+      eXosip_call_send_answer(ctx, evt->tid, 486, NULL);
+      stats.refused++;
+    } else if (!peer_remote_sdp(call, evt->request)) {
+      eXosip_call_send_answer(ctx, evt->tid, 488, NULL);
+      peer_release(call);
+    } else {
+      call->cid = evt->cid;
+      call->did = evt->did;
+      call->tid = evt->tid;
+      call->start = now;
+      call->answer_at = now + answer_ms * MS_NS;
+      eXosip_call_send_answer(ctx, evt->tid, 180, NULL);
+    }
+    eXosip_unlock(ctx);
+    break;
+  case EXOSIP_CALL_ANSWERED:
+    if (call == NULL)
+      break;
+    eXosip_lock(ctx);
+    if (eXosip_call_build_ack(ctx, evt->did, &msg) == 0)
+      eXosip_call_send_ack(ctx, evt->did, msg);
+    eXosip_unlock(ctx);
+    if (call->answered)
+      break; // Retransmitted 200 OK
+    call->did = evt->did;
+    call->answered = true;
+    stats.answered++;
+    stats.answer[fertp_hist_bucket((now - call->start) / 1000)]++;
+    if (peer_remote_sdp(call, evt->response))
+      peer_media_start(call, now);
+    else
+      peer_hangup(call);
+    break;
+  case EXOSIP_CALL_MESSAGE_NEW:
+    // BYE is handled by eXosip, INFO and the like by us
+    if (evt->request != NULL && MSG_IS_INFO(evt->request)) {
+      osip_content_type_t *type = osip_message_get_content_type(evt->request);
+      if (type != NULL && type->subtype != NULL
+	  && strcasecmp(type->subtype, "dtmf-relay") == 0)
+	stats.dtmf_rx++;
+      eXosip_lock(ctx);
+      if (eXosip_call_build_answer(ctx, evt->tid, 200, &msg) == 0)
+	eXosip_call_send_answer(ctx, evt->tid, 200, msg);
+      eXosip_unlock(ctx);
+    }
+    break;
+  case EXOSIP_CALL_REQUESTFAILURE:
+  case EXOSIP_CALL_SERVERFAILURE:
+  case EXOSIP_CALL_GLOBALFAILURE:
+  case EXOSIP_CALL_REDIRECTED:
+  case EXOSIP_CALL_NOANSWER:
+    if (call != NULL && !call->answered)
+      peer_failed(call, evt->response != NULL ? evt->response->status_code : 0);
+    break;
+  case EXOSIP_CALL_CANCELLED:
+  case EXOSIP_CALL_CLOSED:
+  case EXOSIP_CALL_RELEASED:
+    if (call == NULL)
+      break;
+    if (call->outgoing && !call->answered)
+      peer_failed(call, 0);
+    else
+      peer_release(call);
+    break;
+  default:
+    break;
+  }
+}
+
+static void peer_sip_events(long long now)
+{
+  eXosip_event_t *evt;
+  char buf[512];
+  // eXosip only drains its pipe when the queue is empty (see flexosip.c)
+  if (read(eXosip_event_geteventsocket(ctx), buf, sizeof(buf)) < 0) {
+    // Nothing there, the queue is checked anyway
+  }
+  while ((evt = eXosip_event_wait(ctx, 0, 0)) != NULL) {
+    peer_event(evt, now);
+    eXosip_event_free(evt);
+  }
+}
+
+// ------------- Reports -----------------
+
+static void peer_report(const char *kind, double seconds)
+{
+  printf("{\"peer\":\"%s\",\"seconds\":%.1f,\"attempts\":%lu,"
+	 "\"incoming\":%lu,\"answered\":%lu,\"completed\":%lu,"
+	 "\"failed_timeout\":%lu,\"failed_4xx\":%lu,\"failed_5xx\":%lu,"
+	 "\"failed_6xx\":%lu,\"refused\":%lu,\"no_media\":%lu,"
+	 "\"active\":%d,\"max_active\":%d,\"registers\":%lu,"
+	 "\"dtmf_rx\":%lu,\"answer_ms_p50\":%.1f,\"answer_ms_p99\":%.1f,"
+	 "\"first_rtp_ms_p50\":%.1f,\"first_rtp_ms_p99\":%.1f}\n",
+	 kind, seconds, stats.attempts, stats.incoming, stats.answered,
+	 stats.completed, stats.failed[0], stats.failed[1], stats.failed[2],
+	 stats.failed[3], stats.refused, stats.no_media, stats.active,
+	 stats.max_active, stats.registers, stats.dtmf_rx,
+	 fertp_hist_percentile(stats.answer, 0.5) / 1e3,
+	 fertp_hist_percentile(stats.answer, 0.99) / 1e3,
+	 fertp_hist_percentile(stats.first_rtp, 0.5) / 1e3,
+	 fertp_hist_percentile(stats.first_rtp, 0.99) / 1e3);
+  fflush(stdout);
+}
+
+// ------------- Main -----------------
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+	  "Usage: %s [options] [destination-uri]\n"
+	  "  -p port     SIP port (default %d)\n"
+	  "  -f uri      From: of our calls (default sip:peer@127.0.0.1:port)\n"
+	  "  -c codecs   Preference list (default PCMA/8000)\n"
+	  "  -T          No telephone-events in the SDP\n"
+	  "  -d digits   DTMF to send once answered\n"
+	  "  -D ms       Delay before the digits (default %d)\n"
+	  "  -i          Send DTMF as SIP INFO\n"
+	  "  -a ms       Ring before answering (default %d)\n"
+	  "  -e code     Reject incoming calls with this status\n"
+	  "  -H ms       Hang up after (default %d, 0: never)\n"
+	  "  -r cps      Calls per second to the destination (default 1)\n"
+	  "  -n calls    How many, 0: until interrupted (default 1)\n"
+	  "  -m calls    Concurrent calls at most (default %d)\n"
+	  "  -R min-max  Local RTP ports (default %d-%d)\n"
+	  "  -s seconds  Report interval, 0: at the end only (default %d)\n",
+	  name, PEER_SIP_PORT, dtmf_delay_ms, answer_ms, hold_ms,
+	  PEER_MAX_CALLS, PEER_RTP_MIN, PEER_RTP_MAX, report_s);
+  exit(2);
+}
+
+static void parse_codecs(const char *list)
+{
+  char *copy = strdup(list), *save = NULL;
+  ncodecs = 0;
+  for (char *c = strtok_r(copy, ",", &save); c != NULL;
+       c = strtok_r(NULL, ",", &save)) {
+    char *slash = strchr(c, '/');
+    int format = -1;
+    if (slash != NULL) {
+      *slash = '\0';
+      format = fesnd_codec_find(c, atoi(slash + 1));
+    }
+    if (format < 0 || ncodecs >= MAX_CODECS) {
+      fprintf(stderr, "Unknown or too many codecs: %s\n", list);
+      exit(2);
+    }
+    codecs[ncodecs++] = format;
+  }
+  free(copy);
+  if (ncodecs == 0)
+    usage("peer");
+}
+
+int main(int argc, char **argv)
+{
+  int opt, rtp_min = PEER_RTP_MIN, rtp_max = PEER_RTP_MAX;
+  char from[128];
+
+  while ((opt = getopt(argc, argv, "p:f:c:Td:D:ia:e:H:r:n:m:R:s:")) != -1) {
+    switch (opt) {
+    case 'p': sip_port = atoi(optarg); break;
+    case 'f': from_uri = optarg; break;
+    case 'c': parse_codecs(optarg); break;
+    case 'T': offer_events = false; break;
+    case 'd': dtmf_digits = optarg; break;
+    case 'D': dtmf_delay_ms = atoi(optarg); break;
+    case 'i': info_dtmf = true; break;
+    case 'a': answer_ms = atoi(optarg); break;
+    case 'e': reject_code = atoi(optarg); break;
+    case 'H': hold_ms = atoi(optarg); break;
+    case 'r': cps = atof(optarg); break;
+    case 'n': ncalls = atol(optarg); break;
+    case 'm': max_active = atoi(optarg); break;
+    case 'R':
+      if (sscanf(optarg, "%d-%d", &rtp_min, &rtp_max) != 2)
+	usage(argv[0]);
+      break;
+    case 's': report_s = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind < argc)
+    to_uri = argv[optind++];
+  if (optind < argc || cps <= 0 || max_active < 1
+      || max_active > PEER_MAX_CALLS)
+    usage(argv[0]);
+  for (const char *d = dtmf_digits; *d != '\0'; d++) {
+    if (strchr(DTMF_DIGITS, toupper((unsigned char)*d)) == NULL) {
+      fprintf(stderr, "Not a DTMF digit: %c\n", *d);
+      return 2;
+    }
+  }
+  if (from_uri == NULL) {
+    snprintf(from, sizeof(from), "sip:peer@127.0.0.1:%d", sip_port);
+    from_uri = from;
+  }
+
+  ortp_init();
+  ctx = eXosip_malloc();
+  if (ctx == NULL || eXosip_init(ctx) != 0) {
+    fprintf(stderr, "peer: Could not initialize eXosip\n");
+    return 1;
+  }
+  if (eXosip_listen_addr(ctx, IPPROTO_UDP, NULL, sip_port, AF_INET, 0) != 0) {
+    fprintf(stderr, "peer: Could not listen on port %d\n", sip_port);
+    eXosip_quit(ctx);
+    return 1;
+  }
+  eXosip_set_user_agent(ctx, "flexosip-peer");
+  // We pace the audio ourselves, on one 20 ms grid for all calls
+  fertp_set_clocked(true);
+  if (fertp_set_port_range(rtp_min, rtp_max) != 0) {
+    eXosip_quit(ctx);
+    return 1;
+  }
+  signal(SIGINT, peer_stop);
+  signal(SIGTERM, peer_stop);
+
+  static struct pollfd fds[1 + PEER_MAX_CALLS];
+  static struct peer_call *fd_call[1 + PEER_MAX_CALLS];
+  long long begin = now_ns(), next_tick = begin, next_call = begin;
+  long long next_report = begin + report_s * 1000000000LL;
+  long launched = 0;
+  while (!stop_please) {
+    _Bool launching = to_uri != NULL && (ncalls == 0 || launched < ncalls);
+    if (to_uri != NULL && !launching && stats.active == 0)
+      break; // All calls done
+
+    // Wait for SIP, the first RTP packet of a call, or the next frame
+    long long now = now_ns();
+    int nfds = 0;
+    fds[nfds].fd = eXosip_event_geteventsocket(ctx);
+    fds[nfds++].events = POLLIN;
+    for (int i = 0; i < PEER_MAX_CALLS; i++) {
+      if (calls[i].used && !calls[i].media && fertp_fd(&calls[i].rtp) >= 0) {
+	fd_call[nfds] = &calls[i];
+	fds[nfds].fd = fertp_fd(&calls[i].rtp);
+	fds[nfds++].events = POLLIN;
+      }
+    }
+    int timeout = next_tick > now ? (next_tick - now + MS_NS - 1) / MS_NS : 0;
+    if (poll(fds, nfds, timeout) < 0)
+      continue; // EINTR
+    now = now_ns();
+    for (int i = 1; i < nfds; i++)
+      if (fds[i].revents != 0 && fd_call[i]->used && !fd_call[i]->media)
+	peer_first_rtp(fd_call[i], now); // Read with the next frame
+    if (fds[0].revents != 0)
+      peer_sip_events(now);
+    if (now < next_tick)
+      continue;
+
+    // Frame period: place and answer calls, send audio, report
+    while (launching && now >= next_call) {
+      peer_invite(now);
+      launched++;
+      next_call += 1e9 / cps;
+      launching = ncalls == 0 || launched < ncalls;
+    }
+    for (int i = 0; i < PEER_MAX_CALLS; i++)
+      if (calls[i].used && !calls[i].outgoing && !calls[i].answered
+	  && now >= calls[i].answer_at)
+	peer_answer(&calls[i], now);
+    peer_media_tick(now, next_tick);
+    eXosip_lock(ctx);
+    eXosip_automatic_action(ctx);
+    eXosip_unlock(ctx);
+    if (report_s > 0 && now >= next_report) {
+      peer_report("interval", (now - begin) / 1e9);
+      next_report += report_s * 1000000000LL;
+    }
+    next_tick += FRAME_NS;
+    if (next_tick <= now)
+      next_tick = now + FRAME_NS; // Overloaded, do not catch up
+  }
+
+  // Interrupted: hang up (or cancel) what is left
+  for (int i = 0; i < PEER_MAX_CALLS; i++) {
+    if (calls[i].used) {
+      eXosip_lock(ctx);
+      eXosip_call_terminate(ctx, calls[i].cid, calls[i].did);
+      eXosip_unlock(ctx);
+      peer_release(&calls[i]);
+    }
+  }
+  peer_report("final", (now_ns() - begin) / 1e9);
+  eXosip_quit(ctx);
+  fertp_pool_drain();
+  ortp_exit();
+  return 0;
+}